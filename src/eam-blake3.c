@@ -0,0 +1,882 @@
+/* eam-blake3.c: BLAKE3 hashing
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "eam-blake3.h"
+
+/* BLAKE3 splits its input in 1 KiB chunks, hashed independently, and
+ * combines their chaining values in a binary tree. This follows the
+ * structure of the reference implementation:
+ *
+ *  - the hasher keeps the chunk being filled, and a stack with the
+ *    chaining values of the complete subtrees on its left; merging
+ *    them is delayed until more input comes, as the last ones are
+ *    part of the root node
+ *
+ *  - large updates are cut in power-of-two subtrees, whose chunks are
+ *    hashed eight at a time, one per lane of a vector, using the GCC
+ *    vector extensions; on x86 the same code is also built for AVX2,
+ *    and picked at run time
+ *
+ *  - the subtrees of at least %THREAD_MIN_PART_CHUNKS chunks per part
+ *    are split between a pool of threads
+ *
+ * Only the unkeyed hash with a 32 bytes output is implemented.
+ */
+
+#define BLAKE3_BLOCK_LEN        64
+#define BLAKE3_CHUNK_LEN        1024
+#define BLAKE3_MAX_DEPTH        54
+
+/* The number of chunks hashed at once by the vector code */
+#define BLAKE3_LANES            8
+
+/* Subtrees of up to this many chunks are hashed without recursing */
+#define LEAF_SUBTREE_CHUNKS     64
+
+/* The smallest part of a subtree worth handing to another thread */
+#define THREAD_MIN_PART_CHUNKS  512
+
+#define THREAD_MAX_PARTS        16
+
+enum {
+  CHUNK_START = 1 << 0,
+  CHUNK_END = 1 << 1,
+  PARENT = 1 << 2,
+  ROOT = 1 << 3,
+};
+
+typedef struct {
+  guint32 cv[8];
+  guint64 chunk_counter;
+  guint8 buf[BLAKE3_BLOCK_LEN];
+  guint8 buf_len;
+  guint8 blocks_compressed;
+} ChunkState;
+
+/* The last compression of a node, before we know whether it is the
+ * root of the tree
+ */
+typedef struct {
+  guint32 cv[8];
+  guint8 block[BLAKE3_BLOCK_LEN];
+  guint8 block_len;
+  guint64 counter;
+  guint8 flags;
+} Output;
+
+struct _EamBlake3 {
+  ChunkState chunk;
+
+  guint8 cv_stack[(BLAKE3_MAX_DEPTH + 1) * 32];
+  guint cv_stack_len;
+
+  gboolean finished;
+  guint8 digest[EAM_BLAKE3_DIGEST_SIZE];
+  char string[EAM_BLAKE3_DIGEST_SIZE * 2 + 1];
+};
+
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  guint pending;
+} SubtreeBatch;
+
+typedef struct {
+  const guint8 *input;
+  guint64 n_chunks;
+  guint64 counter;
+  guint8 *out;
+
+  SubtreeBatch *batch;
+} SubtreeJob;
+
+typedef void (* HashLanesFunc) (const guint8 *const *inputs,
+                                gsize n_blocks,
+                                guint64 counter,
+                                gboolean increment_counter,
+                                guint8 flags,
+                                guint8 flags_start,
+                                guint8 flags_end,
+                                guint8 *out);
+
+static const guint32 blake3_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const guint8 blake3_schedule[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static GThreadPool *subtree_pool;
+static guint subtree_max_parts;
+static HashLanesFunc hash_lanes;
+static const char *blake3_implementation;
+
+/* These work on both words and vectors of words */
+#define ROTR32(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(v, a, b, c, d, x, y) \
+  G_STMT_START { \
+    v[a] = v[a] + v[b] + (x); \
+    v[d] = ROTR32 (v[d] ^ v[a], 16); \
+    v[c] = v[c] + v[d]; \
+    v[b] = ROTR32 (v[b] ^ v[c], 12); \
+    v[a] = v[a] + v[b] + (y); \
+    v[d] = ROTR32 (v[d] ^ v[a], 8); \
+    v[c] = v[c] + v[d]; \
+    v[b] = ROTR32 (v[b] ^ v[c], 7); \
+  } G_STMT_END
+
+#define ROUND(v, m, r) \
+  G_STMT_START { \
+    const guint8 *s = blake3_schedule[r]; \
+    G (v, 0, 4, 8, 12, m[s[0]], m[s[1]]); \
+    G (v, 1, 5, 9, 13, m[s[2]], m[s[3]]); \
+    G (v, 2, 6, 10, 14, m[s[4]], m[s[5]]); \
+    G (v, 3, 7, 11, 15, m[s[6]], m[s[7]]); \
+    G (v, 0, 5, 10, 15, m[s[8]], m[s[9]]); \
+    G (v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+    G (v, 2, 7, 8, 13, m[s[12]], m[s[13]]); \
+    G (v, 3, 4, 9, 14, m[s[14]], m[s[15]]); \
+  } G_STMT_END
+
+static inline guint32
+load_le32 (const guint8 *p)
+{
+  return (guint32) p[0] |
+         ((guint32) p[1] << 8) |
+         ((guint32) p[2] << 16) |
+         ((guint32) p[3] << 24);
+}
+
+static inline void
+store_le32 (guint8 *p,
+            guint32 x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+static void
+store_cv (guint8 *out,
+          const guint32 cv[8])
+{
+  for (int i = 0; i < 8; i++)
+    store_le32 (out + i * 4, cv[i]);
+}
+
+static void
+compress_pre (guint32 v[16],
+              const guint32 cv[8],
+              const guint8 block[BLAKE3_BLOCK_LEN],
+              guint8 block_len,
+              guint64 counter,
+              guint8 flags)
+{
+  guint32 m[16];
+
+  for (int i = 0; i < 16; i++)
+    m[i] = load_le32 (block + i * 4);
+
+  memcpy (v, cv, 8 * sizeof (guint32));
+  memcpy (v + 8, blake3_iv, 4 * sizeof (guint32));
+  v[12] = (guint32) counter;
+  v[13] = (guint32) (counter >> 32);
+  v[14] = block_len;
+  v[15] = flags;
+
+  for (int r = 0; r < 7; r++)
+    ROUND (v, m, r);
+}
+
+static void
+compress_in_place (guint32 cv[8],
+                   const guint8 block[BLAKE3_BLOCK_LEN],
+                   guint8 block_len,
+                   guint64 counter,
+                   guint8 flags)
+{
+  guint32 v[16];
+
+  compress_pre (v, cv, block, block_len, counter, flags);
+
+  for (int i = 0; i < 8; i++)
+    cv[i] = v[i] ^ v[i + 8];
+}
+
+/* Hashes one input of @n_blocks full blocks */
+static void
+hash_one (const guint8 *input,
+          gsize n_blocks,
+          guint64 counter,
+          guint8 flags,
+          guint8 flags_start,
+          guint8 flags_end,
+          guint8 out[32])
+{
+  guint32 cv[8];
+  guint8 block_flags = flags | flags_start;
+
+  memcpy (cv, blake3_iv, sizeof (cv));
+
+  for (gsize b = 0; b < n_blocks; b++) {
+    if (b + 1 == n_blocks)
+      block_flags |= flags_end;
+
+    compress_in_place (cv, input + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter, block_flags);
+    block_flags = flags;
+  }
+
+  store_cv (out, cv);
+}
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_BLAKE3_LANES 1
+
+typedef guint32 Lanes __attribute__ ((vector_size (BLAKE3_LANES * sizeof (guint32))));
+
+#define LANES_SPLAT(x)  ((Lanes) { 0 } + (guint32) (x))
+
+/* Hashes %BLAKE3_LANES inputs of @n_blocks full blocks at once; the
+ * compiler turns each operation on a vector into SIMD instructions
+ */
+static inline __attribute__ ((always_inline)) void
+hash_lanes_impl (const guint8 *const *inputs,
+                 gsize n_blocks,
+                 guint64 counter,
+                 gboolean increment_counter,
+                 guint8 flags,
+                 guint8 flags_start,
+                 guint8 flags_end,
+                 guint8 *out)
+{
+  Lanes h[8], counter_low, counter_high;
+  guint8 block_flags = flags | flags_start;
+
+  for (int i = 0; i < 8; i++)
+    h[i] = LANES_SPLAT (blake3_iv[i]);
+
+  for (int j = 0; j < BLAKE3_LANES; j++) {
+    guint64 c = counter + (increment_counter ? j : 0);
+
+    counter_low[j] = (guint32) c;
+    counter_high[j] = (guint32) (c >> 32);
+  }
+
+  for (gsize b = 0; b < n_blocks; b++) {
+    Lanes m[16], v[16];
+
+    if (b + 1 == n_blocks)
+      block_flags |= flags_end;
+
+    for (int i = 0; i < 16; i++)
+      for (int j = 0; j < BLAKE3_LANES; j++)
+        m[i][j] = load_le32 (inputs[j] + b * BLAKE3_BLOCK_LEN + i * 4);
+
+    for (int i = 0; i < 8; i++)
+      v[i] = h[i];
+
+    for (int i = 0; i < 4; i++)
+      v[i + 8] = LANES_SPLAT (blake3_iv[i]);
+
+    v[12] = counter_low;
+    v[13] = counter_high;
+    v[14] = LANES_SPLAT (BLAKE3_BLOCK_LEN);
+    v[15] = LANES_SPLAT (block_flags);
+
+    for (int r = 0; r < 7; r++)
+      ROUND (v, m, r);
+
+    for (int i = 0; i < 8; i++)
+      h[i] = v[i] ^ v[i + 8];
+
+    block_flags = flags;
+  }
+
+  for (int j = 0; j < BLAKE3_LANES; j++)
+    for (int i = 0; i < 8; i++)
+      store_le32 (out + j * 32 + i * 4, h[i][j]);
+}
+
+static void
+hash_lanes_generic (const guint8 *const *inputs,
+                    gsize n_blocks,
+                    guint64 counter,
+                    gboolean increment_counter,
+                    guint8 flags,
+                    guint8 flags_start,
+                    guint8 flags_end,
+                    guint8 *out)
+{
+  hash_lanes_impl (inputs, n_blocks, counter, increment_counter,
+                   flags, flags_start, flags_end, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_BLAKE3_AVX2 1
+
+__attribute__ ((target ("avx2")))
+static void
+hash_lanes_avx2 (const guint8 *const *inputs,
+                 gsize n_blocks,
+                 guint64 counter,
+                 gboolean increment_counter,
+                 guint8 flags,
+                 guint8 flags_start,
+                 guint8 flags_end,
+                 guint8 *out)
+{
+  hash_lanes_impl (inputs, n_blocks, counter, increment_counter,
+                   flags, flags_start, flags_end, out);
+}
+#endif /* x86 */
+#endif /* HAVE_BLAKE3_LANES */
+
+static void
+hash_many (const guint8 *const *inputs,
+           gsize n_inputs,
+           gsize n_blocks,
+           guint64 counter,
+           gboolean increment_counter,
+           guint8 flags,
+           guint8 flags_start,
+           guint8 flags_end,
+           guint8 *out)
+{
+  if (hash_lanes != NULL) {
+    while (n_inputs >= BLAKE3_LANES) {
+      hash_lanes (inputs, n_blocks, counter, increment_counter,
+                  flags, flags_start, flags_end, out);
+
+      if (increment_counter)
+        counter += BLAKE3_LANES;
+
+      inputs += BLAKE3_LANES;
+      n_inputs -= BLAKE3_LANES;
+      out += BLAKE3_LANES * 32;
+    }
+  }
+
+  while (n_inputs > 0) {
+    hash_one (inputs[0], n_blocks, counter, flags, flags_start, flags_end, out);
+
+    if (increment_counter)
+      counter += 1;
+
+    inputs += 1;
+    n_inputs -= 1;
+    out += 32;
+  }
+}
+
+static void
+parent_cv (const guint8 block[BLAKE3_BLOCK_LEN],
+           guint8 out[32])
+{
+  hash_one (block, 1, 0, PARENT, 0, 0, out);
+}
+
+/* Returns the chaining value of a subtree of @n_chunks chunks, which
+ * is a power of two
+ */
+static void
+subtree_cv (const guint8 *input,
+            guint64 n_chunks,
+            guint64 counter,
+            guint8 out[32])
+{
+  if (n_chunks > LEAF_SUBTREE_CHUNKS) {
+    guint8 children[64];
+    guint64 half = n_chunks / 2;
+
+    subtree_cv (input, half, counter, children);
+    subtree_cv (input + half * BLAKE3_CHUNK_LEN, half, counter + half, children + 32);
+    parent_cv (children, out);
+    return;
+  }
+
+  const guint8 *inputs[LEAF_SUBTREE_CHUNKS];
+  guint8 cvs[LEAF_SUBTREE_CHUNKS * 32];
+
+  for (guint i = 0; i < n_chunks; i++)
+    inputs[i] = input + i * BLAKE3_CHUNK_LEN;
+
+  hash_many (inputs, n_chunks, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, counter, TRUE,
+             0, CHUNK_START, CHUNK_END, cvs);
+
+  /* Each level of parents overwrites the one below */
+  while (n_chunks > 1) {
+    n_chunks /= 2;
+
+    for (guint i = 0; i < n_chunks; i++)
+      inputs[i] = cvs + i * 64;
+
+    hash_many (inputs, n_chunks, 1, 0, FALSE, PARENT, 0, 0, cvs);
+  }
+
+  memcpy (out, cvs, 32);
+}
+
+static void
+subtree_job_run (SubtreeJob *job)
+{
+  subtree_cv (job->input, job->n_chunks, job->counter, job->out);
+
+  g_mutex_lock (&job->batch->lock);
+  if (--job->batch->pending == 0)
+    g_cond_signal (&job->batch->cond);
+  g_mutex_unlock (&job->batch->lock);
+}
+
+static void
+subtree_job_func (gpointer data,
+                  gpointer user_data)
+{
+  subtree_job_run (data);
+}
+
+static void
+blake3_init (void)
+{
+  static gsize initialized = 0;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  blake3_implementation = "portable";
+
+#ifdef HAVE_BLAKE3_LANES
+  hash_lanes = hash_lanes_generic;
+  blake3_implementation = "vector";
+
+#ifdef HAVE_BLAKE3_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) {
+    hash_lanes = hash_lanes_avx2;
+    blake3_implementation = "avx2";
+  }
+#endif
+#endif
+
+  guint n_processors = MIN (g_get_num_processors (), THREAD_MAX_PARTS);
+
+  subtree_max_parts = 1;
+  while (subtree_max_parts * 2 <= n_processors)
+    subtree_max_parts *= 2;
+
+  /* The calling thread hashes one of the parts */
+  if (subtree_max_parts > 1)
+    subtree_pool = g_thread_pool_new (subtree_job_func, NULL, subtree_max_parts - 1, FALSE, NULL);
+
+  g_once_init_leave (&initialized, 1);
+}
+
+/* Returns the chaining values of the two children of a subtree of
+ * @n_chunks chunks, which is a power of two larger than one; they are
+ * not merged, as they may be the children of the root
+ */
+static void
+subtree_children (const guint8 *input,
+                  guint64 n_chunks,
+                  guint64 counter,
+                  guint8 out[64])
+{
+  guint n_parts = 2;
+
+  while (n_parts < subtree_max_parts && n_chunks / (n_parts * 2) >= THREAD_MIN_PART_CHUNKS)
+    n_parts *= 2;
+
+  if (subtree_pool == NULL || n_chunks / n_parts < THREAD_MIN_PART_CHUNKS) {
+    guint64 half = n_chunks / 2;
+
+    subtree_cv (input, half, counter, out);
+    subtree_cv (input + half * BLAKE3_CHUNK_LEN, half, counter + half, out + 32);
+    return;
+  }
+
+  /* The parts are subtrees too, so they can be hashed independently */
+  guint8 cvs[THREAD_MAX_PARTS * 32];
+  SubtreeJob jobs[THREAD_MAX_PARTS];
+  SubtreeBatch batch;
+  guint64 part = n_chunks / n_parts;
+
+  g_mutex_init (&batch.lock);
+  g_cond_init (&batch.cond);
+  batch.pending = n_parts;
+
+  for (guint i = 0; i < n_parts; i++) {
+    jobs[i].input = input + i * part * BLAKE3_CHUNK_LEN;
+    jobs[i].n_chunks = part;
+    jobs[i].counter = counter + i * part;
+    jobs[i].out = cvs + i * 32;
+    jobs[i].batch = &batch;
+  }
+
+  for (guint i = 1; i < n_parts; i++)
+    g_thread_pool_push (subtree_pool, &jobs[i], NULL);
+
+  subtree_job_run (&jobs[0]);
+
+  g_mutex_lock (&batch.lock);
+  while (batch.pending > 0)
+    g_cond_wait (&batch.cond, &batch.lock);
+  g_mutex_unlock (&batch.lock);
+
+  g_mutex_clear (&batch.lock);
+  g_cond_clear (&batch.cond);
+
+  while (n_parts > 2) {
+    n_parts /= 2;
+
+    for (guint i = 0; i < n_parts; i++)
+      parent_cv (cvs + i * 64, cvs + i * 32);
+  }
+
+  memcpy (out, cvs, 64);
+}
+
+static void
+chunk_state_init (ChunkState *chunk,
+                  guint64 chunk_counter)
+{
+  memcpy (chunk->cv, blake3_iv, sizeof (chunk->cv));
+  chunk->chunk_counter = chunk_counter;
+  chunk->buf_len = 0;
+  chunk->blocks_compressed = 0;
+}
+
+static gsize
+chunk_state_len (const ChunkState *chunk)
+{
+  return BLAKE3_BLOCK_LEN * (gsize) chunk->blocks_compressed + chunk->buf_len;
+}
+
+static void
+chunk_state_update (ChunkState *chunk,
+                    const guint8 *input,
+                    gsize size)
+{
+  while (size > 0) {
+    /* The last block is only compressed once we know it is not last */
+    if (chunk->buf_len == BLAKE3_BLOCK_LEN) {
+      compress_in_place (chunk->cv, chunk->buf, BLAKE3_BLOCK_LEN, chunk->chunk_counter,
+                         chunk->blocks_compressed == 0 ? CHUNK_START : 0);
+      chunk->blocks_compressed += 1;
+      chunk->buf_len = 0;
+    }
+
+    gsize take = MIN (size, (gsize) (BLAKE3_BLOCK_LEN - chunk->buf_len));
+
+    memcpy (chunk->buf + chunk->buf_len, input, take);
+    chunk->buf_len += take;
+    input += take;
+    size -= take;
+  }
+}
+
+static void
+chunk_state_output (const ChunkState *chunk,
+                    Output *output)
+{
+  memcpy (output->cv, chunk->cv, sizeof (output->cv));
+  memcpy (output->block, chunk->buf, chunk->buf_len);
+  memset (output->block + chunk->buf_len, 0, BLAKE3_BLOCK_LEN - chunk->buf_len);
+  output->block_len = chunk->buf_len;
+  output->counter = chunk->chunk_counter;
+  output->flags = (chunk->blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+}
+
+static void
+parent_output (const guint8 block[BLAKE3_BLOCK_LEN],
+               Output *output)
+{
+  memcpy (output->cv, blake3_iv, sizeof (output->cv));
+  memcpy (output->block, block, BLAKE3_BLOCK_LEN);
+  output->block_len = BLAKE3_BLOCK_LEN;
+  output->counter = 0;
+  output->flags = PARENT;
+}
+
+static void
+output_cv (const Output *output,
+           guint8 out[32])
+{
+  guint32 cv[8];
+
+  memcpy (cv, output->cv, sizeof (cv));
+  compress_in_place (cv, output->block, output->block_len, output->counter, output->flags);
+  store_cv (out, cv);
+}
+
+static void
+output_root (const Output *output,
+             guint8 out[32])
+{
+  guint32 v[16];
+  guint32 cv[8];
+
+  compress_pre (v, output->cv, output->block, output->block_len, 0, output->flags | ROOT);
+
+  for (int i = 0; i < 8; i++)
+    cv[i] = v[i] ^ v[i + 8];
+
+  store_cv (out, cv);
+}
+
+static guint
+popcount64 (guint64 x)
+{
+  guint n = 0;
+
+  for (; x != 0; x &= x - 1)
+    n++;
+
+  return n;
+}
+
+/* Merges the completed subtrees on the stack, given that
+ * @total_chunks chunks come before the input to add
+ */
+static void
+hasher_merge_cv_stack (EamBlake3 *hasher,
+                       guint64 total_chunks)
+{
+  guint post_merge_len = popcount64 (total_chunks);
+
+  while (hasher->cv_stack_len > post_merge_len) {
+    guint8 *node = hasher->cv_stack + (hasher->cv_stack_len - 2) * 32;
+
+    parent_cv (node, node);
+    hasher->cv_stack_len -= 1;
+  }
+}
+
+static void
+hasher_push_cv (EamBlake3 *hasher,
+                const guint8 cv[32],
+                guint64 chunk_counter)
+{
+  hasher_merge_cv_stack (hasher, chunk_counter);
+
+  memcpy (hasher->cv_stack + hasher->cv_stack_len * 32, cv, 32);
+  hasher->cv_stack_len += 1;
+}
+
+/**
+ * eam_blake3_get_implementation:
+ *
+ * Returns: the name of the implementation used on this machine
+ */
+const char *
+eam_blake3_get_implementation (void)
+{
+  blake3_init ();
+
+  return blake3_implementation;
+}
+
+/**
+ * eam_blake3_new:
+ *
+ * Returns: (transfer full): a new #EamBlake3
+ */
+EamBlake3 *
+eam_blake3_new (void)
+{
+  blake3_init ();
+
+  EamBlake3 *hasher = g_new0 (EamBlake3, 1);
+  chunk_state_init (&hasher->chunk, 0);
+
+  return hasher;
+}
+
+void
+eam_blake3_free (EamBlake3 *hasher)
+{
+  g_free (hasher);
+}
+
+/**
+ * eam_blake3_update:
+ * @hasher: a #EamBlake3
+ * @data: the data to hash
+ * @size: the size of @data
+ *
+ * Adds @data to the hash; this cannot be called after the digest has
+ * been retrieved. Large blocks of data are hashed by several threads.
+ */
+void
+eam_blake3_update (EamBlake3 *hasher,
+                   const void *data,
+                   gsize size)
+{
+  const guint8 *p = data;
+
+  g_return_if_fail (!hasher->finished);
+
+  /* Complete the current chunk first */
+  if (chunk_state_len (&hasher->chunk) > 0) {
+    gsize take = MIN (size, BLAKE3_CHUNK_LEN - chunk_state_len (&hasher->chunk));
+
+    chunk_state_update (&hasher->chunk, p, take);
+    p += take;
+    size -= take;
+
+    if (size == 0)
+      return;
+
+    /* More input follows, so this chunk is not the root */
+    Output output;
+    guint8 cv[32];
+
+    chunk_state_output (&hasher->chunk, &output);
+    output_cv (&output, cv);
+    hasher_push_cv (hasher, cv, hasher->chunk.chunk_counter);
+    chunk_state_init (&hasher->chunk, hasher->chunk.chunk_counter + 1);
+  }
+
+  /* Then the largest subtrees that are aligned with what came before,
+   * keeping the last chunk for the chunk state
+   */
+  while (size > BLAKE3_CHUNK_LEN) {
+    guint64 subtree_len = BLAKE3_CHUNK_LEN;
+    guint64 count_so_far = hasher->chunk.chunk_counter * BLAKE3_CHUNK_LEN;
+
+    while (subtree_len * 2 <= size && ((subtree_len * 2 - 1) & count_so_far) == 0)
+      subtree_len *= 2;
+
+    guint64 subtree_chunks = subtree_len / BLAKE3_CHUNK_LEN;
+    guint64 counter = hasher->chunk.chunk_counter;
+
+    if (subtree_chunks == 1) {
+      ChunkState chunk;
+      Output output;
+      guint8 cv[32];
+
+      chunk_state_init (&chunk, counter);
+      chunk_state_update (&chunk, p, BLAKE3_CHUNK_LEN);
+      chunk_state_output (&chunk, &output);
+      output_cv (&output, cv);
+      hasher_push_cv (hasher, cv, counter);
+    }
+    else {
+      guint8 cv_pair[64];
+
+      subtree_children (p, subtree_chunks, counter, cv_pair);
+      hasher_push_cv (hasher, cv_pair, counter);
+      hasher_push_cv (hasher, cv_pair + 32, counter + subtree_chunks / 2);
+    }
+
+    hasher->chunk.chunk_counter += subtree_chunks;
+    p += subtree_len;
+    size -= subtree_len;
+  }
+
+  if (size > 0) {
+    chunk_state_update (&hasher->chunk, p, size);
+    hasher_merge_cv_stack (hasher, hasher->chunk.chunk_counter);
+  }
+}
+
+static void
+blake3_finish (EamBlake3 *hasher)
+{
+  if (hasher->finished)
+    return;
+
+  Output output;
+  guint remaining;
+
+  if (hasher->cv_stack_len == 0 || chunk_state_len (&hasher->chunk) > 0) {
+    chunk_state_output (&hasher->chunk, &output);
+    remaining = hasher->cv_stack_len;
+  }
+  else {
+    /* The input ended with a subtree, whose children are on the stack */
+    parent_output (hasher->cv_stack + (hasher->cv_stack_len - 2) * 32, &output);
+    remaining = hasher->cv_stack_len - 2;
+  }
+
+  while (remaining > 0) {
+    guint8 block[BLAKE3_BLOCK_LEN];
+
+    remaining -= 1;
+    memcpy (block, hasher->cv_stack + remaining * 32, 32);
+    output_cv (&output, block + 32);
+    parent_output (block, &output);
+  }
+
+  output_root (&output, hasher->digest);
+
+  static const char hex[] = "0123456789abcdef";
+
+  for (int i = 0; i < EAM_BLAKE3_DIGEST_SIZE; i++) {
+    hasher->string[i * 2] = hex[hasher->digest[i] >> 4];
+    hasher->string[i * 2 + 1] = hex[hasher->digest[i] & 0x0f];
+  }
+
+  hasher->string[EAM_BLAKE3_DIGEST_SIZE * 2] = '\0';
+  hasher->finished = TRUE;
+}
+
+/**
+ * eam_blake3_get_digest:
+ * @hasher: a #EamBlake3
+ * @digest: (out caller-allocates): a buffer of %EAM_BLAKE3_DIGEST_SIZE
+ *   bytes
+ *
+ * Retrieves the binary digest of the data hashed so far.
+ */
+void
+eam_blake3_get_digest (EamBlake3 *hasher,
+                       guint8 *digest)
+{
+  blake3_finish (hasher);
+
+  memcpy (digest, hasher->digest, EAM_BLAKE3_DIGEST_SIZE);
+}
+
+/**
+ * eam_blake3_get_string:
+ * @hasher: a #EamBlake3
+ *
+ * Returns: the digest of the data hashed so far, as a lower case
+ *   hexadecimal string owned by @hasher
+ */
+const char *
+eam_blake3_get_string (EamBlake3 *hasher)
+{
+  blake3_finish (hasher);
+
+  return hasher->string;
+}
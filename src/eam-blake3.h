@@ -0,0 +1,43 @@
+/* eam-blake3.h: BLAKE3 hashing
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EAM_BLAKE3_DIGEST_SIZE  32
+
+typedef struct _EamBlake3       EamBlake3;
+
+EamBlake3 *     eam_blake3_new                  (void);
+void            eam_blake3_free                 (EamBlake3 *hasher);
+
+void            eam_blake3_update               (EamBlake3 *hasher,
+                                                 const void *data,
+                                                 gsize size);
+void            eam_blake3_get_digest           (EamBlake3 *hasher,
+                                                 guint8 *digest);
+const char *    eam_blake3_get_string           (EamBlake3 *hasher);
+
+const char *    eam_blake3_get_implementation   (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamBlake3, eam_blake3_free)
+
+G_END_DECLS
@@ -26,6 +26,8 @@
 #define EAM_CONFIG_DIRECTORIES  "Directories"
 #define EAM_CONFIG_DAEMON       "Daemon"
 #define EAM_CONFIG_REPOSITORY   "Repository"
+#define EAM_CONFIG_INSTALL      "Install"
+#define EAM_CONFIG_DOWNLOAD     "Download"
 
 typedef struct {
   /* Directories */
@@ -40,6 +42,23 @@ typedef struct {
   char *api_version;
   gboolean enable_delta_updates;
 
+  /* Install */
+  guint extract_workers;
+  gboolean streaming_verification;
+  char *bundle_reader;
+  gboolean deduplicate;
+  gboolean preallocate;
+  gboolean io_uring;
+  gboolean resumable_extraction;
+  char *locales;
+  char *architectures;
+
+  /* Download */
+  guint max_connections;
+  guint max_connections_per_host;
+  guint segmented_threshold;
+  guint payload_cache_size;
+
   /* Daemon */
   guint inactivity_timeout;
 } EamConfig;
@@ -120,6 +139,97 @@ static const EamConfigKey eam_config_keys[] = {
     .key_type = G_TYPE_BOOLEAN,
     .key_default.bool_val = TRUE,
   },
+  {
+    .key_name = "ExtractWorkers",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, extract_workers),
+    .key_type = G_TYPE_INT,
+    .key_default.int_val = 0,
+  },
+  {
+    .key_name = "StreamingVerification",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, streaming_verification),
+    .key_type = G_TYPE_BOOLEAN,
+    .key_default.bool_val = TRUE,
+  },
+  {
+    .key_name = "BundleReader",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, bundle_reader),
+    .key_type = G_TYPE_STRING,
+    .key_default.str_val = "mmap",
+  },
+  {
+    .key_name = "Deduplicate",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, deduplicate),
+    .key_type = G_TYPE_BOOLEAN,
+    .key_default.bool_val = FALSE,
+  },
+  {
+    .key_name = "Preallocate",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, preallocate),
+    .key_type = G_TYPE_BOOLEAN,
+    .key_default.bool_val = TRUE,
+  },
+  {
+    .key_name = "IoUring",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, io_uring),
+    .key_type = G_TYPE_BOOLEAN,
+    .key_default.bool_val = TRUE,
+  },
+  {
+    .key_name = "ResumableExtraction",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, resumable_extraction),
+    .key_type = G_TYPE_BOOLEAN,
+    .key_default.bool_val = TRUE,
+  },
+  {
+    .key_name = "Locales",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, locales),
+    .key_type = G_TYPE_STRING,
+    .key_default.str_val = "all",
+  },
+  {
+    .key_name = "Architectures",
+    .key_group = EAM_CONFIG_INSTALL,
+    .key_field = G_STRUCT_OFFSET (EamConfig, architectures),
+    .key_type = G_TYPE_STRING,
+    .key_default.str_val = "all",
+  },
+  {
+    .key_name = "MaxConnections",
+    .key_group = EAM_CONFIG_DOWNLOAD,
+    .key_field = G_STRUCT_OFFSET (EamConfig, max_connections),
+    .key_type = G_TYPE_INT,
+    .key_default.int_val = 8,
+  },
+  {
+    .key_name = "MaxConnectionsPerHost",
+    .key_group = EAM_CONFIG_DOWNLOAD,
+    .key_field = G_STRUCT_OFFSET (EamConfig, max_connections_per_host),
+    .key_type = G_TYPE_INT,
+    .key_default.int_val = 4,
+  },
+  {
+    .key_name = "SegmentedThreshold",
+    .key_group = EAM_CONFIG_DOWNLOAD,
+    .key_field = G_STRUCT_OFFSET (EamConfig, segmented_threshold),
+    .key_type = G_TYPE_INT,
+    .key_default.int_val = 64,
+  },
+  {
+    .key_name = "PayloadCacheSize",
+    .key_group = EAM_CONFIG_DOWNLOAD,
+    .key_field = G_STRUCT_OFFSET (EamConfig, payload_cache_size),
+    .key_type = G_TYPE_INT,
+    .key_default.int_val = 1024,
+  },
 };
 
 static inline void
@@ -366,3 +476,83 @@ eam_config_get_enable_delta_updates (void)
 {
   return eam_config_get ()->enable_delta_updates;
 }
+
+guint
+eam_config_get_extract_workers (void)
+{
+  return eam_config_get ()->extract_workers;
+}
+
+gboolean
+eam_config_get_streaming_verification (void)
+{
+  return eam_config_get ()->streaming_verification;
+}
+
+const char *
+eam_config_get_bundle_reader (void)
+{
+  return eam_config_get ()->bundle_reader;
+}
+
+gboolean
+eam_config_get_deduplicate (void)
+{
+  return eam_config_get ()->deduplicate;
+}
+
+gboolean
+eam_config_get_preallocate (void)
+{
+  return eam_config_get ()->preallocate;
+}
+
+gboolean
+eam_config_get_io_uring (void)
+{
+  return eam_config_get ()->io_uring;
+}
+
+gboolean
+eam_config_get_resumable_extraction (void)
+{
+  return eam_config_get ()->resumable_extraction;
+}
+
+const char *
+eam_config_get_locales (void)
+{
+  return eam_config_get ()->locales;
+}
+
+const char *
+eam_config_get_architectures (void)
+{
+  return eam_config_get ()->architectures;
+}
+
+guint
+eam_config_get_max_connections (void)
+{
+  return eam_config_get ()->max_connections;
+}
+
+guint
+eam_config_get_max_connections_per_host (void)
+{
+  return eam_config_get ()->max_connections_per_host;
+}
+
+/* In MiB; 0 disables segmented downloads */
+guint
+eam_config_get_segmented_threshold (void)
+{
+  return eam_config_get ()->segmented_threshold;
+}
+
+/* In MiB; 0 disables the cache of external payloads */
+guint
+eam_config_get_payload_cache_size (void)
+{
+  return eam_config_get ()->payload_cache_size;
+}
@@ -31,6 +31,19 @@ const char *    eam_config_get_server_url               (void);
 const char *    eam_config_get_api_version              (void);
 gboolean        eam_config_get_enable_delta_updates     (void);
 guint           eam_config_get_inactivity_timeout       (void);
+guint           eam_config_get_extract_workers          (void);
+gboolean        eam_config_get_streaming_verification   (void);
+const char *    eam_config_get_bundle_reader            (void);
+gboolean        eam_config_get_deduplicate              (void);
+gboolean        eam_config_get_preallocate              (void);
+gboolean        eam_config_get_io_uring                 (void);
+gboolean        eam_config_get_resumable_extraction     (void);
+const char *    eam_config_get_locales                  (void);
+const char *    eam_config_get_architectures            (void);
+guint           eam_config_get_max_connections          (void);
+guint           eam_config_get_max_connections_per_host (void);
+guint           eam_config_get_segmented_threshold      (void);
+guint           eam_config_get_payload_cache_size       (void);
 
 gboolean        eam_config_set_key                      (const char *key,
                                                          const char *value);
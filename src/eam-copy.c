@@ -0,0 +1,881 @@
+/* eam-copy.c: Copying files in the kernel
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <gio/gio.h>
+
+#include "eam-copy.h"
+
+#include "eam-walk.h"
+
+/* Files are copied without bringing their data into user space, with
+ * the first of these methods that works:
+ *
+ *  - FICLONE makes the target share the extents of the source, on file
+ *    systems that support it, so no data is copied at all
+ *  - copy_file_range() copies in the kernel, and lets the file system
+ *    offload the copy; before Linux 5.3, it only works within a file
+ *    system
+ *  - sendfile() copies in the kernel, through the page cache, between
+ *    any two files
+ *  - read() and write(), as a last resort
+ *
+ * A method that the kernel or the file systems do not support fails on
+ * its first call, before any data is copied, and the next one is tried.
+ *
+ * Each file costs one open(), one fstat() and the calls that set its
+ * metadata, which is what makes copying trees of small files fast. The
+ * metadata includes the extended attributes, as g_file_copy() copied
+ * them; listing them costs a call per file, which finds none on most.
+ */
+
+/* The most a single system call copies */
+#define COPY_CHUNK_SIZE         (16 * 1024 * 1024)
+
+#define COPY_BUFFER_SIZE        (256 * 1024)
+
+#ifndef HAVE_COPY_FILE_RANGE
+static ssize_t
+copy_file_range (int fd_in,
+                 loff_t *off_in,
+                 int fd_out,
+                 loff_t *off_out,
+                 size_t len,
+                 unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+  return syscall (__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+#endif
+
+static gboolean
+set_error_from_errno (GError **error,
+                      const char *action,
+                      const char *name)
+{
+  int saved_errno = errno;
+
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "Unable to %s '%s': %s", action, name, g_strerror (saved_errno));
+
+  return FALSE;
+}
+
+static gboolean
+is_unsupported (int errnum)
+{
+  return errnum == ENOSYS || errnum == EOPNOTSUPP || errnum == ENOTTY ||
+         errnum == EXDEV || errnum == EINVAL;
+}
+
+/* The copy methods return 1 if they copied the file, 0 if they are not
+ * supported for it, and -1 on error, with errno set
+ */
+static int
+copy_clone (int source_fd,
+            int target_fd)
+{
+#ifdef FICLONE
+  if (ioctl (target_fd, FICLONE, source_fd) == 0)
+    return 1;
+
+  return is_unsupported (errno) ? 0 : -1;
+#else
+  return 0;
+#endif
+}
+
+static int
+copy_range (int source_fd,
+            int target_fd,
+            off_t size)
+{
+  off_t copied = 0;
+
+  while (copied < size) {
+    ssize_t n = copy_file_range (source_fd, NULL, target_fd, NULL,
+                                 MIN (size - copied, COPY_CHUNK_SIZE), 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return copied == 0 && is_unsupported (errno) ? 0 : -1;
+    }
+
+    /* Some file systems, e.g. procfs, report no data at all; otherwise,
+     * the source was truncated under us
+     */
+    if (n == 0)
+      return copied == 0 ? 0 : 1;
+
+    copied += n;
+  }
+
+  return 1;
+}
+
+static int
+copy_sendfile (int source_fd,
+               int target_fd,
+               off_t size)
+{
+  off_t copied = 0;
+
+  while (copied < size) {
+    ssize_t n = sendfile (target_fd, source_fd, NULL, MIN (size - copied, COPY_CHUNK_SIZE));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return copied == 0 && is_unsupported (errno) ? 0 : -1;
+    }
+
+    if (n == 0)
+      return copied == 0 ? 0 : 1;
+
+    copied += n;
+  }
+
+  return 1;
+}
+
+static int
+copy_read_write (int source_fd,
+                 int target_fd)
+{
+  g_autofree guint8 *buffer = g_malloc (COPY_BUFFER_SIZE);
+
+  while (TRUE) {
+    ssize_t n = read (source_fd, buffer, COPY_BUFFER_SIZE);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    if (n == 0)
+      return 1;
+
+    const guint8 *p = buffer;
+    while (n > 0) {
+      ssize_t w = write (target_fd, p, n);
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+
+        return -1;
+      }
+
+      p += w;
+      n -= w;
+    }
+  }
+}
+
+static gboolean
+copy_data (int source_fd,
+           int target_fd,
+           off_t size)
+{
+  /* Most files of an application are small, and many are empty */
+  if (size == 0)
+    return TRUE;
+
+  int res = copy_clone (source_fd, target_fd);
+
+  if (res == 0)
+    res = copy_range (source_fd, target_fd, size);
+
+  if (res == 0)
+    res = copy_sendfile (source_fd, target_fd, size);
+
+  if (res == 0)
+    res = copy_read_write (source_fd, target_fd);
+
+  return res > 0;
+}
+
+/* Only root can give files away; the copy keeps our ownership
+ * otherwise, like cp does
+ */
+static gboolean
+chown_is_fatal (int errnum)
+{
+  return errnum != EPERM || geteuid () == 0;
+}
+
+static gboolean
+xattr_is_unsupported (int errnum)
+{
+  return errnum == ENOTSUP || errnum == EOPNOTSUPP;
+}
+
+/* Reads the attribute @attr of @fd into @value, growing it as needed;
+ * returns its size, or -1 with errno set
+ */
+static ssize_t
+get_xattr (int fd,
+           const char *attr,
+           char **value,
+           gsize *value_size)
+{
+  while (TRUE) {
+    ssize_t len = fgetxattr (fd, attr, NULL, 0);
+    if (len <= 0)
+      return len;
+
+    if ((gsize) len > *value_size) {
+      *value_size = len;
+      *value = g_realloc (*value, *value_size);
+    }
+
+    len = fgetxattr (fd, attr, *value, *value_size);
+
+    /* Otherwise, the attribute grew since we asked for its size */
+    if (len >= 0 || errno != ERANGE)
+      return len;
+  }
+}
+
+/* The attributes are copied when both file systems support them; like
+ * the ownership, the ones only root can set are skipped otherwise
+ */
+static gboolean
+copy_xattrs (int source_fd,
+             int target_fd)
+{
+  g_autofree char *names = NULL;
+  ssize_t len = flistxattr (source_fd, NULL, 0);
+
+  while (len > 0) {
+    names = g_realloc (names, len);
+
+    ssize_t n = flistxattr (source_fd, names, len);
+    if (n >= 0 || errno != ERANGE) {
+      len = n;
+      break;
+    }
+
+    len = flistxattr (source_fd, NULL, 0);
+  }
+
+  if (len < 0)
+    return xattr_is_unsupported (errno);
+
+  g_autofree char *value = NULL;
+  gsize value_size = 0;
+
+  for (const char *attr = names; attr < names + len; attr += strlen (attr) + 1) {
+    ssize_t value_len = get_xattr (source_fd, attr, &value, &value_size);
+
+    if (value_len < 0) {
+      /* The attribute was removed since we listed it */
+      if (errno == ENODATA)
+        continue;
+
+      return FALSE;
+    }
+
+    if (fsetxattr (target_fd, attr, value, value_len, 0) != 0 &&
+        !xattr_is_unsupported (errno) && chown_is_fatal (errno))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_copy_metadata:
+ * @source_fd: the file the metadata is copied from
+ * @fd: an open file
+ * @name: the name of @fd, for error messages
+ * @st: the status of @source_fd
+ * @error: return location for a #GError
+ *
+ * Gives @fd the ownership, mode, extended attributes and times of
+ * @source_fd. The ownership is set first, as changing it clears the
+ * set-user-ID and set-group-ID bits, and the file capabilities.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+eam_copy_metadata (int source_fd,
+                   int fd,
+                   const char *name,
+                   const struct stat *st,
+                   GError **error)
+{
+  mode_t mode = st->st_mode & 07777;
+  int r;
+
+  do {
+    r = fchown (fd, st->st_uid, st->st_gid);
+  } while (r != 0 && errno == EINTR);
+
+  if (r != 0) {
+    if (chown_is_fatal (errno))
+      return set_error_from_errno (error, "set the ownership of", name);
+
+    mode &= ~(S_ISUID | S_ISGID);
+  }
+
+  do {
+    r = fchmod (fd, mode);
+  } while (r != 0 && errno == EINTR);
+
+  if (r != 0)
+    return set_error_from_errno (error, "set the mode of", name);
+
+  if (!copy_xattrs (source_fd, fd))
+    return set_error_from_errno (error, "copy the attributes of", name);
+
+  const struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+  if (futimens (fd, times) != 0)
+    return set_error_from_errno (error, "set the times of", name);
+
+  return TRUE;
+}
+
+static gboolean
+copy_symlink_at (int source_dfd,
+                 const char *source_name,
+                 int target_dfd,
+                 const char *target_name,
+                 GError **error)
+{
+  struct stat st;
+
+  if (fstatat (source_dfd, source_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    return set_error_from_errno (error, "query", source_name);
+
+  /* The size of a link is the length of its target, except on a few
+   * file systems that report 0
+   */
+  gsize size = st.st_size > 0 ? st.st_size + 1 : PATH_MAX;
+  g_autofree char *link_target = NULL;
+
+  while (TRUE) {
+    g_free (link_target);
+    link_target = g_malloc (size);
+
+    ssize_t len = readlinkat (source_dfd, source_name, link_target, size);
+    if (len < 0)
+      return set_error_from_errno (error, "read the link", source_name);
+
+    if ((gsize) len < size) {
+      link_target[len] = '\0';
+      break;
+    }
+
+    size *= 2;
+  }
+
+  while (symlinkat (link_target, target_dfd, target_name) != 0) {
+    if (errno != EEXIST || unlinkat (target_dfd, target_name, 0) != 0)
+      return set_error_from_errno (error, "create the link", target_name);
+  }
+
+  if (fchownat (target_dfd, target_name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0 &&
+      chown_is_fatal (errno))
+    return set_error_from_errno (error, "set the ownership of", target_name);
+
+  const struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+  if (utimensat (target_dfd, target_name, times, AT_SYMLINK_NOFOLLOW) != 0)
+    return set_error_from_errno (error, "set the times of", target_name);
+
+  return TRUE;
+}
+
+/**
+ * eam_copy_file_at:
+ * @source_dfd: a directory file descriptor, or %AT_FDCWD
+ * @source_name: the name of the file to copy, relative to @source_dfd
+ * @target_dfd: a directory file descriptor, or %AT_FDCWD
+ * @target_name: the name of the copy, relative to @target_dfd
+ * @error: return location for a #GError
+ *
+ * Copies a regular file or a symbolic link, with its ownership, mode,
+ * extended attributes and times, replacing any existing file at
+ * @target_name. Symbolic links are not followed, and keep no extended
+ * attributes.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+eam_copy_file_at (int source_dfd,
+                  const char *source_name,
+                  int target_dfd,
+                  const char *target_name,
+                  GError **error)
+{
+  /* O_NONBLOCK keeps us from getting stuck on a FIFO */
+  int source_fd = openat (source_dfd, source_name,
+                          O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (source_fd < 0) {
+    if (errno == ELOOP)
+      return copy_symlink_at (source_dfd, source_name, target_dfd, target_name, error);
+
+    return set_error_from_errno (error, "open", source_name);
+  }
+
+  struct stat st;
+  if (fstat (source_fd, &st) != 0) {
+    set_error_from_errno (error, "query", source_name);
+    (void) close (source_fd);
+    return FALSE;
+  }
+
+  if (!S_ISREG (st.st_mode)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "Unable to copy special file '%s'", source_name);
+    (void) close (source_fd);
+    return FALSE;
+  }
+
+  int target_fd = openat (target_dfd, target_name,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (target_fd < 0) {
+    set_error_from_errno (error, "create", target_name);
+    (void) close (source_fd);
+    return FALSE;
+  }
+
+  gboolean res = copy_data (source_fd, target_fd, st.st_size);
+  if (!res)
+    set_error_from_errno (error, "copy", source_name);
+
+  if (res)
+    res = eam_copy_metadata (source_fd, target_fd, target_name, &st, error);
+
+  (void) close (source_fd);
+
+  if (close (target_fd) != 0 && res)
+    res = set_error_from_errno (error, "write", target_name);
+
+  return res;
+}
+
+/* Trees are copied by a few workers, each with its own queue of
+ * directories. A worker copies the files of a directory itself, and
+ * queues its subdirectories; it takes its next directory from the end
+ * of its own queue, to stay close to what it just copied, and when its
+ * queue is empty it steals from the front of the others, where the
+ * largest subtrees wait. This keeps several requests in flight on
+ * devices with parallel queues, and lets metadata operations in one
+ * directory overlap with data copies in another.
+ *
+ * A directory gets its metadata once all its subdirectories are done,
+ * so that its times and its mode apply to the final contents; each
+ * directory counts itself and its unfinished subdirectories, and the
+ * last one to finish completes it.
+ *
+ * Copying is I/O bound, so there are a few workers even on a single
+ * processor.
+ */
+#define COPY_MIN_WORKERS        4
+#define COPY_MAX_WORKERS        8
+
+typedef struct _CopyDir CopyDir;
+
+struct _CopyDir {
+  CopyDir *parent;
+  char *source;
+  char *target;
+  struct stat st;
+
+  /* The directory itself, and its unfinished subdirectories */
+  volatile gint pending;
+};
+
+typedef struct {
+  GMutex lock;
+  GQueue dirs;
+} CopyQueue;
+
+typedef struct {
+  CopyQueue *queues;
+  guint n_workers;
+
+  GCancellable *cancellable;
+
+  /* The directories that are queued or being copied */
+  volatile gint outstanding;
+
+  /* Guards the error, and the waits for work */
+  GMutex lock;
+  GCond cond;
+  GError *error;
+  volatile gint failed;
+} CopyTree;
+
+typedef struct {
+  CopyTree *tree;
+  guint index;
+} CopyWorker;
+
+static CopyDir *
+copy_dir_new (CopyDir *parent,
+              const char *source,
+              const char *target)
+{
+  CopyDir *dir = g_slice_new0 (CopyDir);
+
+  dir->parent = parent;
+  dir->source = g_strdup (source);
+  dir->target = g_strdup (target);
+  dir->pending = 1;
+
+  return dir;
+}
+
+static void
+copy_dir_free (CopyDir *dir)
+{
+  g_free (dir->source);
+  g_free (dir->target);
+  g_slice_free (CopyDir, dir);
+}
+
+static void
+copy_tree_fail (CopyTree *tree,
+                GError *error)
+{
+  g_mutex_lock (&tree->lock);
+
+  if (tree->error == NULL)
+    tree->error = error;
+  else
+    g_error_free (error);
+
+  g_atomic_int_set (&tree->failed, TRUE);
+
+  g_mutex_unlock (&tree->lock);
+}
+
+static gboolean
+copy_tree_should_stop (CopyTree *tree)
+{
+  if (g_atomic_int_get (&tree->failed))
+    return TRUE;
+
+  GError *error = NULL;
+  if (g_cancellable_set_error_if_cancelled (tree->cancellable, &error)) {
+    copy_tree_fail (tree, error);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+copy_tree_push (CopyTree *tree,
+                guint index,
+                CopyDir *dir)
+{
+  CopyQueue *queue = &tree->queues[index];
+
+  g_atomic_int_inc (&tree->outstanding);
+
+  g_mutex_lock (&queue->lock);
+  g_queue_push_tail (&queue->dirs, dir);
+  g_mutex_unlock (&queue->lock);
+
+  /* Taking the lock orders the push before any idle worker looks again */
+  g_mutex_lock (&tree->lock);
+  g_cond_signal (&tree->cond);
+  g_mutex_unlock (&tree->lock);
+}
+
+static CopyDir *
+copy_tree_pop (CopyTree *tree,
+               guint index)
+{
+  for (guint i = 0; i < tree->n_workers; i++) {
+    CopyQueue *queue = &tree->queues[(index + i) % tree->n_workers];
+
+    g_mutex_lock (&queue->lock);
+    CopyDir *dir = i == 0 ? g_queue_pop_tail (&queue->dirs) : g_queue_pop_head (&queue->dirs);
+    g_mutex_unlock (&queue->lock);
+
+    if (dir != NULL)
+      return dir;
+  }
+
+  return NULL;
+}
+
+/* Called once the directory and all its subdirectories are copied */
+static void
+copy_dir_finish (CopyTree *tree,
+                 CopyDir *dir)
+{
+  while (dir != NULL && g_atomic_int_dec_and_test (&dir->pending)) {
+    CopyDir *parent = dir->parent;
+
+    if (!g_atomic_int_get (&tree->failed)) {
+      GError *error = NULL;
+      int source_fd = open (dir->source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      int fd = open (dir->target, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (source_fd < 0)
+        set_error_from_errno (&error, "open", dir->source);
+      else if (fd < 0)
+        set_error_from_errno (&error, "open", dir->target);
+      else
+        eam_copy_metadata (source_fd, fd, dir->target, &dir->st, &error);
+
+      if (source_fd >= 0)
+        (void) close (source_fd);
+      if (fd >= 0)
+        (void) close (fd);
+
+      if (error != NULL)
+        copy_tree_fail (tree, error);
+    }
+
+    copy_dir_free (dir);
+    dir = parent;
+  }
+}
+
+typedef struct {
+  CopyTree *tree;
+  guint index;
+  CopyDir *dir;
+  int target_fd;
+  GError **error;
+} CopyDirWalk;
+
+static EamWalkAction
+copy_dir_visit (EamWalkEvent event,
+                const EamWalkEntry *entry,
+                gpointer user_data)
+{
+  CopyDirWalk *walk = user_data;
+  CopyDir *dir = walk->dir;
+
+  if (copy_tree_should_stop (walk->tree))
+    return EAM_WALK_STOP;
+
+  switch (event) {
+  case EAM_WALK_ENTER:
+    /* Subdirectories are queued, and maybe copied by another worker */
+    if (entry->depth > 0) {
+      g_autofree char *target = g_build_filename (dir->target, entry->name, NULL);
+
+      g_atomic_int_inc (&dir->pending);
+      copy_tree_push (walk->tree, walk->index, copy_dir_new (dir, entry->path, target));
+
+      return EAM_WALK_SKIP;
+    }
+
+    if (fstatat (entry->dfd, entry->name, &dir->st, 0) != 0) {
+      set_error_from_errno (walk->error, "query", dir->source);
+      return EAM_WALK_STOP;
+    }
+
+    int r;
+
+    /* The directory stays private until it gets its final mode */
+    do {
+      r = mkdir (dir->target, 0700);
+    } while (r != 0 && errno == EINTR);
+
+    if (r != 0) {
+      set_error_from_errno (walk->error, "create", dir->target);
+      return EAM_WALK_STOP;
+    }
+
+    walk->target_fd = open (dir->target, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (walk->target_fd < 0) {
+      set_error_from_errno (walk->error, "open", dir->target);
+      return EAM_WALK_STOP;
+    }
+
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_FILE:
+    if (!eam_copy_file_at (entry->dfd, entry->name, walk->target_fd, entry->name, walk->error))
+      return EAM_WALK_STOP;
+
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_LEAVE:
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_ERROR:
+    errno = entry->error;
+    set_error_from_errno (walk->error, "enumerate", entry->path);
+    return EAM_WALK_STOP;
+  }
+
+  return EAM_WALK_STOP;
+}
+
+/* Creates the target of @dir, copies the files of @dir into it, and
+ * queues its subdirectories; returns %FALSE without an error when
+ * another worker failed
+ */
+static gboolean
+copy_dir_run (CopyTree *tree,
+              guint index,
+              CopyDir *dir,
+              GError **error)
+{
+  CopyDirWalk walk = {
+    .tree = tree,
+    .index = index,
+    .dir = dir,
+    .target_fd = -1,
+    .error = error,
+  };
+
+  gboolean ret = eam_walk (AT_FDCWD, dir->source, copy_dir_visit, &walk);
+
+  if (walk.target_fd >= 0)
+    (void) close (walk.target_fd);
+
+  return ret;
+}
+
+static gpointer
+copy_worker_func (gpointer data)
+{
+  CopyWorker *worker = data;
+  CopyTree *tree = worker->tree;
+
+  while (TRUE) {
+    CopyDir *dir = copy_tree_pop (tree, worker->index);
+
+    if (dir == NULL) {
+      g_mutex_lock (&tree->lock);
+
+      /* Look again with the lock held, so that no push goes unseen */
+      while ((dir = copy_tree_pop (tree, worker->index)) == NULL &&
+             g_atomic_int_get (&tree->outstanding) > 0)
+        g_cond_wait (&tree->cond, &tree->lock);
+
+      g_mutex_unlock (&tree->lock);
+
+      if (dir == NULL)
+        break;
+    }
+
+    /* After a failure, the queued directories are only accounted for */
+    GError *error = NULL;
+    if (!copy_tree_should_stop (tree) &&
+        !copy_dir_run (tree, worker->index, dir, &error) &&
+        error != NULL)
+      copy_tree_fail (tree, error);
+
+    copy_dir_finish (tree, dir);
+
+    if (g_atomic_int_dec_and_test (&tree->outstanding)) {
+      g_mutex_lock (&tree->lock);
+      g_cond_broadcast (&tree->cond);
+      g_mutex_unlock (&tree->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * eam_copy_tree:
+ * @source: the directory to copy
+ * @target: the path of the copy, which must not exist
+ * @cancellable: (allow-none): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Copies @source and all its contents to @target, with their
+ * ownership, modes and times, using several threads. On error, the
+ * partial copy is left in place.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+eam_copy_tree (const char *source,
+               const char *target,
+               GCancellable *cancellable,
+               GError **error)
+{
+  CopyTree tree = { NULL, };
+
+  tree.n_workers = CLAMP (g_get_num_processors (), COPY_MIN_WORKERS, COPY_MAX_WORKERS);
+  tree.queues = g_new0 (CopyQueue, tree.n_workers);
+  tree.cancellable = cancellable;
+  g_mutex_init (&tree.lock);
+  g_cond_init (&tree.cond);
+
+  for (guint i = 0; i < tree.n_workers; i++) {
+    g_mutex_init (&tree.queues[i].lock);
+    g_queue_init (&tree.queues[i].dirs);
+  }
+
+  copy_tree_push (&tree, 0, copy_dir_new (NULL, source, target));
+
+  g_autofree CopyWorker *workers = g_new0 (CopyWorker, tree.n_workers);
+  g_autofree GThread **threads = g_new0 (GThread *, tree.n_workers);
+
+  for (guint i = 0; i < tree.n_workers; i++) {
+    workers[i].tree = &tree;
+    workers[i].index = i;
+  }
+
+  /* The calling thread is the first worker */
+  for (guint i = 1; i < tree.n_workers; i++)
+    threads[i] = g_thread_new ("eam-copy", copy_worker_func, &workers[i]);
+
+  copy_worker_func (&workers[0]);
+
+  for (guint i = 1; i < tree.n_workers; i++)
+    g_thread_join (threads[i]);
+
+  for (guint i = 0; i < tree.n_workers; i++)
+    g_mutex_clear (&tree.queues[i].lock);
+
+  g_free (tree.queues);
+  g_mutex_clear (&tree.lock);
+  g_cond_clear (&tree.cond);
+
+  if (tree.error != NULL) {
+    g_propagate_error (error, tree.error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,41 @@
+/* eam-copy.h: Copying files in the kernel
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <sys/stat.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+gboolean        eam_copy_file_at                (int source_dfd,
+                                                 const char *source_name,
+                                                 int target_dfd,
+                                                 const char *target_name,
+                                                 GError **error);
+gboolean        eam_copy_metadata               (int source_fd,
+                                                 int fd,
+                                                 const char *name,
+                                                 const struct stat *st,
+                                                 GError **error);
+gboolean        eam_copy_tree                   (const char *source,
+                                                 const char *target,
+                                                 GCancellable *cancellable,
+                                                 GError **error);
+
+G_END_DECLS
@@ -27,7 +27,9 @@
 #include "eam-dbus-server.h"
 #include "eam-service.h"
 #include "eam-config.h"
+#include "eam-fs-utils.h"
 #include "eam-log.h"
+#include "eam-trash.h"
 
 typedef struct _EamDbusServerPrivate EamDbusServerPrivate;
 
@@ -236,6 +238,14 @@ eam_dbus_server_run (EamDbusServer *server)
     return FALSE;
   }
 
+  /* No transaction can be running yet, so anything left in the
+   * staging directories belongs to an interrupted one
+   */
+  eam_fs_prune_staging_dirs ();
+
+  /* Finish removing what was moved to the trash before we last exited */
+  eam_trash_reclaim ();
+
   priv->busowner = g_bus_own_name (G_BUS_TYPE_SYSTEM, "com.endlessm.AppManager",
     G_BUS_NAME_OWNER_FLAGS_REPLACE | G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT,
     on_bus_acquired, on_name_acquired, on_name_lost,
@@ -0,0 +1,151 @@
+/* eam-digests.c: Checksums of the files written by an extraction
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eam-digests.h"
+
+/* The extraction writers hash every file they write; the checksums are
+ * kept here, so that the steps following the extraction, like the
+ * deduplication of the files and the manifest, do not need to read
+ * the tree all over again.
+ *
+ * Files are recorded by their path relative to the app directory, so
+ * that the records survive the app directory being moved around, and
+ * with the identity of their inode: its number, size, and modification
+ * and change times. A file the external script of the app rewrote, or
+ * replaced, no longer matches its record, and has to be hashed again.
+ */
+
+typedef struct {
+  char *checksum;
+
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+} DigestRecord;
+
+struct _EamDigests {
+  /* Protects the records, which are added by the writer threads */
+  GMutex lock;
+  GHashTable *records;
+};
+
+static void
+digest_record_free (gpointer data)
+{
+  DigestRecord *record = data;
+
+  g_free (record->checksum);
+  g_slice_free (DigestRecord, record);
+}
+
+EamDigests *
+eam_digests_new (void)
+{
+  EamDigests *digests = g_new0 (EamDigests, 1);
+
+  g_mutex_init (&digests->lock);
+  digests->records = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, digest_record_free);
+
+  return digests;
+}
+
+void
+eam_digests_free (EamDigests *digests)
+{
+  if (digests == NULL)
+    return;
+
+  g_hash_table_unref (digests->records);
+  g_mutex_clear (&digests->lock);
+
+  g_free (digests);
+}
+
+static gboolean
+timespec_equal (const struct timespec *a,
+                const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * eam_digests_add:
+ * @digests: a #EamDigests
+ * @path: the path of a regular file, relative to the app directory
+ * @buf: the status of the file, once it is complete
+ * @checksum: the SHA-256 checksum of the contents of the file
+ *
+ * Records the checksum of a file.
+ *
+ * This function can be called from any thread.
+ */
+void
+eam_digests_add (EamDigests *digests,
+                 const char *path,
+                 const struct stat *buf,
+                 const char *checksum)
+{
+  DigestRecord *record = g_slice_new0 (DigestRecord);
+
+  record->checksum = g_strdup (checksum);
+  record->dev = buf->st_dev;
+  record->ino = buf->st_ino;
+  record->size = buf->st_size;
+  record->mtime = buf->st_mtim;
+  record->ctime = buf->st_ctim;
+
+  g_mutex_lock (&digests->lock);
+  g_hash_table_replace (digests->records, g_strdup (path), record);
+  g_mutex_unlock (&digests->lock);
+}
+
+/**
+ * eam_digests_lookup:
+ * @digests: a #EamDigests
+ * @path: the path of a regular file, relative to the app directory
+ * @buf: the current status of the file
+ *
+ * Returns: (transfer none): the checksum of the file at @path, or
+ *   %NULL if it was not recorded, or changed since it was
+ */
+const char *
+eam_digests_lookup (EamDigests *digests,
+                    const char *path,
+                    const struct stat *buf)
+{
+  const char *checksum = NULL;
+
+  g_mutex_lock (&digests->lock);
+
+  DigestRecord *record = g_hash_table_lookup (digests->records, path);
+  if (record != NULL &&
+      record->dev == buf->st_dev && record->ino == buf->st_ino &&
+      record->size == buf->st_size &&
+      timespec_equal (&record->mtime, &buf->st_mtim) &&
+      timespec_equal (&record->ctime, &buf->st_ctim))
+    checksum = record->checksum;
+
+  g_mutex_unlock (&digests->lock);
+
+  return checksum;
+}
@@ -0,0 +1,41 @@
+/* eam-digests.h: Checksums of the files written by an extraction
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <sys/stat.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamDigests      EamDigests;
+
+EamDigests *    eam_digests_new                 (void);
+void            eam_digests_free                (EamDigests *digests);
+
+void            eam_digests_add                 (EamDigests *digests,
+                                                 const char *path,
+                                                 const struct stat *buf,
+                                                 const char *checksum);
+const char *    eam_digests_lookup              (EamDigests *digests,
+                                                 const char *path,
+                                                 const struct stat *buf);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamDigests, eam_digests_free)
+
+G_END_DECLS
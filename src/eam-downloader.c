@@ -0,0 +1,528 @@
+/* eam-downloader.c: Shared HTTP session for downloads
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <libsoup/soup.h>
+
+#include "eam-downloader.h"
+
+#include "eam-config.h"
+#include "eam-error.h"
+
+/* The downloader owns a single SoupSession, so that the connections,
+ * with their TLS sessions, and the resolved addresses are kept around
+ * and reused between downloads, instead of being set up for each
+ * payload.
+ *
+ * The synchronous API of SoupSession can be used from any thread, so
+ * the transactions share the session from their worker threads; the
+ * session limits the number of connections, in total and per host,
+ * and requests beyond those wait for a connection to be released.
+ *
+ * The default downloader lives as long as the daemon, and follows the
+ * [Download] section of the configuration; other downloaders can be
+ * created, e.g. to talk to a local server.
+ */
+
+#define DOWNLOADER_USER_AGENT   "EOS web get "
+
+struct _EamDownloader {
+  SoupSession *session;
+};
+
+/**
+ * eam_downloader_new:
+ * @max_conns: the maximum number of connections
+ * @max_conns_per_host: the maximum number of connections to each host
+ *
+ * Returns: (transfer full): a new #EamDownloader
+ */
+EamDownloader *
+eam_downloader_new (guint max_conns,
+                    guint max_conns_per_host)
+{
+  EamDownloader *downloader = g_new0 (EamDownloader, 1);
+
+  downloader->session =
+    soup_session_new_with_options (SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_DECODER,
+                                   SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_COOKIE_JAR,
+                                   SOUP_SESSION_USER_AGENT, DOWNLOADER_USER_AGENT,
+                                   SOUP_SESSION_ACCEPT_LANGUAGE_AUTO, TRUE,
+                                   SOUP_SESSION_MAX_CONNS, MAX (max_conns, 1),
+                                   SOUP_SESSION_MAX_CONNS_PER_HOST, MAX (max_conns_per_host, 1),
+                                   NULL);
+
+  return downloader;
+}
+
+/**
+ * eam_downloader_get_default:
+ *
+ * Returns: (transfer none): the #EamDownloader shared by the whole
+ *   process
+ */
+EamDownloader *
+eam_downloader_get_default (void)
+{
+  static volatile gpointer default_downloader;
+
+  if (g_once_init_enter (&default_downloader)) {
+    EamDownloader *downloader =
+      eam_downloader_new (eam_config_get_max_connections (),
+                          eam_config_get_max_connections_per_host ());
+
+    g_once_init_leave (&default_downloader, downloader);
+  }
+
+  return default_downloader;
+}
+
+void
+eam_downloader_free (EamDownloader *downloader)
+{
+  if (downloader == NULL)
+    return;
+
+  soup_session_abort (downloader->session);
+  g_object_unref (downloader->session);
+  g_free (downloader);
+}
+
+static SoupMessage *
+downloader_new_message (const char *url,
+                        GError **error)
+{
+  g_autoptr(SoupURI) uri = soup_uri_new (url);
+  if (uri == NULL) {
+    g_set_error (error, EAM_ERROR, EAM_ERROR_PROTOCOL_ERROR,
+                 "Could not parse '%s' as a URL", url);
+    return NULL;
+  }
+
+  return soup_message_new_from_uri ("GET", uri);
+}
+
+/**
+ * eam_downloader_open:
+ * @downloader: a #EamDownloader
+ * @url: the URL to download
+ * @content_length: (out) (allow-none): return location for the size
+ *   announced by the server, or -1 if it did not announce one
+ * @cancellable: (allow-none): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Sends a GET request for @url, and waits for the headers of the
+ * response; a response other than a success is an error.
+ *
+ * Returns: (transfer full): a stream with the body of the response, or
+ *   %NULL on error
+ */
+GInputStream *
+eam_downloader_open (EamDownloader *downloader,
+                     const char *url,
+                     goffset *content_length,
+                     GCancellable *cancellable,
+                     GError **error)
+{
+  g_autoptr(SoupMessage) msg = downloader_new_message (url, error);
+  if (msg == NULL)
+    return NULL;
+
+  g_autoptr(GInputStream) stream = soup_session_send (downloader->session, msg, cancellable, error);
+  if (stream == NULL)
+    return NULL;
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+    g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                 "%u %s", msg->status_code, msg->reason_phrase);
+    return NULL;
+  }
+
+  /* Without a Content-Length, the size is unknown; when the body is
+   * decoded, the header applies to the encoded body
+   */
+  if (content_length != NULL) {
+    *content_length = -1;
+
+    if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH &&
+        soup_message_headers_get_one (msg->response_headers, "Content-Encoding") == NULL)
+      *content_length = soup_message_headers_get_content_length (msg->response_headers);
+  }
+
+  return g_steal_pointer (&stream);
+}
+
+/**
+ * eam_download_info_clear:
+ * @info: a #EamDownloadInfo
+ *
+ * Frees the contents of @info.
+ */
+void
+eam_download_info_clear (EamDownloadInfo *info)
+{
+  g_clear_pointer (&info->validator, g_free);
+}
+
+/* A weak ETag does not promise byte-for-byte equality, so it cannot
+ * be used to resume; the modification date is the fallback
+ */
+static char *
+response_get_validator (SoupMessage *msg)
+{
+  const char *etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  if (etag != NULL && !g_str_has_prefix (etag, "W/"))
+    return g_strdup (etag);
+
+  return g_strdup (soup_message_headers_get_one (msg->response_headers, "Last-Modified"));
+}
+
+static gboolean
+response_accepts_ranges (SoupMessage *msg)
+{
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+    return TRUE;
+
+  const char *accept_ranges = soup_message_headers_get_list (msg->response_headers, "Accept-Ranges");
+
+  return accept_ranges != NULL && soup_header_contains (accept_ranges, "bytes");
+}
+
+/**
+ * eam_downloader_open_range:
+ * @downloader: a #EamDownloader
+ * @url: the URL to download
+ * @offset: the offset of the first byte to download
+ * @end: the offset of the last byte to download, or -1 for the end of
+ *   the resource
+ * @validator: (allow-none): the validator of the resource, as returned
+ *   by a previous request
+ * @info: (out caller-allocates): return location for what the response
+ *   tells about its body
+ * @cancellable: (allow-none): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like eam_downloader_open(), but asks for the bytes of the resource
+ * between @offset and @end, provided that it still matches @validator;
+ * otherwise, or if the server does not support ranges, the whole
+ * resource is sent, and the start of @info is set to 0.
+ *
+ * The body is never decoded, so that offsets are stable between
+ * requests.
+ *
+ * Returns: (transfer full): a stream with the body of the response, or
+ *   %NULL on error
+ */
+GInputStream *
+eam_downloader_open_range (EamDownloader *downloader,
+                           const char *url,
+                           goffset offset,
+                           goffset end,
+                           const char *validator,
+                           EamDownloadInfo *info,
+                           GCancellable *cancellable,
+                           GError **error)
+{
+  g_autoptr(SoupMessage) msg = downloader_new_message (url, error);
+  if (msg == NULL)
+    return NULL;
+
+  soup_message_disable_feature (msg, SOUP_TYPE_CONTENT_DECODER);
+
+  /* Without a validator, we cannot tell whether the bytes we already
+   * have belong to the current version of the resource
+   */
+  if ((offset > 0 || end >= 0) && validator != NULL) {
+    soup_message_headers_set_range (msg->request_headers, offset, end);
+    soup_message_headers_replace (msg->request_headers, "If-Range", validator);
+  }
+  else {
+    offset = 0;
+    end = -1;
+  }
+
+  g_autoptr(GInputStream) stream = soup_session_send (downloader->session, msg, cancellable, error);
+  if (stream == NULL)
+    return NULL;
+
+  /* The resource is not longer than what we have, so it changed
+   * without its validator changing; start over
+   */
+  if (offset > 0 && msg->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+    g_input_stream_close (stream, NULL, NULL);
+    return eam_downloader_open_range (downloader, url, 0, -1, NULL, info, cancellable, error);
+  }
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+    g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                 "%u %s", msg->status_code, msg->reason_phrase);
+    return NULL;
+  }
+
+  info->start = 0;
+  info->content_length = -1;
+  info->total_length = -1;
+
+  if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+    info->content_length = soup_message_headers_get_content_length (msg->response_headers);
+
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT) {
+    goffset range_start, range_end, total;
+
+    if (!soup_message_headers_get_content_range (msg->response_headers,
+                                                 &range_start, &range_end, &total) ||
+        range_start != offset || (end >= 0 && range_end != end)) {
+      g_set_error (error, EAM_ERROR, EAM_ERROR_PROTOCOL_ERROR,
+                   "Unexpected range in the response for '%s'", url);
+      return NULL;
+    }
+
+    info->start = offset;
+    info->total_length = total;
+  }
+  else {
+    info->total_length = info->content_length;
+  }
+
+  info->accept_ranges = response_accepts_ranges (msg);
+  info->validator = response_get_validator (msg);
+
+  return g_steal_pointer (&stream);
+}
+
+/* The segments of a download are fetched by a thread each, and written
+ * in place with pwrite(); the first one reuses the stream of the
+ * request that announced the size of the resource
+ */
+#define SEGMENT_BLOCK_SIZE (256 * 1024)
+
+typedef struct {
+  EamDownloader *downloader;
+  const char *url;
+  const char *validator;
+  int fd;
+
+  GInputStream *stream;
+  goffset start;
+  goffset end;
+  goffset done;
+
+  GThread *thread;
+  GCancellable *cancellable;
+  GError *error;
+} Segment;
+
+static gboolean
+segment_write (int fd,
+               const guint8 *data,
+               gsize size,
+               goffset offset,
+               GError **error)
+{
+  while (size > 0) {
+    gssize n = pwrite (fd, data, size, offset);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      int saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "%s", g_strerror (saved_errno));
+      return FALSE;
+    }
+
+    data += n;
+    size -= n;
+    offset += n;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+segment_fetch (Segment *segment,
+               GError **error)
+{
+  g_autoptr(GInputStream) stream = g_steal_pointer (&segment->stream);
+
+  if (stream == NULL) {
+    g_auto(EamDownloadInfo) info = { 0, };
+
+    stream = eam_downloader_open_range (segment->downloader, segment->url,
+                                        segment->start, segment->end - 1,
+                                        segment->validator, &info,
+                                        segment->cancellable, error);
+    if (stream == NULL)
+      return FALSE;
+
+    if (info.start != segment->start) {
+      g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                   "The resource changed during the download");
+      return FALSE;
+    }
+  }
+
+  g_autofree guint8 *buffer = g_malloc (SEGMENT_BLOCK_SIZE);
+
+  while (segment->start + segment->done < segment->end) {
+    gsize size = MIN (SEGMENT_BLOCK_SIZE, segment->end - segment->start - segment->done);
+    gssize n = g_input_stream_read (stream, buffer, size, segment->cancellable, error);
+    if (n < 0)
+      return FALSE;
+
+    if (n == 0) {
+      g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                   "Unexpected end of data");
+      return FALSE;
+    }
+
+    if (!segment_write (segment->fd, buffer, n, segment->start + segment->done, error))
+      return FALSE;
+
+    segment->done += n;
+  }
+
+  return TRUE;
+}
+
+/* A failed segment stops the others */
+static gpointer
+segment_thread_func (gpointer data)
+{
+  Segment *segment = data;
+
+  if (!segment_fetch (segment, &segment->error))
+    g_cancellable_cancel (segment->cancellable);
+
+  return NULL;
+}
+
+static void
+cancel_segments (GCancellable *cancellable,
+                 gpointer data)
+{
+  g_cancellable_cancel (data);
+}
+
+/**
+ * eam_downloader_fetch_segments:
+ * @downloader: a #EamDownloader
+ * @url: the URL to download
+ * @stream: the stream returned by eam_downloader_open_range()
+ * @info: the #EamDownloadInfo of @stream
+ * @fd: the file to write the resource into
+ * @n_segments: the number of segments to fetch concurrently
+ * @completed: (out): return location for the offset up to which the
+ *   resource was written without gaps
+ * @cancellable: (allow-none): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Writes the body of @stream into @fd, at the offset of the body in
+ * the resource, splitting it into @n_segments ranges that are fetched
+ * concurrently; the first range is read from @stream, and the others
+ * are requested anew. The server must accept ranges, and the resource
+ * must have a validator and a known size.
+ *
+ * Returns: %TRUE if the whole body was written
+ */
+gboolean
+eam_downloader_fetch_segments (EamDownloader *downloader,
+                               const char *url,
+                               GInputStream *stream,
+                               const EamDownloadInfo *info,
+                               int fd,
+                               guint n_segments,
+                               goffset *completed,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+  g_return_val_if_fail (info->accept_ranges && info->validator != NULL, FALSE);
+  g_return_val_if_fail (info->content_length >= 0, FALSE);
+
+  goffset size = info->content_length;
+  n_segments = CLAMP (n_segments, 1, MAX (size / SEGMENT_BLOCK_SIZE, 1));
+
+  g_autoptr(GCancellable) stop = g_cancellable_new ();
+  gulong handler = 0;
+  if (cancellable != NULL)
+    handler = g_cancellable_connect (cancellable, G_CALLBACK (cancel_segments),
+                                     g_object_ref (stop), g_object_unref);
+
+  g_autofree Segment *segments = g_new0 (Segment, n_segments);
+  goffset segment_size = size / n_segments;
+
+  for (guint i = 0; i < n_segments; i++) {
+    Segment *segment = &segments[i];
+
+    segment->downloader = downloader;
+    segment->url = url;
+    segment->validator = info->validator;
+    segment->fd = fd;
+    segment->start = info->start + i * segment_size;
+    segment->end = i + 1 < n_segments ? segment->start + segment_size : info->start + size;
+    segment->cancellable = stop;
+  }
+
+  segments[0].stream = g_object_ref (stream);
+
+  for (guint i = 1; i < n_segments; i++)
+    segments[i].thread = g_thread_new ("eam-segment", segment_thread_func, &segments[i]);
+
+  segment_thread_func (&segments[0]);
+
+  for (guint i = 1; i < n_segments; i++)
+    g_thread_join (segments[i].thread);
+
+  g_cancellable_disconnect (cancellable, handler);
+
+  /* The segments that were stopped by another one report being
+   * cancelled, so the first other error is the cause
+   */
+  GError *cause = NULL;
+  *completed = info->start;
+
+  for (guint i = 0; i < n_segments; i++) {
+    Segment *segment = &segments[i];
+
+    if (segment->error != NULL &&
+        (cause == NULL ||
+         (g_error_matches (cause, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+          !g_error_matches (segment->error, G_IO_ERROR, G_IO_ERROR_CANCELLED))))
+      cause = segment->error;
+
+    if (*completed == segment->start)
+      *completed += segment->done;
+  }
+
+  gboolean res = TRUE;
+
+  if (cause != NULL) {
+    g_propagate_error (error, g_error_copy (cause));
+    res = FALSE;
+  }
+
+  for (guint i = 0; i < n_segments; i++)
+    g_clear_error (&segments[i].error);
+
+  return res;
+}
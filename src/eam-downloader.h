@@ -0,0 +1,79 @@
+/* eam-downloader.h: Shared HTTP session for downloads
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamDownloader   EamDownloader;
+
+/**
+ * EamDownloadInfo:
+ * @start: the offset of the first byte of the body in the resource
+ * @content_length: the size of the body, or -1 if unknown
+ * @total_length: the size of the resource, or -1 if unknown
+ * @accept_ranges: whether the server accepts range requests
+ * @validator: the strong ETag or the modification date of the
+ *   resource, or %NULL if it has neither
+ *
+ * What the headers of a response tell about its body.
+ */
+typedef struct {
+  goffset start;
+  goffset content_length;
+  goffset total_length;
+  gboolean accept_ranges;
+  char *validator;
+} EamDownloadInfo;
+
+void                    eam_download_info_clear         (EamDownloadInfo *info);
+
+EamDownloader *         eam_downloader_new              (guint max_conns,
+                                                         guint max_conns_per_host);
+EamDownloader *         eam_downloader_get_default      (void);
+void                    eam_downloader_free             (EamDownloader *downloader);
+
+GInputStream *          eam_downloader_open             (EamDownloader *downloader,
+                                                         const char *url,
+                                                         goffset *content_length,
+                                                         GCancellable *cancellable,
+                                                         GError **error);
+GInputStream *          eam_downloader_open_range       (EamDownloader *downloader,
+                                                         const char *url,
+                                                         goffset offset,
+                                                         goffset end,
+                                                         const char *validator,
+                                                         EamDownloadInfo *info,
+                                                         GCancellable *cancellable,
+                                                         GError **error);
+gboolean                eam_downloader_fetch_segments   (EamDownloader *downloader,
+                                                         const char *url,
+                                                         GInputStream *stream,
+                                                         const EamDownloadInfo *info,
+                                                         int fd,
+                                                         guint n_segments,
+                                                         goffset *completed,
+                                                         GCancellable *cancellable,
+                                                         GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamDownloader, eam_downloader_free)
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (EamDownloadInfo, eam_download_info_clear)
+
+G_END_DECLS
@@ -0,0 +1,435 @@
+/* eam-extract-filter.c: Partial extraction of bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "eam-extract-filter.h"
+
+#include "eam-config.h"
+#include "eam-log.h"
+
+/* Bundles ship the translations for every language they support, and
+ * some of them ship libraries for more than one architecture. The
+ * filter decides which of those subtrees are worth extracting on this
+ * system, and remembers the ones it left out, so that they can be
+ * recorded in the app's .info file:
+ *
+ *   [Partial]
+ *   locales=en;pt
+ *   architectures=x86_64-linux-gnu;i386-linux-gnu
+ *   skipped_locales=de;fr;pt_BR
+ *   skipped_architectures=arm-linux-gnueabihf
+ *
+ * A client noticing that the system locales are not covered anymore
+ * can then install the full bundle again.
+ *
+ * Locales are matched by language, so keeping "pt" keeps "pt_BR" as
+ * well; the "C" locale, used as a fallback by help files, is always
+ * kept. Architectures are matched by multiarch triplet, and only
+ * the triplets we know about are ever left out.
+ */
+
+/* Directories of an app holding one subdirectory per locale */
+static const char * const locale_dirs[] = {
+  "share/locale",
+  "share/help",
+  NULL
+};
+
+/* Directories of an app holding one subdirectory per triplet */
+static const char * const arch_dirs[] = {
+  "lib",
+  NULL
+};
+
+static const char * const known_triplets[] = {
+  "x86_64-linux-gnu",
+  "i386-linux-gnu",
+  "aarch64-linux-gnu",
+  "arm-linux-gnueabihf",
+  NULL
+};
+
+/* The triplets this machine can run */
+static const char * const native_triplets[] = {
+#if defined(__x86_64__)
+  "x86_64-linux-gnu",
+  "i386-linux-gnu",
+#elif defined(__i386__)
+  "i386-linux-gnu",
+#elif defined(__aarch64__)
+  "aarch64-linux-gnu",
+  "arm-linux-gnueabihf",
+#elif defined(__arm__)
+  "arm-linux-gnueabihf",
+#endif
+  NULL
+};
+
+/* Files listing the system locales, in shell variable syntax */
+static const char * const locale_files[] = {
+  "/etc/locale.conf",
+  "/etc/default/locale",
+  NULL
+};
+
+struct _EamExtractFilter {
+  /* Sets of names to keep; %NULL keeps everything */
+  GHashTable *languages;
+  GHashTable *architectures;
+
+  GHashTable *skipped_locales;
+  GHashTable *skipped_architectures;
+};
+
+static char *
+locale_get_language (const char *locale)
+{
+  return g_strndup (locale, strcspn (locale, "_.@"));
+}
+
+static GHashTable *
+string_set_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+add_system_locales_from_file (GPtrArray *locales,
+                              const char *file)
+{
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (file, &contents, NULL, NULL))
+    return;
+
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i] != NULL; i++) {
+    char *line = g_strstrip (lines[i]);
+
+    if (!g_str_has_prefix (line, "LANG=") &&
+        !g_str_has_prefix (line, "LANGUAGE=") &&
+        !g_str_has_prefix (line, "LC_MESSAGES="))
+      continue;
+
+    char *value = strchr (line, '=') + 1;
+    value = g_strdelimit (value, "\"'", ' ');
+
+    /* LANGUAGE is a list of locales */
+    g_auto(GStrv) values = g_strsplit (g_strstrip (value), ":", -1);
+    for (guint j = 0; values[j] != NULL; j++) {
+      if (*values[j] != '\0')
+        g_ptr_array_add (locales, g_strdup (values[j]));
+    }
+  }
+}
+
+static GStrv
+get_system_locales (void)
+{
+  GPtrArray *locales = g_ptr_array_new ();
+
+  for (guint i = 0; locale_files[i] != NULL; i++)
+    add_system_locales_from_file (locales, locale_files[i]);
+
+  const char * const *names = g_get_language_names ();
+  for (guint i = 0; names[i] != NULL; i++)
+    g_ptr_array_add (locales, g_strdup (names[i]));
+
+  g_ptr_array_add (locales, NULL);
+
+  return (GStrv) g_ptr_array_free (locales, FALSE);
+}
+
+/* Parses "all", "system", or a list of names separated by semicolons;
+ * returns %NULL for "all"
+ */
+static GStrv
+parse_config_list (const char *value,
+                   GStrv (* get_system) (void))
+{
+  if (value == NULL || *value == '\0' || g_strcmp0 (value, "all") == 0)
+    return NULL;
+
+  if (g_strcmp0 (value, "system") == 0)
+    return get_system ();
+
+  GStrv names = g_strsplit (value, ";", -1);
+  for (guint i = 0; names[i] != NULL; i++)
+    g_strstrip (names[i]);
+
+  return names;
+}
+
+static GStrv
+get_native_triplets (void)
+{
+  /* Keep everything on machines we know nothing about */
+  if (native_triplets[0] == NULL)
+    return NULL;
+
+  return g_strdupv ((GStrv) native_triplets);
+}
+
+/**
+ * eam_extract_filter_new:
+ * @locales: (allow-none): the locales to keep, or %NULL to keep all
+ * @architectures: (allow-none): the multiarch triplets to keep, or
+ *   %NULL to keep all
+ *
+ * Returns: (transfer full): a new #EamExtractFilter
+ */
+EamExtractFilter *
+eam_extract_filter_new (const char * const *locales,
+                        const char * const *architectures)
+{
+  EamExtractFilter *filter = g_new0 (EamExtractFilter, 1);
+
+  if (locales != NULL) {
+    filter->languages = string_set_new ();
+    for (guint i = 0; locales[i] != NULL; i++) {
+      if (*locales[i] != '\0')
+        g_hash_table_add (filter->languages, locale_get_language (locales[i]));
+    }
+  }
+
+  if (architectures != NULL) {
+    filter->architectures = string_set_new ();
+    for (guint i = 0; architectures[i] != NULL; i++) {
+      if (*architectures[i] != '\0')
+        g_hash_table_add (filter->architectures, g_strdup (architectures[i]));
+    }
+  }
+
+  filter->skipped_locales = string_set_new ();
+  filter->skipped_architectures = string_set_new ();
+
+  return filter;
+}
+
+/**
+ * eam_extract_filter_new_from_config:
+ *
+ * Creates a filter from the Locales and Architectures keys of the
+ * configuration.
+ *
+ * Returns: (transfer full): a new #EamExtractFilter, or %NULL if
+ *   the configuration asks for everything to be extracted
+ */
+EamExtractFilter *
+eam_extract_filter_new_from_config (void)
+{
+  g_auto(GStrv) locales = parse_config_list (eam_config_get_locales (), get_system_locales);
+  g_auto(GStrv) architectures = parse_config_list (eam_config_get_architectures (), get_native_triplets);
+
+  if (locales == NULL && architectures == NULL)
+    return NULL;
+
+  return eam_extract_filter_new ((const char * const *) locales,
+                                 (const char * const *) architectures);
+}
+
+void
+eam_extract_filter_free (EamExtractFilter *filter)
+{
+  if (filter == NULL)
+    return;
+
+  g_clear_pointer (&filter->languages, g_hash_table_unref);
+  g_clear_pointer (&filter->architectures, g_hash_table_unref);
+  g_hash_table_unref (filter->skipped_locales);
+  g_hash_table_unref (filter->skipped_architectures);
+
+  g_free (filter);
+}
+
+/* Returns the name of the subdirectory of @dir that @path is in, or
+ * %NULL if @path is not inside a subdirectory of @dir
+ */
+static char *
+get_subtree_name (const char *path,
+                  const char *dir,
+                  gboolean is_dir)
+{
+  gsize len = strlen (dir);
+
+  if (strncmp (path, dir, len) != 0 || path[len] != '/')
+    return NULL;
+
+  const char *name = path + len + 1;
+  const char *end = strchr (name, '/');
+
+  /* A file directly inside @dir is not a subtree */
+  if (end == NULL && !is_dir)
+    return NULL;
+
+  gsize name_len = end != NULL ? (gsize) (end - name) : strlen (name);
+  if (name_len == 0)
+    return NULL;
+
+  return g_strndup (name, name_len);
+}
+
+static gboolean
+filter_match_locale (EamExtractFilter *filter,
+                     const char *path,
+                     gboolean is_dir)
+{
+  for (guint i = 0; locale_dirs[i] != NULL; i++) {
+    g_autofree char *locale = get_subtree_name (path, locale_dirs[i], is_dir);
+    if (locale == NULL)
+      continue;
+
+    if (strcmp (locale, "C") == 0 || strcmp (locale, "POSIX") == 0)
+      return TRUE;
+
+    g_autofree char *language = locale_get_language (locale);
+    if (g_hash_table_contains (filter->languages, language))
+      return TRUE;
+
+    g_hash_table_add (filter->skipped_locales, g_steal_pointer (&locale));
+
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+filter_match_architecture (EamExtractFilter *filter,
+                           const char *path,
+                           gboolean is_dir)
+{
+  for (guint i = 0; arch_dirs[i] != NULL; i++) {
+    g_autofree char *triplet = get_subtree_name (path, arch_dirs[i], is_dir);
+    if (triplet == NULL)
+      continue;
+
+    if (!g_strv_contains (known_triplets, triplet) ||
+        g_hash_table_contains (filter->architectures, triplet))
+      return TRUE;
+
+    g_hash_table_add (filter->skipped_architectures, g_steal_pointer (&triplet));
+
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_extract_filter_match:
+ * @filter: a #EamExtractFilter
+ * @path: the path of a bundle entry, starting with the app id
+ * @is_dir: whether the entry is a directory
+ *
+ * Returns: %TRUE if the entry should be extracted
+ */
+gboolean
+eam_extract_filter_match (EamExtractFilter *filter,
+                          const char *path,
+                          gboolean is_dir)
+{
+  while (g_str_has_prefix (path, "./"))
+    path += 2;
+
+  /* Everything is relative to the app directory */
+  const char *rel = strchr (path, '/');
+  if (rel == NULL)
+    return TRUE;
+
+  rel += 1;
+
+  if (filter->languages != NULL && !filter_match_locale (filter, rel, is_dir))
+    return FALSE;
+
+  if (filter->architectures != NULL && !filter_match_architecture (filter, rel, is_dir))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+key_file_set_set (GKeyFile *keyfile,
+                  const char *key,
+                  GHashTable *set)
+{
+  GList *names = g_list_sort (g_hash_table_get_keys (set), (GCompareFunc) g_strcmp0);
+  g_autoptr(GPtrArray) list = g_ptr_array_new ();
+
+  for (GList *l = names; l != NULL; l = l->next)
+    g_ptr_array_add (list, l->data);
+
+  g_key_file_set_string_list (keyfile, EAM_EXTRACT_FILTER_INFO_GROUP, key,
+                              (const char * const *) list->pdata, list->len);
+
+  g_list_free (names);
+}
+
+/**
+ * eam_extract_filter_record:
+ * @filter: a #EamExtractFilter
+ * @appdir: the directory the app was extracted into
+ *
+ * Records what the filter left out in the .info file of @appdir,
+ * if anything.
+ *
+ * Returns: %TRUE if the .info file was updated, or did not need to be
+ */
+gboolean
+eam_extract_filter_record (EamExtractFilter *filter,
+                           const char *appdir)
+{
+  if (g_hash_table_size (filter->skipped_locales) == 0 &&
+      g_hash_table_size (filter->skipped_architectures) == 0)
+    return TRUE;
+
+  g_autofree char *info_file = g_build_filename (appdir, ".info", NULL);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, info_file, G_KEY_FILE_KEEP_COMMENTS, &error)) {
+    eam_log_error_message ("Unable to load bundle metadata '%s': %s", info_file, error->message);
+    return FALSE;
+  }
+
+  g_key_file_remove_group (keyfile, EAM_EXTRACT_FILTER_INFO_GROUP, NULL);
+
+  if (filter->languages != NULL)
+    key_file_set_set (keyfile, "locales", filter->languages);
+  if (filter->architectures != NULL)
+    key_file_set_set (keyfile, "architectures", filter->architectures);
+
+  key_file_set_set (keyfile, "skipped_locales", filter->skipped_locales);
+  key_file_set_set (keyfile, "skipped_architectures", filter->skipped_architectures);
+
+  if (!g_key_file_save_to_file (keyfile, info_file, &error)) {
+    eam_log_error_message ("Unable to save bundle metadata '%s': %s", info_file, error->message);
+    return FALSE;
+  }
+
+  eam_log_info_message ("Left out %u locales and %u architectures from '%s'",
+                        g_hash_table_size (filter->skipped_locales),
+                        g_hash_table_size (filter->skipped_architectures),
+                        appdir);
+
+  return TRUE;
+}
@@ -0,0 +1,44 @@
+/* eam-extract-filter.h: Partial extraction of bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamExtractFilter        EamExtractFilter;
+
+#define EAM_EXTRACT_FILTER_INFO_GROUP   "Partial"
+
+EamExtractFilter *      eam_extract_filter_new          (const char * const *locales,
+                                                         const char * const *architectures);
+EamExtractFilter *      eam_extract_filter_new_from_config
+                                                        (void);
+void                    eam_extract_filter_free         (EamExtractFilter *filter);
+
+gboolean                eam_extract_filter_match        (EamExtractFilter *filter,
+                                                         const char *path,
+                                                         gboolean is_dir);
+
+gboolean                eam_extract_filter_record       (EamExtractFilter *filter,
+                                                         const char *appdir);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamExtractFilter, eam_extract_filter_free)
+
+G_END_DECLS
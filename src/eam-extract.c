@@ -0,0 +1,1614 @@
+/* eam-extract.c: Bundle extraction engine
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "eam-extract.h"
+
+#include "eam-log.h"
+#include "eam-sha256.h"
+#include "eam-uring.h"
+#include "eam-zstd.h"
+
+/* The extraction is split in two stages: the thread calling
+ * eam_extractor_run() reads the headers and decompresses the data,
+ * and a pool of writer threads drains the resulting entries to disk.
+ *
+ * Regular files are handed over to the writers as soon as their
+ * header has been read; the data follows in chunks, so large files
+ * are streamed instead of being buffered in memory. The amount of
+ * decompressed data waiting to be written is bounded, which keeps
+ * the memory usage constant regardless of the bundle size.
+ *
+ * Directories and symbolic links are created by the reader, so that
+ * they exist before any file is written inside them; hard links are
+ * deferred until all the writers are done, as their target may still
+ * be in flight.
+ *
+ * Plain regular files are written by the writers themselves rather
+ * than through libarchive: each file is allocated in full before its
+ * data is written, so that the file system can lay it out in one
+ * piece instead of growing it block by block, which fragments badly
+ * on flash storage. The ownership, permissions and timestamps are
+ * applied once the data is in place.
+ *
+ * With a filter, the reader skips the entries the system has no use
+ * for, like translations in other languages; hard links to skipped
+ * entries are skipped as well.
+ *
+ * With a digests table, the writers hash the files as they write
+ * them, and record the checksums once the files are complete; files
+ * resumed from the journal are recorded with their journaled checksum.
+ * The files are not deduplicated here: the external script of the app
+ * may still modify them, so that only happens once it has run.
+ *
+ * With a journal, the writers record the files they complete, with
+ * the checksum of their data, and the reader periodically makes them
+ * durable with a checkpoint. Files that a previous, interrupted,
+ * extraction recorded in the journal are not written again: the reader
+ * still hashes their data as it goes past, and if it does not match the
+ * journal the extraction fails, so that it can be started over. The
+ * copies on disk are read back and compared with the same data, and
+ * whatever changed since they were journaled is written again.
+ *
+ * The bundle is read through our own callbacks, so that the raw data
+ * can be tapped, e.g. to verify its signature in the same pass. The
+ * bundle is either mapped in memory, and handed to libarchive in
+ * windows of the mapping, or read in large blocks; in both cases the
+ * kernel is told that the access is sequential, so that it reads
+ * ahead aggressively.
+ *
+ * Seekable zstd bundles are made of independent frames, which are
+ * decompressed by a pool of threads before the data reaches
+ * libarchive; any other bundle is decompressed by libarchive itself,
+ * in the reader thread.
+ */
+
+/* Size of the blocks handed to libarchive, and to the tap */
+#define READ_BLOCK_SIZE              (1024 * 1024)
+
+/* Alignment of the read buffer; a page is enough for any device */
+#define READ_BUFFER_ALIGNMENT        4096
+
+/* Upper bound for the decompressed data queued for the writers */
+#define MAX_BYTES_IN_FLIGHT          (32 * 1024 * 1024)
+
+/* Upper bound for the entries queued for each writer */
+#define MAX_JOBS_PER_WRITER          64
+
+#define MAX_WRITERS                  16
+
+/* How much of the bundle is read between two journal checkpoints */
+#define CHECKPOINT_BYTES             (64 * 1024 * 1024)
+
+/* Size of the blocks compared when resuming an extraction */
+#define REPAIR_BLOCK_SIZE            (64 * 1024)
+
+#define EXTRACT_FLAGS \
+  (ARCHIVE_EXTRACT_TIME | \
+   ARCHIVE_EXTRACT_PERM | \
+   ARCHIVE_EXTRACT_ACL | \
+   ARCHIVE_EXTRACT_FFLAGS)
+
+typedef struct {
+  gint64 offset;
+  gsize size;
+  guint8 data[];
+} ExtractChunk;
+
+typedef struct {
+  struct archive_entry *entry;
+  GAsyncQueue *chunks;
+
+  /* The position and name of the entry in the bundle */
+  guint64 index;
+  char *name;
+} ExtractJob;
+
+/* The state owned by each writer thread */
+typedef struct {
+  struct archive *ext;
+
+  /* User and group names already resolved, to their ids */
+  GHashTable *uids;
+  GHashTable *gids;
+
+  /* When the kernel supports it, the data of the files we write
+   * directly is written in batches; the chunks stay around until
+   * their batch is complete
+   */
+  EamUring *ring;
+  GPtrArray *pending;
+} ExtractWriter;
+
+struct _EamExtractor {
+  char *bundle_file;
+  char *target_prefix;
+
+  guint n_writers;
+  gboolean preallocate;
+
+  EamExtractorTapFunc tap_func;
+  gpointer tap_data;
+
+  EamExtractorReader reader;
+
+  int fd;
+  guint8 *read_buffer;
+  const guint8 *map;
+  gsize map_size;
+  gsize map_offset;
+  guint64 bundle_size;
+  EamZstdDecoder *zstd;
+  guint64 bytes_read;
+  guint64 entries_read;
+  gboolean tap_failed;
+
+  EamProgress *progress;
+  EamExtractFilter *filter;
+  guint64 entries_filtered;
+  EamDigests *digests;
+  EamJournal *journal;
+  guint64 checkpoint_bytes;
+  guint64 entries_skipped;
+  gboolean resume_rejected;
+
+  GCancellable *cancellable;
+
+  GAsyncQueue *jobs;
+
+  /* Protects the fields below */
+  GMutex lock;
+  GCond cond;
+
+  gsize bytes_in_flight;
+  guint jobs_in_flight;
+
+  gboolean aborted;
+  char *error_message;
+};
+
+/* Markers for the end of an entry's data, and for the end of the job
+ * queue; they are only ever compared by address
+ */
+static ExtractChunk end_of_entry;
+static ExtractJob end_of_jobs;
+
+static ExtractJob *
+extract_job_new (struct archive_entry *entry,
+                 guint64 index,
+                 const char *name)
+{
+  ExtractJob *job = g_slice_new (ExtractJob);
+
+  job->entry = archive_entry_clone (entry);
+  job->chunks = g_async_queue_new ();
+  job->index = index;
+  job->name = g_strdup (name);
+
+  return job;
+}
+
+static void
+extract_job_free (ExtractJob *job)
+{
+  archive_entry_free (job->entry);
+  g_async_queue_unref (job->chunks);
+  g_free (job->name);
+
+  g_slice_free (ExtractJob, job);
+}
+
+/**
+ * eam_extractor_new:
+ * @bundle_file: the path of the bundle to extract
+ * @target_prefix: the directory the bundle is extracted into
+ *
+ * Returns: (transfer full): a new #EamExtractor
+ */
+EamExtractor *
+eam_extractor_new (const char *bundle_file,
+                   const char *target_prefix)
+{
+  EamExtractor *extractor = g_new0 (EamExtractor, 1);
+
+  extractor->bundle_file = g_strdup (bundle_file);
+  extractor->target_prefix = g_strdup (target_prefix);
+  extractor->n_writers = 1;
+  extractor->reader = EAM_EXTRACTOR_READER_MMAP;
+  extractor->preallocate = TRUE;
+  extractor->fd = -1;
+
+  g_mutex_init (&extractor->lock);
+  g_cond_init (&extractor->cond);
+
+  return extractor;
+}
+
+void
+eam_extractor_free (EamExtractor *extractor)
+{
+  if (extractor == NULL)
+    return;
+
+  g_free (extractor->bundle_file);
+  g_free (extractor->target_prefix);
+  g_free (extractor->error_message);
+
+  g_mutex_clear (&extractor->lock);
+  g_cond_clear (&extractor->cond);
+
+  g_free (extractor);
+}
+
+/**
+ * eam_extractor_set_n_writers:
+ * @extractor: a #EamExtractor
+ * @n_writers: the number of threads writing to disk, or 0 to pick
+ *   a default based on the number of available processors
+ *
+ * Sets the size of the writer thread pool.
+ */
+void
+eam_extractor_set_n_writers (EamExtractor *extractor,
+                             guint n_writers)
+{
+  if (n_writers == 0)
+    n_writers = CLAMP (g_get_num_processors () - 1, 1, 4);
+
+  extractor->n_writers = MIN (n_writers, MAX_WRITERS);
+}
+
+/**
+ * eam_extractor_set_preallocate:
+ * @extractor: a #EamExtractor
+ * @preallocate: whether regular files are allocated before being written
+ *
+ * Selects whether regular files are allocated in full, and written
+ * directly, or written through libarchive. Files that carry ACLs or
+ * file flags are always written through libarchive.
+ */
+void
+eam_extractor_set_preallocate (EamExtractor *extractor,
+                               gboolean preallocate)
+{
+  extractor->preallocate = preallocate;
+}
+
+/**
+ * eam_extractor_set_reader:
+ * @extractor: a #EamExtractor
+ * @reader: how the bundle is read
+ *
+ * Selects how the bundle is read. If the bundle cannot be mapped in
+ * memory, %EAM_EXTRACTOR_READER_MMAP falls back to buffered reads.
+ */
+void
+eam_extractor_set_reader (EamExtractor *extractor,
+                          EamExtractorReader reader)
+{
+  extractor->reader = reader;
+}
+
+/**
+ * eam_extractor_set_digests:
+ * @extractor: a #EamExtractor
+ * @digests: (allow-none): a #EamDigests
+ *
+ * Sets the table recording the checksums of the regular files of the
+ * bundle. The @extractor does not take ownership of @digests.
+ */
+void
+eam_extractor_set_digests (EamExtractor *extractor,
+                           EamDigests *digests)
+{
+  extractor->digests = digests;
+}
+
+/**
+ * eam_extractor_set_filter:
+ * @extractor: a #EamExtractor
+ * @filter: (allow-none): a #EamExtractFilter
+ *
+ * Sets the filter deciding which entries are extracted. The @extractor
+ * does not take ownership of @filter.
+ */
+void
+eam_extractor_set_filter (EamExtractor *extractor,
+                          EamExtractFilter *filter)
+{
+  extractor->filter = filter;
+}
+
+/**
+ * eam_extractor_set_journal:
+ * @extractor: a #EamExtractor
+ * @journal: (allow-none): a #EamJournal
+ *
+ * Sets the journal recording the progress of the extraction, so that
+ * it can be resumed if it is interrupted. The @extractor does not take
+ * ownership of @journal.
+ */
+void
+eam_extractor_set_journal (EamExtractor *extractor,
+                           EamJournal *journal)
+{
+  extractor->journal = journal;
+}
+
+/**
+ * eam_extractor_set_progress:
+ * @extractor: a #EamExtractor
+ * @progress: (allow-none): a #EamProgress
+ *
+ * Sets the tracker updated with the amount of the bundle read, and the
+ * number of entries extracted. The @extractor does not take ownership
+ * of @progress.
+ */
+void
+eam_extractor_set_progress (EamExtractor *extractor,
+                            EamProgress *progress)
+{
+  extractor->progress = progress;
+}
+
+/**
+ * eam_extractor_set_tap_func:
+ * @extractor: a #EamExtractor
+ * @func: (allow-none): a function called with each block read from
+ *   the bundle
+ * @user_data: data for @func
+ *
+ * Sets a function that sees the raw contents of the bundle, in order
+ * and in their entirety, while they are being extracted. If @func
+ * returns %FALSE the extraction is aborted.
+ */
+void
+eam_extractor_set_tap_func (EamExtractor *extractor,
+                            EamExtractorTapFunc func,
+                            gpointer user_data)
+{
+  extractor->tap_func = func;
+  extractor->tap_data = user_data;
+}
+
+static void
+extractor_abort (EamExtractor *extractor,
+                 const char *message)
+{
+  g_mutex_lock (&extractor->lock);
+
+  if (!extractor->aborted) {
+    extractor->aborted = TRUE;
+    extractor->error_message = g_strdup (message);
+  }
+
+  g_cond_broadcast (&extractor->cond);
+  g_mutex_unlock (&extractor->lock);
+}
+
+static gboolean
+extractor_is_aborted (EamExtractor *extractor)
+{
+  g_mutex_lock (&extractor->lock);
+  gboolean res = extractor->aborted;
+  g_mutex_unlock (&extractor->lock);
+
+  return res;
+}
+
+/* Records the checksum of a complete file under its path relative to
+ * the app directory, that is without the leading app id
+ */
+static void
+extractor_record_digest (EamExtractor *extractor,
+                         const char *name,
+                         const char *path,
+                         const char *checksum)
+{
+  while (g_str_has_prefix (name, "./"))
+    name += 2;
+
+  const char *rel = strchr (name, '/');
+  if (rel == NULL)
+    return;
+
+  struct stat buf;
+  if (lstat (path, &buf) < 0 || !S_ISREG (buf.st_mode))
+    return;
+
+  eam_digests_add (extractor->digests, rel + 1, &buf, checksum);
+}
+
+/* Blocks the reader until there is room for @size more bytes in the
+ * queue. A single chunk is always accepted if nothing else is queued,
+ * so we cannot stall on chunks larger than the whole budget.
+ */
+static gboolean
+extractor_reserve (EamExtractor *extractor,
+                   gsize size,
+                   guint n_jobs)
+{
+  g_mutex_lock (&extractor->lock);
+
+  guint max_jobs = extractor->n_writers * MAX_JOBS_PER_WRITER;
+
+  while (!extractor->aborted &&
+         extractor->bytes_in_flight > 0 &&
+         (extractor->bytes_in_flight + size > MAX_BYTES_IN_FLIGHT ||
+          extractor->jobs_in_flight + n_jobs > max_jobs))
+    g_cond_wait (&extractor->cond, &extractor->lock);
+
+  gboolean res = !extractor->aborted;
+  if (res) {
+    extractor->bytes_in_flight += size;
+    extractor->jobs_in_flight += n_jobs;
+  }
+
+  g_mutex_unlock (&extractor->lock);
+
+  return res;
+}
+
+static void
+extractor_release (EamExtractor *extractor,
+                   gsize size,
+                   guint n_jobs)
+{
+  g_mutex_lock (&extractor->lock);
+
+  extractor->bytes_in_flight -= size;
+  extractor->jobs_in_flight -= n_jobs;
+
+  g_cond_broadcast (&extractor->cond);
+  g_mutex_unlock (&extractor->lock);
+}
+
+static char *
+archive_error_message (struct archive *a)
+{
+  const char *message = archive_error_string (a);
+
+  return g_strdup (message != NULL ? message : "Unknown error");
+}
+
+/* Entries with metadata we do not restore ourselves go through libarchive */
+static gboolean
+entry_can_write_directly (struct archive_entry *entry)
+{
+  unsigned long fflags_set, fflags_clear;
+
+  archive_entry_fflags (entry, &fflags_set, &fflags_clear);
+  if (fflags_set != 0 || fflags_clear != 0)
+    return FALSE;
+
+  if (archive_entry_acl_count (entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT) > 0)
+    return FALSE;
+
+  return TRUE;
+}
+
+static uid_t
+writer_lookup_uid (ExtractWriter *writer,
+                   struct archive_entry *entry)
+{
+  const char *name = archive_entry_uname (entry);
+  uid_t uid = archive_entry_uid (entry);
+
+  if (name == NULL || *name == '\0')
+    return uid;
+
+  gpointer value;
+  if (g_hash_table_lookup_extended (writer->uids, name, NULL, &value))
+    return GPOINTER_TO_UINT (value);
+
+  struct passwd pwd, *result = NULL;
+  char buf[1024];
+
+  if (getpwnam_r (name, &pwd, buf, sizeof (buf), &result) == 0 && result != NULL)
+    uid = result->pw_uid;
+
+  g_hash_table_insert (writer->uids, g_strdup (name), GUINT_TO_POINTER (uid));
+
+  return uid;
+}
+
+static gid_t
+writer_lookup_gid (ExtractWriter *writer,
+                   struct archive_entry *entry)
+{
+  const char *name = archive_entry_gname (entry);
+  gid_t gid = archive_entry_gid (entry);
+
+  if (name == NULL || *name == '\0')
+    return gid;
+
+  gpointer value;
+  if (g_hash_table_lookup_extended (writer->gids, name, NULL, &value))
+    return GPOINTER_TO_UINT (value);
+
+  struct group grp, *result = NULL;
+  char buf[1024];
+
+  if (getgrnam_r (name, &grp, buf, sizeof (buf), &result) == 0 && result != NULL)
+    gid = result->gr_gid;
+
+  g_hash_table_insert (writer->gids, g_strdup (name), GUINT_TO_POINTER (gid));
+
+  return gid;
+}
+
+static int
+file_open (const char *path)
+{
+  int fd;
+
+  do {
+    fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  } while (fd < 0 && errno == EINTR);
+
+  return fd;
+}
+
+static int
+file_create (struct archive_entry *entry,
+             char **error_message)
+{
+  const char *path = archive_entry_pathname (entry);
+
+  int fd = file_open (path);
+
+  /* Same as libarchive: create the missing parents, and replace
+   * whatever is in the way
+   */
+  if (fd < 0 && errno == ENOENT) {
+    g_autofree char *dirname = g_path_get_dirname (path);
+
+    if (g_mkdir_with_parents (dirname, 0755) == 0)
+      fd = file_open (path);
+  }
+
+  if (fd < 0 && errno == EEXIST) {
+    if (unlink (path) == 0)
+      fd = file_open (path);
+  }
+
+  if (fd < 0) {
+    *error_message = g_strdup (g_strerror (errno));
+    return -1;
+  }
+
+  /* Sparse files are left sparse; their data blocks are allocated
+   * as they are written
+   */
+  la_int64_t size = archive_entry_size (entry);
+
+  if (size > 0 && archive_entry_sparse_count (entry) == 0) {
+    int res;
+
+    do {
+      res = fallocate (fd, 0, 0, size);
+    } while (res < 0 && errno == EINTR);
+
+    /* Not every file system can preallocate; running out of space,
+     * on the other hand, is better found out now
+     */
+    if (res < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+      *error_message = g_strdup (g_strerror (errno));
+      (void) close (fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+static gboolean
+file_write (int fd,
+            const guint8 *data,
+            gsize size,
+            gint64 offset,
+            char **error_message)
+{
+  while (size > 0) {
+    gssize n = pwrite (fd, data, size, offset);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      *error_message = g_strdup (g_strerror (errno));
+      return FALSE;
+    }
+
+    data += n;
+    size -= n;
+    offset += n;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+file_set_times (int fd,
+                struct archive_entry *entry)
+{
+  if (!archive_entry_mtime_is_set (entry))
+    return TRUE;
+
+  struct timespec times[2] = {
+    { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+    { .tv_sec = archive_entry_mtime (entry), .tv_nsec = archive_entry_mtime_nsec (entry) },
+  };
+
+  if (archive_entry_atime_is_set (entry)) {
+    times[0].tv_sec = archive_entry_atime (entry);
+    times[0].tv_nsec = archive_entry_atime_nsec (entry);
+  }
+
+  return futimens (fd, times) == 0;
+}
+
+/* Applies the metadata of @entry, and closes @fd */
+static gboolean
+file_finish (ExtractWriter *writer,
+             int fd,
+             struct archive_entry *entry,
+             char **error_message)
+{
+  mode_t mode = archive_entry_perm (entry) & 07777;
+
+  /* A trailing hole in a sparse file is never written */
+  if (ftruncate (fd, archive_entry_size (entry)) < 0)
+    goto error;
+
+  /* As libarchive does, we only keep the set-id bits if we could
+   * restore the ownership they refer to
+   */
+  if (geteuid () == 0) {
+    if (fchown (fd, writer_lookup_uid (writer, entry), writer_lookup_gid (writer, entry)) < 0)
+      mode &= ~(S_ISUID | S_ISGID);
+  }
+  else {
+    mode &= ~(S_ISUID | S_ISGID);
+  }
+
+  if (fchmod (fd, mode) < 0)
+    goto error;
+
+  if (!file_set_times (fd, entry))
+    goto error;
+
+  if (close (fd) < 0 && errno != EINTR) {
+    *error_message = g_strdup (g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+
+error:
+  *error_message = g_strdup (g_strerror (errno));
+  (void) close (fd);
+
+  return FALSE;
+}
+
+/* Completes the writes queued so far, and releases their chunks */
+static void
+writer_flush (EamExtractor *extractor,
+              ExtractWriter *writer,
+              char **error_message)
+{
+  if (writer->pending->len == 0)
+    return;
+
+  if (!eam_uring_flush (writer->ring) && *error_message == NULL)
+    *error_message = g_strdup (g_strerror (errno));
+
+  for (guint i = 0; i < writer->pending->len; i++) {
+    ExtractChunk *chunk = g_ptr_array_index (writer->pending, i);
+
+    extractor_release (extractor, chunk->size, 0);
+    g_free (chunk);
+  }
+
+  g_ptr_array_set_size (writer->pending, 0);
+}
+
+static void
+writer_process_job (EamExtractor *extractor,
+                    ExtractWriter *writer,
+                    ExtractJob *job)
+{
+  /* Cancellation is checked once per entry; if we are already failing
+   * we keep draining the data so that the reader is never left waiting
+   * for room in the queue.
+   */
+  gboolean skip = extractor_is_aborted (extractor);
+
+  if (!skip && g_cancellable_is_cancelled (extractor->cancellable)) {
+    extractor_abort (extractor, "Extracting bundle was cancelled");
+    skip = TRUE;
+  }
+
+  gboolean direct = extractor->preallocate && entry_can_write_directly (job->entry);
+  g_autofree char *error_message = NULL;
+  int fd = -1;
+
+  if (!skip) {
+    if (direct)
+      fd = file_create (job->entry, &error_message);
+    else if (archive_write_header (writer->ext, job->entry) != ARCHIVE_OK)
+      error_message = archive_error_message (writer->ext);
+
+    skip = error_message != NULL;
+  }
+
+  /* Sparse files are neither recorded nor journaled, as the
+   * checksum of their data blocks does not account for the holes
+   */
+  g_autoptr(EamSha256) checksum = NULL;
+  gint64 data_end = 0;
+
+  if (!skip && (extractor->digests != NULL || extractor->journal != NULL))
+    checksum = eam_sha256_new ();
+
+  while (TRUE) {
+    ExtractChunk *chunk = g_async_queue_try_pop (job->chunks);
+
+    /* The queued writes are completed before waiting for more data,
+     * as the reader may be waiting for their chunks to be released
+     */
+    if (chunk == NULL) {
+      writer_flush (extractor, writer, &error_message);
+      skip = skip || error_message != NULL;
+
+      chunk = g_async_queue_pop (job->chunks);
+    }
+
+    if (chunk == &end_of_entry)
+      break;
+
+    gboolean queued = FALSE;
+
+    if (!skip) {
+      if (direct && writer->ring != NULL) {
+        eam_uring_write (writer->ring, fd, chunk->data, chunk->size, chunk->offset);
+        queued = TRUE;
+      }
+      else if (direct)
+        file_write (fd, chunk->data, chunk->size, chunk->offset, &error_message);
+      else if (archive_write_data_block (writer->ext, chunk->data, chunk->size, chunk->offset) != ARCHIVE_OK)
+        error_message = archive_error_message (writer->ext);
+
+      skip = error_message != NULL;
+    }
+
+    if (!skip && checksum != NULL) {
+      if (chunk->offset == data_end) {
+        eam_sha256_update (checksum, chunk->data, chunk->size);
+        data_end += chunk->size;
+      }
+      else {
+        g_clear_pointer (&checksum, eam_sha256_free);
+      }
+    }
+
+    if (queued) {
+      g_ptr_array_add (writer->pending, chunk);
+      continue;
+    }
+
+    extractor_release (extractor, chunk->size, 0);
+    g_free (chunk);
+  }
+
+  /* The data must be in place before the file is finished, or closed */
+  writer_flush (extractor, writer, &error_message);
+
+  if (error_message == NULL && !extractor_is_aborted (extractor)) {
+    if (direct) {
+      file_finish (writer, fd, job->entry, &error_message);
+      fd = -1;
+    }
+    else if (archive_write_finish_entry (writer->ext) != ARCHIVE_OK) {
+      error_message = archive_error_message (writer->ext);
+    }
+
+    if (error_message != NULL || checksum == NULL ||
+        data_end != archive_entry_size (job->entry))
+      g_clear_pointer (&checksum, eam_sha256_free);
+
+    if (checksum != NULL && extractor->digests != NULL)
+      extractor_record_digest (extractor, job->name,
+                               archive_entry_pathname (job->entry),
+                               eam_sha256_get_string (checksum));
+
+    if (checksum != NULL && extractor->journal != NULL)
+      eam_journal_add (extractor->journal, job->index, job->name,
+                       archive_entry_size (job->entry),
+                       eam_sha256_get_string (checksum));
+  }
+
+  if (fd >= 0)
+    (void) close (fd);
+
+  if (error_message != NULL) {
+    g_autofree char *message =
+      g_strdup_printf ("Unable to write '%s': %s",
+                       archive_entry_pathname (job->entry),
+                       error_message);
+    extractor_abort (extractor, message);
+  }
+
+  extractor_release (extractor, 0, 1);
+}
+
+static gpointer
+writer_thread (gpointer data)
+{
+  EamExtractor *extractor = data;
+  ExtractWriter writer;
+
+  writer.ext = archive_write_disk_new ();
+  archive_write_disk_set_options (writer.ext, EXTRACT_FLAGS);
+  archive_write_disk_set_standard_lookup (writer.ext);
+
+  writer.uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  writer.gids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  writer.ring = extractor->preallocate ? eam_uring_new () : NULL;
+  writer.pending = g_ptr_array_new ();
+
+  while (TRUE) {
+    ExtractJob *job = g_async_queue_pop (extractor->jobs);
+
+    if (job == &end_of_jobs)
+      break;
+
+    writer_process_job (extractor, &writer, job);
+    extract_job_free (job);
+  }
+
+  if (archive_write_close (writer.ext) != ARCHIVE_OK)
+    extractor_abort (extractor, archive_error_string (writer.ext));
+
+  archive_write_free (writer.ext);
+
+  g_hash_table_unref (writer.uids);
+  g_hash_table_unref (writer.gids);
+
+  g_clear_pointer (&writer.ring, eam_uring_free);
+  g_ptr_array_unref (writer.pending);
+
+  return NULL;
+}
+
+/* Moves the data of the current entry from @ar into the queue of @job */
+static int
+reader_queue_data (EamExtractor *extractor,
+                   struct archive *ar,
+                   ExtractJob *job)
+{
+  int err;
+
+  while (TRUE) {
+    const void *buff;
+    size_t size;
+    la_int64_t offset;
+
+    err = archive_read_data_block (ar, &buff, &size, &offset);
+
+    if (err == ARCHIVE_EOF) {
+      err = ARCHIVE_OK;
+      break;
+    }
+
+    if (err != ARCHIVE_OK)
+      break;
+
+    if (!extractor_reserve (extractor, size, 0))
+      break;
+
+    ExtractChunk *chunk = g_malloc (sizeof (ExtractChunk) + size);
+    chunk->offset = offset;
+    chunk->size = size;
+    memcpy (chunk->data, buff, size);
+
+    g_async_queue_push (job->chunks, chunk);
+  }
+
+  g_async_queue_push (job->chunks, &end_of_entry);
+
+  return err;
+}
+
+static gssize
+bundle_read_mapped (EamExtractor *extractor,
+                    const void **buffer)
+{
+  gsize n = MIN (READ_BLOCK_SIZE, extractor->map_size - extractor->map_offset);
+
+  /* libarchive is done with the previous window by now, and we never
+   * go back, so there is no point in keeping it mapped in
+   */
+  if (extractor->map_offset >= READ_BLOCK_SIZE)
+    (void) madvise ((void *) (extractor->map + extractor->map_offset - READ_BLOCK_SIZE),
+                    READ_BLOCK_SIZE, MADV_DONTNEED);
+
+  *buffer = extractor->map + extractor->map_offset;
+  extractor->map_offset += n;
+
+  return n;
+}
+
+static gssize
+bundle_read_buffered (EamExtractor *extractor,
+                      const void **buffer)
+{
+  gssize n;
+
+  do {
+    n = read (extractor->fd, extractor->read_buffer, READ_BLOCK_SIZE);
+  } while (n < 0 && errno == EINTR);
+
+  *buffer = extractor->read_buffer;
+
+  return n;
+}
+
+static gboolean
+bundle_tap (const void *data,
+            gsize size,
+            gpointer user_data)
+{
+  EamExtractor *extractor = user_data;
+
+  if (extractor->tap_func != NULL &&
+      !extractor->tap_func (data, size, extractor->tap_data)) {
+    extractor->tap_failed = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* The decoder taps the compressed data itself */
+static gssize
+bundle_read_zstd (EamExtractor *extractor,
+                  const void **buffer)
+{
+  gssize n = eam_zstd_decoder_read (extractor->zstd, buffer);
+
+  extractor->bytes_read = eam_zstd_decoder_get_bytes_read (extractor->zstd);
+
+  if (extractor->progress != NULL)
+    eam_progress_update (extractor->progress, extractor->bytes_read, extractor->entries_read);
+
+  return n;
+}
+
+static gssize
+bundle_read (EamExtractor *extractor,
+             const void **buffer)
+{
+  gssize n;
+
+  if (extractor->zstd != NULL)
+    return bundle_read_zstd (extractor, buffer);
+
+  if (extractor->map != NULL)
+    n = bundle_read_mapped (extractor, buffer);
+  else
+    n = bundle_read_buffered (extractor, buffer);
+
+  if (n <= 0)
+    return n;
+
+  extractor->bytes_read += n;
+
+  if (extractor->progress != NULL)
+    eam_progress_update (extractor->progress, extractor->bytes_read, extractor->entries_read);
+
+  if (!bundle_tap (*buffer, n, extractor))
+    return -1;
+
+  return n;
+}
+
+static la_ssize_t
+bundle_read_cb (struct archive *a,
+                void *data,
+                const void **buffer)
+{
+  EamExtractor *extractor = data;
+
+  gssize n = bundle_read (extractor, buffer);
+  if (n < 0) {
+    if (extractor->tap_failed)
+      archive_set_error (a, EIO, "Bundle rejected while reading");
+    else
+      archive_set_error (a, errno, "%s", g_strerror (errno));
+    return -1;
+  }
+
+  return n;
+}
+
+/* libarchive stops reading as soon as it finds the end of the archive,
+ * so we need to pass what is left of the file to the tap ourselves
+ */
+static gboolean
+bundle_drain (EamExtractor *extractor)
+{
+  if (extractor->tap_func == NULL)
+    return TRUE;
+
+  if (extractor->zstd != NULL)
+    return eam_zstd_decoder_finish (extractor->zstd);
+
+  while (TRUE) {
+    const void *buffer;
+    gssize n = bundle_read (extractor, &buffer);
+
+    if (n == 0)
+      return TRUE;
+
+    if (n < 0)
+      return FALSE;
+  }
+}
+
+static gboolean
+bundle_map (EamExtractor *extractor)
+{
+  if (extractor->bundle_size == 0 || extractor->bundle_size > G_MAXSIZE)
+    return FALSE;
+
+  gsize size = extractor->bundle_size;
+
+  void *map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, extractor->fd, 0);
+  if (map == MAP_FAILED) {
+    eam_log_debug_message ("Unable to map bundle '%s': %s",
+                           extractor->bundle_file, g_strerror (errno));
+    return FALSE;
+  }
+
+  (void) madvise (map, size, MADV_SEQUENTIAL);
+  (void) madvise (map, MIN (size, 4 * READ_BLOCK_SIZE), MADV_WILLNEED);
+
+  extractor->map = map;
+  extractor->map_size = size;
+  extractor->map_offset = 0;
+
+  return TRUE;
+}
+
+/* Legacy bundles are left to libarchive, so this never fails */
+static gboolean
+bundle_open_zstd (EamExtractor *extractor)
+{
+  extractor->zstd = eam_zstd_decoder_new (extractor->fd, extractor->map,
+                                          extractor->bundle_size,
+                                          g_get_num_processors ());
+  if (extractor->zstd == NULL)
+    return TRUE;
+
+  eam_zstd_decoder_set_tap_func (extractor->zstd, bundle_tap, extractor);
+
+  eam_log_debug_message ("Bundle '%s' is a seekable zstd bundle with %u frames",
+                         extractor->bundle_file,
+                         eam_zstd_decoder_get_n_frames (extractor->zstd));
+
+  return TRUE;
+}
+
+static gboolean
+bundle_open (EamExtractor *extractor)
+{
+  do {
+    extractor->fd = open (extractor->bundle_file, O_RDONLY | O_CLOEXEC);
+  } while (extractor->fd < 0 && errno == EINTR);
+
+  if (extractor->fd < 0)
+    return FALSE;
+
+  struct stat buf;
+  if (fstat (extractor->fd, &buf) < 0) {
+    int saved_errno = errno;
+    (void) close (extractor->fd);
+    extractor->fd = -1;
+    errno = saved_errno;
+    return FALSE;
+  }
+
+  extractor->bundle_size = buf.st_size;
+  extractor->bytes_read = 0;
+  extractor->entries_read = 0;
+  extractor->entries_skipped = 0;
+  extractor->entries_filtered = 0;
+  extractor->checkpoint_bytes = 0;
+  extractor->tap_failed = FALSE;
+
+  (void) posix_fadvise (extractor->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  if (extractor->reader == EAM_EXTRACTOR_READER_MMAP && bundle_map (extractor))
+    return bundle_open_zstd (extractor);
+
+  void *read_buffer = NULL;
+  int err = posix_memalign (&read_buffer, READ_BUFFER_ALIGNMENT, READ_BLOCK_SIZE);
+  if (err != 0) {
+    (void) close (extractor->fd);
+    extractor->fd = -1;
+    errno = err;
+    return FALSE;
+  }
+
+  extractor->read_buffer = read_buffer;
+
+  return bundle_open_zstd (extractor);
+}
+
+static void
+bundle_close (EamExtractor *extractor)
+{
+  g_clear_pointer (&extractor->zstd, eam_zstd_decoder_free);
+
+  if (extractor->map != NULL)
+    (void) munmap ((void *) extractor->map, extractor->map_size);
+
+  if (extractor->fd >= 0)
+    (void) close (extractor->fd);
+
+  extractor->fd = -1;
+  extractor->map = NULL;
+  extractor->map_size = 0;
+
+  free (extractor->read_buffer);
+  extractor->read_buffer = NULL;
+}
+
+/* Returns the checksum recorded for the entry, if a previous attempt
+ * left a durable copy of it
+ */
+static const char *
+reader_entry_is_done (EamExtractor *extractor,
+                      const char *name,
+                      const char *path)
+{
+  guint64 size;
+  const char *checksum;
+
+  if (extractor->journal == NULL ||
+      !eam_journal_lookup (extractor->journal, extractor->entries_read, name, &size, &checksum))
+    return NULL;
+
+  struct stat buf;
+  if (lstat (path, &buf) < 0 || !S_ISREG (buf.st_mode) || (guint64) buf.st_size != size)
+    return NULL;
+
+  return checksum;
+}
+
+/* Compares the data of a file extracted by a previous attempt with
+ * @data, and writes again the blocks that differ
+ */
+static gboolean
+file_repair (int fd,
+             const guint8 *data,
+             gsize size,
+             gint64 offset,
+             guint8 *buffer,
+             gboolean *repaired,
+             char **error_message)
+{
+  while (size > 0) {
+    gsize n = MIN (size, REPAIR_BLOCK_SIZE);
+    gssize n_read = pread (fd, buffer, n, offset);
+
+    if (n_read < 0) {
+      if (errno == EINTR)
+        continue;
+
+      *error_message = g_strdup (g_strerror (errno));
+      return FALSE;
+    }
+
+    if ((gsize) n_read != n || memcmp (buffer, data, n) != 0) {
+      if (!file_write (fd, data, n, offset, error_message))
+        return FALSE;
+
+      *repaired = TRUE;
+    }
+
+    data += n;
+    size -= n;
+    offset += n;
+  }
+
+  return TRUE;
+}
+
+/* Hashes the data of an entry extracted by a previous attempt, the
+ * same way the writers do, and checks it against the journal. The
+ * copy on disk is compared with the data as it goes past, and written
+ * again wherever it differs, e.g. if it was modified since
+ */
+static int
+reader_skip_data (EamExtractor *extractor,
+                  struct archive *ar,
+                  struct archive_entry *entry,
+                  const char *name,
+                  const char *expected)
+{
+  const char *path = archive_entry_pathname (entry);
+  g_autoptr(EamSha256) checksum = eam_sha256_new ();
+  g_autofree guint8 *buffer = g_malloc (REPAIR_BLOCK_SIZE);
+  g_autofree char *error_message = NULL;
+  gint64 data_end = 0;
+  gboolean matches = TRUE;
+  gboolean repaired = FALSE;
+  int err;
+
+  int fd = open (path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    error_message = g_strdup (g_strerror (errno));
+
+  while (TRUE) {
+    const void *buff;
+    size_t size;
+    la_int64_t offset;
+
+    err = archive_read_data_block (ar, &buff, &size, &offset);
+
+    if (err == ARCHIVE_EOF) {
+      err = ARCHIVE_OK;
+      break;
+    }
+
+    if (err != ARCHIVE_OK)
+      goto out;
+
+    /* Sparse files are never journaled */
+    if (offset != data_end)
+      matches = FALSE;
+
+    if (!matches)
+      continue;
+
+    eam_sha256_update (checksum, buff, size);
+
+    if (error_message == NULL)
+      (void) file_repair (fd, buff, size, offset, buffer, &repaired, &error_message);
+
+    data_end += size;
+  }
+
+  if (matches && error_message == NULL && repaired && !file_set_times (fd, entry))
+    error_message = g_strdup (g_strerror (errno));
+
+  /* What cannot be checked cannot be kept either */
+  if (!matches || error_message != NULL ||
+      g_strcmp0 (eam_sha256_get_string (checksum), expected) != 0) {
+    g_autofree char *message = NULL;
+
+    if (error_message != NULL)
+      message = g_strdup_printf ("Unable to check '%s' from the interrupted extraction: %s",
+                                 name, error_message);
+    else
+      message = g_strdup_printf ("'%s' does not match the interrupted extraction", name);
+
+    extractor->resume_rejected = TRUE;
+    extractor_abort (extractor, message);
+  }
+  else if (repaired) {
+    eam_log_info_message ("Repaired '%s' from the bundle", name);
+  }
+
+out:
+  if (fd >= 0)
+    (void) close (fd);
+
+  return err;
+}
+
+static gboolean
+reader_entry_is_wanted (EamExtractor *extractor,
+                        struct archive_entry *entry,
+                        const char *name)
+{
+  if (extractor->filter == NULL)
+    return TRUE;
+
+  gboolean is_dir = archive_entry_filetype (entry) == AE_IFDIR;
+  if (!eam_extract_filter_match (extractor->filter, name, is_dir))
+    return FALSE;
+
+  /* A hard link to a skipped entry would have nothing to point to */
+  const char *target = archive_entry_hardlink (entry);
+  if (target != NULL && !eam_extract_filter_match (extractor->filter, target, FALSE))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+reader_checkpoint (EamExtractor *extractor)
+{
+  if (extractor->journal == NULL ||
+      extractor->bytes_read - extractor->checkpoint_bytes < CHECKPOINT_BYTES)
+    return;
+
+  extractor->checkpoint_bytes = extractor->bytes_read;
+
+  /* A failed checkpoint only means there is less to resume from */
+  eam_journal_checkpoint (extractor->journal);
+}
+
+static int
+write_entry (struct archive *ext,
+             struct archive_entry *entry)
+{
+  int err = archive_write_header (ext, entry);
+  if (err != ARCHIVE_OK)
+    return err;
+
+  return archive_write_finish_entry (ext);
+}
+
+/**
+ * eam_extractor_run:
+ * @extractor: a #EamExtractor
+ * @cancellable: (allow-none): a #GCancellable, checked for each entry
+ *
+ * Extracts the bundle using a pool of writer threads.
+ *
+ * Returns: %TRUE if all the entries were extracted, and %FALSE otherwise
+ */
+gboolean
+eam_extractor_run (EamExtractor *extractor,
+                   GCancellable *cancellable)
+{
+  extractor->cancellable = cancellable;
+  extractor->aborted = FALSE;
+  extractor->bytes_in_flight = 0;
+  extractor->jobs_in_flight = 0;
+  extractor->resume_rejected = FALSE;
+  g_clear_pointer (&extractor->error_message, g_free);
+
+  struct archive *a = archive_read_new ();
+  archive_read_support_filter_all (a);
+  archive_read_support_format_all (a);
+
+  struct archive *ext = archive_write_disk_new ();
+  archive_write_disk_set_options (ext, EXTRACT_FLAGS);
+  archive_write_disk_set_standard_lookup (ext);
+
+  GPtrArray *hardlinks = g_ptr_array_new_with_free_func ((GDestroyNotify) archive_entry_free);
+
+  if (!bundle_open (extractor)) {
+    int saved_errno = errno;
+    eam_log_error_message ("Unable to open bundle '%s': %s",
+                           extractor->bundle_file,
+                           g_strerror (saved_errno));
+    g_ptr_array_unref (hardlinks);
+    archive_read_free (a);
+    archive_write_free (ext);
+    extractor->cancellable = NULL;
+    return FALSE;
+  }
+
+  gint64 start_time = g_get_monotonic_time ();
+
+  /* The number of entries is only known at the end */
+  if (extractor->progress != NULL)
+    eam_progress_set_totals (extractor->progress, extractor->bundle_size, 0);
+
+  extractor->jobs = g_async_queue_new ();
+
+  GThread *writers[MAX_WRITERS] = { NULL, };
+  for (guint i = 0; i < extractor->n_writers; i++)
+    writers[i] = g_thread_new ("eam-extract-writer", writer_thread, extractor);
+
+  int err = archive_read_open (a, extractor, NULL, bundle_read_cb, NULL);
+
+  while (err == ARCHIVE_OK) {
+    struct archive_entry *entry;
+
+    if (extractor_is_aborted (extractor))
+      break;
+
+    /* This is not a libarchive error condition, so we log the
+     * cancellation through the abort message
+     */
+    if (g_cancellable_is_cancelled (cancellable)) {
+      extractor_abort (extractor, "Extracting bundle was cancelled");
+      break;
+    }
+
+    err = archive_read_next_header (a, &entry);
+
+    if (err == ARCHIVE_EOF) {
+      err = ARCHIVE_OK;
+      break;
+    }
+
+    if (err != ARCHIVE_OK)
+      break;
+
+    extractor->entries_read += 1;
+
+    g_autofree char *entpath = g_strdup (archive_entry_pathname (entry));
+    g_autofree char *newpath = g_build_filename (extractor->target_prefix, entpath, NULL);
+
+    if (!reader_entry_is_wanted (extractor, entry, entpath)) {
+      extractor->entries_filtered += 1;
+      err = archive_read_data_skip (a);
+      continue;
+    }
+
+    archive_entry_copy_pathname (entry, newpath);
+
+    if (archive_entry_hardlink (entry) != NULL) {
+      const char *linkpath = archive_entry_hardlink (entry);
+      g_autofree char *newlinkpath = g_build_filename (extractor->target_prefix, linkpath, NULL);
+
+      archive_entry_copy_hardlink (entry, newlinkpath);
+      g_ptr_array_add (hardlinks, archive_entry_clone (entry));
+      continue;
+    }
+
+    if (archive_entry_filetype (entry) != AE_IFREG || archive_entry_size (entry) <= 0) {
+      err = write_entry (ext, entry);
+      continue;
+    }
+
+    const char *done_checksum = reader_entry_is_done (extractor, entpath, newpath);
+    if (done_checksum != NULL) {
+      extractor->entries_skipped += 1;
+      err = reader_skip_data (extractor, a, entry, entpath, done_checksum);
+
+      if (err == ARCHIVE_OK && extractor->digests != NULL)
+        extractor_record_digest (extractor, entpath, newpath, done_checksum);
+
+      continue;
+    }
+
+    reader_checkpoint (extractor);
+
+    if (!extractor_reserve (extractor, 0, 1))
+      break;
+
+    ExtractJob *job = extract_job_new (entry, extractor->entries_read, entpath);
+    g_async_queue_push (extractor->jobs, job);
+
+    err = reader_queue_data (extractor, a, job);
+  }
+
+  if (err == ARCHIVE_OK && !extractor_is_aborted (extractor) && !bundle_drain (extractor))
+    extractor_abort (extractor, "Bundle rejected while reading");
+
+  /* Reader errors are reported after the writers have been stopped */
+  const char *read_error = NULL;
+  if (err != ARCHIVE_OK) {
+    read_error = archive_error_string (a);
+    if (read_error == NULL)
+      read_error = archive_error_string (ext);
+    if (read_error == NULL)
+      read_error = "Unknown error";
+
+    extractor_abort (extractor, read_error);
+  }
+
+  for (guint i = 0; i < extractor->n_writers; i++)
+    g_async_queue_push (extractor->jobs, &end_of_jobs);
+
+  for (guint i = 0; i < extractor->n_writers; i++)
+    g_thread_join (writers[i]);
+
+  g_async_queue_unref (extractor->jobs);
+  extractor->jobs = NULL;
+
+  /* All the link targets are now on disk */
+  for (guint i = 0; i < hardlinks->len && !extractor_is_aborted (extractor); i++) {
+    struct archive_entry *entry = g_ptr_array_index (hardlinks, i);
+
+    if (write_entry (ext, entry) != ARCHIVE_OK) {
+      g_autofree char *message =
+        g_strdup_printf ("Unable to link '%s': %s",
+                         archive_entry_pathname (entry),
+                         archive_error_string (ext));
+      extractor_abort (extractor, message);
+    }
+  }
+
+  /* Closing the disk writer applies the deferred directory metadata */
+  if (archive_write_close (ext) != ARCHIVE_OK)
+    extractor_abort (extractor, archive_error_string (ext));
+
+  gboolean ret = !extractor->aborted;
+
+  if (ret) {
+    double elapsed = MAX (g_get_monotonic_time () - start_time, 1) / (double) G_USEC_PER_SEC;
+    g_autofree char *size = g_format_size (extractor->bytes_read);
+
+    if (extractor->progress != NULL) {
+      eam_progress_set_totals (extractor->progress, extractor->bundle_size, extractor->entries_read);
+      eam_progress_update (extractor->progress, extractor->bytes_read, extractor->entries_read);
+      eam_progress_finish (extractor->progress);
+    }
+
+    eam_log_info_message ("Extracted %" G_GUINT64_FORMAT " entries, %s from '%s' "
+                          "in %.2f seconds (%.1f MB/s, %s reader%s)",
+                          extractor->entries_read,
+                          size, extractor->bundle_file, elapsed,
+                          extractor->bytes_read / elapsed / 1000000.0,
+                          extractor->map != NULL ? "mmap" : "buffered",
+                          extractor->zstd != NULL ? ", parallel zstd" : "");
+
+    if (extractor->entries_filtered > 0)
+      eam_log_info_message ("Left out %" G_GUINT64_FORMAT " entries not needed on this system",
+                            extractor->entries_filtered);
+
+    if (extractor->entries_skipped > 0)
+      eam_log_info_message ("Skipped %" G_GUINT64_FORMAT " entries extracted by a previous attempt",
+                            extractor->entries_skipped);
+  }
+  else {
+    eam_log_error_message ("Unable to extract archive '%s': %s",
+                           extractor->bundle_file,
+                           extractor->error_message != NULL ? extractor->error_message : "");
+  }
+
+  g_ptr_array_unref (hardlinks);
+  archive_read_free (a);
+  archive_write_free (ext);
+
+  bundle_close (extractor);
+
+  extractor->cancellable = NULL;
+
+  return ret;
+}
+
+/**
+ * eam_extractor_get_resume_rejected:
+ * @extractor: a #EamExtractor
+ *
+ * Returns: %TRUE if the last run failed because the bundle does not
+ *   match the files its journal recorded; the extraction must then be
+ *   started over, without the journal
+ */
+gboolean
+eam_extractor_get_resume_rejected (EamExtractor *extractor)
+{
+  return extractor->resume_rejected;
+}
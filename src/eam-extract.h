@@ -0,0 +1,69 @@
+/* eam-extract.h: Bundle extraction engine
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gio/gio.h>
+
+#include "eam-digests.h"
+#include "eam-extract-filter.h"
+#include "eam-journal.h"
+#include "eam-progress.h"
+
+G_BEGIN_DECLS
+
+typedef struct _EamExtractor    EamExtractor;
+
+typedef enum {
+  EAM_EXTRACTOR_READER_BUFFERED,
+  EAM_EXTRACTOR_READER_MMAP
+} EamExtractorReader;
+
+typedef gboolean (* EamExtractorTapFunc) (const void *data,
+                                          gsize size,
+                                          gpointer user_data);
+
+EamExtractor *  eam_extractor_new               (const char *bundle_file,
+                                                 const char *target_prefix);
+void            eam_extractor_free              (EamExtractor *extractor);
+
+void            eam_extractor_set_n_writers     (EamExtractor *extractor,
+                                                 guint n_writers);
+void            eam_extractor_set_preallocate   (EamExtractor *extractor,
+                                                 gboolean preallocate);
+void            eam_extractor_set_reader        (EamExtractor *extractor,
+                                                 EamExtractorReader reader);
+void            eam_extractor_set_filter        (EamExtractor *extractor,
+                                                 EamExtractFilter *filter);
+void            eam_extractor_set_journal       (EamExtractor *extractor,
+                                                 EamJournal *journal);
+void            eam_extractor_set_digests       (EamExtractor *extractor,
+                                                 EamDigests *digests);
+void            eam_extractor_set_progress      (EamExtractor *extractor,
+                                                 EamProgress *progress);
+void            eam_extractor_set_tap_func      (EamExtractor *extractor,
+                                                 EamExtractorTapFunc func,
+                                                 gpointer user_data);
+
+gboolean        eam_extractor_run               (EamExtractor *extractor,
+                                                 GCancellable *cancellable);
+gboolean        eam_extractor_get_resume_rejected (EamExtractor *extractor);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamExtractor, eam_extractor_free)
+
+G_END_DECLS
@@ -21,10 +21,15 @@
 
 #include "eam-fs-utils.h"
 #include "eam-config.h"
+#include "eam-copy.h"
 #include "eam-log.h"
+#include "eam-object-store.h"
+#include "eam-uring.h"
 #include "eam-utils.h"
+#include "eam-walk.h"
 #include "eam-error.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
@@ -48,6 +53,9 @@
 #define G_SCHEMAS_SUBDIR "share/glib-2.0/schemas"
 #define XDG_AUTOSTART_SUBDIR "xdg/autostart"
 
+#define STAGING_SUBDIR ".staging"
+#define JOURNAL_EXT ".journal"
+
 static const char *fs_layout[] = {
   [EAM_BUNDLE_DIRECTORY_BIN] = "bin",
   [EAM_BUNDLE_DIRECTORY_DESKTOP] = "share/applications",
@@ -138,79 +146,123 @@ eam_fs_is_app_dir (const char *path)
   return g_file_test (info_path, G_FILE_TEST_EXISTS);
 }
 
+/* It's impossible to know what the desired permissions are for each file,
+ * so we check 'r-x' permissions for "owner" and apply them to "other".
+ */
+static mode_t
+fixed_permissions (mode_t mode)
+{
+  return mode | (((mode & S_IRUSR) | (mode & S_IXUSR)) >> 6);
+}
+
+/* Files deduplicated in the object store are hard links shared with
+ * other applications, so they are copied before their mode changes,
+ * and the copy replaces them
+ */
 static gboolean
-fix_permissions_for_application (const gchar *path)
+chmod_unshared_at (int dfd,
+                   const char *name,
+                   const struct stat *buf,
+                   mode_t mode)
 {
-  GStatBuf buf;
-  GError *error = NULL;
-  gboolean retval = TRUE;
+  if (buf->st_nlink <= 1 || !S_ISREG (buf->st_mode))
+    return fchmodat (dfd, name, mode, 0) == 0;
 
-  g_assert (path);
+  g_autofree char *tmp_name = g_strconcat (name, ".eam-unshare", NULL);
+  g_autoptr(GError) error = NULL;
 
-  GFile *file = g_file_new_for_path (path);
+  (void) unlinkat (dfd, tmp_name, 0);
 
-  /* We fix permissions for the children of a directory first, so that the
-   * root path is the last thing we fix when everything else has worked as
-   * expected, so that we can try again the next time if something went wrong.
-   */
-  if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
-    GFileEnumerator *children = g_file_enumerate_children (file, G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                                           G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                           NULL, &error);
-    if (error) {
-      eam_log_error_message ("Failed to get the children of '%s': %s", path, error->message);
-      g_clear_error (&error);
-      retval = FALSE;
-      goto bail;
+  if (!eam_copy_file_at (dfd, name, dfd, tmp_name, &error)) {
+    eam_log_error_message ("Unable to copy '%s': %s", name, error->message);
+    return FALSE;
+  }
+
+  if (fchmodat (dfd, tmp_name, mode, 0) != 0 ||
+      renameat (dfd, tmp_name, dfd, name) != 0) {
+    (void) unlinkat (dfd, tmp_name, 0);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* We fix permissions for the children of a directory first, so that the
+ * root path is the last thing we fix when everything else has worked as
+ * expected, so that we can try again the next time if something went wrong.
+ * Symbolic links are left alone, as changing their mode would change the
+ * file they point to, and files whose mode is already right are not touched.
+ */
+static EamWalkAction
+fix_permissions_visit (EamWalkEvent event,
+                       const EamWalkEntry *entry,
+                       gpointer user_data)
+{
+  gboolean *failed = user_data;
+  struct stat buf;
+
+  switch (event) {
+  case EAM_WALK_ENTER:
+    break;
+
+  case EAM_WALK_FILE:
+    if (entry->type == DT_LNK)
+      break;
+
+    if (fstatat (entry->dfd, entry->name, &buf, AT_SYMLINK_NOFOLLOW) != 0) {
+      eam_log_error_message ("Error retrieving information about path '%s'", entry->path);
+      *failed = TRUE;
+      break;
+    }
+
+    if (fixed_permissions (buf.st_mode) == buf.st_mode)
+      break;
+
+    if (!chmod_unshared_at (entry->dfd, entry->name, &buf, fixed_permissions (buf.st_mode) & 07777)) {
+      eam_log_error_message ("Error fixing permissions for path '%s'", entry->path);
+      *failed = TRUE;
     }
+    break;
 
-    GFileInfo *child_info = NULL;
-    while ((child_info = g_file_enumerator_next_file (children, NULL, &error))) {
-      GFile *child = g_file_get_child (file, g_file_info_get_name (child_info));
-      gchar *child_path = g_file_get_path (child);
-      g_object_unref (child_info);
-      g_object_unref (child);
+  case EAM_WALK_LEAVE:
+    /* Don't bother updating the directories if something went
+     * wrong already while looking at their children.
+     */
+    if (*failed)
+      break;
 
-      retval = fix_permissions_for_application (child_path);
-      g_free (child_path);
+    if (fstat (entry->fd, &buf) != 0) {
+      eam_log_error_message ("Error retrieving information about path '%s'", entry->path);
+      *failed = TRUE;
+      break;
     }
-    g_object_unref (children);
 
-    if (error) {
-      eam_log_error_message ("Failure while processing the children of '%s': %s", path, error->message);
-      g_clear_error (&error);
-      retval = FALSE;
-      goto bail;
+    if (fchmod (entry->fd, fixed_permissions (buf.st_mode)) != 0) {
+      eam_log_error_message ("Error fixing permissions for path '%s'", entry->path);
+      *failed = TRUE;
     }
+    break;
+
+  case EAM_WALK_ERROR:
+    eam_log_error_message ("Failed to get the children of '%s': %s",
+                           entry->path, g_strerror (entry->error));
+    *failed = TRUE;
+    break;
   }
 
-  /* Don't bother updating the current path if something went
-   * wrong already now while looking at its children.
-   */
-  if (!retval)
-    goto bail;
+  return EAM_WALK_CONTINUE;
+}
 
-  if (stat (path, &buf) != 0) {
-    eam_log_error_message ("Error retrieving information about path '%s'", path);
-    retval = FALSE;
-    goto bail;
-  }
+static gboolean
+fix_permissions_for_application (const gchar *path)
+{
+  gboolean failed = FALSE;
 
-  /* It's impossible to know what the desired permissions are for each file,
-   * so we check 'r-x' permissions for "owner" and apply them to "other".
-   */
-  mode_t mod_mask = buf.st_mode;
-  mod_mask |= (((buf.st_mode & S_IRUSR) | (buf.st_mode & S_IXUSR)) >> 6);
+  g_assert (path);
 
-  if (chmod (path, mod_mask) != 0) {
-    eam_log_error_message ("Error fixing permissions for path '%s'", path);
-    retval = FALSE;
-    goto bail;
-  }
+  eam_walk (AT_FDCWD, path, fix_permissions_visit, &failed);
 
- bail:
-  g_object_unref (file);
-  return retval;
+  return !failed;
 }
 
 static void
@@ -331,204 +383,148 @@ eam_fs_sanity_check (void)
   return TRUE;
 }
 
-gboolean
-eam_fs_rmdir_recursive (const char *path)
-{
-  g_autoptr(GError) err = NULL;
-  g_autoptr(GDir) dir = g_dir_open (path, 0, &err);
-  if (err != NULL) {
-    /* If the directory is already gone, then we consider it a success */
-    if (g_error_matches (err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-      return TRUE;
+/* When the kernel supports it, the files are unlinked in batches, and
+ * each directory is removed once the batch holding its children is
+ * complete; a failure is then only noticed at the end of the batch.
+ *
+ * Setting up a ring costs more than removing a small tree, so each
+ * thread keeps its own from one removal to the next, and only sets it
+ * up once there is a file to remove.
+ */
+static GPrivate rmdir_ring = G_PRIVATE_INIT ((GDestroyNotify) eam_uring_free);
 
-    /* An empty dir could be removable even if it is unreadable. */
-    if (g_error_matches (err, G_FILE_ERROR, G_FILE_ERROR_ACCES))
-      return rmdir (path) == 0;
+static EamUring *
+rmdir_get_ring (void)
+{
+  EamUring *ring = g_private_get (&rmdir_ring);
 
-    return FALSE;
+  if (ring == NULL && eam_uring_is_supported ()) {
+    ring = eam_uring_new ();
+    g_private_set (&rmdir_ring, ring);
   }
 
-  const char *fn;
-
-  while ((fn = g_dir_read_name (dir)) != NULL) {
-    g_autofree char *epath = g_build_filename (path, fn, NULL);
-
-    struct stat st;
-    if (lstat (epath, &st) != 0) {
-      /* Bail out, unless the file disappeared */
-      if (errno != ENOENT)
-        return FALSE;
-
-      continue;
-    }
-
-    if (S_ISDIR (st.st_mode)) {
-      if (!eam_fs_rmdir_recursive (epath))
-        return FALSE;
-
-      continue;
-    }
-    else {
-      if (unlink (epath) != 0) {
-        /* Bail out, unless the file disappeared */
-        if (errno != ENOENT)
-          return FALSE;
-      }
-    }
-  }
+  return ring;
+}
 
-  /* The directory at path should now be empty, or not exist */
-  if (rmdir (path) == 0)
-    return TRUE;
-  else {
-    if (errno == ENOENT)
-      return TRUE;
-  }
+/* The queued removals refer to the directories being walked, so they
+ * complete before the walk stops and closes them
+ */
+static EamWalkAction
+rmdir_stop (EamUring *ring)
+{
+  if (ring != NULL)
+    (void) eam_uring_flush (ring);
 
-  return FALSE;
+  return EAM_WALK_STOP;
 }
 
-gboolean
-eam_fs_prune_dir (const char *prefix,
-                  const char *appdir)
+static EamWalkAction
+rmdir_visit (EamWalkEvent event,
+             const EamWalkEntry *entry,
+             gpointer user_data)
 {
-  g_autofree char *path = g_build_filename (prefix, appdir, NULL);
+  EamUring **ring = user_data;
 
-  return eam_fs_rmdir_recursive (path);
-}
+  switch (event) {
+  case EAM_WALK_ENTER:
+    return EAM_WALK_CONTINUE;
 
-#define CP_ENUMERATE_ATTRS \
-  G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
-  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
-  G_FILE_ATTRIBUTE_UNIX_UID "," \
-  G_FILE_ATTRIBUTE_UNIX_GID "," \
-  G_FILE_ATTRIBUTE_UNIX_MODE
+  case EAM_WALK_FILE:
+    if (*ring == NULL)
+      *ring = rmdir_get_ring ();
 
-#define CP_QUERY_ATTRS \
-  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
-  G_FILE_ATTRIBUTE_UNIX_MODE "," \
-  G_FILE_ATTRIBUTE_UNIX_UID "," \
-  G_FILE_ATTRIBUTE_UNIX_GID "," \
-  G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
-  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC "," \
-  G_FILE_ATTRIBUTE_TIME_ACCESS "," \
-  G_FILE_ATTRIBUTE_TIME_ACCESS_USEC
+    if (*ring != NULL) {
+      eam_uring_unlinkat (*ring, entry->dfd, entry->name, 0);
+      return EAM_WALK_CONTINUE;
+    }
 
-static gboolean
-cp_internal (GFile *source,
-             GFile *target,
-             GCancellable *cancellable)
-{
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GFileEnumerator) enumerator =
-    g_file_enumerate_children (source, CP_ENUMERATE_ATTRS,
-                               G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                               cancellable, &error);
+    /* Bail out, unless the file disappeared */
+    if (unlinkat (entry->dfd, entry->name, 0) != 0 && errno != ENOENT)
+      return EAM_WALK_STOP;
 
-  if (error != NULL) {
-    eam_log_error_message ("Unable to enumerate source: %s", error->message);
-    return FALSE;
-  }
+    return EAM_WALK_CONTINUE;
 
-  g_autoptr(GFileInfo) source_info =
-    g_file_query_info (source, CP_QUERY_ATTRS,
-                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                       cancellable, &error);
-  if (error != NULL) {
-    eam_log_error_message ("Unable to query source info: %s", error->message);
-    return FALSE;
-  }
+  case EAM_WALK_LEAVE:
+    if (*ring != NULL) {
+      if (!eam_uring_flush (*ring))
+        return EAM_WALK_STOP;
 
-  g_autofree char *target_path = g_file_get_path (target);
-  int r;
+      eam_uring_unlinkat (*ring, entry->dfd, entry->name, AT_REMOVEDIR);
+      return EAM_WALK_CONTINUE;
+    }
 
-  do {
-    r = mkdir (target_path, 0755);
-  } while (r != 0 && errno == EINTR);
+    /* The directory should now be empty, or not exist */
+    if (unlinkat (entry->dfd, entry->name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+      return EAM_WALK_STOP;
 
-  if (r != 0) {
-    eam_log_error_message ("Unable to create target directory: %s", g_strerror (errno));
-    return FALSE;
-  }
+    return EAM_WALK_CONTINUE;
 
-  /* XXX: This is Linux-specific */
-  int target_fd = open (target_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
-  if (target_fd == -1) {
-    eam_log_error_message ("Unable to open target directory: %s", g_strerror (errno));
-    return FALSE;
-  }
+  case EAM_WALK_ERROR:
+    /* If the directory is already gone, then we consider it a success */
+    if (entry->error == ENOENT)
+      return EAM_WALK_CONTINUE;
 
-  do {
-    guint32 src_uid = g_file_info_get_attribute_uint32 (source_info, G_FILE_ATTRIBUTE_UNIX_UID);
-    guint32 src_gid = g_file_info_get_attribute_uint32 (source_info, G_FILE_ATTRIBUTE_UNIX_GID);
-    r = fchown (target_fd, src_uid, src_gid);
-  } while (r != 0 && errno == EINTR);
+    /* An empty dir could be removable even if it is unreadable. */
+    if (entry->error == EACCES && unlinkat (entry->dfd, entry->name, AT_REMOVEDIR) == 0)
+      return EAM_WALK_CONTINUE;
 
-  if (r != 0) {
-    eam_log_error_message ("Unable to set ownership of target directory: %s",
-                           g_strerror (errno));
-    return FALSE;
+    return rmdir_stop (*ring);
   }
 
-  do {
-    guint32 src_mode = g_file_info_get_attribute_uint32 (source_info, G_FILE_ATTRIBUTE_UNIX_MODE);
-    r = fchmod (target_fd, src_mode);
-  } while (r != 0 && errno == EINTR);
+  return rmdir_stop (*ring);
+}
 
-  if (r != 0) {
-    eam_log_error_message ("Unable to set mode of target directory: %s", g_strerror (errno));
-    return FALSE;
-  }
+gboolean
+eam_fs_rmdir_recursive (const char *path)
+{
+  struct stat buf;
 
-  (void) close (target_fd);
+  /* Removing what is already gone is common, and needs no walk */
+  if (lstat (path, &buf) < 0 && errno == ENOENT)
+    return TRUE;
 
-  while (TRUE) {
-    GFileInfo *file_info = NULL;
-    GFile *source_child = NULL;
+  EamUring *ring = NULL;
 
-    if (!g_file_enumerator_iterate (enumerator, &file_info, &source_child, cancellable, &error)) {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        eam_log_error_message ("Recursive copy operation was cancelled");
-      else
-        eam_log_error_message ("Unable to enumerate source: %s", error->message);
+  if (!eam_walk (AT_FDCWD, path, rmdir_visit, &ring))
+    return FALSE;
 
-      return FALSE;
-    }
+  /* The removal of @path itself is still queued */
+  return ring == NULL || eam_uring_flush (ring);
+}
 
-    if (file_info == NULL)
-      break;
+gboolean
+eam_fs_prune_dir (const char *prefix,
+                  const char *appdir)
+{
+  g_autofree char *path = g_build_filename (prefix, appdir, NULL);
 
-    g_autoptr(GFile) target_child = g_file_get_child (target, g_file_info_get_name (file_info));
+  if (!eam_fs_rmdir_recursive (path))
+    return FALSE;
 
-    if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY) {
-      if (!cp_internal (source_child, target_child, cancellable)) {
-        return FALSE;
-      }
-    }
-    else {
-      GFileCopyFlags flags = G_FILE_COPY_OVERWRITE |
-                             G_FILE_COPY_NOFOLLOW_SYMLINKS |
-                             G_FILE_COPY_ALL_METADATA;
-
-      if (!g_file_copy (source_child, target_child, flags, cancellable, NULL, NULL, &error)) {
-        eam_log_error_message ("Unable to copy source file: %s", error->message);
-        return FALSE;
-      }
-    }
-  }
+  /* Release the objects that were only used by @appdir */
+  eam_object_store_prune (prefix);
 
   return TRUE;
 }
 
+/* The copy runs on several threads; see eam_copy_tree() */
 gboolean
 eam_fs_cpdir_recursive (const char *src,
                         const char *dst,
                         GCancellable *cancellable)
 {
-  g_autoptr(GFile) source = g_file_new_for_path (src);
-  g_autoptr(GFile) target = g_file_new_for_path (dst);
+  g_autoptr(GError) error = NULL;
+
+  if (!eam_copy_tree (src, dst, cancellable, &error)) {
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      eam_log_error_message ("Recursive copy operation was cancelled");
+    else
+      eam_log_error_message ("Unable to copy '%s' to '%s': %s", src, dst, error->message);
+
+    return FALSE;
+  }
 
-  return cp_internal (source, target, cancellable);
+  return TRUE;
 }
 
 gboolean
@@ -563,6 +559,131 @@ eam_fs_deploy_app (const char *source,
   return ret;
 }
 
+/**
+ * eam_fs_get_staging_dir:
+ * @prefix: the applications prefix
+ *
+ * Returns the directory where applications are prepared before being
+ * deployed inside @prefix, creating it if needed.
+ *
+ * The staging directory lives inside @prefix, so that deploying an
+ * application from it with eam_fs_deploy_app() is always a rename(),
+ * even when @prefix is on a different file system than the cache.
+ *
+ * Returns: (transfer full): the staging directory, or %NULL on error
+ */
+char *
+eam_fs_get_staging_dir (const char *prefix)
+{
+  char *staging_dir = g_build_filename (prefix, STAGING_SUBDIR, NULL);
+
+  if (g_mkdir_with_parents (staging_dir, 0755) < 0) {
+    eam_log_error_message ("Unable to create the staging directory '%s': %s",
+                           staging_dir, g_strerror (errno));
+    g_free (staging_dir);
+    return NULL;
+  }
+
+  return staging_dir;
+}
+
+/* An extraction directory with a journal next to it can be resumed */
+static gboolean
+staging_entry_is_resumable (const char *staging_dir,
+                            const char *name)
+{
+  if (g_str_has_suffix (name, JOURNAL_EXT)) {
+    g_autofree char *base = g_strndup (name, strlen (name) - strlen (JOURNAL_EXT));
+    g_autofree char *path = g_build_filename (staging_dir, base, NULL);
+
+    return g_file_test (path, G_FILE_TEST_IS_DIR);
+  }
+
+  g_autofree char *journal = g_strconcat (staging_dir, G_DIR_SEPARATOR_S, name, JOURNAL_EXT, NULL);
+
+  return g_file_test (journal, G_FILE_TEST_IS_REGULAR);
+}
+
+static void
+prune_staging_dir_for_prefix (const char *prefix)
+{
+  if (prefix == NULL)
+    return;
+
+  g_autofree char *staging_dir = g_build_filename (prefix, STAGING_SUBDIR, NULL);
+
+  g_autoptr(GDir) dir = g_dir_open (staging_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  const char *name;
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    if (staging_entry_is_resumable (staging_dir, name))
+      continue;
+
+    g_autofree char *path = g_build_filename (staging_dir, name, NULL);
+
+    eam_log_info_message ("Removing stale staging data '%s'", path);
+
+    if (g_file_test (path, G_FILE_TEST_IS_DIR) && !g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+      if (!eam_fs_rmdir_recursive (path))
+        eam_log_error_message ("Unable to remove '%s'", path);
+    }
+    else if (unlink (path) < 0) {
+      eam_log_error_message ("Unable to remove '%s': %s", path, g_strerror (errno));
+    }
+  }
+
+  /* Objects added by an interrupted transaction were only linked
+   * from its staging directory
+   */
+  eam_object_store_prune (prefix);
+}
+
+/**
+ * eam_fs_prune_staged_app:
+ * @prefix: the applications prefix
+ * @appid: the application ID
+ *
+ * Removes the copy of @appid that was being prepared in the staging
+ * directory of @prefix, after a failure.
+ *
+ * The files of a staged application may already be linked to the
+ * object store of @prefix, which is then pruned too; pruning the
+ * staging directory itself as a prefix would not find them.
+ *
+ * Returns: %TRUE if the copy was removed
+ */
+gboolean
+eam_fs_prune_staged_app (const char *prefix,
+                         const char *appid)
+{
+  g_autofree char *path = g_build_filename (prefix, STAGING_SUBDIR, appid, NULL);
+
+  if (!eam_fs_rmdir_recursive (path))
+    return FALSE;
+
+  eam_object_store_prune (prefix);
+
+  return TRUE;
+}
+
+/**
+ * eam_fs_prune_staging_dirs:
+ *
+ * Removes whatever was left in the staging directories of the
+ * primary and secondary storage by transactions that were
+ * interrupted, except for the extractions that have a journal, and
+ * can be resumed. This must only be called when no transaction is
+ * running.
+ */
+void
+eam_fs_prune_staging_dirs (void)
+{
+  prune_staging_dir_for_prefix (eam_config_get_primary_storage ());
+  prune_staging_dir_for_prefix (eam_config_get_secondary_storage ());
+}
+
 static gboolean
 create_symlink (const char *source,
                 const char *target)
@@ -588,46 +709,90 @@ create_symlink (const char *source,
   return TRUE;
 }
 
-static gboolean
-symlinkdirs_recursive (const char *source_dir,
-                       const char *target_dir,
-                       gboolean    shallow)
+/* The links of the symlink farm mirror the tree of an application;
+ * the path of the counterpart of each entry is built in a buffer that
+ * starts with the target directory
+ */
+typedef struct {
+  GString *target;
+  gsize target_len;
+  gboolean shallow;
+} SymlinkWalk;
+
+static const char *
+symlink_walk_get_target (SymlinkWalk *walk,
+                         const EamWalkEntry *entry)
 {
-  if (g_mkdir_with_parents (target_dir, 0755) != 0)
-    return FALSE;
+  g_string_truncate (walk->target, walk->target_len);
 
-  g_autoptr(GDir) dir = g_dir_open (source_dir, 0, NULL);
-  if (dir == NULL)
-    return TRUE; /* it's OK if the bundle doesn't have that dir */
+  if (entry->depth > 0) {
+    g_string_append_c (walk->target, '/');
+    g_string_append (walk->target, entry->relative);
+  }
 
-  const char *fn;
-  while ((fn = g_dir_read_name (dir)) != NULL) {
-    g_autofree char *spath = g_build_filename (source_dir, fn, NULL);
-    g_autofree char *tpath = g_build_filename (target_dir, fn, NULL);
+  return walk->target->str;
+}
 
-    struct stat st;
-    if (lstat (spath, &st) != 0)
-      return FALSE;
+static EamWalkAction
+symlinkdirs_visit (EamWalkEvent event,
+                   const EamWalkEntry *entry,
+                   gpointer user_data)
+{
+  SymlinkWalk *walk = user_data;
 
-    if (S_ISLNK (st.st_mode) || S_ISREG (st.st_mode)) {
-      if (!create_symlink (spath, tpath))
-        return FALSE;
+  switch (event) {
+  case EAM_WALK_ENTER:
+    if (entry->depth == 0)
+      return EAM_WALK_CONTINUE;
+
+    /* recursive if directory and not shallow */
+    if (walk->shallow) {
+      if (!create_symlink (entry->path, symlink_walk_get_target (walk, entry)))
+        return EAM_WALK_STOP;
+
+      return EAM_WALK_SKIP;
     }
-    else if (S_ISDIR (st.st_mode)) {
-      /* recursive if directory and not shallow */
-      if (!shallow) {
-        /* If symlinkdirs_recursive() fails, we fail the whole operation */
-        if (!symlinkdirs_recursive (spath, tpath, FALSE))
-          return FALSE;
-      }
-      else {
-        if (!create_symlink (spath, tpath))
-          return FALSE;
-      }
+
+    if (mkdir (symlink_walk_get_target (walk, entry), 0755) != 0 && errno != EEXIST)
+      return EAM_WALK_STOP;
+
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_FILE:
+    if (entry->type == DT_LNK || entry->type == DT_REG) {
+      if (!create_symlink (entry->path, symlink_walk_get_target (walk, entry)))
+        return EAM_WALK_STOP;
     }
+
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_LEAVE:
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_ERROR:
+    /* it's OK if the bundle doesn't have that dir */
+    return EAM_WALK_CONTINUE;
   }
 
-  return TRUE;
+  return EAM_WALK_STOP;
+}
+
+static gboolean
+symlinkdirs_recursive (const char *source_dir,
+                       const char *target_dir,
+                       gboolean    shallow)
+{
+  if (g_mkdir_with_parents (target_dir, 0755) != 0)
+    return FALSE;
+
+  g_autoptr(GString) target = g_string_new (target_dir);
+  SymlinkWalk walk = {
+    .target = target,
+    .target_len = target->len,
+    .shallow = shallow,
+  };
+
+  return eam_walk (AT_FDCWD, source_dir, symlinkdirs_visit, &walk);
 }
 
 static char *
@@ -797,57 +962,68 @@ do_binaries_symlinks (const char *prefix,
   return FALSE;
 }
 
-static gboolean
-rmsymlinks_recursive (const char *source_dir,
-                      const char *target_dir)
+static EamWalkAction
+rmsymlinks_visit (EamWalkEvent event,
+                  const EamWalkEntry *entry,
+                  gpointer user_data)
 {
-  g_autoptr(GDir) dp = g_dir_open (source_dir, 0, NULL);
-  if (dp == NULL)
-    return FALSE;
-
-  const char *fn;
+  SymlinkWalk *walk = user_data;
+  struct stat st;
 
-  while ((fn = g_dir_read_name (dp)) != NULL) {
-    g_autofree char *spath = g_build_filename (source_dir, fn, NULL);
-    g_autofree char *tpath = g_build_filename (target_dir, fn, NULL);
+  switch (event) {
+  case EAM_WALK_ENTER:
+  case EAM_WALK_FILE:
+    if (entry->depth == 0)
+      return EAM_WALK_CONTINUE;
 
-    struct stat st;
-    if (lstat (tpath, &st) != 0) {
+    if (lstat (symlink_walk_get_target (walk, entry), &st) != 0) {
       /* Bail out, unless the file disappeared */
       if (errno != ENOENT)
-        return FALSE;
+        return EAM_WALK_STOP;
 
-      continue;
+      return EAM_WALK_SKIP;
     }
 
     /* If the file is a link, we remove it */
     if (S_ISLNK (st.st_mode)) {
-      g_autofree char *file = g_file_read_link (tpath, NULL);
-      if (file == NULL)
-        continue;
-
       /* Remove link unless the file was removed */
-      if (unlink (tpath) != 0) {
-        /* Bail out, unless the file disappeared */
-        if (errno != ENOENT)
-          return FALSE;
-      }
+      if (unlink (walk->target->str) != 0 && errno != ENOENT)
+        return EAM_WALK_STOP;
 
-      continue;
-    }
-    else if (S_ISDIR (st.st_mode)) {
-      /* If the file is a directory, we recurse into it */
-      if (!rmsymlinks_recursive (spath, tpath))
-        return FALSE;
-
-      /* Try to cleanup empty directories that had links.
-       * We intentionally ignore errors.
-       */
-      rmdir (tpath);
+      return EAM_WALK_SKIP;
     }
+
+    /* If the file is a directory, we recurse into it */
+    return S_ISDIR (st.st_mode) ? EAM_WALK_CONTINUE : EAM_WALK_SKIP;
+
+  case EAM_WALK_LEAVE:
+    /* Try to cleanup empty directories that had links.
+     * We intentionally ignore errors.
+     */
+    if (entry->depth > 0)
+      rmdir (symlink_walk_get_target (walk, entry));
+
+    return EAM_WALK_CONTINUE;
+
+  case EAM_WALK_ERROR:
+    return EAM_WALK_STOP;
   }
 
-  return TRUE;
+  return EAM_WALK_STOP;
+}
+
+static gboolean
+rmsymlinks_recursive (const char *source_dir,
+                      const char *target_dir)
+{
+  g_autoptr(GString) target = g_string_new (target_dir);
+  SymlinkWalk walk = {
+    .target = target,
+    .target_len = target->len,
+    .shallow = FALSE,
+  };
+
+  return eam_walk (AT_FDCWD, source_dir, rmsymlinks_visit, &walk);
 }
 
 gboolean
@@ -51,6 +51,11 @@ gboolean        eam_fs_cpdir_recursive  (const char *src,
 gboolean        eam_fs_prune_dir        (const char *prefix,
                                          const char *appdir);
 
+char *          eam_fs_get_staging_dir  (const char *prefix);
+gboolean        eam_fs_prune_staged_app (const char *prefix,
+                                         const char *appid);
+void            eam_fs_prune_staging_dirs (void);
+
 gboolean        eam_fs_deploy_app       (const char *source,
                                          const char *target,
                                          const char *appdir,
@@ -27,7 +27,10 @@
 #include "eam-error.h"
 #include "eam-fs-utils.h"
 #include "eam-log.h"
+#include "eam-manifest.h"
+#include "eam-object-store.h"
 #include "eam-utils.h"
+#include "eam-verify-cache.h"
 
 #define INSTALL_BUNDLE_EXT              "bundle"
 
@@ -194,7 +197,14 @@ eam_install_run_sync (EamTransaction *trans,
     return FALSE;
   }
 
-  if (!priv->skip_signature) {
+  /* A bundle verified by a previous attempt is not verified again */
+  gboolean skip_signature = priv->skip_signature ||
+                            eam_verify_cache_lookup (priv->bundle_file, priv->signature_file);
+
+  /* When streaming, the signature is verified while extracting */
+  gboolean stream_verify = !skip_signature && eam_config_get_streaming_verification ();
+
+  if (!skip_signature && !stream_verify) {
     if (!eam_utils_verify_signature (priv->bundle_file, priv->signature_file, cancellable)) {
       if (g_cancellable_is_cancelled (cancellable))
         g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
@@ -205,10 +215,39 @@ eam_install_run_sync (EamTransaction *trans,
     }
   }
 
+  /* The bundle is extracted next to its final location, so that
+   * deploying it is a rename()
+   */
+  g_autofree char *staging_dir = eam_fs_get_staging_dir (priv->prefix);
+  if (staging_dir == NULL) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
+                         "Unable to create the staging directory");
+    return FALSE;
+  }
+
   /* Further operations require rollback */
 
-  if (!eam_utils_bundle_extract (priv->bundle_file, eam_config_get_cache_dir (), priv->appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), priv->appid);
+  /* The manifest and the deduplication of the files follow the external
+   * script, as it may modify them; the extraction records the checksums
+   * of the files until then
+   */
+  g_autoptr(EamObjectStore) store = NULL;
+  g_autoptr(EamDigests) digests = eam_digests_new ();
+  if (eam_config_get_deduplicate ())
+    store = eam_object_store_new (priv->prefix);
+
+  g_autoptr(EamProgress) progress = eam_progress_new (trans, "extract");
+
+  if (stream_verify) {
+    if (!eam_utils_bundle_extract_verified (priv->bundle_file, priv->signature_file,
+                                            staging_dir, priv->appid,
+                                            digests, progress, cancellable, error)) {
+      eam_fs_prune_staged_app (priv->prefix, priv->appid);
+      return FALSE;
+    }
+  }
+  else if (!eam_utils_bundle_extract (priv->bundle_file, staging_dir, priv->appid, digests, progress, cancellable)) {
+    eam_fs_prune_staged_app (priv->prefix, priv->appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -218,8 +257,8 @@ eam_install_run_sync (EamTransaction *trans,
   }
 
   /* run 3rd party scripts */
-  if (!eam_utils_run_external_scripts (eam_config_get_cache_dir (), priv->appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), priv->appid);
+  if (!eam_utils_run_external_scripts (staging_dir, priv->appid, cancellable)) {
+    eam_fs_prune_staged_app (priv->prefix, priv->appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -228,9 +267,18 @@ eam_install_run_sync (EamTransaction *trans,
     return FALSE;
   }
 
+  /* Record what was installed, for eamctl verify */
+  g_autofree char *appdir = g_build_filename (staging_dir, priv->appid, NULL);
+  if (!eam_manifest_write (appdir, digests))
+    eam_log_error_message ("Could not write the manifest of '%s'", priv->appid);
+
+  /* Linking changes the status of the files, so it follows the manifest */
+  if (store != NULL && !eam_object_store_link_tree (store, appdir, digests))
+    eam_log_error_message ("Could not deduplicate the files of '%s'", priv->appid);
+
   /* Deploy the appdir from the extraction directory to the app directory */
-  if (!eam_fs_deploy_app (eam_config_get_cache_dir (), priv->prefix, priv->appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), priv->appid);
+  if (!eam_fs_deploy_app (staging_dir, priv->prefix, priv->appid, cancellable)) {
+    eam_fs_prune_staged_app (priv->prefix, priv->appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
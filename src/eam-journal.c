@@ -0,0 +1,357 @@
+/* eam-journal.c: Extraction checkpoint journal
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "eam-journal.h"
+
+#include "eam-log.h"
+
+/* The journal records the entries of a bundle that have been
+ * extracted and are known to be on disk, so that an extraction that
+ * was interrupted, e.g. by a power loss, can be resumed instead of
+ * started over.
+ *
+ * The journal is a text file: a header identifying the bundle,
+ * followed by one line per extracted file with its index in the
+ * bundle, its size, the SHA-256 checksum of its data, and its escaped
+ * name.
+ *
+ * The bundle is identified by the same key as the verified bundles
+ * cache: its device, inode, size, modification and change times, and
+ * the digest of its signature. A file recorded in the journal is only
+ * kept if the data the bundle holds for it has the recorded checksum,
+ * so a resumed extraction never keeps anything the bundle would not
+ * have produced.
+ *
+ * Entries are added to the journal in batches, at checkpoints: the
+ * file system is synced first, so that every entry in the journal has
+ * its contents safely on disk, even when its blocks were allocated
+ * ahead of the data.
+ */
+
+#define JOURNAL_MAGIC           "EAM-JOURNAL 2"
+
+typedef struct {
+  guint64 index;
+  guint64 size;
+  char *name;
+  char *checksum;
+} JournalRecord;
+
+struct _EamJournal {
+  char *journal_file;
+  int fd;
+
+  gboolean resumed;
+
+  /* Records read from an existing journal, by index */
+  GHashTable *records;
+
+  /* Protects the pending records */
+  GMutex lock;
+  GPtrArray *pending;
+};
+
+static void
+journal_record_free (gpointer data)
+{
+  JournalRecord *record = data;
+
+  g_free (record->name);
+  g_free (record->checksum);
+
+  g_slice_free (JournalRecord, record);
+}
+
+static GHashTable *
+journal_load (const char *journal_file,
+              const char *bundle_id)
+{
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (journal_file, &contents, NULL, NULL))
+    return NULL;
+
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+
+  if (g_strv_length (lines) < 2 ||
+      g_strcmp0 (lines[0], JOURNAL_MAGIC) != 0 ||
+      g_strcmp0 (lines[1], bundle_id) != 0)
+    return NULL;
+
+  GHashTable *records =
+    g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, journal_record_free);
+
+  /* A line cut short by a crash is ignored, as are the ones after it */
+  for (guint i = 2; lines[i] != NULL && lines[i + 1] != NULL; i++) {
+    g_auto(GStrv) fields = g_strsplit (lines[i], " ", 4);
+
+    if (g_strv_length (fields) != 4)
+      break;
+
+    JournalRecord *record = g_slice_new0 (JournalRecord);
+
+    record->index = g_ascii_strtoull (fields[0], NULL, 10);
+    record->size = g_ascii_strtoull (fields[1], NULL, 10);
+    record->checksum = g_strdup (fields[2]);
+    record->name = g_strcompress (fields[3]);
+
+    g_hash_table_replace (records, &record->index, record);
+  }
+
+  return records;
+}
+
+static gboolean
+journal_write (int fd,
+               const char *data)
+{
+  gsize size = strlen (data);
+
+  while (size > 0) {
+    gssize n = write (fd, data, size);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    data += n;
+    size -= n;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_journal_open:
+ * @journal_file: the path of the journal
+ * @bundle_id: the key identifying the bundle being extracted, as
+ *   returned by eam_verify_cache_get_key()
+ *
+ * Opens the journal for the extraction of the bundle identified by
+ * @bundle_id. If @journal_file was left by an extraction of the same
+ * bundle, its records are loaded, and eam_journal_is_resumed() returns
+ * %TRUE; otherwise, a new journal is started.
+ *
+ * Returns: (transfer full): the journal, or %NULL if it could not be
+ *   created
+ */
+EamJournal *
+eam_journal_open (const char *journal_file,
+                  const char *bundle_id)
+{
+  g_return_val_if_fail (bundle_id != NULL, NULL);
+
+  EamJournal *journal = g_new0 (EamJournal, 1);
+
+  journal->journal_file = g_strdup (journal_file);
+  journal->pending = g_ptr_array_new_with_free_func (journal_record_free);
+  g_mutex_init (&journal->lock);
+
+  journal->records = journal_load (journal_file, bundle_id);
+  journal->resumed = journal->records != NULL;
+
+  if (journal->resumed) {
+    journal->fd = open (journal_file, O_WRONLY | O_APPEND | O_CLOEXEC);
+  }
+  else {
+    journal->records = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, journal_record_free);
+    journal->fd = open (journal_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+    if (journal->fd >= 0) {
+      g_autofree char *header = g_strdup_printf ("%s\n%s\n", JOURNAL_MAGIC, bundle_id);
+
+      if (!journal_write (journal->fd, header)) {
+        (void) close (journal->fd);
+        journal->fd = -1;
+      }
+    }
+  }
+
+  if (journal->fd < 0) {
+    eam_log_error_message ("Unable to open the journal '%s': %s",
+                           journal_file, g_strerror (errno));
+    eam_journal_free (journal);
+    return NULL;
+  }
+
+  if (journal->resumed)
+    eam_log_info_message ("Resuming extraction from '%s' (%u entries done)",
+                          journal_file, g_hash_table_size (journal->records));
+
+  return journal;
+}
+
+void
+eam_journal_free (EamJournal *journal)
+{
+  if (journal == NULL)
+    return;
+
+  if (journal->fd >= 0)
+    (void) close (journal->fd);
+
+  g_clear_pointer (&journal->records, g_hash_table_unref);
+  g_ptr_array_unref (journal->pending);
+  g_mutex_clear (&journal->lock);
+  g_free (journal->journal_file);
+
+  g_free (journal);
+}
+
+gboolean
+eam_journal_is_resumed (EamJournal *journal)
+{
+  return journal->resumed;
+}
+
+/**
+ * eam_journal_lookup:
+ * @journal: a #EamJournal
+ * @index: the index of the entry in the bundle
+ * @name: the name of the entry in the bundle
+ * @size: (out): return location for the size of the extracted file
+ * @checksum: (out) (transfer none): return location for the SHA-256
+ *   checksum of the extracted file
+ *
+ * Returns: %TRUE if the entry was extracted by a previous attempt
+ */
+gboolean
+eam_journal_lookup (EamJournal *journal,
+                    guint64 index,
+                    const char *name,
+                    guint64 *size,
+                    const char **checksum)
+{
+  JournalRecord *record = g_hash_table_lookup (journal->records, &index);
+
+  if (record == NULL || g_strcmp0 (record->name, name) != 0)
+    return FALSE;
+
+  *size = record->size;
+  *checksum = record->checksum;
+
+  return TRUE;
+}
+
+/**
+ * eam_journal_add:
+ * @journal: a #EamJournal
+ * @index: the index of the entry in the bundle
+ * @name: the name of the entry in the bundle
+ * @size: the size of the extracted file
+ * @checksum: the SHA-256 checksum of the data of the file
+ *
+ * Queues an extracted entry, to be recorded at the next checkpoint.
+ *
+ * This function can be called from any thread.
+ */
+void
+eam_journal_add (EamJournal *journal,
+                 guint64 index,
+                 const char *name,
+                 guint64 size,
+                 const char *checksum)
+{
+  JournalRecord *record = g_slice_new0 (JournalRecord);
+
+  record->index = index;
+  record->size = size;
+  record->name = g_strdup (name);
+  record->checksum = g_strdup (checksum);
+
+  g_mutex_lock (&journal->lock);
+  g_ptr_array_add (journal->pending, record);
+  g_mutex_unlock (&journal->lock);
+}
+
+/**
+ * eam_journal_checkpoint:
+ * @journal: a #EamJournal
+ *
+ * Makes the entries queued so far durable: the file system holding the
+ * journal is synced, then the entries are appended to the journal.
+ *
+ * Returns: %TRUE if the entries were recorded
+ */
+gboolean
+eam_journal_checkpoint (EamJournal *journal)
+{
+  g_mutex_lock (&journal->lock);
+  GPtrArray *pending = journal->pending;
+  journal->pending = g_ptr_array_new_with_free_func (journal_record_free);
+  g_mutex_unlock (&journal->lock);
+
+  gboolean ret = TRUE;
+
+  if (pending->len == 0)
+    goto out;
+
+  if (syncfs (journal->fd) < 0) {
+    eam_log_error_message ("Unable to sync the extracted files: %s", g_strerror (errno));
+    ret = FALSE;
+    goto out;
+  }
+
+  GString *buf = g_string_new (NULL);
+
+  for (guint i = 0; i < pending->len; i++) {
+    JournalRecord *record = g_ptr_array_index (pending, i);
+    g_autofree char *escaped = g_strescape (record->name, NULL);
+
+    g_string_append_printf (buf, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %s %s\n",
+                            record->index, record->size, record->checksum, escaped);
+  }
+
+  ret = journal_write (journal->fd, buf->str) && fdatasync (journal->fd) == 0;
+  if (!ret)
+    eam_log_error_message ("Unable to write the journal '%s': %s",
+                           journal->journal_file, g_strerror (errno));
+
+  g_string_free (buf, TRUE);
+
+out:
+  g_ptr_array_unref (pending);
+
+  return ret;
+}
+
+/**
+ * eam_journal_remove:
+ * @journal_file: the path of a journal
+ *
+ * Removes a journal once its extraction is complete, or abandoned.
+ */
+void
+eam_journal_remove (const char *journal_file)
+{
+  if (unlink (journal_file) < 0 && errno != ENOENT)
+    eam_log_error_message ("Unable to remove the journal '%s': %s",
+                           journal_file, g_strerror (errno));
+}
@@ -0,0 +1,49 @@
+/* eam-journal.h: Extraction checkpoint journal
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamJournal      EamJournal;
+
+EamJournal *    eam_journal_open                (const char *journal_file,
+                                                 const char *bundle_id);
+void            eam_journal_free                (EamJournal *journal);
+
+gboolean        eam_journal_is_resumed          (EamJournal *journal);
+
+gboolean        eam_journal_lookup              (EamJournal *journal,
+                                                 guint64 index,
+                                                 const char *name,
+                                                 guint64 *size,
+                                                 const char **checksum);
+void            eam_journal_add                 (EamJournal *journal,
+                                                 guint64 index,
+                                                 const char *name,
+                                                 guint64 size,
+                                                 const char *checksum);
+gboolean        eam_journal_checkpoint          (EamJournal *journal);
+
+void            eam_journal_remove              (const char *journal_file);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamJournal, eam_journal_free)
+
+G_END_DECLS
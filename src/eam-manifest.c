@@ -0,0 +1,602 @@
+/* eam-manifest.c: Digests of the files of an installed app
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "eam-manifest.h"
+
+#include "eam-digests.h"
+#include "eam-log.h"
+#include "eam-sha256.h"
+
+/* The manifest lists the regular files and symbolic links of an app
+ * once it is installed, that is after its external script ran, so
+ * that the tree can later be checked against it.
+ *
+ * It is a text file at the top of the app directory, with a line per
+ * entry, sorted by path; the fields are separated by tabs, and escaped
+ * like C strings:
+ *
+ *   file	<size>	<sha256>	<path>
+ *   symlink	<target>	<path>
+ *
+ * Directories are not listed, and neither are the Python byte code
+ * files, which are compiled after the app has been deployed.
+ *
+ * The files are hashed by a pool of threads; when verifying several
+ * apps, they all share the same pool, so that scanning one app and
+ * hashing the files of another overlap. When writing the manifest, the
+ * checksums the extraction recorded are used instead, so that only the
+ * files the external script added or changed are read.
+ */
+
+#define MANIFEST_HEADER         "# eos-app-manager manifest 1"
+
+/* Files are hashed in blocks of this size */
+#define MANIFEST_BLOCK_SIZE     (256 * 1024)
+
+typedef enum {
+  ENTRY_FILE,
+  ENTRY_SYMLINK
+} EntryType;
+
+typedef struct {
+  EntryType type;
+  char *path;
+
+  guint64 size;
+
+  /* The digest of a file, or the target of a symbolic link */
+  char *data;
+} ManifestEntry;
+
+typedef struct {
+  char *file;
+  ManifestEntry *entry;
+
+  char *digest;
+} HashJob;
+
+typedef struct {
+  char *appid;
+  char *appdir;
+
+  /* The path of each entry of the manifest, to its ManifestEntry */
+  GHashTable *expected;
+
+  /* The entries found in the app directory, and the files among them
+   * that need hashing
+   */
+  GPtrArray *found;
+  GPtrArray *jobs;
+
+  GPtrArray *problems;
+} VerifyApp;
+
+typedef struct {
+  char *path;
+  EamManifestStatus status;
+} VerifyProblem;
+
+struct _EamManifestVerifier {
+  GThreadPool *pool;
+  GPtrArray *apps;
+};
+
+static void
+manifest_entry_free (ManifestEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry->data);
+  g_slice_free (ManifestEntry, entry);
+}
+
+static ManifestEntry *
+manifest_entry_new (EntryType type,
+                    const char *path)
+{
+  ManifestEntry *entry = g_slice_new0 (ManifestEntry);
+
+  entry->type = type;
+  entry->path = g_strdup (path);
+
+  return entry;
+}
+
+static int
+manifest_entry_compare (gconstpointer a,
+                        gconstpointer b)
+{
+  const ManifestEntry *entry_a = *(const ManifestEntry **) a;
+  const ManifestEntry *entry_b = *(const ManifestEntry **) b;
+
+  return strcmp (entry_a->path, entry_b->path);
+}
+
+static void
+hash_job_free (HashJob *job)
+{
+  g_free (job->file);
+  g_free (job->digest);
+  g_slice_free (HashJob, job);
+}
+
+static gboolean
+is_python_artifact (const char *name,
+                    gboolean is_dir)
+{
+  if (is_dir)
+    return strcmp (name, "__pycache__") == 0;
+
+  return g_str_has_suffix (name, ".pyc") || g_str_has_suffix (name, ".pyo");
+}
+
+/* Lists the files and symbolic links under @appdir/@relpath, with the
+ * digests of the files that are still as recorded in @digests
+ */
+static gboolean
+manifest_scan (const char *appdir,
+               const char *relpath,
+               EamDigests *digests,
+               GPtrArray *entries)
+{
+  g_autofree char *dir = g_build_filename (appdir, relpath, NULL);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDir) dp = g_dir_open (dir, 0, &error);
+
+  if (dp == NULL) {
+    eam_log_error_message ("Unable to list '%s': %s", dir, error->message);
+    return FALSE;
+  }
+
+  const char *name;
+
+  while ((name = g_dir_read_name (dp)) != NULL) {
+    g_autofree char *path = relpath[0] == '\0' ? g_strdup (name) : g_build_filename (relpath, name, NULL);
+    g_autofree char *file = g_build_filename (dir, name, NULL);
+    struct stat buf;
+
+    if (lstat (file, &buf) < 0) {
+      int saved_errno = errno;
+      eam_log_error_message ("Unable to stat '%s': %s", file, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+    if (S_ISDIR (buf.st_mode)) {
+      if (!is_python_artifact (name, TRUE) && !manifest_scan (appdir, path, digests, entries))
+        return FALSE;
+    }
+    else if (S_ISREG (buf.st_mode)) {
+      if (is_python_artifact (name, FALSE) || strcmp (path, EAM_MANIFEST_FILE) == 0)
+        continue;
+
+      ManifestEntry *entry = manifest_entry_new (ENTRY_FILE, path);
+      entry->size = buf.st_size;
+      if (digests != NULL)
+        entry->data = g_strdup (eam_digests_lookup (digests, path, &buf));
+      g_ptr_array_add (entries, entry);
+    }
+    else if (S_ISLNK (buf.st_mode)) {
+      ManifestEntry *entry = manifest_entry_new (ENTRY_SYMLINK, path);
+      entry->data = g_file_read_link (file, &error);
+
+      if (entry->data == NULL) {
+        eam_log_error_message ("Unable to read '%s': %s", file, error->message);
+        manifest_entry_free (entry);
+        return FALSE;
+      }
+
+      g_ptr_array_add (entries, entry);
+    }
+  }
+
+  return TRUE;
+}
+
+static char *
+hash_file (const char *file)
+{
+  int fd = open (file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return NULL;
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  g_autoptr(EamSha256) checksum = eam_sha256_new ();
+  g_autofree guint8 *buffer = g_malloc (MANIFEST_BLOCK_SIZE);
+
+  while (TRUE) {
+    gssize n = read (fd, buffer, MANIFEST_BLOCK_SIZE);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0) {
+      (void) close (fd);
+      return NULL;
+    }
+
+    if (n == 0)
+      break;
+
+    eam_sha256_update (checksum, buffer, n);
+  }
+
+  (void) close (fd);
+
+  return g_strdup (eam_sha256_get_string (checksum));
+}
+
+static void
+hash_job_run (gpointer data,
+              gpointer user_data)
+{
+  HashJob *job = data;
+
+  job->digest = hash_file (job->file);
+}
+
+static HashJob *
+hash_job_new (const char *appdir,
+              ManifestEntry *entry)
+{
+  HashJob *job = g_slice_new0 (HashJob);
+
+  job->file = g_build_filename (appdir, entry->path, NULL);
+  job->entry = entry;
+
+  return job;
+}
+
+static GThreadPool *
+hash_pool_new (guint n_threads)
+{
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  return g_thread_pool_new (hash_job_run, NULL, n_threads, FALSE, NULL);
+}
+
+/**
+ * eam_manifest_write:
+ * @appdir: the directory of an app
+ * @digests: (nullable): the checksums recorded by the extraction of
+ *   @appdir
+ *
+ * Hashes the contents of @appdir, and records them in its manifest.
+ * Files that are still as recorded in @digests are not hashed again.
+ *
+ * Returns: %TRUE if the manifest was written
+ */
+gboolean
+eam_manifest_write (const char *appdir,
+                    EamDigests *digests)
+{
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) manifest_entry_free);
+
+  if (!manifest_scan (appdir, "", digests, entries))
+    return FALSE;
+
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) hash_job_free);
+  GThreadPool *pool = hash_pool_new (0);
+
+  for (guint i = 0; i < entries->len; i++) {
+    ManifestEntry *entry = g_ptr_array_index (entries, i);
+
+    if (entry->type != ENTRY_FILE || entry->data != NULL)
+      continue;
+
+    HashJob *job = hash_job_new (appdir, entry);
+    g_ptr_array_add (jobs, job);
+    g_thread_pool_push (pool, job, NULL);
+  }
+
+  /* Waits for all the jobs */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (guint i = 0; i < jobs->len; i++) {
+    HashJob *job = g_ptr_array_index (jobs, i);
+
+    if (job->digest == NULL) {
+      eam_log_error_message ("Unable to hash '%s'", job->file);
+      return FALSE;
+    }
+
+    job->entry->data = g_steal_pointer (&job->digest);
+  }
+
+  g_ptr_array_sort (entries, manifest_entry_compare);
+
+  g_autoptr(GString) contents = g_string_new (MANIFEST_HEADER "\n");
+
+  for (guint i = 0; i < entries->len; i++) {
+    ManifestEntry *entry = g_ptr_array_index (entries, i);
+    g_autofree char *path = g_strescape (entry->path, NULL);
+
+    if (entry->type == ENTRY_FILE) {
+      g_string_append_printf (contents, "file\t%" G_GUINT64_FORMAT "\t%s\t%s\n",
+                              entry->size, entry->data, path);
+    }
+    else {
+      g_autofree char *target = g_strescape (entry->data, NULL);
+      g_string_append_printf (contents, "symlink\t%s\t%s\n", target, path);
+    }
+  }
+
+  g_autofree char *manifest_file = g_build_filename (appdir, EAM_MANIFEST_FILE, NULL);
+  g_autoptr(GError) error = NULL;
+
+  if (!g_file_set_contents (manifest_file, contents->str, contents->len, &error)) {
+    eam_log_error_message ("Unable to write '%s': %s", manifest_file, error->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static GHashTable *
+manifest_load (const char *appdir)
+{
+  g_autofree char *manifest_file = g_build_filename (appdir, EAM_MANIFEST_FILE, NULL);
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (manifest_file, &contents, NULL, NULL))
+    return NULL;
+
+  if (!g_str_has_prefix (contents, MANIFEST_HEADER "\n")) {
+    eam_log_error_message ("Unknown manifest format in '%s'", manifest_file);
+    return NULL;
+  }
+
+  GHashTable *entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify) manifest_entry_free);
+  g_auto(GStrv) lines = g_strsplit (contents, "\n", -1);
+
+  for (guint i = 1; lines[i] != NULL; i++) {
+    if (lines[i][0] == '\0')
+      continue;
+
+    g_auto(GStrv) fields = g_strsplit (lines[i], "\t", -1);
+    guint n_fields = g_strv_length (fields);
+    ManifestEntry *entry = NULL;
+
+    if (n_fields == 4 && strcmp (fields[0], "file") == 0) {
+      g_autofree char *path = g_strcompress (fields[3]);
+
+      entry = manifest_entry_new (ENTRY_FILE, path);
+      entry->size = g_ascii_strtoull (fields[1], NULL, 10);
+      entry->data = g_strdup (fields[2]);
+    }
+    else if (n_fields == 3 && strcmp (fields[0], "symlink") == 0) {
+      g_autofree char *path = g_strcompress (fields[2]);
+
+      entry = manifest_entry_new (ENTRY_SYMLINK, path);
+      entry->data = g_strcompress (fields[1]);
+    }
+    else {
+      eam_log_error_message ("Invalid line %u in '%s'", i + 1, manifest_file);
+      g_hash_table_unref (entries);
+      return NULL;
+    }
+
+    g_hash_table_replace (entries, entry->path, entry);
+  }
+
+  return entries;
+}
+
+static void
+verify_app_free (VerifyApp *app)
+{
+  g_free (app->appid);
+  g_free (app->appdir);
+  g_hash_table_unref (app->expected);
+  g_ptr_array_unref (app->found);
+  g_ptr_array_unref (app->jobs);
+  g_ptr_array_unref (app->problems);
+  g_slice_free (VerifyApp, app);
+}
+
+static void
+verify_problem_free (VerifyProblem *problem)
+{
+  g_free (problem->path);
+  g_slice_free (VerifyProblem, problem);
+}
+
+static int
+verify_problem_compare (gconstpointer a,
+                        gconstpointer b)
+{
+  const VerifyProblem *problem_a = *(const VerifyProblem **) a;
+  const VerifyProblem *problem_b = *(const VerifyProblem **) b;
+
+  return strcmp (problem_a->path, problem_b->path);
+}
+
+static void
+verify_app_add_problem (VerifyApp *app,
+                        const char *path,
+                        EamManifestStatus status)
+{
+  VerifyProblem *problem = g_slice_new0 (VerifyProblem);
+
+  problem->path = g_strdup (path);
+  problem->status = status;
+
+  g_ptr_array_add (app->problems, problem);
+}
+
+/**
+ * eam_manifest_verifier_new:
+ * @n_threads: the number of threads hashing files, or 0 for one
+ *   thread per processor
+ *
+ * Returns: (transfer full): a new #EamManifestVerifier
+ */
+EamManifestVerifier *
+eam_manifest_verifier_new (guint n_threads)
+{
+  EamManifestVerifier *verifier = g_new0 (EamManifestVerifier, 1);
+
+  verifier->pool = hash_pool_new (n_threads);
+  verifier->apps = g_ptr_array_new_with_free_func ((GDestroyNotify) verify_app_free);
+
+  return verifier;
+}
+
+void
+eam_manifest_verifier_free (EamManifestVerifier *verifier)
+{
+  if (verifier->pool != NULL)
+    g_thread_pool_free (verifier->pool, TRUE, TRUE);
+
+  g_ptr_array_unref (verifier->apps);
+  g_free (verifier);
+}
+
+/**
+ * eam_manifest_verifier_add:
+ * @verifier: a #EamManifestVerifier
+ * @appid: the id of the app
+ * @appdir: the directory of the app
+ *
+ * Compares the contents of @appdir with its manifest; the files whose
+ * size matches are hashed in the background.
+ *
+ * Returns: %FALSE if @appdir has no manifest, or cannot be listed
+ */
+gboolean
+eam_manifest_verifier_add (EamManifestVerifier *verifier,
+                           const char *appid,
+                           const char *appdir)
+{
+  g_return_val_if_fail (verifier->pool != NULL, FALSE);
+
+  GHashTable *expected = manifest_load (appdir);
+  if (expected == NULL)
+    return FALSE;
+
+  VerifyApp *app = g_slice_new0 (VerifyApp);
+  app->appid = g_strdup (appid);
+  app->appdir = g_strdup (appdir);
+  app->expected = expected;
+  app->found = g_ptr_array_new_with_free_func ((GDestroyNotify) manifest_entry_free);
+  app->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) hash_job_free);
+  app->problems = g_ptr_array_new_with_free_func ((GDestroyNotify) verify_problem_free);
+
+  if (!manifest_scan (appdir, "", NULL, app->found)) {
+    verify_app_free (app);
+    return FALSE;
+  }
+
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (guint i = 0; i < app->found->len; i++) {
+    ManifestEntry *entry = g_ptr_array_index (app->found, i);
+    ManifestEntry *expected_entry = g_hash_table_lookup (app->expected, entry->path);
+
+    if (expected_entry == NULL) {
+      verify_app_add_problem (app, entry->path, EAM_MANIFEST_STATUS_EXTRA);
+      continue;
+    }
+
+    g_hash_table_add (seen, expected_entry->path);
+
+    if (entry->type != expected_entry->type ||
+        (entry->type == ENTRY_SYMLINK && strcmp (entry->data, expected_entry->data) != 0) ||
+        (entry->type == ENTRY_FILE && entry->size != expected_entry->size)) {
+      verify_app_add_problem (app, entry->path, EAM_MANIFEST_STATUS_MODIFIED);
+      continue;
+    }
+
+    if (entry->type == ENTRY_FILE) {
+      HashJob *job = hash_job_new (appdir, expected_entry);
+      g_ptr_array_add (app->jobs, job);
+      g_thread_pool_push (verifier->pool, job, NULL);
+    }
+  }
+
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init (&iter, app->expected);
+  while (g_hash_table_iter_next (&iter, &key, NULL)) {
+    if (!g_hash_table_contains (seen, key))
+      verify_app_add_problem (app, key, EAM_MANIFEST_STATUS_MISSING);
+  }
+
+  g_ptr_array_add (verifier->apps, app);
+
+  return TRUE;
+}
+
+/**
+ * eam_manifest_verifier_finish:
+ * @verifier: a #EamManifestVerifier
+ * @func: the function called for each problem
+ * @user_data: data for @func
+ *
+ * Waits for all the files to be hashed, and reports the problems
+ * found in each app, in the order the apps were added, and sorted by
+ * path; @func is called in the calling thread.
+ *
+ * Returns: the number of problems found
+ */
+guint
+eam_manifest_verifier_finish (EamManifestVerifier *verifier,
+                              EamManifestReportFunc func,
+                              gpointer user_data)
+{
+  g_return_val_if_fail (verifier->pool != NULL, 0);
+
+  g_thread_pool_free (verifier->pool, FALSE, TRUE);
+  verifier->pool = NULL;
+
+  guint n_problems = 0;
+
+  for (guint i = 0; i < verifier->apps->len; i++) {
+    VerifyApp *app = g_ptr_array_index (verifier->apps, i);
+
+    for (guint j = 0; j < app->jobs->len; j++) {
+      HashJob *job = g_ptr_array_index (app->jobs, j);
+
+      if (g_strcmp0 (job->digest, job->entry->data) != 0)
+        verify_app_add_problem (app, job->entry->path, EAM_MANIFEST_STATUS_MODIFIED);
+    }
+
+    g_ptr_array_sort (app->problems, verify_problem_compare);
+
+    for (guint j = 0; j < app->problems->len; j++) {
+      VerifyProblem *problem = g_ptr_array_index (app->problems, j);
+
+      func (app->appid, problem->path, problem->status, user_data);
+    }
+
+    n_problems += app->problems->len;
+  }
+
+  return n_problems;
+}
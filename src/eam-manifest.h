@@ -0,0 +1,57 @@
+/* eam-manifest.h: Digests of the files of an installed app
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+#include "eam-digests.h"
+
+G_BEGIN_DECLS
+
+#define EAM_MANIFEST_FILE       ".manifest"
+
+typedef enum {
+  EAM_MANIFEST_STATUS_MODIFIED,
+  EAM_MANIFEST_STATUS_MISSING,
+  EAM_MANIFEST_STATUS_EXTRA
+} EamManifestStatus;
+
+typedef struct _EamManifestVerifier     EamManifestVerifier;
+
+typedef void (* EamManifestReportFunc) (const char *appid,
+                                        const char *path,
+                                        EamManifestStatus status,
+                                        gpointer user_data);
+
+gboolean                eam_manifest_write              (const char *appdir,
+                                                         EamDigests *digests);
+
+EamManifestVerifier *   eam_manifest_verifier_new       (guint n_threads);
+void                    eam_manifest_verifier_free      (EamManifestVerifier *verifier);
+
+gboolean                eam_manifest_verifier_add       (EamManifestVerifier *verifier,
+                                                         const char *appid,
+                                                         const char *appdir);
+guint                   eam_manifest_verifier_finish    (EamManifestVerifier *verifier,
+                                                         EamManifestReportFunc func,
+                                                         gpointer user_data);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamManifestVerifier, eam_manifest_verifier_free)
+
+G_END_DECLS
@@ -0,0 +1,322 @@
+/* eam-object-store.c: Content-addressed file store
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "eam-object-store.h"
+
+#include "eam-log.h"
+#include "eam-walk.h"
+
+/* The object store keeps one copy of each distinct file installed in
+ * a prefix, under <prefix>/.objects. Applications get hard links to
+ * the objects instead of their own copies, so identical files shipped
+ * by different bundles, or by different versions of the same bundle,
+ * only use disk space once.
+ *
+ * Hard links share their inode, so objects are keyed by the checksum
+ * of their contents and by the metadata that must not be shared
+ * between different files: mode and ownership. The modification time
+ * is not part of the key; a deduplicated file has the one of the
+ * first copy that was stored.
+ *
+ * Objects never have write bits, so that writing to a file through
+ * one application does not silently change it for all the others;
+ * code modifying installed files must replace them, or copy them
+ * first. For the same reason files are only deduplicated once the
+ * external script of an application, which may modify its files in
+ * place, has run.
+ *
+ * The link count of an object doubles as its reference count: an
+ * object whose only link is the one in the store is not used by any
+ * application anymore, and can be removed.
+ */
+
+#define OBJECTS_SUBDIR ".objects"
+
+#define OBJECT_WRITE_BITS (S_IWUSR | S_IWGRP | S_IWOTH)
+
+struct _EamObjectStore {
+  char *objects_dir;
+};
+
+/**
+ * eam_object_store_new:
+ * @prefix: the applications prefix
+ *
+ * Opens the object store of @prefix, creating it if needed.
+ *
+ * Returns: (transfer full): the object store, or %NULL on error
+ */
+EamObjectStore *
+eam_object_store_new (const char *prefix)
+{
+  g_autofree char *objects_dir = g_build_filename (prefix, OBJECTS_SUBDIR, NULL);
+
+  if (g_mkdir_with_parents (objects_dir, 0755) < 0) {
+    eam_log_error_message ("Unable to create the object store '%s': %s",
+                           objects_dir, g_strerror (errno));
+    return NULL;
+  }
+
+  EamObjectStore *store = g_new0 (EamObjectStore, 1);
+
+  store->objects_dir = g_steal_pointer (&objects_dir);
+
+  return store;
+}
+
+void
+eam_object_store_free (EamObjectStore *store)
+{
+  if (store == NULL)
+    return;
+
+  g_free (store->objects_dir);
+
+  g_free (store);
+}
+
+static char *
+object_path_for_file (EamObjectStore *store,
+                      const char *checksum,
+                      const struct stat *buf)
+{
+  /* The first two characters of the checksum are used to fan out the
+   * objects, to keep the directories small
+   */
+  char fanout[3] = { checksum[0], checksum[1], '\0' };
+
+  g_autofree char *name =
+    g_strdup_printf ("%s.%o.%u.%u", checksum + 2,
+                     (guint) (buf->st_mode & 07777 & ~OBJECT_WRITE_BITS),
+                     (guint) buf->st_uid,
+                     (guint) buf->st_gid);
+
+  return g_build_filename (store->objects_dir, fanout, name, NULL);
+}
+
+static gboolean
+store_link_file (EamObjectStore *store,
+                 const char *path,
+                 const struct stat *buf,
+                 const char *checksum)
+{
+  g_autofree char *object = object_path_for_file (store, checksum, buf);
+
+  /* Try adding the file as a new object first; the write bits are
+   * removed before, so that the object is never writable
+   */
+  if ((buf->st_mode & OBJECT_WRITE_BITS) != 0 &&
+      chmod (path, buf->st_mode & 07777 & ~OBJECT_WRITE_BITS) < 0)
+    return FALSE;
+
+  if (link (path, object) == 0)
+    return TRUE;
+
+  if (errno == ENOENT) {
+    g_autofree char *fanout_dir = g_path_get_dirname (object);
+
+    if (g_mkdir (fanout_dir, 0755) < 0 && errno != EEXIST)
+      return FALSE;
+
+    if (link (path, object) == 0)
+      return TRUE;
+  }
+
+  if (errno != EEXIST)
+    return FALSE;
+
+  /* The object exists, so we replace our copy with a link to it; we
+   * go through a temporary link, so that @path is never missing
+   */
+  g_autofree char *tmp_path = g_strconcat (path, ".eam-object", NULL);
+
+  (void) unlink (tmp_path);
+
+  if (link (object, tmp_path) < 0) {
+    /* EMLINK means the object has too many links; the copy we
+     * already have is as good as any
+     */
+    if (errno != EMLINK)
+      eam_log_debug_message ("Unable to link '%s' to '%s': %s",
+                             path, object, g_strerror (errno));
+    return FALSE;
+  }
+
+  if (rename (tmp_path, path) < 0) {
+    (void) unlink (tmp_path);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_object_store_link_file:
+ * @store: a #EamObjectStore
+ * @path: a regular file inside the prefix of @store
+ * @checksum: the SHA-256 checksum of the contents of @path, as a hex string
+ *
+ * If the store already has an object matching @path, replaces @path
+ * with a hard link to it; otherwise, @path becomes a new object. Either
+ * way, @path loses its write bits.
+ *
+ * This function can be called from any thread.
+ *
+ * Returns: %TRUE if @path is now linked to the store
+ */
+gboolean
+eam_object_store_link_file (EamObjectStore *store,
+                            const char *path,
+                            const char *checksum)
+{
+  struct stat buf;
+
+  if (strlen (checksum) < 3 || lstat (path, &buf) < 0 || !S_ISREG (buf.st_mode))
+    return FALSE;
+
+  return store_link_file (store, path, &buf, checksum);
+}
+
+typedef struct {
+  EamObjectStore *store;
+  EamDigests *digests;
+  guint64 n_linked;
+} LinkTreeData;
+
+static EamWalkAction
+link_tree_visit (EamWalkEvent event,
+                 const EamWalkEntry *entry,
+                 gpointer user_data)
+{
+  LinkTreeData *data = user_data;
+  struct stat buf;
+
+  if (event != EAM_WALK_FILE || (entry->type != DT_REG && entry->type != DT_UNKNOWN))
+    return EAM_WALK_CONTINUE;
+
+  if (fstatat (entry->dfd, entry->name, &buf, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG (buf.st_mode))
+    return EAM_WALK_CONTINUE;
+
+  /* Files the external script added, or changed, have no checksum, and
+   * are left alone
+   */
+  const char *checksum = eam_digests_lookup (data->digests, entry->relative, &buf);
+  if (checksum == NULL || strlen (checksum) < 3)
+    return EAM_WALK_CONTINUE;
+
+  if (store_link_file (data->store, entry->path, &buf, checksum))
+    data->n_linked += 1;
+
+  return EAM_WALK_CONTINUE;
+}
+
+/**
+ * eam_object_store_link_tree:
+ * @store: a #EamObjectStore
+ * @appdir: an application directory inside the prefix of @store
+ * @digests: the checksums of the files extracted into @appdir
+ *
+ * Links the files of @appdir that are still as they were extracted to
+ * the store, with eam_object_store_link_file(). This must only be
+ * called once nothing is going to modify the files of @appdir anymore.
+ *
+ * Returns: %TRUE if @appdir could be walked
+ */
+gboolean
+eam_object_store_link_tree (EamObjectStore *store,
+                            const char *appdir,
+                            EamDigests *digests)
+{
+  LinkTreeData data = { store, digests, 0 };
+
+  gboolean ret = eam_walk (AT_FDCWD, appdir, link_tree_visit, &data);
+
+  eam_log_debug_message ("Linked %" G_GUINT64_FORMAT " files of '%s' to the object store",
+                         data.n_linked, appdir);
+
+  return ret;
+}
+
+/**
+ * eam_object_store_prune:
+ * @prefix: the applications prefix
+ *
+ * Removes the objects of @prefix that are not linked from any
+ * application anymore.
+ *
+ * Returns: %TRUE if the store was pruned, or does not exist
+ */
+gboolean
+eam_object_store_prune (const char *prefix)
+{
+  g_autofree char *objects_dir = g_build_filename (prefix, OBJECTS_SUBDIR, NULL);
+
+  g_autoptr(GDir) dir = g_dir_open (objects_dir, 0, NULL);
+  if (dir == NULL)
+    return TRUE;
+
+  guint64 n_removed = 0;
+  guint64 size_removed = 0;
+  gboolean ret = TRUE;
+
+  const char *fanout;
+  while ((fanout = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *fanout_dir = g_build_filename (objects_dir, fanout, NULL);
+
+    g_autoptr(GDir) subdir = g_dir_open (fanout_dir, 0, NULL);
+    if (subdir == NULL)
+      continue;
+
+    const char *name;
+    while ((name = g_dir_read_name (subdir)) != NULL) {
+      g_autofree char *object = g_build_filename (fanout_dir, name, NULL);
+      struct stat buf;
+
+      if (lstat (object, &buf) < 0 || buf.st_nlink > 1)
+        continue;
+
+      if (unlink (object) < 0) {
+        eam_log_error_message ("Unable to remove object '%s': %s",
+                               object, g_strerror (errno));
+        ret = FALSE;
+        continue;
+      }
+
+      n_removed += 1;
+      size_removed += buf.st_size;
+    }
+  }
+
+  if (n_removed > 0) {
+    g_autofree char *size = g_format_size (size_removed);
+    eam_log_info_message ("Removed %" G_GUINT64_FORMAT " unused objects (%s) from '%s'",
+                          n_removed, size, objects_dir);
+  }
+
+  return ret;
+}
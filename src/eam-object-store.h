@@ -0,0 +1,43 @@
+/* eam-object-store.h: Content-addressed file store
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gio/gio.h>
+
+#include "eam-digests.h"
+
+G_BEGIN_DECLS
+
+typedef struct _EamObjectStore  EamObjectStore;
+
+EamObjectStore *        eam_object_store_new            (const char *prefix);
+void                    eam_object_store_free           (EamObjectStore *store);
+
+gboolean                eam_object_store_link_file      (EamObjectStore *store,
+                                                         const char *path,
+                                                         const char *checksum);
+gboolean                eam_object_store_link_tree      (EamObjectStore *store,
+                                                         const char *appdir,
+                                                         EamDigests *digests);
+
+gboolean                eam_object_store_prune          (const char *prefix);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamObjectStore, eam_object_store_free)
+
+G_END_DECLS
@@ -0,0 +1,274 @@
+/* eam-payload-cache.c: Cache of external payloads
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "eam-payload-cache.h"
+
+#include "eam-config.h"
+#include "eam-log.h"
+
+/* The external payloads of applications are large, and the same
+ * payload is downloaded again whenever its application is reinstalled
+ * or updated; the cache keeps the payloads that passed verification,
+ * so that the next transaction that needs one finds it locally.
+ *
+ * The cache is content addressed: each payload is a file in the
+ * payloads directory of the cache directory, named after its digest,
+ * so identical payloads are only stored once. The modification time
+ * of a payload records its last use, and the least recently used
+ * payloads are evicted first when the cache grows over its size.
+ */
+
+#define PAYLOAD_CACHE_DIR       "payloads"
+
+/* Both SHA-256 and BLAKE3 digests are 32 bytes long */
+#define PAYLOAD_KEY_LENGTH      64
+
+G_LOCK_DEFINE_STATIC (payload_cache);
+
+void
+eam_payload_cache_entry_free (EamPayloadCacheEntry *entry)
+{
+  if (entry == NULL)
+    return;
+
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static char *
+get_cache_dir (void)
+{
+  return g_build_filename (eam_config_get_cache_dir (), PAYLOAD_CACHE_DIR, NULL);
+}
+
+static gboolean
+is_valid_key (const char *key)
+{
+  gsize len = 0;
+
+  while (g_ascii_isxdigit (key[len]) && !g_ascii_isupper (key[len]))
+    len++;
+
+  return len == PAYLOAD_KEY_LENGTH && key[len] == '\0';
+}
+
+/**
+ * eam_payload_cache_get_key:
+ * @digest: the digest of a payload, in hexadecimal
+ *
+ * The digest comes from the bundle, so it is only used as a file name
+ * if it looks like one.
+ *
+ * Returns: (transfer full): the key of the payload, or %NULL if
+ *   @digest is not valid
+ */
+char *
+eam_payload_cache_get_key (const char *digest)
+{
+  gsize len = 0;
+
+  while (g_ascii_isxdigit (digest[len]))
+    len++;
+
+  if (len < PAYLOAD_KEY_LENGTH)
+    return NULL;
+
+  return g_ascii_strdown (digest, PAYLOAD_KEY_LENGTH);
+}
+
+/**
+ * eam_payload_cache_lookup:
+ * @key: the key of a payload
+ *
+ * Looks for a payload in the cache, and marks it as used.
+ *
+ * Returns: (transfer full): the path of the payload, or %NULL if it is
+ *   not in the cache
+ */
+char *
+eam_payload_cache_lookup (const char *key)
+{
+  g_return_val_if_fail (is_valid_key (key), NULL);
+
+  g_autofree char *dir = get_cache_dir ();
+  g_autofree char *path = g_build_filename (dir, key, NULL);
+
+  /* Updating the time also tells whether the payload is there */
+  if (utimensat (AT_FDCWD, path, NULL, 0) < 0)
+    return NULL;
+
+  return g_steal_pointer (&path);
+}
+
+/**
+ * eam_payload_cache_add:
+ * @key: the key of a payload
+ * @path: the path of the payload, on the same file system as the
+ *   cache directory
+ *
+ * Moves a verified payload into the cache.
+ *
+ * Returns: (transfer full): the new path of the payload, or %NULL on
+ *   error
+ */
+char *
+eam_payload_cache_add (const char *key,
+                       const char *path)
+{
+  g_return_val_if_fail (is_valid_key (key), NULL);
+
+  g_autofree char *dir = get_cache_dir ();
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    eam_log_error_message ("Could not create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  g_autofree char *cache_path = g_build_filename (dir, key, NULL);
+
+  /* Another transaction may be reading the payload we replace, but it
+   * keeps reading the old copy, which has the same contents
+   */
+  if (g_rename (path, cache_path) < 0) {
+    eam_log_error_message ("Could not move %s to %s: %s", path, cache_path, g_strerror (errno));
+    return NULL;
+  }
+
+  (void) utimensat (AT_FDCWD, cache_path, NULL, 0);
+
+  return g_steal_pointer (&cache_path);
+}
+
+/**
+ * eam_payload_cache_remove:
+ * @key: the key of a payload
+ *
+ * Removes a payload from the cache.
+ *
+ * Returns: %TRUE if the payload is not in the cache anymore
+ */
+gboolean
+eam_payload_cache_remove (const char *key)
+{
+  g_return_val_if_fail (is_valid_key (key), FALSE);
+
+  g_autofree char *dir = get_cache_dir ();
+  g_autofree char *path = g_build_filename (dir, key, NULL);
+
+  return g_unlink (path) == 0 || errno == ENOENT;
+}
+
+static int
+compare_entries_by_use (gconstpointer a,
+                        gconstpointer b)
+{
+  const EamPayloadCacheEntry *entry_a = *(EamPayloadCacheEntry **) a;
+  const EamPayloadCacheEntry *entry_b = *(EamPayloadCacheEntry **) b;
+
+  if (entry_a->last_used != entry_b->last_used)
+    return entry_a->last_used > entry_b->last_used ? -1 : 1;
+
+  return strcmp (entry_a->key, entry_b->key);
+}
+
+/**
+ * eam_payload_cache_list:
+ *
+ * Returns: (transfer full) (element-type EamPayloadCacheEntry): the
+ *   payloads in the cache, from the most to the least recently used
+ */
+GPtrArray *
+eam_payload_cache_list (void)
+{
+  GPtrArray *entries = g_ptr_array_new_with_free_func ((GDestroyNotify) eam_payload_cache_entry_free);
+
+  g_autofree char *dir = get_cache_dir ();
+  g_autoptr(GDir) dp = g_dir_open (dir, 0, NULL);
+  if (dp == NULL)
+    return entries;
+
+  const char *name;
+  while ((name = g_dir_read_name (dp)) != NULL) {
+    if (!is_valid_key (name))
+      continue;
+
+    g_autofree char *path = g_build_filename (dir, name, NULL);
+    GStatBuf buf;
+
+    if (g_lstat (path, &buf) < 0 || !S_ISREG (buf.st_mode))
+      continue;
+
+    EamPayloadCacheEntry *entry = g_new0 (EamPayloadCacheEntry, 1);
+    entry->key = g_strdup (name);
+    entry->size = buf.st_size;
+    entry->last_used = buf.st_mtime;
+
+    g_ptr_array_add (entries, entry);
+  }
+
+  g_ptr_array_sort (entries, compare_entries_by_use);
+
+  return entries;
+}
+
+/**
+ * eam_payload_cache_prune:
+ * @max_size: the size the cache must fit in, in bytes
+ *
+ * Evicts the least recently used payloads until the cache fits in
+ * @max_size; with a @max_size of 0, the cache is emptied.
+ *
+ * Returns: the number of bytes that were freed
+ */
+guint64
+eam_payload_cache_prune (guint64 max_size)
+{
+  G_LOCK (payload_cache);
+
+  g_autoptr(GPtrArray) entries = eam_payload_cache_list ();
+  guint64 total = 0;
+  guint64 freed = 0;
+
+  for (guint i = 0; i < entries->len; i++) {
+    EamPayloadCacheEntry *entry = g_ptr_array_index (entries, i);
+
+    total += entry->size;
+    if (total <= max_size)
+      continue;
+
+    if (!eam_payload_cache_remove (entry->key)) {
+      eam_log_error_message ("Could not evict payload %s: %s", entry->key, g_strerror (errno));
+      continue;
+    }
+
+    eam_log_info_message ("Evicted payload %s from the cache", entry->key);
+    freed += entry->size;
+  }
+
+  G_UNLOCK (payload_cache);
+
+  return freed;
+}
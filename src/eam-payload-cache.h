@@ -0,0 +1,52 @@
+/* eam-payload-cache.h: Cache of external payloads
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EamPayloadCacheEntry:
+ * @key: the key of the payload
+ * @size: the size of the payload, in bytes
+ * @last_used: the last time the payload was stored or used, in
+ *   seconds since the Epoch
+ *
+ * A payload in the cache.
+ */
+typedef struct {
+  char *key;
+  goffset size;
+  gint64 last_used;
+} EamPayloadCacheEntry;
+
+void            eam_payload_cache_entry_free    (EamPayloadCacheEntry *entry);
+
+char *          eam_payload_cache_get_key       (const char *digest);
+char *          eam_payload_cache_lookup        (const char *key);
+char *          eam_payload_cache_add           (const char *key,
+                                                 const char *path);
+gboolean        eam_payload_cache_remove        (const char *key);
+GPtrArray *     eam_payload_cache_list          (void);
+guint64         eam_payload_cache_prune         (guint64 max_size);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamPayloadCacheEntry, eam_payload_cache_entry_free)
+
+G_END_DECLS
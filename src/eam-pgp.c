@@ -0,0 +1,1185 @@
+/* eam-pgp.c: In-process OpenPGP signature verification
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GCRYPT
+#include <gcrypt.h>
+#endif
+
+#include "eam-pgp.h"
+
+#include "eam-log.h"
+
+/* The verifier checks detached signatures against the keyring without
+ * running gpgv, so that verifying a bundle costs little more than
+ * hashing it.
+ *
+ * Only the common case is handled here: a single version 4 signature
+ * of binary data, made with an RSA key of the keyring, which is
+ * expected to be a plain OpenPGP keyring, not a keybox. Anything else,
+ * including signatures made by keys with a revocation certificate,
+ * makes eam_pgp_verifier_new() return %NULL, and the caller falls back
+ * to gpgv, which knows the rest of OpenPGP.
+ *
+ * A primary key is only trusted if it carries a valid self-signature,
+ * and a subkey if it carries a valid binding signature from its
+ * primary key, with the signing flag, and a valid back-signature from
+ * the subkey itself. The key expiration times, and the expiration
+ * times of these signatures and of the signature being verified, are
+ * enforced; expired keys and signatures are left to gpgv as well.
+ *
+ * The keyring is parsed once, and kept around until the file changes.
+ */
+
+#ifdef HAVE_GCRYPT
+
+#define PGP_TAG_SIGNATURE            2
+#define PGP_TAG_PUBLIC_KEY           6
+#define PGP_TAG_TRUST                12
+#define PGP_TAG_USER_ID              13
+#define PGP_TAG_PUBLIC_SUBKEY        14
+
+#define PGP_SIG_BINARY               0x00
+#define PGP_SIG_CERT_GENERIC         0x10
+#define PGP_SIG_CERT_POSITIVE        0x13
+#define PGP_SIG_SUBKEY_BINDING       0x18
+#define PGP_SIG_PRIMARY_BINDING      0x19
+#define PGP_SIG_DIRECT_KEY           0x1f
+#define PGP_SIG_KEY_REVOCATION       0x20
+#define PGP_SIG_SUBKEY_REVOCATION    0x28
+#define PGP_SIG_CERT_REVOCATION      0x30
+
+#define PGP_SUBPACKET_CREATION_TIME  2
+#define PGP_SUBPACKET_SIG_EXPIRATION 3
+#define PGP_SUBPACKET_KEY_EXPIRATION 9
+#define PGP_SUBPACKET_PREF_SYMMETRIC 11
+#define PGP_SUBPACKET_ISSUER         16
+#define PGP_SUBPACKET_PREF_HASH      21
+#define PGP_SUBPACKET_PREF_COMPRESS  22
+#define PGP_SUBPACKET_KEYSERVER_PREF 23
+#define PGP_SUBPACKET_PRIMARY_UID    25
+#define PGP_SUBPACKET_KEY_FLAGS      27
+#define PGP_SUBPACKET_FEATURES       30
+#define PGP_SUBPACKET_EMBEDDED_SIG   32
+#define PGP_SUBPACKET_ISSUER_FPR     33
+#define PGP_SUBPACKET_CRITICAL       0x80
+
+#define PGP_KEY_FLAG_SIGN            0x02
+
+#define PGP_PK_RSA                   1
+#define PGP_PK_RSA_SIGN              3
+
+#define ARMOR_BEGIN                  "-----BEGIN PGP SIGNATURE-----"
+#define ARMOR_END                    "-----END PGP SIGNATURE-----"
+
+static const struct {
+  guint8 pgp_algo;
+  int md_algo;
+  const char *name;
+} hash_algos[] = {
+  { 2, GCRY_MD_SHA1, "sha1" },
+  { 8, GCRY_MD_SHA256, "sha256" },
+  { 9, GCRY_MD_SHA384, "sha384" },
+  { 10, GCRY_MD_SHA512, "sha512" },
+  { 11, GCRY_MD_SHA224, "sha224" },
+};
+
+typedef struct {
+  guint64 keyid;
+  gcry_sexp_t key;
+  gboolean revoked;
+
+  /* Creation and expiration times, in seconds since the epoch; the
+   * expiration time is 0 if the key never expires
+   */
+  guint32 created;
+  guint32 expires;
+} PgpKey;
+
+/* A version 4 signature; the pointers refer to the packet it was
+ * parsed from
+ */
+typedef struct {
+  guint8 type;
+  int md_algo;
+  const char *md_name;
+
+  /* The part of the signature packet covered by the hash */
+  const guint8 *hashed;
+  gsize hashed_len;
+
+  guint8 left16[2];
+  gcry_sexp_t sig;
+
+  guint64 issuer;
+  guint32 created;
+
+  /* From the hashed subpackets only; 0 if they are absent */
+  guint32 expires_after;
+  guint32 key_expires_after;
+  gboolean has_key_flags;
+  guint8 key_flags;
+
+  /* The primary key binding signature, in a subkey binding signature */
+  const guint8 *embedded;
+  gsize embedded_len;
+} PgpSignature;
+
+typedef struct {
+  guint tag;
+  const guint8 *body;
+  gsize len;
+} PgpPacket;
+
+typedef struct {
+  volatile gint ref_count;
+
+  /* The key id of each key and subkey, to its PgpKey */
+  GHashTable *keys;
+} PgpKeyring;
+
+struct _EamPgpVerifier {
+  PgpKeyring *keyring;
+  PgpKey *key;
+
+  gcry_md_hd_t md;
+
+  /* The signature packet, and the signature parsed from it */
+  guint8 *packet;
+  PgpSignature sig;
+};
+
+G_LOCK_DEFINE_STATIC (keyring_cache);
+static PgpKeyring *cached_keyring;
+static char *cached_path;
+static struct stat cached_stat;
+
+static gboolean
+gcrypt_init (void)
+{
+  static gsize initialized = 0;
+  static gboolean usable = FALSE;
+
+  if (g_once_init_enter (&initialized)) {
+    if (gcry_control (GCRYCTL_INITIALIZATION_FINISHED_P)) {
+      usable = TRUE;
+    }
+    else if (gcry_check_version (GCRYPT_VERSION) != NULL) {
+      /* We only ever handle public keys */
+      gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+      gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+      usable = TRUE;
+    }
+
+    g_once_init_leave (&initialized, 1);
+  }
+
+  return usable;
+}
+
+static guint32
+read_be32 (const guint8 *p)
+{
+  return ((guint32) p[0] << 24) |
+         ((guint32) p[1] << 16) |
+         ((guint32) p[2] << 8) |
+         (guint32) p[3];
+}
+
+static guint64
+read_be64 (const guint8 *p)
+{
+  return ((guint64) read_be32 (p) << 32) | read_be32 (p + 4);
+}
+
+/* Reads the next packet of @data; partial body lengths, which are
+ * only used for streamed data, are not supported
+ */
+static gboolean
+packet_next (const guint8 **data,
+             const guint8 *end,
+             guint *tag,
+             const guint8 **body,
+             gsize *body_len)
+{
+  const guint8 *p = *data;
+  gsize len;
+
+  if (p >= end || (*p & 0x80) == 0)
+    return FALSE;
+
+  guint8 header = *p++;
+
+  if ((header & 0x40) != 0) {
+    *tag = header & 0x3f;
+
+    if (p >= end)
+      return FALSE;
+
+    if (p[0] < 192) {
+      len = p[0];
+      p += 1;
+    }
+    else if (p[0] < 224) {
+      if (end - p < 2)
+        return FALSE;
+      len = ((p[0] - 192) << 8) + p[1] + 192;
+      p += 2;
+    }
+    else if (p[0] == 255) {
+      if (end - p < 5)
+        return FALSE;
+      len = read_be32 (p + 1);
+      p += 5;
+    }
+    else {
+      return FALSE;
+    }
+  }
+  else {
+    *tag = (header >> 2) & 0x0f;
+
+    switch (header & 0x03) {
+    case 0:
+      if (end - p < 1)
+        return FALSE;
+      len = p[0];
+      p += 1;
+      break;
+    case 1:
+      if (end - p < 2)
+        return FALSE;
+      len = (p[0] << 8) | p[1];
+      p += 2;
+      break;
+    case 2:
+      if (end - p < 4)
+        return FALSE;
+      len = read_be32 (p);
+      p += 4;
+      break;
+    default:
+      len = end - p;
+      break;
+    }
+  }
+
+  if ((gsize) (end - p) < len)
+    return FALSE;
+
+  *body = p;
+  *body_len = len;
+  *data = p + len;
+
+  return TRUE;
+}
+
+static gboolean
+read_mpi (const guint8 **data,
+          const guint8 *end,
+          gcry_mpi_t *mpi)
+{
+  const guint8 *p = *data;
+
+  if (end - p < 2)
+    return FALSE;
+
+  gsize n_bytes = (((p[0] << 8) | p[1]) + 7) / 8;
+  p += 2;
+
+  if ((gsize) (end - p) < n_bytes)
+    return FALSE;
+
+  if (gcry_mpi_scan (mpi, GCRYMPI_FMT_USG, p, n_bytes, NULL) != 0)
+    return FALSE;
+
+  *data = p + n_bytes;
+
+  return TRUE;
+}
+
+static void
+pgp_key_free (PgpKey *key)
+{
+  gcry_sexp_release (key->key);
+  g_free (key);
+}
+
+/* Returns %NULL for keys we cannot verify signatures with */
+static PgpKey *
+pgp_key_new (const guint8 *body,
+             gsize len)
+{
+  /* Version, creation time, algorithm */
+  if (len < 6 || body[0] != 4)
+    return NULL;
+
+  if (body[5] != PGP_PK_RSA && body[5] != PGP_PK_RSA_SIGN)
+    return NULL;
+
+  const guint8 *p = body + 6;
+  const guint8 *end = body + len;
+  gcry_mpi_t n = NULL, e = NULL;
+
+  if (!read_mpi (&p, end, &n) || !read_mpi (&p, end, &e)) {
+    gcry_mpi_release (n);
+    return NULL;
+  }
+
+  gcry_sexp_t sexp = NULL;
+  gcry_error_t err = gcry_sexp_build (&sexp, NULL, "(public-key (rsa (n %m) (e %m)))", n, e);
+
+  gcry_mpi_release (n);
+  gcry_mpi_release (e);
+
+  if (err != 0)
+    return NULL;
+
+  /* The key id is the tail of the fingerprint */
+  guint8 prefix[3] = { 0x99, (len >> 8) & 0xff, len & 0xff };
+  guint8 fingerprint[20];
+  gcry_md_hd_t md;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0) != 0) {
+    gcry_sexp_release (sexp);
+    return NULL;
+  }
+
+  gcry_md_write (md, prefix, sizeof (prefix));
+  gcry_md_write (md, body, len);
+  memcpy (fingerprint, gcry_md_read (md, GCRY_MD_SHA1), sizeof (fingerprint));
+  gcry_md_close (md);
+
+  PgpKey *key = g_new0 (PgpKey, 1);
+  key->keyid = read_be64 (fingerprint + 12);
+  key->key = sexp;
+  key->created = read_be32 (body + 1);
+
+  return key;
+}
+
+/* Returns the earliest of two expiration times, where 0 means never */
+static guint32
+expiration_min (guint32 a,
+                guint32 b)
+{
+  if (a == 0)
+    return b;
+
+  if (b == 0)
+    return a;
+
+  return MIN (a, b);
+}
+
+static gboolean
+is_expired (guint32 expires)
+{
+  return expires != 0 && (gint64) expires <= g_get_real_time () / G_USEC_PER_SEC;
+}
+
+static int
+signature_get_type (const guint8 *body,
+                    gsize len)
+{
+  if (len >= 2 && body[0] == 4)
+    return body[1];
+
+  if (len >= 3 && body[0] == 3)
+    return body[2];
+
+  return -1;
+}
+
+static void
+signature_clear (PgpSignature *sig)
+{
+  gcry_sexp_release (sig->sig);
+  sig->sig = NULL;
+}
+
+/* Subpackets we can ignore even when they are marked as critical */
+static gboolean
+subpacket_is_harmless (guint8 type)
+{
+  switch (type) {
+  case PGP_SUBPACKET_CREATION_TIME:
+  case PGP_SUBPACKET_PREF_SYMMETRIC:
+  case PGP_SUBPACKET_PREF_HASH:
+  case PGP_SUBPACKET_PREF_COMPRESS:
+  case PGP_SUBPACKET_KEYSERVER_PREF:
+  case PGP_SUBPACKET_PRIMARY_UID:
+  case PGP_SUBPACKET_FEATURES:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+static gboolean
+signature_parse_subpackets (PgpSignature *sig,
+                            const guint8 *subpackets,
+                            gsize len,
+                            gboolean hashed)
+{
+  const guint8 *p = subpackets;
+  const guint8 *end = subpackets + len;
+
+  while (p < end) {
+    gsize sub_len;
+
+    if (p[0] < 192) {
+      sub_len = p[0];
+      p += 1;
+    }
+    else if (p[0] < 255) {
+      if (end - p < 2)
+        return FALSE;
+      sub_len = ((p[0] - 192) << 8) + p[1] + 192;
+      p += 2;
+    }
+    else {
+      if (end - p < 5)
+        return FALSE;
+      sub_len = read_be32 (p + 1);
+      p += 5;
+    }
+
+    if (sub_len == 0 || (gsize) (end - p) < sub_len)
+      return FALSE;
+
+    guint8 type = p[0] & ~PGP_SUBPACKET_CRITICAL;
+    gboolean critical = (p[0] & PGP_SUBPACKET_CRITICAL) != 0;
+
+    /* The issuer only selects the key; a wrong one fails to verify */
+    if (type == PGP_SUBPACKET_ISSUER && sub_len == 9) {
+      if (sig->issuer == 0)
+        sig->issuer = read_be64 (p + 1);
+    }
+    else if (type == PGP_SUBPACKET_ISSUER_FPR && sub_len == 22 && p[1] == 4) {
+      if (sig->issuer == 0)
+        sig->issuer = read_be64 (p + 14);
+    }
+    else if (type == PGP_SUBPACKET_EMBEDDED_SIG && sub_len > 1) {
+      sig->embedded = p + 1;
+      sig->embedded_len = sub_len - 1;
+    }
+    else if (!hashed) {
+      /* Anything else is only trusted from the hashed area */
+    }
+    else if (type == PGP_SUBPACKET_CREATION_TIME && sub_len == 5) {
+      sig->created = read_be32 (p + 1);
+    }
+    else if (type == PGP_SUBPACKET_SIG_EXPIRATION && sub_len == 5) {
+      sig->expires_after = read_be32 (p + 1);
+    }
+    else if (type == PGP_SUBPACKET_KEY_EXPIRATION && sub_len == 5) {
+      sig->key_expires_after = read_be32 (p + 1);
+    }
+    else if (type == PGP_SUBPACKET_KEY_FLAGS) {
+      sig->has_key_flags = TRUE;
+      sig->key_flags = sub_len > 1 ? p[1] : 0;
+    }
+    else if (critical && !subpacket_is_harmless (type)) {
+      return FALSE;
+    }
+
+    p += sub_len;
+  }
+
+  return TRUE;
+}
+
+/* Parses a version 4 RSA signature; the packet must outlive @sig */
+static gboolean
+signature_parse (PgpSignature *sig,
+                 const guint8 *body,
+                 gsize len)
+{
+  const guint8 *end = body + len;
+
+  memset (sig, 0, sizeof (PgpSignature));
+
+  /* Version, type, public key and hash algorithms, hashed length */
+  if (len < 6 || body[0] != 4)
+    return FALSE;
+
+  sig->type = body[1];
+
+  if (body[2] != PGP_PK_RSA && body[2] != PGP_PK_RSA_SIGN)
+    return FALSE;
+
+  for (guint i = 0; i < G_N_ELEMENTS (hash_algos); i++) {
+    if (hash_algos[i].pgp_algo == body[3]) {
+      sig->md_algo = hash_algos[i].md_algo;
+      sig->md_name = hash_algos[i].name;
+    }
+  }
+
+  if (sig->md_name == NULL)
+    return FALSE;
+
+  gsize hashed_len = (body[4] << 8) | body[5];
+  const guint8 *p = body + 6;
+
+  if ((gsize) (end - p) < hashed_len + 2)
+    return FALSE;
+
+  if (!signature_parse_subpackets (sig, p, hashed_len, TRUE))
+    return FALSE;
+
+  sig->hashed = body;
+  sig->hashed_len = 6 + hashed_len;
+
+  p += hashed_len;
+
+  gsize unhashed_len = (p[0] << 8) | p[1];
+  p += 2;
+
+  if ((gsize) (end - p) < unhashed_len + 2)
+    return FALSE;
+
+  if (!signature_parse_subpackets (sig, p, unhashed_len, FALSE))
+    return FALSE;
+
+  p += unhashed_len;
+
+  sig->left16[0] = p[0];
+  sig->left16[1] = p[1];
+  p += 2;
+
+  gcry_mpi_t s = NULL;
+  if (!read_mpi (&p, end, &s))
+    return FALSE;
+
+  gcry_error_t err = gcry_sexp_build (&sig->sig, NULL, "(sig-val (rsa (s %m)))", s);
+  gcry_mpi_release (s);
+
+  return err == 0;
+}
+
+static gboolean
+signature_is_expired (const PgpSignature *sig)
+{
+  return sig->expires_after != 0 &&
+         is_expired (sig->created + sig->expires_after);
+}
+
+/* Completes the hash of the signed data in @md with the signature
+ * fields, and checks the signature against @key
+ */
+static gboolean
+signature_check (const PgpSignature *sig,
+                 gcry_md_hd_t md,
+                 gcry_sexp_t key,
+                 const char **error_message)
+{
+  guint8 trailer[6] = {
+    0x04, 0xff,
+    (sig->hashed_len >> 24) & 0xff,
+    (sig->hashed_len >> 16) & 0xff,
+    (sig->hashed_len >> 8) & 0xff,
+    sig->hashed_len & 0xff,
+  };
+
+  gcry_md_write (md, sig->hashed, sig->hashed_len);
+  gcry_md_write (md, trailer, sizeof (trailer));
+
+  const guint8 *digest = gcry_md_read (md, sig->md_algo);
+  gsize digest_len = gcry_md_get_algo_dlen (sig->md_algo);
+
+  if (digest[0] != sig->left16[0] || digest[1] != sig->left16[1]) {
+    *error_message = "digest mismatch";
+    return FALSE;
+  }
+
+  gcry_sexp_t hash = NULL;
+  if (gcry_sexp_build (&hash, NULL, "(data (flags pkcs1) (hash %s %b))",
+                       sig->md_name, (int) digest_len, digest) != 0) {
+    *error_message = "invalid digest";
+    return FALSE;
+  }
+
+  gcry_error_t err = gcry_pk_verify (sig->sig, hash, key);
+  gcry_sexp_release (hash);
+
+  if (err != 0) {
+    *error_message = gcry_strerror (err);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+md_write_key (gcry_md_hd_t md,
+              const PgpPacket *packet)
+{
+  guint8 prefix[3] = { 0x99, (packet->len >> 8) & 0xff, packet->len & 0xff };
+
+  gcry_md_write (md, prefix, sizeof (prefix));
+  gcry_md_write (md, packet->body, packet->len);
+}
+
+static void
+md_write_user_id (gcry_md_hd_t md,
+                  const PgpPacket *packet)
+{
+  guint8 prefix[5] = {
+    0xb4,
+    (packet->len >> 24) & 0xff,
+    (packet->len >> 16) & 0xff,
+    (packet->len >> 8) & 0xff,
+    packet->len & 0xff,
+  };
+
+  gcry_md_write (md, prefix, sizeof (prefix));
+  gcry_md_write (md, packet->body, packet->len);
+}
+
+/* Checks a signature over the primary key and, if not %NULL, the user
+ * id or subkey @component, made by @signer
+ */
+static gboolean
+key_signature_check (const PgpSignature *sig,
+                     const PgpKey *signer,
+                     const PgpPacket *primary,
+                     const PgpPacket *component)
+{
+  gcry_md_hd_t md;
+
+  if (gcry_md_open (&md, sig->md_algo, 0) != 0)
+    return FALSE;
+
+  md_write_key (md, primary);
+
+  if (component != NULL && component->tag == PGP_TAG_USER_ID)
+    md_write_user_id (md, component);
+  else if (component != NULL)
+    md_write_key (md, component);
+
+  const char *error_message = NULL;
+  gboolean res = signature_check (sig, md, signer->key, &error_message);
+
+  gcry_md_close (md);
+
+  return res;
+}
+
+/* Checks that a binding signature makes @subkey a signing subkey of
+ * @primary; the subkey must also sign the binding back
+ */
+static gboolean
+subkey_binding_check (const PgpSignature *sig,
+                      const PgpKey *primary_key,
+                      const PgpKey *subkey,
+                      const PgpPacket *primary,
+                      const PgpPacket *component)
+{
+  if (!sig->has_key_flags || (sig->key_flags & PGP_KEY_FLAG_SIGN) == 0 ||
+      sig->embedded == NULL)
+    return FALSE;
+
+  if (!key_signature_check (sig, primary_key, primary, component))
+    return FALSE;
+
+  PgpSignature backsig;
+  gboolean res =
+    signature_parse (&backsig, sig->embedded, sig->embedded_len) &&
+    backsig.type == PGP_SIG_PRIMARY_BINDING &&
+    !signature_is_expired (&backsig) &&
+    key_signature_check (&backsig, subkey, primary, component);
+
+  signature_clear (&backsig);
+
+  return res;
+}
+
+/* Adds the usable keys of the block of packets for a primary key */
+static void
+keyring_add_block (PgpKeyring *keyring,
+                   GArray *block)
+{
+  if (block->len == 0)
+    return;
+
+  const PgpPacket *primary = &g_array_index (block, PgpPacket, 0);
+  PgpKey *primary_key = pgp_key_new (primary->body, primary->len);
+
+  /* Without the primary key, no binding can be checked */
+  if (primary_key == NULL)
+    return;
+
+  g_autoptr(GPtrArray) subkeys = g_ptr_array_new ();
+
+  /* The most recent valid self-signature of the primary key */
+  PgpSignature self_sig = { 0, };
+  gboolean has_self_sig = FALSE;
+  gboolean revoked = FALSE;
+
+  /* The user id or subkey the next signatures apply to */
+  const PgpPacket *component = NULL;
+  PgpKey *subkey = NULL;
+  gboolean has_binding = FALSE;
+  guint32 binding_created = 0;
+
+  for (guint i = 1; i <= block->len; i++) {
+    const PgpPacket *packet = i < block->len ? &g_array_index (block, PgpPacket, i) : NULL;
+
+    /* GnuPG keeps its own trust information between the packets */
+    if (packet != NULL && packet->tag == PGP_TAG_TRUST)
+      continue;
+
+    /* The previous subkey is complete */
+    if (subkey != NULL && (packet == NULL || packet->tag != PGP_TAG_SIGNATURE)) {
+      if (has_binding && !subkey->revoked)
+        g_ptr_array_add (subkeys, subkey);
+      else
+        pgp_key_free (subkey);
+
+      subkey = NULL;
+    }
+
+    if (packet == NULL)
+      break;
+
+    if (packet->tag == PGP_TAG_USER_ID) {
+      component = packet;
+      continue;
+    }
+
+    if (packet->tag == PGP_TAG_PUBLIC_SUBKEY) {
+      component = packet;
+      subkey = pgp_key_new (packet->body, packet->len);
+      has_binding = FALSE;
+      binding_created = 0;
+      continue;
+    }
+
+    if (packet->tag != PGP_TAG_SIGNATURE) {
+      component = NULL;
+      continue;
+    }
+
+    /* We do not check revocation certificates, we just leave the keys
+     * they apply to to gpgv
+     */
+    int type = signature_get_type (packet->body, packet->len);
+
+    if (type == PGP_SIG_KEY_REVOCATION) {
+      revoked = TRUE;
+      continue;
+    }
+
+    if (type == PGP_SIG_SUBKEY_REVOCATION) {
+      if (subkey != NULL)
+        subkey->revoked = TRUE;
+      continue;
+    }
+
+    /* A user id with a revoked certification does not count */
+    if (type == PGP_SIG_CERT_REVOCATION) {
+      if (component != NULL && component->tag == PGP_TAG_USER_ID)
+        component = NULL;
+      continue;
+    }
+
+    PgpSignature sig;
+    if (!signature_parse (&sig, packet->body, packet->len) ||
+        sig.issuer != primary_key->keyid ||
+        signature_is_expired (&sig)) {
+      signature_clear (&sig);
+      continue;
+    }
+
+    gboolean is_self_sig =
+      (type == PGP_SIG_DIRECT_KEY && component == NULL) ||
+      (type >= PGP_SIG_CERT_GENERIC && type <= PGP_SIG_CERT_POSITIVE &&
+       component != NULL && component->tag == PGP_TAG_USER_ID);
+
+    if (is_self_sig &&
+        (!has_self_sig || sig.created >= self_sig.created) &&
+        key_signature_check (&sig, primary_key, primary, component)) {
+      signature_clear (&self_sig);
+      self_sig = sig;
+      has_self_sig = TRUE;
+      continue;
+    }
+
+    if (type == PGP_SIG_SUBKEY_BINDING && subkey != NULL &&
+        (!has_binding || sig.created >= binding_created) &&
+        subkey_binding_check (&sig, primary_key, subkey, primary, component)) {
+      has_binding = TRUE;
+      binding_created = sig.created;
+      subkey->expires = 0;
+      if (sig.key_expires_after != 0)
+        subkey->expires = subkey->created + sig.key_expires_after;
+      if (sig.expires_after != 0)
+        subkey->expires = expiration_min (subkey->expires, sig.created + sig.expires_after);
+    }
+
+    signature_clear (&sig);
+  }
+
+  /* A key without a valid self-signature is not usable at all */
+  if (!has_self_sig) {
+    g_ptr_array_foreach (subkeys, (GFunc) pgp_key_free, NULL);
+    pgp_key_free (primary_key);
+    return;
+  }
+
+  if (self_sig.key_expires_after != 0)
+    primary_key->expires = primary_key->created + self_sig.key_expires_after;
+  if (self_sig.expires_after != 0)
+    primary_key->expires = expiration_min (primary_key->expires,
+                                           self_sig.created + self_sig.expires_after);
+
+  /* The subkeys cannot outlive their primary key */
+  for (guint i = 0; i < subkeys->len; i++) {
+    PgpKey *key = g_ptr_array_index (subkeys, i);
+
+    key->revoked = revoked;
+    key->expires = expiration_min (key->expires, primary_key->expires);
+    g_hash_table_replace (keyring->keys, &key->keyid, key);
+  }
+
+  /* The primary key may be restricted to certifications */
+  if (!self_sig.has_key_flags || (self_sig.key_flags & PGP_KEY_FLAG_SIGN) != 0) {
+    primary_key->revoked = revoked;
+    g_hash_table_replace (keyring->keys, &primary_key->keyid, primary_key);
+  }
+  else {
+    pgp_key_free (primary_key);
+  }
+
+  signature_clear (&self_sig);
+}
+
+static PgpKeyring *
+keyring_ref (PgpKeyring *keyring)
+{
+  g_atomic_int_inc (&keyring->ref_count);
+
+  return keyring;
+}
+
+static void
+keyring_unref (PgpKeyring *keyring)
+{
+  if (!g_atomic_int_dec_and_test (&keyring->ref_count))
+    return;
+
+  g_hash_table_unref (keyring->keys);
+  g_free (keyring);
+}
+
+static PgpKeyring *
+keyring_load (const char *path)
+{
+  g_autofree char *contents = NULL;
+  gsize len;
+  g_autoptr(GError) error = NULL;
+
+  if (!g_file_get_contents (path, &contents, &len, &error)) {
+    eam_log_error_message ("Unable to load keyring: %s", error->message);
+    return NULL;
+  }
+
+  PgpKeyring *keyring = g_new0 (PgpKeyring, 1);
+  keyring->ref_count = 1;
+  keyring->keys = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                         NULL, (GDestroyNotify) pgp_key_free);
+
+  const guint8 *p = (const guint8 *) contents;
+  const guint8 *end = p + len;
+
+  /* The packets of the primary key being parsed, starting with it */
+  g_autoptr(GArray) block = g_array_new (FALSE, FALSE, sizeof (PgpPacket));
+
+  while (p < end) {
+    PgpPacket packet;
+
+    if (!packet_next (&p, end, &packet.tag, &packet.body, &packet.len)) {
+      eam_log_debug_message ("Keyring '%s' is not a plain OpenPGP keyring", path);
+      keyring_unref (keyring);
+      return NULL;
+    }
+
+    if (packet.tag == PGP_TAG_PUBLIC_KEY) {
+      keyring_add_block (keyring, block);
+      g_array_set_size (block, 0);
+    }
+
+    /* Anything before the first primary key is ignored */
+    if (packet.tag == PGP_TAG_PUBLIC_KEY || block->len > 0)
+      g_array_append_val (block, packet);
+  }
+
+  keyring_add_block (keyring, block);
+
+  return keyring;
+}
+
+/* Returns the parsed keyring, reloading it if the file changed */
+static PgpKeyring *
+keyring_get (const char *path)
+{
+  struct stat buf;
+
+  if (stat (path, &buf) < 0)
+    return NULL;
+
+  G_LOCK (keyring_cache);
+
+  if (cached_keyring != NULL &&
+      g_strcmp0 (cached_path, path) == 0 &&
+      cached_stat.st_dev == buf.st_dev &&
+      cached_stat.st_ino == buf.st_ino &&
+      cached_stat.st_size == buf.st_size &&
+      cached_stat.st_mtim.tv_sec == buf.st_mtim.tv_sec &&
+      cached_stat.st_mtim.tv_nsec == buf.st_mtim.tv_nsec) {
+    PgpKeyring *keyring = keyring_ref (cached_keyring);
+    G_UNLOCK (keyring_cache);
+    return keyring;
+  }
+
+  g_clear_pointer (&cached_keyring, keyring_unref);
+  g_free (cached_path);
+
+  cached_keyring = keyring_load (path);
+  cached_path = g_strdup (path);
+  cached_stat = buf;
+
+  if (cached_keyring != NULL)
+    eam_log_info_message ("Loaded %u keys from keyring '%s'",
+                          g_hash_table_size (cached_keyring->keys), path);
+
+  PgpKeyring *keyring = cached_keyring != NULL ? keyring_ref (cached_keyring) : NULL;
+
+  G_UNLOCK (keyring_cache);
+
+  return keyring;
+}
+
+/* Returns the binary form of an armored signature */
+static guint8 *
+signature_dearmor (const char *contents,
+                   gsize *len)
+{
+  const char *begin = strstr (contents, ARMOR_BEGIN);
+  if (begin == NULL)
+    return NULL;
+
+  g_auto(GStrv) lines = g_strsplit (begin, "\n", -1);
+  g_autoptr(GString) base64 = g_string_new (NULL);
+  gboolean in_headers = TRUE;
+
+  for (guint i = 1; lines[i] != NULL; i++) {
+    char *line = g_strstrip (lines[i]);
+
+    if (in_headers) {
+      if (*line == '\0')
+        in_headers = FALSE;
+      else if (strchr (line, ':') == NULL)
+        return NULL;
+      continue;
+    }
+
+    /* The CRC24 of the data; the signature speaks for itself */
+    if (*line == '=' || g_str_has_prefix (line, ARMOR_END))
+      break;
+
+    g_string_append (base64, line);
+  }
+
+  if (base64->len == 0)
+    return NULL;
+
+  return g_base64_decode (base64->str, len);
+}
+
+/**
+ * eam_pgp_verifier_new:
+ * @keyring_file: the path of the keyring
+ * @signature_file: the path of a detached signature
+ *
+ * Returns: (transfer full): a new #EamPgpVerifier, or %NULL if the
+ *   signature cannot be verified in process, and gpgv should be used
+ */
+EamPgpVerifier *
+eam_pgp_verifier_new (const char *keyring_file,
+                      const char *signature_file)
+{
+  if (!gcrypt_init ())
+    return NULL;
+
+  g_autofree char *contents = NULL;
+  gsize len;
+
+  if (!g_file_get_contents (signature_file, &contents, &len, NULL))
+    return NULL;
+
+  g_autofree guint8 *binary = NULL;
+  const guint8 *data = (const guint8 *) contents;
+
+  if (len > 0 && (data[0] & 0x80) == 0) {
+    binary = signature_dearmor (contents, &len);
+    if (binary == NULL)
+      return NULL;
+    data = binary;
+  }
+
+  /* Exactly one signature packet */
+  const guint8 *p = data;
+  const guint8 *end = data + len;
+  const guint8 *body;
+  gsize body_len;
+  guint tag;
+
+  if (!packet_next (&p, end, &tag, &body, &body_len) ||
+      tag != PGP_TAG_SIGNATURE || p != end)
+    return NULL;
+
+  EamPgpVerifier *verifier = g_new0 (EamPgpVerifier, 1);
+  verifier->packet = g_memdup (body, body_len);
+
+  if (!signature_parse (&verifier->sig, verifier->packet, body_len) ||
+      verifier->sig.type != PGP_SIG_BINARY || verifier->sig.issuer == 0) {
+    eam_log_debug_message ("Unsupported signature '%s'", signature_file);
+    eam_pgp_verifier_free (verifier);
+    return NULL;
+  }
+
+  if (signature_is_expired (&verifier->sig)) {
+    eam_log_debug_message ("Signature '%s' has expired", signature_file);
+    eam_pgp_verifier_free (verifier);
+    return NULL;
+  }
+
+  guint64 keyid = verifier->sig.issuer;
+
+  verifier->keyring = keyring_get (keyring_file);
+  if (verifier->keyring != NULL)
+    verifier->key = g_hash_table_lookup (verifier->keyring->keys, &keyid);
+
+  if (verifier->key == NULL || verifier->key->revoked || is_expired (verifier->key->expires)) {
+    eam_log_debug_message ("No usable key %016" G_GINT64_MODIFIER "X for signature '%s'",
+                           keyid, signature_file);
+    eam_pgp_verifier_free (verifier);
+    return NULL;
+  }
+
+  if (gcry_md_open (&verifier->md, verifier->sig.md_algo, 0) != 0) {
+    eam_pgp_verifier_free (verifier);
+    return NULL;
+  }
+
+  return verifier;
+}
+
+void
+eam_pgp_verifier_free (EamPgpVerifier *verifier)
+{
+  if (verifier == NULL)
+    return;
+
+  if (verifier->md != NULL)
+    gcry_md_close (verifier->md);
+
+  signature_clear (&verifier->sig);
+
+  if (verifier->keyring != NULL)
+    keyring_unref (verifier->keyring);
+
+  g_free (verifier->packet);
+  g_free (verifier);
+}
+
+/**
+ * eam_pgp_verifier_update:
+ * @verifier: a #EamPgpVerifier
+ * @data: the next block of signed data
+ * @size: the size of @data
+ */
+void
+eam_pgp_verifier_update (EamPgpVerifier *verifier,
+                         const void *data,
+                         gsize size)
+{
+  gcry_md_write (verifier->md, data, size);
+}
+
+/**
+ * eam_pgp_verifier_finish:
+ * @verifier: a #EamPgpVerifier
+ *
+ * Returns: %TRUE if the signature matches all the data passed to
+ *   eam_pgp_verifier_update()
+ */
+gboolean
+eam_pgp_verifier_finish (EamPgpVerifier *verifier)
+{
+  const char *error_message = NULL;
+
+  if (!signature_check (&verifier->sig, verifier->md, verifier->key->key, &error_message)) {
+    eam_log_error_message ("Bad signature: %s", error_message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#else /* !HAVE_GCRYPT */
+
+struct _EamPgpVerifier {
+  int unused;
+};
+
+EamPgpVerifier *
+eam_pgp_verifier_new (const char *keyring_file,
+                      const char *signature_file)
+{
+  return NULL;
+}
+
+void
+eam_pgp_verifier_free (EamPgpVerifier *verifier)
+{
+  g_free (verifier);
+}
+
+void
+eam_pgp_verifier_update (EamPgpVerifier *verifier,
+                         const void *data,
+                         gsize size)
+{
+  g_return_if_reached ();
+}
+
+gboolean
+eam_pgp_verifier_finish (EamPgpVerifier *verifier)
+{
+  g_return_val_if_reached (FALSE);
+}
+
+#endif /* HAVE_GCRYPT */
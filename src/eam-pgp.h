@@ -0,0 +1,38 @@
+/* eam-pgp.h: In-process OpenPGP signature verification
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamPgpVerifier  EamPgpVerifier;
+
+EamPgpVerifier *        eam_pgp_verifier_new            (const char *keyring_file,
+                                                         const char *signature_file);
+void                    eam_pgp_verifier_free           (EamPgpVerifier *verifier);
+
+void                    eam_pgp_verifier_update         (EamPgpVerifier *verifier,
+                                                         const void *data,
+                                                         gsize size);
+gboolean                eam_pgp_verifier_finish         (EamPgpVerifier *verifier);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamPgpVerifier, eam_pgp_verifier_free)
+
+G_END_DECLS
@@ -0,0 +1,149 @@
+/* eam-progress.c: Transaction progress reporting
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eam-progress.h"
+
+/* Progress is reported from the thread doing the work, which may be
+ * updating it for every block it reads; the Progress signal is only
+ * emitted every PROGRESS_INTERVAL, plus once at the end of the stage.
+ */
+#define PROGRESS_INTERVAL       (G_USEC_PER_SEC / 4)
+
+struct _EamProgress {
+  EamTransaction *transaction;
+  char *stage;
+
+  guint64 bytes_done;
+  guint64 bytes_total;
+  guint64 entries_done;
+  guint64 entries_total;
+
+  gint64 start_time;
+  gint64 last_emit_time;
+};
+
+/**
+ * eam_progress_new:
+ * @transaction: (allow-none): the #EamTransaction to report to
+ * @stage: the name of the stage being tracked
+ *
+ * Creates a tracker for a stage of @transaction. If @transaction is
+ * %NULL, the progress is only tracked, and never reported.
+ *
+ * An #EamProgress must only be updated from one thread at a time.
+ *
+ * Returns: (transfer full): a new #EamProgress
+ */
+EamProgress *
+eam_progress_new (EamTransaction *transaction,
+                  const char *stage)
+{
+  EamProgress *progress = g_new0 (EamProgress, 1);
+
+  if (transaction != NULL)
+    progress->transaction = g_object_ref (transaction);
+
+  progress->stage = g_strdup (stage);
+  progress->start_time = g_get_monotonic_time ();
+
+  return progress;
+}
+
+void
+eam_progress_free (EamProgress *progress)
+{
+  if (progress == NULL)
+    return;
+
+  g_clear_object (&progress->transaction);
+  g_free (progress->stage);
+
+  g_free (progress);
+}
+
+/**
+ * eam_progress_set_totals:
+ * @progress: a #EamProgress
+ * @bytes_total: the number of bytes in the stage, or 0 if unknown
+ * @entries_total: the number of entries in the stage, or 0 if unknown
+ */
+void
+eam_progress_set_totals (EamProgress *progress,
+                         guint64 bytes_total,
+                         guint64 entries_total)
+{
+  progress->bytes_total = bytes_total;
+  progress->entries_total = entries_total;
+}
+
+static void
+progress_emit (EamProgress *progress,
+               gint64 now)
+{
+  progress->last_emit_time = now;
+
+  if (progress->transaction == NULL)
+    return;
+
+  double elapsed = MAX (now - progress->start_time, 1) / (double) G_USEC_PER_SEC;
+
+  eam_transaction_emit_progress (progress->transaction,
+                                 progress->stage,
+                                 progress->bytes_done,
+                                 progress->bytes_total,
+                                 progress->entries_done,
+                                 progress->entries_total,
+                                 progress->bytes_done / elapsed / 1000000.0);
+}
+
+/**
+ * eam_progress_update:
+ * @progress: a #EamProgress
+ * @bytes_done: the number of bytes processed so far
+ * @entries_done: the number of entries processed so far
+ *
+ * Updates the counters, and reports them if enough time has passed
+ * since they were last reported.
+ */
+void
+eam_progress_update (EamProgress *progress,
+                     guint64 bytes_done,
+                     guint64 entries_done)
+{
+  progress->bytes_done = bytes_done;
+  progress->entries_done = entries_done;
+
+  gint64 now = g_get_monotonic_time ();
+  if (now - progress->last_emit_time >= PROGRESS_INTERVAL)
+    progress_emit (progress, now);
+}
+
+/**
+ * eam_progress_finish:
+ * @progress: a #EamProgress
+ *
+ * Reports the final value of the counters.
+ */
+void
+eam_progress_finish (EamProgress *progress)
+{
+  progress_emit (progress, g_get_monotonic_time ());
+}
@@ -0,0 +1,41 @@
+/* eam-progress.h: Transaction progress reporting
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "eam-transaction.h"
+
+G_BEGIN_DECLS
+
+typedef struct _EamProgress     EamProgress;
+
+EamProgress *   eam_progress_new                (EamTransaction *transaction,
+                                                 const char *stage);
+void            eam_progress_free               (EamProgress *progress);
+
+void            eam_progress_set_totals         (EamProgress *progress,
+                                                 guint64 bytes_total,
+                                                 guint64 entries_total);
+void            eam_progress_update             (EamProgress *progress,
+                                                 guint64 bytes_done,
+                                                 guint64 entries_done);
+void            eam_progress_finish             (EamProgress *progress);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamProgress, eam_progress_free)
+
+G_END_DECLS
@@ -34,6 +34,7 @@
 #include "eam-resources.h"
 #include "eam-service.h"
 #include "eam-transaction-dbus.h"
+#include "eam-trash.h"
 #include "eam-uninstall.h"
 #include "eam-update.h"
 #include "eam-utils.h"
@@ -478,6 +479,10 @@ eam_service_is_busy (EamService *service)
   if (priv->busy_counter > 0)
     return TRUE;
 
+  /* Stay around until the trash is empty */
+  if (eam_trash_is_busy ())
+    return TRUE;
+
   return FALSE;
 }
 
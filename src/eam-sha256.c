@@ -0,0 +1,525 @@
+/* eam-sha256.c: SHA-256 with hardware acceleration
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "eam-sha256.h"
+
+/* A drop-in replacement for GChecksum, restricted to SHA-256, which
+ * uses the SHA instructions of the CPU when it has them: the SHA
+ * extensions on x86, and the cryptography extensions on ARMv8. The
+ * implementation is picked once, at run time, so that the same binary
+ * works everywhere.
+ *
+ * The accelerated versions are compiled with per-function target
+ * attributes, so they do not require any special compiler flags.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define HAVE_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 7))
+#define HAVE_SHA256_ARM 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+/* From asm/hwcap.h */
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+#define SHA256_BLOCK_SIZE       64
+
+typedef void (* Sha256BlocksFunc) (guint32 *state,
+                                   const guint8 *data,
+                                   gsize n_blocks);
+
+struct _EamSha256 {
+  guint32 state[8];
+  guint64 n_bytes;
+
+  guint8 block[SHA256_BLOCK_SIZE];
+  gsize block_len;
+
+  gboolean finished;
+  guint8 digest[EAM_SHA256_DIGEST_SIZE];
+  char string[EAM_SHA256_DIGEST_SIZE * 2 + 1];
+};
+
+static const guint32 sha256_init[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const guint32 sha256_k[64] __attribute__ ((aligned (16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n)      (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)     (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)    (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SIGMA0(x)       (ROTR (x, 2) ^ ROTR (x, 13) ^ ROTR (x, 22))
+#define SIGMA1(x)       (ROTR (x, 6) ^ ROTR (x, 11) ^ ROTR (x, 25))
+#define GAMMA0(x)       (ROTR (x, 7) ^ ROTR (x, 18) ^ ((x) >> 3))
+#define GAMMA1(x)       (ROTR (x, 17) ^ ROTR (x, 19) ^ ((x) >> 10))
+
+static void
+sha256_blocks_generic (guint32 *state,
+                       const guint8 *data,
+                       gsize n_blocks)
+{
+  guint32 w[64];
+
+  while (n_blocks-- > 0) {
+    for (int i = 0; i < 16; i++)
+      w[i] = ((guint32) data[i * 4] << 24) |
+             ((guint32) data[i * 4 + 1] << 16) |
+             ((guint32) data[i * 4 + 2] << 8) |
+             (guint32) data[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++)
+      w[i] = GAMMA1 (w[i - 2]) + w[i - 7] + GAMMA0 (w[i - 15]) + w[i - 16];
+
+    guint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    guint32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+      guint32 t1 = h + SIGMA1 (e) + CH (e, f, g) + sha256_k[i] + w[i];
+      guint32 t2 = SIGMA0 (a) + MAJ (a, b, c);
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+
+    data += SHA256_BLOCK_SIZE;
+  }
+}
+
+#ifdef HAVE_SHA256_X86
+/* Four rounds, with the message words in @msg */
+#define X86_ROUNDS(msg, k) \
+  G_STMT_START { \
+    tmp = _mm_add_epi32 (msg, _mm_load_si128 ((const __m128i *) &sha256_k[k])); \
+    state1 = _mm_sha256rnds2_epu32 (state1, state0, tmp); \
+    tmp = _mm_shuffle_epi32 (tmp, 0x0e); \
+    state0 = _mm_sha256rnds2_epu32 (state0, state1, tmp); \
+  } G_STMT_END
+
+/* The two halves of the message schedule */
+#define X86_SCHEDULE1(prev, cur) \
+  prev = _mm_sha256msg1_epu32 (prev, cur)
+
+#define X86_SCHEDULE2(next, cur, prev) \
+  G_STMT_START { \
+    next = _mm_add_epi32 (next, _mm_alignr_epi8 (cur, prev, 4)); \
+    next = _mm_sha256msg2_epu32 (next, cur); \
+  } G_STMT_END
+
+__attribute__ ((target ("sha,sse4.1,ssse3")))
+static void
+sha256_blocks_x86 (guint32 *state,
+                   const guint8 *data,
+                   gsize n_blocks)
+{
+  const __m128i bswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, tmp;
+  __m128i msg0, msg1, msg2, msg3;
+
+  /* The instructions want the state as ABEF and CDGH */
+  tmp = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[0]), 0xb1);
+  state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) &state[4]), 0x1b);
+  state0 = _mm_alignr_epi8 (tmp, state1, 8);
+  state1 = _mm_blend_epi16 (state1, tmp, 0xf0);
+
+  while (n_blocks-- > 0) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+
+    msg0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 0)), bswap);
+    msg1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)), bswap);
+    msg2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)), bswap);
+    msg3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)), bswap);
+
+    X86_ROUNDS (msg0, 0);
+    X86_ROUNDS (msg1, 4);
+    X86_SCHEDULE1 (msg0, msg1);
+    X86_ROUNDS (msg2, 8);
+    X86_SCHEDULE1 (msg1, msg2);
+    X86_ROUNDS (msg3, 12);
+    X86_SCHEDULE2 (msg0, msg3, msg2);
+    X86_SCHEDULE1 (msg2, msg3);
+
+    for (int k = 16; k < 48; k += 16) {
+      X86_ROUNDS (msg0, k);
+      X86_SCHEDULE2 (msg1, msg0, msg3);
+      X86_SCHEDULE1 (msg3, msg0);
+      X86_ROUNDS (msg1, k + 4);
+      X86_SCHEDULE2 (msg2, msg1, msg0);
+      X86_SCHEDULE1 (msg0, msg1);
+      X86_ROUNDS (msg2, k + 8);
+      X86_SCHEDULE2 (msg3, msg2, msg1);
+      X86_SCHEDULE1 (msg1, msg2);
+      X86_ROUNDS (msg3, k + 12);
+      X86_SCHEDULE2 (msg0, msg3, msg2);
+      X86_SCHEDULE1 (msg2, msg3);
+    }
+
+    X86_ROUNDS (msg0, 48);
+    X86_SCHEDULE2 (msg1, msg0, msg3);
+    X86_SCHEDULE1 (msg3, msg0);
+    X86_ROUNDS (msg1, 52);
+    X86_SCHEDULE2 (msg2, msg1, msg0);
+    X86_ROUNDS (msg2, 56);
+    X86_SCHEDULE2 (msg3, msg2, msg1);
+    X86_ROUNDS (msg3, 60);
+
+    state0 = _mm_add_epi32 (state0, abef);
+    state1 = _mm_add_epi32 (state1, cdgh);
+
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  /* Back to ABCD and EFGH */
+  tmp = _mm_shuffle_epi32 (state0, 0x1b);
+  state1 = _mm_shuffle_epi32 (state1, 0xb1);
+  state0 = _mm_blend_epi16 (tmp, state1, 0xf0);
+  state1 = _mm_alignr_epi8 (state1, tmp, 8);
+
+  _mm_storeu_si128 ((__m128i *) &state[0], state0);
+  _mm_storeu_si128 ((__m128i *) &state[4], state1);
+}
+
+static gboolean
+cpu_has_sha_x86 (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return FALSE;
+
+  /* SSSE3 and SSE4.1 */
+  if ((ecx & (1 << 9)) == 0 || (ecx & (1 << 19)) == 0)
+    return FALSE;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  /* SHA */
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  return (ebx & (1 << 29)) != 0;
+}
+#endif /* HAVE_SHA256_X86 */
+
+#ifdef HAVE_SHA256_ARM
+/* Four rounds, with the message words in @msg; the schedule for four
+ * rounds later is computed in place
+ */
+#define ARM_ROUNDS(msg0, msg1, msg2, msg3, k) \
+  G_STMT_START { \
+    uint32x4_t wk = vaddq_u32 (msg0, vld1q_u32 (&sha256_k[k])); \
+    uint32x4_t abcd = state0; \
+    msg0 = vsha256su0q_u32 (msg0, msg1); \
+    state0 = vsha256hq_u32 (state0, state1, wk); \
+    state1 = vsha256h2q_u32 (state1, abcd, wk); \
+    msg0 = vsha256su1q_u32 (msg0, msg2, msg3); \
+  } G_STMT_END
+
+#define ARM_ROUNDS_LAST(msg0, k) \
+  G_STMT_START { \
+    uint32x4_t wk = vaddq_u32 (msg0, vld1q_u32 (&sha256_k[k])); \
+    uint32x4_t abcd = state0; \
+    state0 = vsha256hq_u32 (state0, state1, wk); \
+    state1 = vsha256h2q_u32 (state1, abcd, wk); \
+  } G_STMT_END
+
+#ifndef __ARM_FEATURE_CRYPTO
+__attribute__ ((target ("+crypto")))
+#endif
+static void
+sha256_blocks_arm (guint32 *state,
+                   const guint8 *data,
+                   gsize n_blocks)
+{
+  uint32x4_t state0 = vld1q_u32 (&state[0]);
+  uint32x4_t state1 = vld1q_u32 (&state[4]);
+
+  while (n_blocks-- > 0) {
+    uint32x4_t abcd = state0;
+    uint32x4_t efgh = state1;
+
+    uint32x4_t msg0 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 0)));
+    uint32x4_t msg1 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 16)));
+    uint32x4_t msg2 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 32)));
+    uint32x4_t msg3 = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data + 48)));
+
+    for (int k = 0; k < 48; k += 16) {
+      ARM_ROUNDS (msg0, msg1, msg2, msg3, k);
+      ARM_ROUNDS (msg1, msg2, msg3, msg0, k + 4);
+      ARM_ROUNDS (msg2, msg3, msg0, msg1, k + 8);
+      ARM_ROUNDS (msg3, msg0, msg1, msg2, k + 12);
+    }
+
+    ARM_ROUNDS_LAST (msg0, 48);
+    ARM_ROUNDS_LAST (msg1, 52);
+    ARM_ROUNDS_LAST (msg2, 56);
+    ARM_ROUNDS_LAST (msg3, 60);
+
+    state0 = vaddq_u32 (state0, abcd);
+    state1 = vaddq_u32 (state1, efgh);
+
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  vst1q_u32 (&state[0], state0);
+  vst1q_u32 (&state[4], state1);
+}
+
+static gboolean
+cpu_has_sha_arm (void)
+{
+  return (getauxval (AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif /* HAVE_SHA256_ARM */
+
+static Sha256BlocksFunc sha256_blocks;
+static const char *sha256_implementation;
+
+static void
+sha256_select_implementation (void)
+{
+  static gsize initialized = 0;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  sha256_blocks = sha256_blocks_generic;
+  sha256_implementation = "generic";
+
+  /* Forcing the generic version is useful to compare them */
+  if (g_strcmp0 (g_getenv ("EAM_SHA256_GENERIC"), "1") != 0) {
+#ifdef HAVE_SHA256_X86
+    if (cpu_has_sha_x86 ()) {
+      sha256_blocks = sha256_blocks_x86;
+      sha256_implementation = "x86-sha";
+    }
+#endif
+
+#ifdef HAVE_SHA256_ARM
+    if (cpu_has_sha_arm ()) {
+      sha256_blocks = sha256_blocks_arm;
+      sha256_implementation = "armv8-ce";
+    }
+#endif
+  }
+
+  g_once_init_leave (&initialized, 1);
+}
+
+/**
+ * eam_sha256_get_implementation:
+ *
+ * Returns: the name of the implementation used on this machine
+ */
+const char *
+eam_sha256_get_implementation (void)
+{
+  sha256_select_implementation ();
+
+  return sha256_implementation;
+}
+
+/**
+ * eam_sha256_new:
+ *
+ * Returns: (transfer full): a new #EamSha256
+ */
+EamSha256 *
+eam_sha256_new (void)
+{
+  sha256_select_implementation ();
+
+  EamSha256 *sha = g_new0 (EamSha256, 1);
+  memcpy (sha->state, sha256_init, sizeof (sha256_init));
+
+  return sha;
+}
+
+void
+eam_sha256_free (EamSha256 *sha)
+{
+  g_free (sha);
+}
+
+/**
+ * eam_sha256_update:
+ * @sha: a #EamSha256
+ * @data: the data to hash
+ * @size: the size of @data
+ *
+ * Adds @data to the hash; like for #GChecksum, this cannot be called
+ * after the digest has been retrieved.
+ */
+void
+eam_sha256_update (EamSha256 *sha,
+                   const void *data,
+                   gsize size)
+{
+  const guint8 *p = data;
+
+  g_return_if_fail (!sha->finished);
+
+  sha->n_bytes += size;
+
+  if (sha->block_len > 0) {
+    gsize n = MIN (size, SHA256_BLOCK_SIZE - sha->block_len);
+
+    memcpy (sha->block + sha->block_len, p, n);
+    sha->block_len += n;
+    p += n;
+    size -= n;
+
+    if (sha->block_len < SHA256_BLOCK_SIZE)
+      return;
+
+    sha256_blocks (sha->state, sha->block, 1);
+    sha->block_len = 0;
+  }
+
+  if (size >= SHA256_BLOCK_SIZE) {
+    gsize n_blocks = size / SHA256_BLOCK_SIZE;
+
+    sha256_blocks (sha->state, p, n_blocks);
+    p += n_blocks * SHA256_BLOCK_SIZE;
+    size -= n_blocks * SHA256_BLOCK_SIZE;
+  }
+
+  memcpy (sha->block, p, size);
+  sha->block_len = size;
+}
+
+static void
+sha256_finish (EamSha256 *sha)
+{
+  if (sha->finished)
+    return;
+
+  guint64 n_bits = sha->n_bytes * 8;
+
+  sha->block[sha->block_len++] = 0x80;
+
+  if (sha->block_len > SHA256_BLOCK_SIZE - 8) {
+    memset (sha->block + sha->block_len, 0, SHA256_BLOCK_SIZE - sha->block_len);
+    sha256_blocks (sha->state, sha->block, 1);
+    sha->block_len = 0;
+  }
+
+  memset (sha->block + sha->block_len, 0, SHA256_BLOCK_SIZE - 8 - sha->block_len);
+  for (int i = 0; i < 8; i++)
+    sha->block[SHA256_BLOCK_SIZE - 1 - i] = (n_bits >> (i * 8)) & 0xff;
+
+  sha256_blocks (sha->state, sha->block, 1);
+
+  static const char hex[] = "0123456789abcdef";
+
+  for (int i = 0; i < 8; i++) {
+    sha->digest[i * 4] = sha->state[i] >> 24;
+    sha->digest[i * 4 + 1] = sha->state[i] >> 16;
+    sha->digest[i * 4 + 2] = sha->state[i] >> 8;
+    sha->digest[i * 4 + 3] = sha->state[i];
+  }
+
+  for (int i = 0; i < EAM_SHA256_DIGEST_SIZE; i++) {
+    sha->string[i * 2] = hex[sha->digest[i] >> 4];
+    sha->string[i * 2 + 1] = hex[sha->digest[i] & 0x0f];
+  }
+
+  sha->string[EAM_SHA256_DIGEST_SIZE * 2] = '\0';
+  sha->finished = TRUE;
+}
+
+/**
+ * eam_sha256_get_digest:
+ * @sha: a #EamSha256
+ * @digest: (out caller-allocates): a buffer of %EAM_SHA256_DIGEST_SIZE
+ *   bytes
+ *
+ * Retrieves the binary digest of the data hashed so far.
+ */
+void
+eam_sha256_get_digest (EamSha256 *sha,
+                       guint8 *digest)
+{
+  sha256_finish (sha);
+
+  memcpy (digest, sha->digest, EAM_SHA256_DIGEST_SIZE);
+}
+
+/**
+ * eam_sha256_get_string:
+ * @sha: a #EamSha256
+ *
+ * Returns: the digest of the data hashed so far, as a lower case
+ *   hexadecimal string owned by @sha
+ */
+const char *
+eam_sha256_get_string (EamSha256 *sha)
+{
+  sha256_finish (sha);
+
+  return sha->string;
+}
@@ -0,0 +1,43 @@
+/* eam-sha256.h: SHA-256 with hardware acceleration
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EAM_SHA256_DIGEST_SIZE  32
+
+typedef struct _EamSha256       EamSha256;
+
+EamSha256 *     eam_sha256_new                  (void);
+void            eam_sha256_free                 (EamSha256 *sha);
+
+void            eam_sha256_update               (EamSha256 *sha,
+                                                 const void *data,
+                                                 gsize size);
+void            eam_sha256_get_digest           (EamSha256 *sha,
+                                                 guint8 *digest);
+const char *    eam_sha256_get_string           (EamSha256 *sha);
+
+const char *    eam_sha256_get_implementation   (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamSha256, eam_sha256_free)
+
+G_END_DECLS
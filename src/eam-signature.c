@@ -0,0 +1,213 @@
+/* eam-signature.c: Streaming signature verification
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <signal.h>
+
+#include "eam-signature.h"
+
+#include "eam-config.h"
+#include "eam-error.h"
+#include "eam-log.h"
+#include "eam-pgp.h"
+
+/* A signature stream verifies a detached signature against data that
+ * is fed to it incrementally, instead of reading the signed file on
+ * its own. This lets the installer verify a bundle while it is being
+ * extracted, reading it from disk only once.
+ *
+ * Signatures that the in-process verifier understands are checked by
+ * hashing the data as it comes; for the others, the data is piped into
+ * gpgv, so the hashing happens in a separate process, concurrently
+ * with the extraction.
+ */
+struct _EamSignatureStream {
+  EamPgpVerifier *verifier;
+
+  GSubprocess *gpgv;
+  GOutputStream *input;
+
+  gboolean failed;
+  gboolean finished;
+};
+
+static void
+ignore_sigpipe (void)
+{
+  static gsize initialized = 0;
+
+  /* If gpgv bails out early, e.g. on a malformed signature, writing
+   * to its standard input would kill us with SIGPIPE; we want to get
+   * EPIPE instead, and report the failure.
+   */
+  if (g_once_init_enter (&initialized)) {
+    struct sigaction sa;
+
+    if (sigaction (SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+      sa.sa_handler = SIG_IGN;
+      sigaction (SIGPIPE, &sa, NULL);
+    }
+
+    g_once_init_leave (&initialized, 1);
+  }
+}
+
+/**
+ * eam_signature_stream_new:
+ * @signature_file: the path of the detached signature
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): a new #EamSignatureStream, or %NULL if
+ *   the verification could not be started
+ */
+EamSignatureStream *
+eam_signature_stream_new (const char *signature_file,
+                          GError **error)
+{
+  if (signature_file == NULL || !g_file_test (signature_file, G_FILE_TEST_EXISTS)) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_INVALID_FILE,
+                         "No signature file found");
+    return NULL;
+  }
+
+  EamSignatureStream *stream = g_new0 (EamSignatureStream, 1);
+
+  stream->verifier = eam_pgp_verifier_new (eam_config_get_gpg_keyring (), signature_file);
+  if (stream->verifier != NULL)
+    return stream;
+
+  ignore_sigpipe ();
+
+  const char *argv[] = {
+    "gpgv",
+    "--keyring", eam_config_get_gpg_keyring (),
+    "--logger-fd", "1",
+    "--quiet",
+    signature_file,
+    "-",
+    NULL
+  };
+
+  GSubprocessFlags flags = G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                           G_SUBPROCESS_FLAGS_STDOUT_SILENCE;
+
+  GSubprocess *gpgv = g_subprocess_newv (argv, flags, error);
+  if (gpgv == NULL) {
+    g_free (stream);
+    return NULL;
+  }
+
+  stream->gpgv = gpgv;
+  stream->input = g_subprocess_get_stdin_pipe (gpgv);
+
+  return stream;
+}
+
+void
+eam_signature_stream_free (EamSignatureStream *stream)
+{
+  if (stream == NULL)
+    return;
+
+  eam_pgp_verifier_free (stream->verifier);
+
+  /* Do not leave gpgv behind if the verification was abandoned */
+  if (stream->gpgv != NULL && !stream->finished) {
+    g_subprocess_force_exit (stream->gpgv);
+    g_subprocess_wait (stream->gpgv, NULL, NULL);
+  }
+
+  g_clear_object (&stream->gpgv);
+
+  g_free (stream);
+}
+
+/**
+ * eam_signature_stream_update:
+ * @stream: a #EamSignatureStream
+ * @data: the next block of signed data
+ * @size: the size of @data
+ *
+ * Feeds a block of data to the verifier.
+ *
+ * Returns: %FALSE if the verification has already failed
+ */
+gboolean
+eam_signature_stream_update (EamSignatureStream *stream,
+                             const void *data,
+                             gsize size)
+{
+  if (stream->failed)
+    return FALSE;
+
+  if (stream->verifier != NULL) {
+    eam_pgp_verifier_update (stream->verifier, data, size);
+    return TRUE;
+  }
+
+  g_autoptr(GError) error = NULL;
+  if (!g_output_stream_write_all (stream->input, data, size, NULL, NULL, &error)) {
+    eam_log_error_message ("Unable to feed data to gpgv: %s", error->message);
+    stream->failed = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_signature_stream_finish:
+ * @stream: a #EamSignatureStream
+ * @cancellable: (allow-none): a #GCancellable
+ *
+ * Signals the end of the signed data, and waits for the result.
+ *
+ * Returns: %TRUE if the signature matches all the data passed to
+ *   eam_signature_stream_update()
+ */
+gboolean
+eam_signature_stream_finish (EamSignatureStream *stream,
+                             GCancellable *cancellable)
+{
+  g_return_val_if_fail (!stream->finished, FALSE);
+
+  if (stream->verifier != NULL) {
+    stream->finished = TRUE;
+    return eam_pgp_verifier_finish (stream->verifier);
+  }
+
+  g_autoptr(GError) error = NULL;
+
+  if (!g_output_stream_close (stream->input, NULL, &error)) {
+    if (!stream->failed)
+      eam_log_error_message ("Unable to feed data to gpgv: %s", error->message);
+    stream->failed = TRUE;
+    g_clear_error (&error);
+  }
+
+  if (!g_subprocess_wait (stream->gpgv, cancellable, &error)) {
+    eam_log_error_message ("gpgv failed: %s", error->message);
+    return FALSE;
+  }
+
+  stream->finished = TRUE;
+
+  return !stream->failed && g_subprocess_get_successful (stream->gpgv);
+}
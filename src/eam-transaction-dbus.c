@@ -40,6 +40,7 @@ struct _EamRemoteTransaction {
   char *sender;
   guint registration_id;
   guint watch_id;
+  gulong progress_id;
 };
 
 static void
@@ -50,6 +51,9 @@ eam_remote_transaction_free (EamRemoteTransaction *remote)
   if (remote->watch_id != 0)
     g_bus_unwatch_name (remote->watch_id);
 
+  if (remote->progress_id != 0)
+    g_signal_handler_disconnect (remote->transaction, remote->progress_id);
+
   if (remote->registration_id != 0)
     g_dbus_connection_unregister_object (remote->connection,
                                          remote->registration_id);
@@ -194,6 +198,31 @@ handle_transaction_method_call (GDBusConnection *connection,
   }
 }
 
+static void
+transaction_progress_cb (EamTransaction *transaction,
+                         const char *stage,
+                         guint64 bytes_done,
+                         guint64 bytes_total,
+                         guint64 entries_done,
+                         guint64 entries_total,
+                         double rate,
+                         gpointer data)
+{
+  EamRemoteTransaction *remote = data;
+
+  g_dbus_connection_emit_signal (remote->connection,
+                                 remote->sender,
+                                 remote->obj_path,
+                                 "com.endlessm.AppManager.Transaction",
+                                 "Progress",
+                                 g_variant_new ("(sttttd)",
+                                                stage,
+                                                bytes_done, bytes_total,
+                                                entries_done, entries_total,
+                                                rate),
+                                 NULL);
+}
+
 static const GDBusInterfaceVTable transaction_vtable = {
   handle_transaction_method_call,
   NULL,
@@ -280,6 +309,11 @@ eam_remote_transaction_register_dbus (EamRemoteTransaction *remote,
                                     remote,
                                     NULL);
 
+  remote->progress_id =
+    g_signal_connect (remote->transaction, "progress",
+                      G_CALLBACK (transaction_progress_cb),
+                      remote);
+
   return TRUE;
 }
 
@@ -24,9 +24,43 @@
 
 G_DEFINE_INTERFACE (EamTransaction, eam_transaction, G_TYPE_OBJECT)
 
+enum {
+  PROGRESS,
+
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0, };
+
 static void
 eam_transaction_default_init (EamTransactionInterface *iface)
 {
+  /**
+   * EamTransaction::progress:
+   * @trans: the #EamTransaction
+   * @stage: the name of the current stage
+   * @bytes_done: the number of bytes processed in the stage
+   * @bytes_total: the number of bytes in the stage, or 0 if unknown
+   * @entries_done: the number of entries processed in the stage
+   * @entries_total: the number of entries in the stage, or 0 if unknown
+   * @rate: the throughput of the stage so far, in MB/s
+   *
+   * Emitted in the main context while a transaction is running.
+   */
+  signals[PROGRESS] =
+    g_signal_new ("progress",
+                  G_TYPE_FROM_INTERFACE (iface),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 6,
+                  G_TYPE_STRING,
+                  G_TYPE_UINT64,
+                  G_TYPE_UINT64,
+                  G_TYPE_UINT64,
+                  G_TYPE_UINT64,
+                  G_TYPE_DOUBLE);
 }
 
 gboolean
@@ -79,3 +113,77 @@ eam_transaction_finish (EamTransaction *trans,
 
   return EAM_TRANSACTION_GET_IFACE (trans)->finish (trans, res, error);
 }
+
+typedef struct {
+  EamTransaction *trans;
+  char *stage;
+  guint64 bytes_done;
+  guint64 bytes_total;
+  guint64 entries_done;
+  guint64 entries_total;
+  double rate;
+} ProgressData;
+
+static void
+progress_data_free (gpointer data)
+{
+  ProgressData *pd = data;
+
+  g_object_unref (pd->trans);
+  g_free (pd->stage);
+
+  g_slice_free (ProgressData, pd);
+}
+
+static gboolean
+emit_progress_idle (gpointer data)
+{
+  ProgressData *pd = data;
+
+  g_signal_emit (pd->trans, signals[PROGRESS], 0,
+                 pd->stage,
+                 pd->bytes_done, pd->bytes_total,
+                 pd->entries_done, pd->entries_total,
+                 pd->rate);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * eam_transaction_emit_progress:
+ * @trans: a #GType supporting #EamTransaction.
+ * @stage: the name of the current stage
+ * @bytes_done: the number of bytes processed in the stage
+ * @bytes_total: the number of bytes in the stage, or 0 if unknown
+ * @entries_done: the number of entries processed in the stage
+ * @entries_total: the number of entries in the stage, or 0 if unknown
+ * @rate: the throughput of the stage so far, in MB/s
+ *
+ * Emits the #EamTransaction::progress signal in the main context. This
+ * function can be called from any thread.
+ **/
+void
+eam_transaction_emit_progress (EamTransaction *trans,
+                               const char *stage,
+                               guint64 bytes_done,
+                               guint64 bytes_total,
+                               guint64 entries_done,
+                               guint64 entries_total,
+                               double rate)
+{
+  g_return_if_fail (EAM_IS_TRANSACTION (trans));
+
+  ProgressData *pd = g_slice_new (ProgressData);
+
+  pd->trans = g_object_ref (trans);
+  pd->stage = g_strdup (stage);
+  pd->bytes_done = bytes_done;
+  pd->bytes_total = bytes_total;
+  pd->entries_done = entries_done;
+  pd->entries_total = entries_total;
+  pd->rate = rate;
+
+  g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
+                              emit_progress_idle,
+                              pd, progress_data_free);
+}
@@ -82,6 +82,14 @@ gboolean         eam_transaction_finish         (EamTransaction *trans,
                                                  GAsyncResult *res,
                                                  GError **error);
 
+void             eam_transaction_emit_progress  (EamTransaction *trans,
+                                                 const char *stage,
+                                                 guint64 bytes_done,
+                                                 guint64 bytes_total,
+                                                 guint64 entries_done,
+                                                 guint64 entries_total,
+                                                 double rate);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamTransaction, g_object_unref)
 
 G_END_DECLS
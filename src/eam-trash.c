@@ -0,0 +1,254 @@
+/* eam-trash.c: Deferred removal of directories
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "eam-trash.h"
+
+#include "eam-config.h"
+#include "eam-fs-utils.h"
+#include "eam-log.h"
+#include "eam-object-store.h"
+
+/* Removing an application can mean unlinking tens of thousands of
+ * files, which takes a long time; the transactions that remove a
+ * directory move it to the trash of its prefix instead, which is a
+ * single rename, and return right away.
+ *
+ * The trash of a prefix is emptied by a worker thread, at the lowest
+ * CPU and I/O priority, so that it does not get in the way of the
+ * rest of the system. Whatever is left in the trash when the service
+ * exits is reclaimed the next time it starts.
+ */
+
+#define TRASH_SUBDIR ".trash"
+
+/* From linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_WHO_PROCESS      1
+
+G_LOCK_DEFINE_STATIC (trash);
+
+/* The prefixes whose trash needs emptying, and whether the worker is
+ * running; both protected by the trash lock
+ */
+static GHashTable *trash_prefixes;
+static gboolean trash_running;
+
+static void
+lower_thread_priority (void)
+{
+  /* On Linux, both apply to the calling thread only */
+  if (setpriority (PRIO_PROCESS, 0, 19) < 0)
+    eam_log_debug_message ("Unable to lower the priority of the trash worker: %s",
+                           g_strerror (errno));
+
+#ifdef SYS_ioprio_set
+  if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+    eam_log_debug_message ("Unable to lower the I/O priority of the trash worker: %s",
+                           g_strerror (errno));
+#endif
+}
+
+static void
+empty_trash_for_prefix (const char *prefix)
+{
+  g_autofree char *trash_dir = g_build_filename (prefix, TRASH_SUBDIR, NULL);
+
+  g_autoptr(GDir) dir = g_dir_open (trash_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  guint n_removed = 0;
+  const char *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *path = g_build_filename (trash_dir, name, NULL);
+
+    if (!eam_fs_rmdir_recursive (path)) {
+      eam_log_error_message ("Unable to remove '%s' from the trash", path);
+      continue;
+    }
+
+    n_removed += 1;
+  }
+
+  if (n_removed == 0)
+    return;
+
+  eam_log_info_message ("Removed %u directories from '%s'", n_removed, trash_dir);
+
+  /* Release the objects that were only used by what we removed */
+  eam_object_store_prune (prefix);
+}
+
+static gpointer
+trash_worker_func (gpointer data)
+{
+  lower_thread_priority ();
+
+  while (TRUE) {
+    G_LOCK (trash);
+
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, trash_prefixes);
+    if (!g_hash_table_iter_next (&iter, &key, NULL)) {
+      trash_running = FALSE;
+      G_UNLOCK (trash);
+      break;
+    }
+
+    g_autofree char *prefix = key;
+    g_hash_table_iter_steal (&iter);
+
+    G_UNLOCK (trash);
+
+    empty_trash_for_prefix (prefix);
+  }
+
+  return NULL;
+}
+
+/* Must be called with the trash lock held */
+static void
+trash_schedule (const char *prefix)
+{
+  if (prefix == NULL)
+    return;
+
+  if (trash_prefixes == NULL)
+    trash_prefixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  g_hash_table_add (trash_prefixes, g_strdup (prefix));
+
+  if (trash_running)
+    return;
+
+  trash_running = TRUE;
+  g_thread_unref (g_thread_new ("eam-trash", trash_worker_func, NULL));
+}
+
+static gboolean
+move_to_trash (const char *prefix,
+               const char *path)
+{
+  g_autofree char *trash_dir = g_build_filename (prefix, TRASH_SUBDIR, NULL);
+
+  if (g_mkdir_with_parents (trash_dir, 0700) < 0) {
+    eam_log_error_message ("Unable to create the trash directory '%s': %s",
+                           trash_dir, g_strerror (errno));
+    return FALSE;
+  }
+
+  g_autofree char *basename = g_path_get_basename (path);
+
+  /* The same directory can be trashed more than once before the
+   * trash is emptied, so the names get a random suffix
+   */
+  for (int i = 0; i < 8; i++) {
+    g_autofree char *name = g_strdup_printf ("%s.%08x", basename, g_random_int ());
+    g_autofree char *target = g_build_filename (trash_dir, name, NULL);
+
+    if (rename (path, target) == 0)
+      return TRUE;
+
+    if (errno != EEXIST && errno != ENOTEMPTY)
+      break;
+  }
+
+  eam_log_error_message ("Unable to move '%s' to the trash: %s",
+                         path, g_strerror (errno));
+  return FALSE;
+}
+
+/**
+ * eam_trash_add:
+ * @prefix: the applications prefix
+ * @path: a directory inside @prefix
+ *
+ * Moves @path to the trash of @prefix, and schedules its removal in
+ * the background; once it is removed, the objects of @prefix that
+ * were only used by @path are removed as well.
+ *
+ * If @path cannot be moved, it is removed right away instead.
+ *
+ * Returns: %TRUE if @path is gone from its location
+ */
+gboolean
+eam_trash_add (const char *prefix,
+               const char *path)
+{
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    return TRUE;
+
+  if (!move_to_trash (prefix, path)) {
+    if (!eam_fs_rmdir_recursive (path))
+      return FALSE;
+
+    eam_object_store_prune (prefix);
+    return TRUE;
+  }
+
+  G_LOCK (trash);
+  trash_schedule (prefix);
+  G_UNLOCK (trash);
+
+  return TRUE;
+}
+
+/**
+ * eam_trash_reclaim:
+ *
+ * Starts emptying the trash of the primary and secondary storage in
+ * the background, to finish what a previous run of the service left.
+ */
+void
+eam_trash_reclaim (void)
+{
+  G_LOCK (trash);
+  trash_schedule (eam_config_get_primary_storage ());
+  trash_schedule (eam_config_get_secondary_storage ());
+  G_UNLOCK (trash);
+}
+
+/**
+ * eam_trash_is_busy:
+ *
+ * Returns: %TRUE if the trash is being emptied
+ */
+gboolean
+eam_trash_is_busy (void)
+{
+  G_LOCK (trash);
+  gboolean ret = trash_running;
+  G_UNLOCK (trash);
+
+  return ret;
+}
@@ -25,6 +25,7 @@
 #include "eam-error.h"
 #include "eam-fs-utils.h"
 #include "eam-log.h"
+#include "eam-trash.h"
 #include "eam-utils.h"
 
 #include <string.h>
@@ -86,7 +87,9 @@ eam_uninstall_run_sync (EamTransaction *trans,
    */
   eam_fs_prune_symlinks (priv->prefix, priv->appid);
 
-  if (!eam_fs_prune_dir (priv->prefix, priv->appid)) {
+  /* The files are removed in the background */
+  g_autofree char *appdir = g_build_filename (priv->prefix, priv->appid, NULL);
+  if (!eam_trash_add (priv->prefix, appdir)) {
     if (!priv->is_force) {
       g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
                            "Unable to remove the bundle files");
@@ -25,9 +25,14 @@
 
 #include "eam-config.h"
 #include "eam-error.h"
+#include "eam-extract-filter.h"
 #include "eam-fs-utils.h"
 #include "eam-log.h"
+#include "eam-manifest.h"
+#include "eam-object-store.h"
+#include "eam-trash.h"
 #include "eam-utils.h"
+#include "eam-verify-cache.h"
 
 #define XDELTA_BUNDLE_EXT               "xdelta"
 #define INSTALL_BUNDLE_EXT              "bundle"
@@ -165,6 +170,15 @@ eam_update_new (const gchar *appid)
                        NULL);
 }
 
+static gboolean
+app_is_partial (const char *prefix,
+                const char *appid)
+{
+  g_autoptr(GKeyFile) info = eam_utils_load_app_info (prefix, appid);
+
+  return info != NULL && g_key_file_has_group (info, EAM_EXTRACT_FILTER_INFO_GROUP);
+}
+
 static gboolean
 do_xdelta_update (const char *prefix,
                   const char *appid,
@@ -173,9 +187,18 @@ do_xdelta_update (const char *prefix,
                   GCancellable *cancellable,
                   GError **error)
 {
+  /* The updated appdir is built next to its final location */
+  g_autofree char *staging_dir = eam_fs_get_staging_dir (prefix);
+  if (staging_dir == NULL) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
+                         "Unable to create the staging directory");
+    return FALSE;
+  }
+
   eam_utils_cleanup_python (source_dir);
 
-  if (!eam_utils_apply_xdelta (source_dir, appid, delta_file, cancellable)) {
+  if (!eam_utils_apply_xdelta (source_dir, staging_dir, appid, delta_file, cancellable)) {
+    eam_fs_prune_staged_app (prefix, appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -184,9 +207,14 @@ do_xdelta_update (const char *prefix,
     return FALSE;
   }
 
+  /* Record what was installed, for eamctl verify */
+  g_autofree char *appdir = g_build_filename (staging_dir, appid, NULL);
+  if (!eam_manifest_write (appdir, NULL))
+    eam_log_error_message ("Could not write the manifest of '%s'", appid);
+
   /* Deploy the appdir from the extraction directory to the app directory */
-  if (!eam_fs_deploy_app (eam_config_get_cache_dir (), prefix, appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), appid);
+  if (!eam_fs_deploy_app (staging_dir, prefix, appid, cancellable)) {
+    eam_fs_prune_staged_app (prefix, appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -203,11 +231,37 @@ static gboolean
 do_full_update (const char *prefix,
                 const char *appid,
                 const char *bundle_file,
+                const char *signature_file,
+                EamObjectStore *store,
+                EamProgress *progress,
                 GCancellable *cancellable,
                 GError **error)
 {
-  if (!eam_utils_bundle_extract (bundle_file, eam_config_get_cache_dir (), appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), appid);
+  /* The manifest and the deduplication of the files follow the external
+   * script, as it may modify them; the extraction records the checksums
+   * of the files until then
+   */
+  g_autoptr(EamDigests) digests = eam_digests_new ();
+
+  /* The bundle is extracted next to its final location */
+  g_autofree char *staging_dir = eam_fs_get_staging_dir (prefix);
+  if (staging_dir == NULL) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
+                         "Unable to create the staging directory");
+    return FALSE;
+  }
+
+  /* A signature file means the bundle has not been verified yet */
+  if (signature_file != NULL) {
+    if (!eam_utils_bundle_extract_verified (bundle_file, signature_file,
+                                            staging_dir, appid,
+                                            digests, progress, cancellable, error)) {
+      eam_fs_prune_staged_app (prefix, appid);
+      return FALSE;
+    }
+  }
+  else if (!eam_utils_bundle_extract (bundle_file, staging_dir, appid, digests, progress, cancellable)) {
+    eam_fs_prune_staged_app (prefix, appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -217,8 +271,8 @@ do_full_update (const char *prefix,
   }
 
   /* run 3rd party scripts */
-  if (!eam_utils_run_external_scripts (eam_config_get_cache_dir (), appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), appid);
+  if (!eam_utils_run_external_scripts (staging_dir, appid, cancellable)) {
+    eam_fs_prune_staged_app (prefix, appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -227,9 +281,18 @@ do_full_update (const char *prefix,
     return FALSE;
   }
 
+  /* Record what was installed, for eamctl verify */
+  g_autofree char *appdir = g_build_filename (staging_dir, appid, NULL);
+  if (!eam_manifest_write (appdir, digests))
+    eam_log_error_message ("Could not write the manifest of '%s'", appid);
+
+  /* Linking changes the status of the files, so it follows the manifest */
+  if (store != NULL && !eam_object_store_link_tree (store, appdir, digests))
+    eam_log_error_message ("Could not deduplicate the files of '%s'", appid);
+
   /* Deploy the appdir from the extraction directory to the app directory */
-  if (!eam_fs_deploy_app (eam_config_get_cache_dir (), prefix, appid, cancellable)) {
-    eam_fs_prune_dir (eam_config_get_cache_dir (), appid);
+  if (!eam_fs_deploy_app (staging_dir, prefix, appid, cancellable)) {
+    eam_fs_prune_staged_app (prefix, appid);
     if (g_cancellable_is_cancelled (cancellable))
       g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
     else
@@ -274,7 +337,26 @@ eam_update_run_sync (EamTransaction *trans,
     return FALSE;
   }
 
-  if (!priv->skip_signature) {
+  /* Full bundles can be verified while they are extracted; deltas are
+   * applied by xdelta3, so they are always verified up front
+   */
+  gboolean is_full_update = g_str_has_suffix (priv->bundle_file, INSTALL_BUNDLE_EXT);
+
+  /* A delta needs the whole of the old version to apply to */
+  if (!is_full_update && app_is_partial (priv->source_prefix, priv->appid)) {
+    g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                 "Application '%s' was partially installed, and needs a full update",
+                 priv->appid);
+    return FALSE;
+  }
+  /* A bundle verified by a previous attempt is not verified again */
+  gboolean skip_signature = priv->skip_signature ||
+                            eam_verify_cache_lookup (priv->bundle_file, priv->signature_file);
+
+  gboolean stream_verify = !skip_signature && is_full_update &&
+                           eam_config_get_streaming_verification ();
+
+  if (!skip_signature && !stream_verify) {
     if (!eam_utils_verify_signature (priv->bundle_file, priv->signature_file, cancellable)) {
       if (g_cancellable_is_cancelled (cancellable))
         g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
@@ -296,8 +378,17 @@ eam_update_run_sync (EamTransaction *trans,
   GError *internal_error = NULL;
   gboolean res;
 
-  if (g_str_has_suffix (priv->bundle_file, INSTALL_BUNDLE_EXT))
-    res = do_full_update (priv->target_prefix, priv->appid, priv->bundle_file, cancellable, &internal_error);
+  if (is_full_update) {
+    g_autoptr(EamObjectStore) store = NULL;
+    if (eam_config_get_deduplicate ())
+      store = eam_object_store_new (priv->target_prefix);
+
+    g_autoptr(EamProgress) progress = eam_progress_new (trans, "extract");
+
+    res = do_full_update (priv->target_prefix, priv->appid, priv->bundle_file,
+                          stream_verify ? priv->signature_file : NULL,
+                          store, progress, cancellable, &internal_error);
+  }
   else if (g_str_has_suffix (priv->bundle_file, XDELTA_BUNDLE_EXT))
     res = do_xdelta_update (priv->target_prefix, priv->appid, backupdir, priv->bundle_file, cancellable, &internal_error);
   else
@@ -332,9 +423,11 @@ eam_update_run_sync (EamTransaction *trans,
     eam_log_error_message ("Could not update the desktop's metadata");
   }
 
-  /* The update was successful; we can delete the back up directory */
+  /* The update was successful; we can delete the back up directory,
+   * and the objects only the old version was using, in the background
+   */
   if (backupdir)
-    eam_fs_rmdir_recursive (backupdir);
+    eam_trash_add (priv->source_prefix, backupdir);
 
   return TRUE;
 }
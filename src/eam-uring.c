@@ -0,0 +1,663 @@
+/* eam-uring.c: Batched file system operations
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eam-uring.h"
+
+#include "eam-config.h"
+#include "eam-log.h"
+
+/* Removing or writing a large tree costs one system call per file, or
+ * per block of data. On kernels that have io_uring, an EamUring queues
+ * those operations, and submits them to the kernel in batches with a
+ * single system call; the kernel may then run them concurrently.
+ *
+ * Only the operations whose result is not needed right away can be
+ * queued: unlinking files, and writing data to a file that is already
+ * open. The queued operations are all complete once eam_uring_flush()
+ * returns; until then, the file descriptors and the data they use must
+ * stay valid. The names are copied, so they do not need to.
+ *
+ * The ring is driven through the system calls directly, so we do not
+ * depend on liburing. Whether the kernel supports io_uring, and the
+ * operations we need, is probed at run time; when it does not,
+ * eam_uring_new() returns %NULL and the callers make the system calls
+ * themselves, as they always did. An EamUring must only be used by one
+ * thread at a time.
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The number of operations submitted at once */
+#define URING_ENTRIES           256
+
+/* The space for the names of the queued operations */
+#define URING_NAMES_SIZE        (64 * 1024)
+
+typedef enum {
+  URING_OP_UNLINKAT,
+  URING_OP_WRITE
+} UringOpType;
+
+typedef struct {
+  UringOpType type;
+
+  /* For writes, what is left to write if the kernel comes short */
+  int fd;
+  const guint8 *data;
+  gsize size;
+  gint64 offset;
+} UringOp;
+
+struct _EamUring {
+  int fd;
+
+  void *sq_ring;
+  gsize sq_ring_size;
+  void *cq_ring;
+  gsize cq_ring_size;
+
+  guint *sq_tail;
+  guint sq_mask;
+  guint *sq_array;
+  struct io_uring_sqe *sqes;
+  gsize sqes_size;
+
+  guint *cq_head;
+  guint *cq_tail;
+  guint cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* The operations queued since the last submission */
+  guint n_queued;
+  UringOp ops[URING_ENTRIES];
+
+  char names[URING_NAMES_SIZE];
+  gsize names_len;
+
+  /* The first error since the last flush */
+  int error;
+
+  /* Set if the kernel stopped taking operations; they are then run
+   * synchronously
+   */
+  gboolean broken;
+
+  /* See eam_uring_fail_submit_after() */
+  guint fail_after;
+  int fail_error;
+};
+
+static int
+uring_setup (guint entries,
+             struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter (int fd,
+             guint to_submit,
+             guint min_complete,
+             guint flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register (int fd,
+                guint opcode,
+                void *arg,
+                guint n_args)
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+static gboolean
+uring_probe_ops (int fd)
+{
+  static const guint8 needed[] = { IORING_OP_UNLINKAT, IORING_OP_WRITE };
+  gsize size = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op);
+  g_autofree struct io_uring_probe *probe = g_malloc0 (size);
+
+  if (uring_register (fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    return FALSE;
+
+  for (guint i = 0; i < G_N_ELEMENTS (needed); i++) {
+    if (needed[i] > probe->last_op ||
+        (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_uring_is_supported:
+ *
+ * Checks, once, whether the kernel supports the operations we queue.
+ *
+ * io_uring is not used if the IoUring key of the Install group of the
+ * configuration is false, or if EAM_IO_URING=0 is set in the
+ * environment, which is useful to compare both code paths.
+ *
+ * Returns: %TRUE if io_uring can be used
+ */
+gboolean
+eam_uring_is_supported (void)
+{
+  static gsize initialized = 0;
+  static gboolean supported = FALSE;
+
+  if (g_once_init_enter (&initialized)) {
+    if (eam_config_get_io_uring () &&
+        g_strcmp0 (g_getenv ("EAM_IO_URING"), "0") != 0) {
+      struct io_uring_params params;
+
+      memset (&params, 0, sizeof (params));
+
+      /* Seccomp filters usually make this fail with EPERM or ENOSYS */
+      int fd = uring_setup (4, &params);
+
+      if (fd >= 0) {
+        supported = uring_probe_ops (fd);
+        (void) close (fd);
+      }
+    }
+
+    eam_log_debug_message ("io_uring is %s", supported ? "supported" : "not supported");
+
+    g_once_init_leave (&initialized, 1);
+  }
+
+  return supported;
+}
+
+/**
+ * eam_uring_new:
+ *
+ * Returns: (transfer full): a new #EamUring, or %NULL if io_uring
+ *   cannot be used
+ */
+EamUring *
+eam_uring_new (void)
+{
+  if (!eam_uring_is_supported ())
+    return NULL;
+
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+
+  int fd = uring_setup (URING_ENTRIES, &params);
+  if (fd < 0) {
+    eam_log_debug_message ("Unable to set up io_uring: %s", g_strerror (errno));
+    return NULL;
+  }
+
+  EamUring *ring = g_new0 (EamUring, 1);
+
+  ring->fd = fd;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (guint);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  /* Since Linux 5.4, both rings share the same mapping */
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_ring_size = MAX (ring->sq_ring_size, ring->cq_ring_size);
+    ring->cq_ring_size = 0;
+  }
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto error;
+  }
+
+  if (ring->cq_ring_size == 0) {
+    ring->cq_ring = ring->sq_ring;
+  }
+  else {
+    ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto error;
+    }
+  }
+
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto error;
+  }
+
+  guint8 *sq = ring->sq_ring;
+  guint8 *cq = ring->cq_ring;
+
+  ring->sq_tail = (guint *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(guint *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (guint *) (sq + params.sq_off.array);
+
+  ring->cq_head = (guint *) (cq + params.cq_off.head);
+  ring->cq_tail = (guint *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(guint *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return ring;
+
+error:
+  eam_log_debug_message ("Unable to map the io_uring rings: %s", g_strerror (errno));
+  eam_uring_free (ring);
+
+  return NULL;
+}
+
+void
+eam_uring_free (EamUring *ring)
+{
+  if (ring == NULL)
+    return;
+
+  if (ring->n_queued > 0 && !eam_uring_flush (ring))
+    eam_log_error_message ("Queued file system operations failed: %s", g_strerror (errno));
+
+  if (ring->sqes != NULL)
+    (void) munmap (ring->sqes, ring->sqes_size);
+
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    (void) munmap (ring->cq_ring, ring->cq_ring_size);
+
+  if (ring->sq_ring != NULL)
+    (void) munmap (ring->sq_ring, ring->sq_ring_size);
+
+  (void) close (ring->fd);
+  g_free (ring);
+}
+
+static void
+uring_set_error (EamUring *ring,
+                 int error)
+{
+  if (ring->error == 0)
+    ring->error = error;
+}
+
+static void
+uring_complete (EamUring *ring,
+                UringOp *op,
+                int res)
+{
+  if (op->type == URING_OP_UNLINKAT) {
+    /* Files that are already gone are fine */
+    if (res < 0 && res != -ENOENT)
+      uring_set_error (ring, -res);
+
+    return;
+  }
+
+  /* The kernel may write less than asked, or bounce the request; the
+   * rest of the data is written synchronously
+   */
+  if (res < 0 && res != -EAGAIN && res != -EINTR) {
+    uring_set_error (ring, -res);
+    return;
+  }
+
+  gsize written = MAX (res, 0);
+  const guint8 *data = op->data + written;
+  gsize size = op->size - written;
+  gint64 offset = op->offset + written;
+
+  while (size > 0) {
+    gssize n = pwrite (op->fd, data, size, offset);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      uring_set_error (ring, errno);
+      return;
+    }
+
+    data += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+/* Makes io_uring_enter() fail like the kernel would, for the tests */
+static int
+uring_enter_checked (EamUring *ring,
+                     guint *to_submit,
+                     guint *min_complete)
+{
+  if (ring->fail_error == 0 || *to_submit == 0)
+    return uring_enter (ring->fd, *to_submit, *min_complete, IORING_ENTER_GETEVENTS);
+
+  if (ring->fail_after == 0) {
+    errno = ring->fail_error;
+    return -1;
+  }
+
+  /* Only the operations before the failure go in */
+  if (*to_submit > ring->fail_after) {
+    *to_submit = ring->fail_after;
+    *min_complete = 0;
+  }
+
+  int res = uring_enter (ring->fd, *to_submit, *min_complete, IORING_ENTER_GETEVENTS);
+
+  if (res > 0)
+    ring->fail_after -= MIN ((guint) res, *to_submit);
+
+  return res;
+}
+
+/* Submits the queued operations, and waits for all of them.
+ *
+ * The operations reference memory of the callers, which they free once
+ * the ring is flushed, so every operation the kernel took is waited
+ * for, even once submitting fails; the operations it did not take are
+ * lost, and reported as the error.
+ */
+static void
+uring_submit (EamUring *ring)
+{
+  guint n_submitted = 0;
+  guint n_completed = 0;
+
+  if (ring->n_queued == 0 || ring->broken)
+    return;
+
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail + ring->n_queued, __ATOMIC_RELEASE);
+
+  while (n_completed < n_submitted || (!ring->broken && n_submitted < ring->n_queued)) {
+    guint to_submit = ring->broken ? 0 : ring->n_queued - n_submitted;
+    guint min_complete = n_submitted + to_submit - n_completed;
+    int res = uring_enter_checked (ring, &to_submit, &min_complete);
+
+    if (res < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+
+      /* Nothing that the kernel still reads from may be given back */
+      if (ring->broken)
+        g_error ("Unable to wait for queued file system operations: %s", g_strerror (errno));
+
+      /* The ring cannot be used anymore */
+      uring_set_error (ring, errno);
+      ring->broken = TRUE;
+      continue;
+    }
+
+    n_submitted += MIN ((guint) res, to_submit);
+
+    guint head = *ring->cq_head;
+    guint tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+      uring_complete (ring, &ring->ops[cqe->user_data], cqe->res);
+      n_completed += 1;
+    }
+
+    __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  ring->n_queued = 0;
+  ring->names_len = 0;
+}
+
+/* Makes room for one more operation, and a name of @name_len bytes */
+static gboolean
+uring_reserve (EamUring *ring,
+               gsize name_len)
+{
+  if (ring->n_queued == URING_ENTRIES ||
+      ring->names_len + name_len + 1 > URING_NAMES_SIZE)
+    uring_submit (ring);
+
+  return !ring->broken;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (EamUring *ring,
+               UringOpType type,
+               gsize name_len,
+               char **name_copy)
+{
+  guint index = ring->n_queued++;
+  guint tail = *ring->sq_tail + index;
+  struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+  ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->user_data = index;
+
+  memset (&ring->ops[index], 0, sizeof (UringOp));
+  ring->ops[index].type = type;
+
+  if (name_copy != NULL) {
+    *name_copy = ring->names + ring->names_len;
+    ring->names_len += name_len + 1;
+  }
+
+  return sqe;
+}
+
+/**
+ * eam_uring_unlinkat:
+ * @ring: a #EamUring
+ * @dfd: a directory
+ * @name: the name of the file in @dfd
+ * @flags: the flags of unlinkat()
+ *
+ * Queues the removal of @name; it is not an error if @name does not
+ * exist. @dfd must stay open until the next flush.
+ */
+void
+eam_uring_unlinkat (EamUring *ring,
+                    int dfd,
+                    const char *name,
+                    int flags)
+{
+  gsize len = strlen (name);
+
+  if (!uring_reserve (ring, len)) {
+    if (unlinkat (dfd, name, flags) < 0)
+      uring_complete (ring, &(UringOp) { .type = URING_OP_UNLINKAT }, -errno);
+    return;
+  }
+
+  char *copy;
+  struct io_uring_sqe *sqe = uring_get_sqe (ring, URING_OP_UNLINKAT, len, &copy);
+
+  memcpy (copy, name, len + 1);
+
+  sqe->opcode = IORING_OP_UNLINKAT;
+  sqe->fd = dfd;
+  sqe->addr = (guint64) (guintptr) copy;
+  sqe->unlink_flags = flags;
+}
+
+/**
+ * eam_uring_write:
+ * @ring: a #EamUring
+ * @fd: a file
+ * @data: the data to write
+ * @size: the size of @data
+ * @offset: where to write @data in @fd
+ *
+ * Queues writing @data to @fd; both must stay valid until the next
+ * flush.
+ */
+void
+eam_uring_write (EamUring *ring,
+                 int fd,
+                 const void *data,
+                 gsize size,
+                 gint64 offset)
+{
+  /* A single write is limited to what fits in the result */
+  while (size > 0) {
+    gsize n = MIN (size, G_MAXINT32 & ~4095);
+    UringOp write_op = {
+      .type = URING_OP_WRITE,
+      .fd = fd,
+      .data = data,
+      .size = n,
+      .offset = offset,
+    };
+
+    if (uring_reserve (ring, 0)) {
+      struct io_uring_sqe *sqe = uring_get_sqe (ring, URING_OP_WRITE, 0, NULL);
+
+      ring->ops[sqe->user_data] = write_op;
+
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = fd;
+      sqe->addr = (guint64) (guintptr) data;
+      sqe->len = n;
+      sqe->off = offset;
+    }
+    else {
+      uring_complete (ring, &write_op, 0);
+    }
+
+    data = (const guint8 *) data + n;
+    size -= n;
+    offset += n;
+  }
+}
+
+/**
+ * eam_uring_fail_submit_after:
+ * @ring: a #EamUring
+ * @n_ops: the number of operations the kernel takes
+ * @error: the error of the submissions after these
+ *
+ * Makes @ring behave as if the kernel stopped taking operations with
+ * @error after the next @n_ops, which cannot be provoked otherwise; it
+ * is only meant for the tests.
+ */
+void
+eam_uring_fail_submit_after (EamUring *ring,
+                             guint n_ops,
+                             int error)
+{
+  ring->fail_after = n_ops;
+  ring->fail_error = error;
+}
+
+/**
+ * eam_uring_flush:
+ * @ring: a #EamUring
+ *
+ * Submits the operations queued in @ring, and waits for all of them to
+ * complete; operations are also submitted whenever the ring is full.
+ *
+ * Returns: %TRUE if all the operations queued since the last flush
+ *   succeeded; otherwise, %FALSE, with errno set to the first error
+ */
+gboolean
+eam_uring_flush (EamUring *ring)
+{
+  uring_submit (ring);
+
+  if (ring->error != 0) {
+    errno = ring->error;
+    ring->error = 0;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct _EamUring {
+  int unused;
+};
+
+gboolean
+eam_uring_is_supported (void)
+{
+  return FALSE;
+}
+
+EamUring *
+eam_uring_new (void)
+{
+  return NULL;
+}
+
+void
+eam_uring_free (EamUring *ring)
+{
+  g_free (ring);
+}
+
+void
+eam_uring_unlinkat (EamUring *ring,
+                    int dfd,
+                    const char *name,
+                    int flags)
+{
+  g_return_if_reached ();
+}
+
+void
+eam_uring_write (EamUring *ring,
+                 int fd,
+                 const void *data,
+                 gsize size,
+                 gint64 offset)
+{
+  g_return_if_reached ();
+}
+
+void
+eam_uring_fail_submit_after (EamUring *ring,
+                             guint n_ops,
+                             int error)
+{
+  g_return_if_reached ();
+}
+
+gboolean
+eam_uring_flush (EamUring *ring)
+{
+  g_return_val_if_reached (FALSE);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
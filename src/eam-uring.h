@@ -0,0 +1,49 @@
+/* eam-uring.h: Batched file system operations
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamUring EamUring;
+
+gboolean        eam_uring_is_supported  (void);
+
+EamUring *      eam_uring_new           (void);
+void            eam_uring_free          (EamUring *ring);
+
+void            eam_uring_unlinkat      (EamUring *ring,
+                                         int dfd,
+                                         const char *name,
+                                         int flags);
+void            eam_uring_write         (EamUring *ring,
+                                         int fd,
+                                         const void *data,
+                                         gsize size,
+                                         gint64 offset);
+gboolean        eam_uring_flush         (EamUring *ring);
+
+void            eam_uring_fail_submit_after (EamUring *ring,
+                                             guint n_ops,
+                                             int error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamUring, eam_uring_free)
+
+G_END_DECLS
@@ -22,65 +22,56 @@
 #include <string.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n.h>
-#include <archive.h>
-#include <archive_entry.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ftw.h>
 #include <pwd.h>
 #include <grp.h>
+#include <unistd.h>
 
-#include <libsoup/soup.h>
 #include <gio/gio.h>
 
 #include "eam-utils.h"
 
+#include "eam-blake3.h"
 #include "eam-config.h"
+#include "eam-copy.h"
+#include "eam-downloader.h"
 #include "eam-error.h"
+#include "eam-extract.h"
+#include "eam-extract-filter.h"
 #include "eam-fs-utils.h"
+#include "eam-journal.h"
 #include "eam-log.h"
+#include "eam-payload-cache.h"
+#include "eam-sha256.h"
+#include "eam-signature.h"
+#include "eam-verify-cache.h"
 
 #define BUNDLE_SIGNATURE_EXT ".asc"
 
-G_DEFINE_AUTOPTR_CLEANUP_FUNC (FILE, fclose)
+/* Bundles are hashed in large blocks, to keep the system calls down */
+#define VERIFY_BLOCK_SIZE (1024 * 1024)
 
-#define BLOCKSIZE 32768
+/* External payloads are hashed as they are downloaded, in blocks of
+ * this size
+ */
+#define DOWNLOAD_BLOCK_SIZE (256 * 1024)
+
+/* The digests an external payload can be checked against */
+typedef enum {
+  EXTERNAL_DIGEST_SHA256,
+  EXTERNAL_DIGEST_BLAKE3
+} ExternalDigest;
 
 static gboolean
-verify_checksum_hash (const char    *source_file,
-                      const char    *checksum_str,
-                      gssize         checksum_len,
-                      GChecksumType  checksum_type)
+checksum_matches (const char *hash,
+                  const char *checksum_str)
 {
-  if (checksum_len < 0)
-    checksum_len = strlen (checksum_str);
-
-  gssize hash_len = g_checksum_type_get_length (checksum_type) * 2;
-  if (checksum_len < hash_len)
+  gsize hash_len = strlen (hash);
+  if (strlen (checksum_str) < hash_len)
     return FALSE;
 
-  g_autoptr(FILE) fp = fopen (source_file, "r");
-  if (fp == NULL)
-    return FALSE;
-
-  g_autoptr(GChecksum) checksum = g_checksum_new (checksum_type);
-
-  guint8 buffer[BLOCKSIZE];
-  while (1) {
-    size_t n = fread (buffer, 1, BLOCKSIZE, fp);
-    if (n > 0) {
-      g_checksum_update (checksum, buffer, n);
-      continue;
-    }
-
-    if (feof (fp))
-      break;
-
-    if (ferror (fp))
-      return FALSE;
-  }
-
-  const char *hash = g_checksum_get_string (checksum);
-
   return (g_ascii_strncasecmp (checksum_str, hash, hash_len) == 0);
 }
 
@@ -105,26 +96,75 @@ run_cmd (const char * const *argv,
   return g_subprocess_get_successful (sub);
 }
 
+/**
+ * eam_utils_verify_signature:
+ * @source_file: the path of the signed file
+ * @signature_file: the path of the detached signature of @source_file
+ * @cancellable: (allow-none): a #GCancellable
+ *
+ * Verifies the signature of @source_file, in process when possible,
+ * and through gpgv otherwise. Successful verifications are recorded
+ * in the verified bundles cache.
+ *
+ * Returns: %TRUE if the signature is valid
+ */
 gboolean
 eam_utils_verify_signature (const char *source_file,
                             const char *signature_file,
                             GCancellable *cancellable)
 {
-  const char *gpgdir = eam_config_get_gpg_keyring ();
-
-  char *argv[9] = {
-    "gpgv",
-    "--keyring",
-    (char *) gpgdir,
-    "--logger-fd",
-    "1",
-    "--quiet",
-    (char *) signature_file,
-    (char *) source_file,
-    NULL
-  };
+  g_autofree char *cache_key = eam_verify_cache_get_key (source_file, signature_file);
 
-  return run_cmd ((const char * const *) argv, cancellable);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EamSignatureStream) signature = eam_signature_stream_new (signature_file, &error);
+
+  if (signature == NULL) {
+    eam_log_error_message ("Unable to verify '%s': %s", source_file, error->message);
+    return FALSE;
+  }
+
+  int fd = open (source_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    eam_log_error_message ("Unable to open '%s': %s", source_file, g_strerror (errno));
+    return FALSE;
+  }
+
+  (void) posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  g_autofree guint8 *buffer = g_malloc (VERIFY_BLOCK_SIZE);
+  gboolean res = TRUE;
+
+  while (res) {
+    if (g_cancellable_is_cancelled (cancellable)) {
+      res = FALSE;
+      break;
+    }
+
+    gssize n = read (fd, buffer, VERIFY_BLOCK_SIZE);
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0) {
+      eam_log_error_message ("Unable to read '%s': %s", source_file, g_strerror (errno));
+      res = FALSE;
+      break;
+    }
+
+    if (n == 0)
+      break;
+
+    res = eam_signature_stream_update (signature, buffer, n);
+  }
+
+  (void) close (fd);
+
+  /* Let the stream collect gpgv, if it is running */
+  gboolean verified = eam_signature_stream_finish (signature, cancellable);
+
+  if (res && verified)
+    eam_verify_cache_add (source_file, signature_file, cache_key);
+
+  return res && verified;
 }
 
 GKeyFile *
@@ -185,134 +225,284 @@ eam_utils_app_is_installed (const char *prefix,
   return TRUE;
 }
 
-static int
-copy_data (struct archive *ar,
-           struct archive *aw)
+static EamExtractor *
+bundle_extractor_new (const char *bundle_file,
+                      const char *target_prefix,
+                      EamDigests *digests,
+                      EamProgress *progress)
 {
-  const void *buff;
-  size_t size;
-  off_t offset;
+  EamExtractor *extractor = eam_extractor_new (bundle_file, target_prefix);
+
+  eam_extractor_set_n_writers (extractor, eam_config_get_extract_workers ());
+  eam_extractor_set_preallocate (extractor, eam_config_get_preallocate ());
+  eam_extractor_set_digests (extractor, digests);
+  eam_extractor_set_progress (extractor, progress);
+
+  const char *reader = eam_config_get_bundle_reader ();
+  if (g_strcmp0 (reader, "buffered") == 0)
+    eam_extractor_set_reader (extractor, EAM_EXTRACTOR_READER_BUFFERED);
+  else if (g_strcmp0 (reader, "mmap") == 0)
+    eam_extractor_set_reader (extractor, EAM_EXTRACTOR_READER_MMAP);
+  else
+    eam_log_error_message ("Unknown bundle reader '%s', using the default", reader);
+
+  return extractor;
+}
 
-  while (TRUE) {
-    int err = archive_read_data_block (ar, &buff, &size, &offset);
+/* Opens the journal for extracting @bundle_file into @extract_dir;
+ * unless a previous extraction of the same bundle is resumed, the
+ * contents of @extract_dir are discarded
+ */
+static EamJournal *
+bundle_journal_open (const char *bundle_file,
+                     const char *signature_file,
+                     const char *extract_dir)
+{
+  g_autofree char *journal_file = g_strconcat (extract_dir, ".journal", NULL);
+  g_autofree char *bundle_id = NULL;
+  EamJournal *journal = NULL;
 
-    if (err == ARCHIVE_EOF)
-      return ARCHIVE_OK;
+  if (eam_config_get_resumable_extraction ())
+    bundle_id = eam_verify_cache_get_key (bundle_file, signature_file);
 
-    if (err != ARCHIVE_OK)
-      return err;
+  if (bundle_id != NULL)
+    journal = eam_journal_open (journal_file, bundle_id);
+  else
+    eam_journal_remove (journal_file);
 
-    err = archive_write_data_block (aw, buff, size, offset);
-    if (err != ARCHIVE_OK)
-      return err;
-  }
+  if (journal == NULL || !eam_journal_is_resumed (journal))
+    eam_fs_rmdir_recursive (extract_dir);
+
+  return journal;
+}
 
-  g_assert_not_reached ();
+static void
+bundle_journal_close (EamJournal *journal,
+                      const char *extract_dir)
+{
+  g_autofree char *journal_file = g_strconcat (extract_dir, ".journal", NULL);
+
+  eam_journal_free (journal);
+  eam_journal_remove (journal_file);
 }
 
 gboolean
 eam_utils_bundle_extract (const char *bundle_file,
                           const char *target_prefix,
                           const char *appid,
+                          EamDigests *digests,
+                          EamProgress *progress,
                           GCancellable *cancellable)
 {
-#define READ_ARCHIVE_BLOCK_SIZE      8192
+  g_autofree char *extract_dir = g_build_filename (target_prefix, appid, NULL);
+  EamJournal *journal = bundle_journal_open (bundle_file, NULL, extract_dir);
 
-  gboolean ret = FALSE;
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new_from_config ();
 
-  struct archive *a = archive_read_new ();
-  archive_read_support_filter_all (a);
-  archive_read_support_format_all (a);
+  g_autoptr(EamExtractor) extractor = bundle_extractor_new (bundle_file, target_prefix, digests, progress);
+  eam_extractor_set_journal (extractor, journal);
+  eam_extractor_set_filter (extractor, filter);
 
-  struct archive *ext = archive_write_disk_new ();
-  int flags = ARCHIVE_EXTRACT_TIME
-            | ARCHIVE_EXTRACT_PERM
-            | ARCHIVE_EXTRACT_ACL
-            | ARCHIVE_EXTRACT_FFLAGS;
-  archive_write_disk_set_options (ext, flags);
-  archive_write_disk_set_standard_lookup (ext);
+  gboolean res = eam_extractor_run (extractor, cancellable);
 
-  int err = archive_read_open_filename (a, bundle_file, READ_ARCHIVE_BLOCK_SIZE);
-  if (err != ARCHIVE_OK)
-    goto bail;
+  /* The bundle does not match what the interrupted extraction left
+   * behind, so it is extracted again from scratch
+   */
+  if (!res && eam_extractor_get_resume_rejected (extractor)) {
+    bundle_journal_close (journal, extract_dir);
+    journal = NULL;
 
-  while (TRUE) {
-    struct archive_entry *entry;
+    eam_fs_rmdir_recursive (extract_dir);
 
-    /* This is not a libarchive error condition, so we reset the error code
-     * and log the cancellation here
-     */
-    if (g_cancellable_is_cancelled (cancellable)) {
-      err = ARCHIVE_OK;
-      ret = FALSE;
+    eam_extractor_set_journal (extractor, NULL);
+    res = eam_extractor_run (extractor, cancellable);
+  }
 
-      eam_log_error_message ("Extracting bundle was cancelled");
-      goto bail;
-    }
+  if (res && filter != NULL)
+    res = eam_extract_filter_record (filter, extract_dir);
 
-    err = archive_read_next_header (a, &entry);
+  /* The journal is only left behind if we never get here */
+  bundle_journal_close (journal, extract_dir);
 
-    if (err == ARCHIVE_EOF) {
-      err = ARCHIVE_OK;
-      break;
-    }
+  return res;
+}
 
-    if (err != ARCHIVE_OK)
-      goto bail;
+typedef struct {
+  EamSignatureStream *signature;
+  gboolean rejected;
+} VerifyTap;
 
-    const char *entpath = archive_entry_pathname (entry);
-    g_autofree char *newpath = g_build_filename (target_prefix, entpath, NULL);
+static gboolean
+verify_tap (const void *data,
+            gsize size,
+            gpointer user_data)
+{
+  VerifyTap *tap = user_data;
 
-    eam_log_info_message ("Extracting '%s' to '%s", entpath, newpath);
-    archive_entry_copy_pathname (entry, newpath);
+  if (!eam_signature_stream_update (tap->signature, data, size))
+    tap->rejected = TRUE;
 
-    err = archive_write_header (ext, entry);
-    if (err == ARCHIVE_OK && archive_entry_size (entry) > 0) {
-      err = copy_data (a, ext);
-      if (err != ARCHIVE_OK)
-        goto bail;
-    }
+  return !tap->rejected;
+}
+
+/**
+ * eam_utils_bundle_extract_verified:
+ * @bundle_file: the path of the bundle
+ * @signature_file: the path of the detached signature of @bundle_file
+ * @target_prefix: the directory to extract the bundle into
+ * @appid: the application id
+ * @digests: (allow-none): a #EamDigests to record the checksums of the files in
+ * @progress: (allow-none): a #EamProgress for the extraction
+ * @cancellable: (allow-none): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Extracts @bundle_file while verifying its signature, reading the
+ * bundle only once.
+ *
+ * The bundle is extracted into a quarantine directory under
+ * @target_prefix, and @appid is only moved into @target_prefix once
+ * the signature has been found to match the whole bundle.
+ *
+ * A resumed extraction skips writing the files a previous attempt
+ * completed, but still reads the whole bundle, so the signature is
+ * always checked against all of it; if the data of a skipped file
+ * does not match what the previous attempt wrote, the extraction is
+ * started over.
+ *
+ * Returns: %TRUE if the bundle was verified and extracted
+ */
+gboolean
+eam_utils_bundle_extract_verified (const char *bundle_file,
+                                   const char *signature_file,
+                                   const char *target_prefix,
+                                   const char *appid,
+                                   EamDigests *digests,
+                                   EamProgress *progress,
+                                   GCancellable *cancellable,
+                                   GError **error)
+{
+  g_autofree char *cache_key = eam_verify_cache_get_key (bundle_file, signature_file);
 
-    err = archive_write_finish_entry (ext);
-    if (err != ARCHIVE_OK)
-      goto bail;
+  g_autoptr(EamSignatureStream) signature = eam_signature_stream_new (signature_file, error);
+  if (signature == NULL)
+    return FALSE;
+
+  if (g_mkdir_with_parents (target_prefix, 0755) < 0) {
+    int saved_errno = errno;
+    g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                 "Unable to create '%s': %s",
+                 target_prefix, g_strerror (saved_errno));
+    return FALSE;
   }
 
-  ret = TRUE;
+  /* The quarantine directory has a stable name, so that an interrupted
+   * extraction can be found and resumed
+   */
+  g_autofree char *quarantine_name = g_strconcat (".quarantine-", appid, NULL);
+  g_autofree char *quarantine = g_build_filename (target_prefix, quarantine_name, NULL);
 
-bail:
-  {
-    char errstr[1024];
-    memset (errstr, '\0', 1024);
+  EamJournal *journal = bundle_journal_open (bundle_file, signature_file, quarantine);
+
+  VerifyTap tap = { signature, FALSE };
 
-    if (err != ARCHIVE_OK) {
-      const gchar *str = archive_error_string (a);
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new_from_config ();
 
-      if (!str)
-        str = archive_error_string (ext);
+  g_autoptr(EamExtractor) extractor = bundle_extractor_new (bundle_file, quarantine, digests, progress);
+  eam_extractor_set_tap_func (extractor, verify_tap, &tap);
+  eam_extractor_set_filter (extractor, filter);
 
-      if (str)
-        memcpy (errstr, str, MIN (strlen (str), 1023));
+  gboolean extracted, verified;
+
+  while (TRUE) {
+    if (g_mkdir (quarantine, 0700) < 0 && errno != EEXIST) {
+      int saved_errno = errno;
+      g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                   "Unable to create a quarantine directory in '%s': %s",
+                   target_prefix, g_strerror (saved_errno));
+      bundle_journal_close (journal, quarantine);
+      return FALSE;
     }
 
-    if (err != ARCHIVE_OK)
-      eam_log_error_message ("Unable to extract archive '%s': %s", bundle_file, errstr);
+    eam_extractor_set_journal (extractor, journal);
+
+    extracted = eam_extractor_run (extractor, cancellable);
+    verified = eam_signature_stream_finish (signature, cancellable);
+
+    if (extracted || journal == NULL || !eam_extractor_get_resume_rejected (extractor))
+      break;
+
+    /* The bundle does not match what the interrupted extraction left
+     * behind, so it is extracted and verified again from scratch
+     */
+    bundle_journal_close (journal, quarantine);
+    journal = NULL;
+
+    eam_fs_rmdir_recursive (quarantine);
+
+    g_clear_pointer (&signature, eam_signature_stream_free);
+    signature = eam_signature_stream_new (signature_file, error);
+    if (signature == NULL)
+      return FALSE;
+
+    tap.signature = signature;
+    tap.rejected = FALSE;
   }
 
-  archive_read_free (a);
-  archive_write_free (ext);
+  /* Even if the extraction fails later on, a retry can skip this */
+  if (verified)
+    eam_verify_cache_add (bundle_file, signature_file, cache_key);
+
+  /* The journal is only left behind if we never get here */
+  bundle_journal_close (journal, quarantine);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto bail;
+
+  if (!extracted && !tap.rejected) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
+                         "Could not extract the bundle");
+    goto bail;
+  }
+
+  if (!verified) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_INVALID_FILE,
+                         "The signature for the application bundle is invalid");
+    goto bail;
+  }
+
+  /* Commit the verified tree */
+  g_autofree char *sdir = g_build_filename (quarantine, appid, NULL);
+  g_autofree char *tdir = g_build_filename (target_prefix, appid, NULL);
+
+  if (filter != NULL && !eam_extract_filter_record (filter, sdir)) {
+    g_set_error_literal (error, EAM_ERROR, EAM_ERROR_FAILED,
+                         "Unable to record the partial extraction");
+    goto bail;
+  }
+
+  if (!eam_fs_rmdir_recursive (tdir) || rename (sdir, tdir) != 0) {
+    g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                 "Unable to move the verified bundle to '%s'", tdir);
+    goto bail;
+  }
 
-  return ret;
+  eam_fs_rmdir_recursive (quarantine);
 
-#undef READ_ARCHIVE_BLOCK_SIZE
+  return TRUE;
+
+bail:
+  eam_fs_rmdir_recursive (quarantine);
+
+  return FALSE;
 }
 
 static int
-has_external_script (const char  *prefix,
-                     const char  *appid,
-                     char       **url,
-                     char       **filename,
-                     char       **digest)
+has_external_script (const char      *prefix,
+                     const char      *appid,
+                     char           **url,
+                     char           **filename,
+                     ExternalDigest  *digest_type,
+                     char           **digest)
 {
   g_autofree char *info = g_build_filename (prefix, appid, ".info", NULL);
   g_autoptr(GKeyFile) kf = g_key_file_new ();
@@ -338,72 +528,576 @@ has_external_script (const char  *prefix,
     return -1;
   }
 
-  *digest = g_key_file_get_string (kf, "External", "sha256sum", &err);
+  /* BLAKE3 is preferred when both are present, as it is faster */
+  const char *digest_key = "sha256sum";
+  *digest_type = EXTERNAL_DIGEST_SHA256;
+
+  if (g_key_file_has_key (kf, "External", "blake3sum", NULL)) {
+    digest_key = "blake3sum";
+    *digest_type = EXTERNAL_DIGEST_BLAKE3;
+  }
+
+  *digest = g_key_file_get_string (kf, "External", digest_key, &err);
   if (err) {
-    eam_log_error_message ("Could find 'sha256sum' key in %s: %s", info, err->message);
+    eam_log_error_message ("Could find '%s' key in %s: %s", digest_key, info, err->message);
     return -1;
   }
 
   return 1;
 }
 
+/* Partial downloads of external payloads are kept in the cache
+ * directory, named after their digest, next to a key file with their
+ * URL and the validator (ETag or Last-Modified) the server sent, so
+ * that an interrupted download is resumed where it stopped, instead
+ * of starting over
+ */
+#define PARTIAL_DOWNLOAD_DIR            "external"
+#define PARTIAL_DOWNLOAD_GROUP          "Partial"
+#define PARTIAL_DOWNLOAD_KEY_URL        "URL"
+#define PARTIAL_DOWNLOAD_KEY_VALIDATOR  "Validator"
+
+static char *
+partial_download_get_path (const char *key)
+{
+  g_autofree char *basename = g_strconcat (key, ".part", NULL);
+
+  return g_build_filename (eam_config_get_cache_dir (), PARTIAL_DOWNLOAD_DIR, basename, NULL);
+}
+
+/* Returns the validator to resume the download of @url with, and sets
+ * @offset to the size of what we have, or returns %NULL if the partial
+ * download cannot be resumed
+ */
+static char *
+partial_download_load (const char *part_path,
+                       const char *url,
+                       goffset *offset)
+{
+  g_autofree char *info_path = g_strconcat (part_path, ".info", NULL);
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (keyfile, info_path, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  g_autofree char *part_url =
+    g_key_file_get_string (keyfile, PARTIAL_DOWNLOAD_GROUP, PARTIAL_DOWNLOAD_KEY_URL, NULL);
+  g_autofree char *validator =
+    g_key_file_get_string (keyfile, PARTIAL_DOWNLOAD_GROUP, PARTIAL_DOWNLOAD_KEY_VALIDATOR, NULL);
+
+  if (g_strcmp0 (part_url, url) != 0 || validator == NULL)
+    return NULL;
+
+  struct stat st;
+  if (g_stat (part_path, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size == 0)
+    return NULL;
+
+  *offset = st.st_size;
+
+  return g_steal_pointer (&validator);
+}
+
+/* Without a validator, the download cannot be resumed, so any stale
+ * information is dropped
+ */
+static void
+partial_download_save (const char *part_path,
+                       const char *url,
+                       const char *validator)
+{
+  g_autofree char *info_path = g_strconcat (part_path, ".info", NULL);
+
+  if (validator == NULL) {
+    g_unlink (info_path);
+    return;
+  }
+
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_key_file_set_string (keyfile, PARTIAL_DOWNLOAD_GROUP, PARTIAL_DOWNLOAD_KEY_URL, url);
+  g_key_file_set_string (keyfile, PARTIAL_DOWNLOAD_GROUP, PARTIAL_DOWNLOAD_KEY_VALIDATOR, validator);
+
+  g_autoptr(GError) err = NULL;
+  if (!g_key_file_save_to_file (keyfile, info_path, &err))
+    eam_log_error_message ("Could not save %s: %s", info_path, err->message);
+}
+
+static void
+partial_download_discard (const char *part_path)
+{
+  g_autofree char *info_path = g_strconcat (part_path, ".info", NULL);
+
+  g_unlink (part_path);
+  g_unlink (info_path);
+}
+
+/* The bytes downloaded by a previous attempt are hashed again, as the
+ * state of the hash cannot be saved; so are payloads from the cache
+ */
+static gboolean
+hash_file_prefix (GFile *part,
+                  goffset size,
+                  EamSha256 *sha256,
+                  EamBlake3 *blake3,
+                  guint8 *buffer,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  g_autoptr(GInputStream) ins = G_INPUT_STREAM (g_file_read (part, cancellable, error));
+  if (ins == NULL)
+    return FALSE;
+
+  while (size > 0) {
+    gsize bytes_read;
+
+    if (!g_input_stream_read_all (ins, buffer, MIN (size, DOWNLOAD_BLOCK_SIZE),
+                                  &bytes_read, cancellable, error))
+      return FALSE;
+
+    if (bytes_read == 0) {
+      g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                   "Unexpected end of file");
+      return FALSE;
+    }
+
+    if (blake3 != NULL)
+      eam_blake3_update (blake3, buffer, bytes_read);
+    else
+      eam_sha256_update (sha256, buffer, bytes_read);
+
+    size -= bytes_read;
+  }
+
+  return TRUE;
+}
+
+/* The payload is hashed while it is written, so that it is only read
+ * once; the download is stopped as soon as it goes past its declared
+ * size
+ */
+static gboolean
+download_streamed (const char *url,
+                   GInputStream *ins,
+                   const EamDownloadInfo *info,
+                   const char *part_path,
+                   EamSha256 *sha256,
+                   EamBlake3 *blake3,
+                   guint8 *buffer,
+                   GCancellable *cancellable)
+{
+  g_autoptr(GError) err = NULL;
+  g_autoptr(GFile) part = g_file_new_for_path (part_path);
+  g_autoptr(GOutputStream) outs = NULL;
+
+  if (info->start > 0) {
+    eam_log_info_message ("Resuming download of %s at byte %" G_GINT64_FORMAT,
+                          url, (gint64) info->start);
+
+    if (!hash_file_prefix (part, info->start, sha256, blake3, buffer, cancellable, &err)) {
+      eam_log_error_message ("Could not read %s: %s", part_path, err->message);
+      partial_download_discard (part_path);
+      return FALSE;
+    }
+
+    outs = G_OUTPUT_STREAM (g_file_append_to (part, G_FILE_CREATE_PRIVATE, cancellable, &err));
+  }
+  else {
+    /* The file is created in place, rather than replaced on close, so
+     * that what was written survives an interruption
+     */
+    g_unlink (part_path);
+    outs = G_OUTPUT_STREAM (g_file_create (part, G_FILE_CREATE_PRIVATE, cancellable, &err));
+  }
+
+  if (outs == NULL) {
+    eam_log_error_message ("Could not create %s: %s", part_path, err->message);
+    return FALSE;
+  }
+
+  partial_download_save (part_path, url, info->validator);
+
+  eam_log_info_message ("Downloading %s into %s", url, part_path);
+
+  /* Without a Content-Length, only the digest protects us */
+  goffset len = info->content_length;
+  goffset siz = 0;
+
+  while (TRUE) {
+    gssize n = g_input_stream_read (ins, buffer, DOWNLOAD_BLOCK_SIZE, cancellable, &err);
+    if (n < 0) {
+      /* Closing the stream keeps what we got for the next attempt */
+      eam_log_error_message ("Couldn't download %s: %s", url, err->message);
+      g_output_stream_close (outs, NULL, NULL);
+      return FALSE;
+    }
+
+    if (n == 0)
+      break;
+
+    siz += n;
+    if (len >= 0 && siz > len) {
+      eam_log_error_message ("Could not save %s: more data than the declared %" G_GINT64_FORMAT " bytes",
+                             part_path, (gint64) len);
+      partial_download_discard (part_path);
+      return FALSE;
+    }
+
+    if (blake3 != NULL)
+      eam_blake3_update (blake3, buffer, n);
+    else
+      eam_sha256_update (sha256, buffer, n);
+
+    if (!g_output_stream_write_all (outs, buffer, n, NULL, cancellable, &err)) {
+      eam_log_error_message ("Could not save %s: %s", part_path, err->message);
+      return FALSE;
+    }
+  }
+
+  if (len >= 0 && siz != len) {
+    eam_log_error_message ("Could not save %s: invalid size", part_path);
+    g_output_stream_close (outs, NULL, NULL);
+    return FALSE;
+  }
+
+  if (!g_output_stream_close (outs, cancellable, &err)) {
+    eam_log_error_message ("Could not save %s: %s", part_path, err->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* A single connection to the server is often much slower than the
+ * link, so large payloads are fetched as several ranges at once, one
+ * per connection the server allows us. The file is allocated up front,
+ * and hashed once complete; if the download fails, it is cut after
+ * the first gap, so that it can be resumed by the next attempt
+ */
+static gboolean
+download_is_segmented (const EamDownloadInfo *info)
+{
+  goffset threshold = (goffset) eam_config_get_segmented_threshold () * 1024 * 1024;
+
+  return threshold > 0 &&
+         eam_config_get_max_connections_per_host () > 1 &&
+         info->accept_ranges &&
+         info->validator != NULL &&
+         info->content_length >= threshold;
+}
+
+static gboolean
+download_segmented (const char *url,
+                    GInputStream *ins,
+                    const EamDownloadInfo *info,
+                    const char *part_path,
+                    GCancellable *cancellable)
+{
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  if (info->start == 0)
+    flags |= O_TRUNC;
+
+  int fd = open (part_path, flags, 0600);
+  if (fd < 0) {
+    eam_log_error_message ("Could not create %s: %s", part_path, g_strerror (errno));
+    return FALSE;
+  }
+
+  partial_download_save (part_path, url, info->validator);
+
+  int res;
+  do {
+    res = fallocate (fd, 0, 0, info->start + info->content_length);
+  } while (res < 0 && errno == EINTR);
+
+  /* Not every file system can preallocate; running out of space, on
+   * the other hand, is better found out now
+   */
+  if (res < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+    eam_log_error_message ("Could not allocate %s: %s", part_path, g_strerror (errno));
+    (void) close (fd);
+    return FALSE;
+  }
+
+  guint n_segments = eam_config_get_max_connections_per_host ();
+
+  eam_log_info_message ("Downloading %s into %s, in %u segments from byte %" G_GINT64_FORMAT,
+                        url, part_path, n_segments, (gint64) info->start);
+
+  g_autoptr(GError) err = NULL;
+  goffset completed;
+
+  if (!eam_downloader_fetch_segments (eam_downloader_get_default (), url, ins, info,
+                                      fd, n_segments, &completed, cancellable, &err)) {
+    eam_log_error_message ("Couldn't download %s: %s", url, err->message);
+
+    if (ftruncate (fd, completed) < 0)
+      partial_download_discard (part_path);
+
+    (void) close (fd);
+    return FALSE;
+  }
+
+  if (close (fd) < 0) {
+    eam_log_error_message ("Could not save %s: %s", part_path, g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Payloads are hard linked from the cache when both are on the same
+ * file system: the cache never changes a payload in place, and one
+ * changed through its link is caught by its digest the next time it
+ * is used. Otherwise, the payload is copied by eam_copy_file_at(),
+ * which clones it or copies it in the kernel when it can, and falls
+ * back to read() and write()
+ */
+static gboolean
+link_cached_payload (const char *cached_path,
+                     const char *path)
+{
+  if (g_unlink (path) < 0 && errno != ENOENT)
+    return FALSE;
+
+  return link (cached_path, path) == 0;
+}
+
+static gboolean
+place_cached_payload (const char *cached_path,
+                      const char *path)
+{
+  if (link_cached_payload (cached_path, path))
+    return TRUE;
+
+  g_autoptr(GError) err = NULL;
+  if (!eam_copy_file_at (AT_FDCWD, cached_path, AT_FDCWD, path, &err)) {
+    eam_log_error_message ("Could not copy %s to %s: %s", cached_path, path, err->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* When the payload cannot be linked, it is hashed as it is copied, so
+ * that it is only read once
+ */
+static gboolean
+copy_file_hashed (GFile *source,
+                  GFile *target,
+                  goffset size,
+                  EamSha256 *sha256,
+                  EamBlake3 *blake3,
+                  guint8 *buffer,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  g_autoptr(GInputStream) ins = G_INPUT_STREAM (g_file_read (source, cancellable, error));
+  if (ins == NULL)
+    return FALSE;
+
+  g_autoptr(GOutputStream) outs =
+    G_OUTPUT_STREAM (g_file_replace (target, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                     cancellable, error));
+  if (outs == NULL)
+    return FALSE;
+
+  while (size > 0) {
+    gsize bytes_read;
+
+    if (!g_input_stream_read_all (ins, buffer, MIN (size, DOWNLOAD_BLOCK_SIZE),
+                                  &bytes_read, cancellable, error))
+      return FALSE;
+
+    if (bytes_read == 0) {
+      g_set_error (error, EAM_ERROR, EAM_ERROR_FAILED,
+                   "Unexpected end of file");
+      return FALSE;
+    }
+
+    if (blake3 != NULL)
+      eam_blake3_update (blake3, buffer, bytes_read);
+    else
+      eam_sha256_update (sha256, buffer, bytes_read);
+
+    if (!g_output_stream_write_all (outs, buffer, bytes_read, NULL, cancellable, error))
+      return FALSE;
+
+    size -= bytes_read;
+  }
+
+  return g_output_stream_close (outs, cancellable, error);
+}
+
+/* Payloads from the cache are checked again before use: reading one
+ * is still much cheaper than downloading it. The payload is read once,
+ * either to hash it once it is linked, or while it is copied
+ */
+static gboolean
+copy_cached_payload (const char *key,
+                     ExternalDigest digest_type,
+                     const char *digest,
+                     const char *path,
+                     GCancellable *cancellable)
+{
+  g_autofree char *cached_path = eam_payload_cache_lookup (key);
+  if (cached_path == NULL)
+    return FALSE;
+
+  GStatBuf buf;
+  if (g_stat (cached_path, &buf) < 0)
+    return FALSE;
+
+  g_autoptr(EamSha256) sha256 = NULL;
+  g_autoptr(EamBlake3) blake3 = NULL;
+
+  if (digest_type == EXTERNAL_DIGEST_BLAKE3)
+    blake3 = eam_blake3_new ();
+  else
+    sha256 = eam_sha256_new ();
+
+  g_autoptr(GError) err = NULL;
+  g_autofree guint8 *buffer = g_malloc (DOWNLOAD_BLOCK_SIZE);
+  g_autoptr(GFile) cached = g_file_new_for_path (cached_path);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  gboolean res;
+
+  if (link_cached_payload (cached_path, path))
+    res = hash_file_prefix (cached, buf.st_size, sha256, blake3, buffer, cancellable, &err);
+  else
+    res = copy_file_hashed (cached, file, buf.st_size, sha256, blake3, buffer, cancellable, &err);
+
+  if (!res) {
+    eam_log_error_message ("Could not use %s for %s: %s", cached_path, path, err->message);
+    g_unlink (path);
+    return FALSE;
+  }
+
+  const char *hash = blake3 != NULL ? eam_blake3_get_string (blake3) : eam_sha256_get_string (sha256);
+
+  if (!checksum_matches (hash, digest)) {
+    eam_log_error_message ("Cached payload %s is corrupted, discarding it", cached_path);
+    eam_payload_cache_remove (key);
+    g_unlink (path);
+    return FALSE;
+  }
+
+  eam_log_info_message ("Using cached payload %s for %s", cached_path, path);
+
+  return TRUE;
+}
+
+/* The payload is looked up in the cache first. Otherwise, it is
+ * downloaded in the cache directory, and only moved to @dir, or into
+ * the cache, once it matches @digest; if the connection fails, what
+ * was downloaded is kept for the next attempt
+ */
 static gboolean
 download_external_file (const char *appid,
                         const char *url,
                         const char *dir,
                         const char *filename,
+                        ExternalDigest digest_type,
+                        const char *digest,
                         GCancellable *cancellable)
 {
-  g_autoptr(SoupURI) uri = soup_uri_new (url);
-  if (!uri) {
-    eam_log_error_message ("Could not parse '%s' as a URL", url);
+  g_autofree char *key = eam_payload_cache_get_key (digest);
+  if (key == NULL) {
+    eam_log_error_message ("Invalid digest '%s' for %s", digest, url);
     return FALSE;
   }
 
-  g_autoptr(SoupSession) session =
-    soup_session_new_with_options (SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_DECODER,
-                                   SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_COOKIE_JAR,
-                                   SOUP_SESSION_USER_AGENT, "EOS web get ",
-                                   SOUP_SESSION_ACCEPT_LANGUAGE_AUTO, TRUE,
-                                   NULL);
+  /* TODO: Verify that we don't have any strange data in filename */
+  g_autofree char *path = g_build_filename (dir, filename, NULL);
+  guint64 cache_size = (guint64) eam_config_get_payload_cache_size () * 1024 * 1024;
+
+  if (cache_size > 0 && copy_cached_payload (key, digest_type, digest, path, cancellable))
+    return TRUE;
+
+  g_autofree char *part_path = partial_download_get_path (key);
+
+  g_autofree char *part_dir = g_path_get_dirname (part_path);
+  if (g_mkdir_with_parents (part_dir, 0755) < 0) {
+    eam_log_error_message ("Could not create %s: %s", part_dir, g_strerror (errno));
+    return FALSE;
+  }
 
-  g_autoptr(SoupMessage) msg = soup_message_new_from_uri ("GET", uri);
+  goffset offset = 0;
+  g_autofree char *validator = partial_download_load (part_path, url, &offset);
 
+  g_auto(EamDownloadInfo) info = { 0, };
   g_autoptr(GError) err = NULL;
-  g_autoptr(GInputStream) ins = soup_session_send (session, msg, cancellable, &err);
-  if (err != NULL) {
+  g_autoptr(GInputStream) ins =
+    eam_downloader_open_range (eam_downloader_get_default (), url, offset, -1, validator,
+                               &info, cancellable, &err);
+  if (ins == NULL) {
     eam_log_error_message ("Couldn't download %s: %s", url, err->message);
     return FALSE;
   }
 
-  goffset len = soup_message_headers_get_content_length (msg->response_headers);
+  g_autoptr(EamSha256) sha256 = NULL;
+  g_autoptr(EamBlake3) blake3 = NULL;
 
-  /* TODO: Verify that we don't have any strange data in filename */
-  g_autofree char *path = g_build_filename (dir, filename, NULL);
-  g_autoptr(GFile) file = g_file_new_for_path (path);
-  g_autoptr(GOutputStream) outs =
-    G_OUTPUT_STREAM (g_file_replace (file, NULL, FALSE,
-                                     G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
-                                     cancellable, &err));
-  if (err != NULL) {
-    eam_log_error_message ("Could not create %s: %s", path, err->message);
+  if (digest_type == EXTERNAL_DIGEST_BLAKE3)
+    blake3 = eam_blake3_new ();
+  else
+    sha256 = eam_sha256_new ();
+
+  g_autofree guint8 *buffer = g_malloc (DOWNLOAD_BLOCK_SIZE);
+  g_autoptr(GFile) part = g_file_new_for_path (part_path);
+
+  if (download_is_segmented (&info)) {
+    if (!download_segmented (url, ins, &info, part_path, cancellable))
+      return FALSE;
+
+    if (!hash_file_prefix (part, info.start + info.content_length,
+                           sha256, blake3, buffer, cancellable, &err)) {
+      eam_log_error_message ("Could not read %s: %s", part_path, err->message);
+      partial_download_discard (part_path);
+      return FALSE;
+    }
+  }
+  else if (!download_streamed (url, ins, &info, part_path, sha256, blake3, buffer, cancellable)) {
     return FALSE;
   }
 
-  eam_log_info_message ("Downloading %s into %s", url, path);
-  gssize siz = g_output_stream_splice (outs, ins,
-                                       G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
-                                       cancellable, &err);
-  if (err != NULL) {
-    eam_log_error_message ("Could not save %s: %s", path, err->message);
+  const char *hash = blake3 != NULL ? eam_blake3_get_string (blake3) : eam_sha256_get_string (sha256);
+
+  if (!checksum_matches (hash, digest)) {
+    eam_log_error_message ("Could not save %s: checksum mismatch", part_path);
+    partial_download_discard (part_path);
     return FALSE;
   }
 
-  if (siz < 0 || siz > len) {
-    eam_log_error_message ("Could not save %s: invalid size", path);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+
+  /* Payloads that do not fit in the cache are not worth evicting the
+   * others for
+   */
+  GStatBuf buf;
+  if (cache_size > 0 && g_stat (part_path, &buf) == 0 && (guint64) buf.st_size <= cache_size) {
+    g_autofree char *cached_path = eam_payload_cache_add (key, part_path);
+
+    if (cached_path != NULL) {
+      partial_download_discard (part_path);
+
+      gboolean res = place_cached_payload (cached_path, path);
+
+      eam_payload_cache_prune (cache_size);
+
+      return res;
+    }
+  }
+
+  /* The cache and the application may be on different file systems,
+   * in which case the payload is copied
+   */
+  if (!g_file_move (part, file, G_FILE_COPY_OVERWRITE, cancellable, NULL, NULL, &err)) {
+    eam_log_error_message ("Could not move %s to %s: %s", part_path, path, err->message);
+    partial_download_discard (part_path);
     return FALSE;
   }
 
+  partial_download_discard (part_path);
+
   return TRUE;
 }
 
@@ -438,8 +1132,9 @@ eam_utils_run_external_scripts (const char *prefix,
   g_autofree char *url = NULL;
   g_autofree char *filename = NULL;
   g_autofree char *digest = NULL;
+  ExternalDigest digest_type;
 
-  int res = has_external_script (prefix, appid, &url, &filename, &digest);
+  int res = has_external_script (prefix, appid, &url, &filename, &digest_type, &digest);
   if (res == 0) {
     /* No external script */
     return TRUE;
@@ -457,13 +1152,7 @@ eam_utils_run_external_scripts (const char *prefix,
   if (g_mkdir_with_parents (dir, 0755) < 0)
     return FALSE;
 
-  if (!download_external_file (appid, url, dir, filename, cancellable)) {
-    eam_fs_rmdir_recursive (dir);
-    return FALSE;
-  }
-
-  g_autofree char *path = g_build_filename (dir, filename, NULL);
-  if (!verify_checksum_hash (path, digest, -1, G_CHECKSUM_SHA256)) {
+  if (!download_external_file (appid, url, dir, filename, digest_type, digest, cancellable)) {
     eam_fs_rmdir_recursive (dir);
     return FALSE;
   }
@@ -612,12 +1301,12 @@ eam_utils_update_desktop (void)
 
 gboolean
 eam_utils_apply_xdelta (const char *source_dir,
+                        const char *target_prefix,
                         const char *appid,
                         const char *delta_bundle,
                         GCancellable *cancellable)
 {
-  g_autofree char *target_dir = g_build_filename (eam_config_get_cache_dir (), appid,
-                                                  NULL);
+  g_autofree char *target_dir = g_build_filename (target_prefix, appid, NULL);
 
   if (!eam_fs_rmdir_recursive (target_dir))
     return FALSE;
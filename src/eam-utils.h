@@ -21,6 +21,9 @@
 #include <sys/types.h>
 #include <gio/gio.h>
 
+#include "eam-digests.h"
+#include "eam-progress.h"
+
 G_BEGIN_DECLS
 
 gboolean        eam_utils_verify_signature      (const char *source_file,
@@ -30,7 +33,18 @@ gboolean        eam_utils_verify_signature      (const char *source_file,
 gboolean        eam_utils_bundle_extract        (const char *bundle_file,
                                                  const char *prefix,
                                                  const char *appdir,
+                                                 EamDigests *digests,
+                                                 EamProgress *progress,
                                                  GCancellable *cancellable);
+gboolean        eam_utils_bundle_extract_verified
+                                                (const char *bundle_file,
+                                                 const char *signature_file,
+                                                 const char *prefix,
+                                                 const char *appdir,
+                                                 EamDigests *digests,
+                                                 EamProgress *progress,
+                                                 GCancellable *cancellable,
+                                                 GError **error);
 gboolean        eam_utils_app_is_installed      (const char *prefix,
                                                  const char *appdir);
 
@@ -43,7 +57,8 @@ gboolean        eam_utils_compile_python        (const char *prefix,
 gboolean        eam_utils_cleanup_python        (const char *appdir);
 gboolean        eam_utils_update_desktop        (void);
 
-gboolean        eam_utils_apply_xdelta          (const char *prefix,
+gboolean        eam_utils_apply_xdelta          (const char *source_dir,
+                                                 const char *target_prefix,
                                                  const char *appid,
                                                  const char *delta_bundle,
                                                  GCancellable *cancellable);
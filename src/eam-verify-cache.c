@@ -0,0 +1,239 @@
+/* eam-verify-cache.c: Cache of verified bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "eam-verify-cache.h"
+
+#include "eam-config.h"
+#include "eam-log.h"
+
+/* Transactions are often retried with the same bundle, e.g. after
+ * they were cancelled; the cache remembers which bundles passed the
+ * signature check, so that they are not hashed all over again.
+ *
+ * A bundle is identified by its device, inode, size, modification and
+ * change times, together with the digest of its signature and the
+ * identity of the keyring. The change time cannot be set from user
+ * space, and it moves whenever the contents do, so a bundle matching
+ * its cached key has not been touched since it was verified; changing
+ * the keyring invalidates all the entries.
+ *
+ * The cache is a key file in the cache directory, with a group for
+ * each bundle path:
+ *
+ *   [/var/cache/eos-app-manager/com.example.App.bundle]
+ *   key=2049:1234:...
+ *   time=1458000000
+ */
+
+#define VERIFY_CACHE_FILE           "verified-bundles"
+
+/* Bundles are retried, not collected; a few entries are enough */
+#define VERIFY_CACHE_MAX_ENTRIES    16
+
+G_LOCK_DEFINE_STATIC (verify_cache);
+
+static char *
+get_file_id (const char *path,
+             gboolean with_ctime)
+{
+  GStatBuf buf;
+
+  if (g_stat (path, &buf) < 0)
+    return NULL;
+
+  if (!with_ctime)
+    return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT
+                            ":%" G_GINT64_FORMAT ".%ld",
+                            (guint64) buf.st_dev, (guint64) buf.st_ino,
+                            (gint64) buf.st_size,
+                            (gint64) buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec);
+
+  return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT
+                          ":%" G_GINT64_FORMAT ".%ld:%" G_GINT64_FORMAT ".%ld",
+                          (guint64) buf.st_dev, (guint64) buf.st_ino,
+                          (gint64) buf.st_size,
+                          (gint64) buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec,
+                          (gint64) buf.st_ctim.tv_sec, buf.st_ctim.tv_nsec);
+}
+
+/**
+ * eam_verify_cache_get_key:
+ * @bundle_file: the path of a bundle
+ * @signature_file: (allow-none): the path of the detached signature of
+ *   @bundle_file, or %NULL for a bundle that was verified by other means
+ *
+ * Returns: (transfer full): the key identifying the current state of
+ *   the bundle, its signature and the keyring, or %NULL if any of them
+ *   cannot be accessed
+ */
+char *
+eam_verify_cache_get_key (const char *bundle_file,
+                          const char *signature_file)
+{
+  if (bundle_file == NULL)
+    return NULL;
+
+  g_autofree char *bundle_id = get_file_id (bundle_file, TRUE);
+  g_autofree char *keyring_id = get_file_id (eam_config_get_gpg_keyring (), FALSE);
+  if (bundle_id == NULL || keyring_id == NULL)
+    return NULL;
+
+  if (signature_file == NULL)
+    return g_strconcat (bundle_id, "/-/", keyring_id, NULL);
+
+  g_autofree char *contents = NULL;
+  gsize len;
+  if (!g_file_get_contents (signature_file, &contents, &len, NULL))
+    return NULL;
+
+  g_autofree char *digest = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                         (const guchar *) contents, len);
+
+  return g_strconcat (bundle_id, "/", digest, "/", keyring_id, NULL);
+}
+
+static char *
+get_cache_file (void)
+{
+  return g_build_filename (eam_config_get_cache_dir (), VERIFY_CACHE_FILE, NULL);
+}
+
+static gboolean
+is_valid_group_name (const char *name)
+{
+  return name != NULL && *name != '\0' && strpbrk (name, "[]\n\r") == NULL;
+}
+
+/**
+ * eam_verify_cache_lookup:
+ * @bundle_file: the path of a bundle
+ * @signature_file: the path of the detached signature of @bundle_file
+ *
+ * Returns: %TRUE if @bundle_file was verified against @signature_file
+ *   before, and none of them changed since
+ */
+gboolean
+eam_verify_cache_lookup (const char *bundle_file,
+                         const char *signature_file)
+{
+  if (signature_file == NULL || !is_valid_group_name (bundle_file))
+    return FALSE;
+
+  g_autofree char *key = eam_verify_cache_get_key (bundle_file, signature_file);
+  if (key == NULL)
+    return FALSE;
+
+  g_autofree char *cache_file = get_cache_file ();
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+
+  G_LOCK (verify_cache);
+  gboolean loaded = g_key_file_load_from_file (keyfile, cache_file, G_KEY_FILE_NONE, NULL);
+  G_UNLOCK (verify_cache);
+
+  if (!loaded)
+    return FALSE;
+
+  g_autofree char *cached_key = g_key_file_get_string (keyfile, bundle_file, "key", NULL);
+  if (g_strcmp0 (cached_key, key) != 0)
+    return FALSE;
+
+  eam_log_info_message ("Bundle '%s' was verified by a previous attempt", bundle_file);
+
+  return TRUE;
+}
+
+/* Drops the entries verified longest ago, to make room for a new one */
+static void
+verify_cache_trim (GKeyFile *keyfile)
+{
+  gsize n_groups;
+  g_auto(GStrv) groups = g_key_file_get_groups (keyfile, &n_groups);
+
+  while (n_groups >= VERIFY_CACHE_MAX_ENTRIES) {
+    gsize oldest = 0;
+    gint64 oldest_time = G_MAXINT64;
+
+    for (gsize i = 0; i < n_groups; i++) {
+      if (groups[i] == NULL)
+        continue;
+
+      gint64 time = g_key_file_get_int64 (keyfile, groups[i], "time", NULL);
+      if (time < oldest_time) {
+        oldest = i;
+        oldest_time = time;
+      }
+    }
+
+    g_key_file_remove_group (keyfile, groups[oldest], NULL);
+    g_clear_pointer (&groups[oldest], g_free);
+    n_groups -= 1;
+  }
+}
+
+/**
+ * eam_verify_cache_add:
+ * @bundle_file: the path of a bundle
+ * @signature_file: the path of the detached signature of @bundle_file
+ * @key: the key returned by eam_verify_cache_get_key() before the
+ *   verification started
+ *
+ * Records that @bundle_file was successfully verified. Nothing is
+ * recorded if the bundle, its signature or the keyring changed while
+ * the verification was running.
+ */
+void
+eam_verify_cache_add (const char *bundle_file,
+                      const char *signature_file,
+                      const char *key)
+{
+  if (key == NULL || signature_file == NULL || !is_valid_group_name (bundle_file))
+    return;
+
+  g_autofree char *current_key = eam_verify_cache_get_key (bundle_file, signature_file);
+  if (g_strcmp0 (current_key, key) != 0)
+    return;
+
+  g_autofree char *cache_file = get_cache_file ();
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+
+  G_LOCK (verify_cache);
+
+  /* A missing or corrupted cache is simply started over */
+  g_key_file_load_from_file (keyfile, cache_file, G_KEY_FILE_NONE, NULL);
+
+  g_key_file_remove_group (keyfile, bundle_file, NULL);
+  verify_cache_trim (keyfile);
+
+  g_key_file_set_string (keyfile, bundle_file, "key", key);
+  g_key_file_set_int64 (keyfile, bundle_file, "time", g_get_real_time () / G_USEC_PER_SEC);
+
+  if (g_mkdir_with_parents (eam_config_get_cache_dir (), 0755) < 0 ||
+      !g_key_file_save_to_file (keyfile, cache_file, &error))
+    eam_log_error_message ("Unable to save the verified bundles cache: %s",
+                           error != NULL ? error->message : g_strerror (errno));
+
+  G_UNLOCK (verify_cache);
+}
@@ -0,0 +1,33 @@
+/* eam-verify-cache.h: Cache of verified bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+char *          eam_verify_cache_get_key        (const char *bundle_file,
+                                                 const char *signature_file);
+gboolean        eam_verify_cache_lookup         (const char *bundle_file,
+                                                 const char *signature_file);
+void            eam_verify_cache_add            (const char *bundle_file,
+                                                 const char *signature_file,
+                                                 const char *key);
+
+G_END_DECLS
@@ -0,0 +1,276 @@
+/* eam-walk.c: Walking directory trees
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "eam-walk.h"
+
+/* The walker reads directories with getdents64() into a buffer per
+ * level of depth, which is kept for the next directory at that depth,
+ * and builds the paths of the entries in a single buffer, where the
+ * name of each entry is appended and removed in turn. So walking a
+ * tree allocates nothing per entry; the entries are only stat()ed when
+ * the file system does not report their type, and everything is
+ * opened relative to the directory that contains it.
+ *
+ * The walk is depth-first, with one file descriptor open per level.
+ */
+
+#define WALK_BUFFER_SIZE        (32 * 1024)
+
+struct linux_dirent64 {
+  guint64 d_ino;
+  gint64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef struct {
+  int fd;
+
+  /* Where the name of the directory starts in the path */
+  gsize name_offset;
+
+  char *buffer;
+  gsize pos;
+  gsize len;
+} WalkLevel;
+
+/* Returns the next entry of @level, or %NULL at the end of the
+ * directory, or on error with errno set
+ */
+static struct linux_dirent64 *
+walk_level_next (WalkLevel *level)
+{
+  if (level->buffer == NULL)
+    level->buffer = g_malloc (WALK_BUFFER_SIZE);
+
+  if (level->pos >= level->len) {
+    long n;
+
+    do {
+      n = syscall (SYS_getdents64, level->fd, level->buffer, WALK_BUFFER_SIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+      if (n == 0)
+        errno = 0;
+
+      return NULL;
+    }
+
+    level->pos = 0;
+    level->len = n;
+  }
+
+  struct linux_dirent64 *dirent = (struct linux_dirent64 *) (gpointer) (level->buffer + level->pos);
+  level->pos += dirent->d_reclen;
+
+  return dirent;
+}
+
+static gboolean
+is_dot_or_dotdot (const char *name)
+{
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/**
+ * eam_walk:
+ * @dfd: a directory file descriptor, or %AT_FDCWD
+ * @path: the directory to walk, relative to @dfd
+ * @func: the function called for each entry
+ * @user_data: data for @func
+ *
+ * Walks the tree under @path, calling @func with %EAM_WALK_ENTER
+ * before reading each directory, @path included, with %EAM_WALK_FILE
+ * for everything else, and with %EAM_WALK_LEAVE once all the entries
+ * of a directory were visited, while the directory is still open.
+ * Symbolic links are never followed, except for @path itself.
+ *
+ * When a directory cannot be opened or read, @func is called with
+ * %EAM_WALK_ERROR; if it returns %EAM_WALK_CONTINUE, a directory that
+ * could not be opened is skipped, and one that could not be read is
+ * left. Entries that vanish during the walk are skipped.
+ *
+ * Returns: %TRUE if the whole tree was walked, %FALSE if @func stopped
+ *   the walk
+ */
+gboolean
+eam_walk (int dfd,
+          const char *path,
+          EamWalkFunc func,
+          gpointer user_data)
+{
+  EamWalkEntry entry = {
+    .dfd = dfd,
+    .name = path,
+    .path = path,
+    .relative = "",
+    .fd = -1,
+    .type = DT_DIR,
+    .depth = 0,
+  };
+
+  EamWalkAction action = func (EAM_WALK_ENTER, &entry, user_data);
+  if (action != EAM_WALK_CONTINUE)
+    return action == EAM_WALK_SKIP;
+
+  int root_fd = openat (dfd, path, O_RDONLY | O_DIRECTORY | O_NONBLOCK | O_CLOEXEC);
+  if (root_fd < 0) {
+    entry.error = errno;
+    return func (EAM_WALK_ERROR, &entry, user_data) != EAM_WALK_STOP;
+  }
+
+  g_autoptr(GString) buffer = g_string_new (path);
+  gsize root_len = buffer->len;
+
+  g_autoptr(GArray) levels = g_array_new (FALSE, TRUE, sizeof (WalkLevel));
+  g_array_set_size (levels, 1);
+  g_array_index (levels, WalkLevel, 0).fd = root_fd;
+
+  guint depth = 0;
+  gboolean ret = TRUE;
+
+  while (ret) {
+    WalkLevel *level = &g_array_index (levels, WalkLevel, depth);
+    WalkLevel *parent = depth > 0 ? &g_array_index (levels, WalkLevel, depth - 1) : NULL;
+    struct linux_dirent64 *dirent = walk_level_next (level);
+
+    if (dirent == NULL) {
+      entry.dfd = parent != NULL ? parent->fd : dfd;
+      entry.name = parent != NULL ? buffer->str + level->name_offset : path;
+      entry.path = buffer->str;
+      entry.relative = depth > 0 ? buffer->str + root_len + 1 : "";
+      entry.fd = -1;
+      entry.type = DT_DIR;
+      entry.depth = depth;
+
+      if (errno != 0) {
+        entry.error = errno;
+        if (func (EAM_WALK_ERROR, &entry, user_data) == EAM_WALK_STOP)
+          ret = FALSE;
+      }
+
+      entry.fd = level->fd;
+      if (ret && func (EAM_WALK_LEAVE, &entry, user_data) == EAM_WALK_STOP)
+        ret = FALSE;
+
+      (void) close (level->fd);
+      level->fd = -1;
+      level->pos = level->len = 0;
+
+      if (depth == 0)
+        break;
+
+      g_string_truncate (buffer, level->name_offset - 1);
+      depth--;
+      continue;
+    }
+
+    if (is_dot_or_dotdot (dirent->d_name))
+      continue;
+
+    unsigned char type = dirent->d_type;
+
+    /* Not every file system fills in the type */
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat (level->fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT)
+          continue;
+
+        type = DT_UNKNOWN;
+      }
+      else {
+        type = IFTODT (st.st_mode);
+      }
+    }
+
+    gsize name_offset = buffer->len + 1;
+    g_string_append_c (buffer, '/');
+    g_string_append (buffer, dirent->d_name);
+
+    entry.dfd = level->fd;
+    entry.name = buffer->str + name_offset;
+    entry.path = buffer->str;
+    entry.relative = buffer->str + root_len + 1;
+    entry.fd = -1;
+    entry.type = type;
+    entry.depth = depth + 1;
+
+    if (type != DT_DIR) {
+      if (func (EAM_WALK_FILE, &entry, user_data) == EAM_WALK_STOP)
+        ret = FALSE;
+
+      g_string_truncate (buffer, name_offset - 1);
+      continue;
+    }
+
+    action = func (EAM_WALK_ENTER, &entry, user_data);
+    if (action != EAM_WALK_CONTINUE) {
+      if (action == EAM_WALK_STOP)
+        ret = FALSE;
+
+      g_string_truncate (buffer, name_offset - 1);
+      continue;
+    }
+
+    int fd = openat (level->fd, entry.name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      entry.error = errno;
+
+      if (entry.error != ENOENT && func (EAM_WALK_ERROR, &entry, user_data) == EAM_WALK_STOP)
+        ret = FALSE;
+
+      g_string_truncate (buffer, name_offset - 1);
+      continue;
+    }
+
+    depth++;
+    if (depth >= levels->len)
+      g_array_set_size (levels, depth + 1);
+
+    level = &g_array_index (levels, WalkLevel, depth);
+    level->fd = fd;
+    level->name_offset = name_offset;
+  }
+
+  /* A stopped walk leaves directories open */
+  for (guint i = 0; i < levels->len; i++) {
+    WalkLevel *level = &g_array_index (levels, WalkLevel, i);
+
+    if (i <= depth && level->fd >= 0 && !ret)
+      (void) close (level->fd);
+
+    g_free (level->buffer);
+  }
+
+  return ret;
+}
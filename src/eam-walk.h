@@ -0,0 +1,86 @@
+/* eam-walk.h: Walking directory trees
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EamWalkEvent:
+ * @EAM_WALK_ENTER: a directory is about to be read
+ * @EAM_WALK_LEAVE: all the entries of a directory were visited
+ * @EAM_WALK_FILE: an entry that is not a directory
+ * @EAM_WALK_ERROR: a directory could not be opened or read
+ */
+typedef enum {
+  EAM_WALK_ENTER,
+  EAM_WALK_LEAVE,
+  EAM_WALK_FILE,
+  EAM_WALK_ERROR
+} EamWalkEvent;
+
+/**
+ * EamWalkAction:
+ * @EAM_WALK_CONTINUE: go on with the walk
+ * @EAM_WALK_SKIP: on %EAM_WALK_ENTER, do not read the directory
+ * @EAM_WALK_STOP: stop the walk, which fails
+ */
+typedef enum {
+  EAM_WALK_CONTINUE,
+  EAM_WALK_SKIP,
+  EAM_WALK_STOP
+} EamWalkAction;
+
+/**
+ * EamWalkEntry:
+ * @dfd: the directory that contains the entry
+ * @name: the name of the entry in @dfd
+ * @path: the path of the entry, starting with the root of the walk
+ * @relative: the path of the entry relative to the root of the walk,
+ *   or "" for the root
+ * @fd: on %EAM_WALK_LEAVE, the directory itself; otherwise, -1
+ * @type: the type of the entry, as a DT_ constant
+ * @depth: the depth of the entry, 0 for the root
+ * @error: on %EAM_WALK_ERROR, the errno value
+ *
+ * An entry met during a walk. The strings are only valid during the
+ * call to the #EamWalkFunc.
+ */
+typedef struct {
+  int dfd;
+  const char *name;
+  const char *path;
+  const char *relative;
+  int fd;
+  unsigned char type;
+  guint depth;
+  int error;
+} EamWalkEntry;
+
+typedef EamWalkAction (* EamWalkFunc) (EamWalkEvent event,
+                                       const EamWalkEntry *entry,
+                                       gpointer user_data);
+
+gboolean        eam_walk                        (int dfd,
+                                                 const char *path,
+                                                 EamWalkFunc func,
+                                                 gpointer user_data);
+
+G_END_DECLS
@@ -0,0 +1,573 @@
+/* eam-zstd.c: Parallel decompression of seekable zstd bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "eam-zstd.h"
+
+#include "eam-log.h"
+
+/* A seekable zstd bundle is a tarball compressed as a sequence of
+ * independent zstd frames, followed by a skippable frame holding the
+ * compressed and decompressed size of each of them, as described by
+ * the zstd "seekable format" specification:
+ *
+ *   frame 0 | frame 1 | ... | frame N-1 | seek table
+ *
+ * Since the frames do not depend on each other, they can be
+ * decompressed concurrently: the decoder hands the frames to a pool
+ * of threads, a bounded number of them ahead of the consumer, and
+ * returns the decompressed frames in order, so the consumer sees a
+ * plain, uncompressed, tar stream.
+ *
+ * The compressed data is still passed to the tap in order, as the
+ * frames are read, and so is the seek table once the consumer is
+ * done, so that the whole file can be verified in the same pass.
+ */
+
+#define SEEKABLE_MAGIC               0x8F92EAB1
+#define SKIPPABLE_MAGIC              0x184D2A5E
+
+/* Number of frames, descriptor, magic */
+#define SEEK_TABLE_FOOTER_SIZE       9
+
+/* Magic, frame size */
+#define SKIPPABLE_HEADER_SIZE        8
+
+/* Per-frame checksums are optional, and we do not use them, as the
+ * zstd frames carry their own checksum
+ */
+#define SEEK_TABLE_CHECKSUM_FLAG     0x80
+#define SEEK_TABLE_RESERVED_BITS     0x7c
+
+/* Frames larger than this are not worth splitting across threads,
+ * and would make the memory usage unbounded
+ */
+#define MAX_FRAME_SIZE               (128 * 1024 * 1024)
+
+/* Upper bound for the decompressed data held by the decoder */
+#define MAX_BYTES_IN_FLIGHT          (64 * 1024 * 1024)
+
+/* How many frames may be queued ahead of the consumer, per thread */
+#define FRAMES_PER_THREAD            2
+
+typedef struct {
+  guint64 offset;
+  guint32 compressed_size;
+  guint32 size;
+} ZstdFrame;
+
+typedef struct {
+  EamZstdDecoder *decoder;
+
+  const guint8 *src;
+  gsize src_size;
+  guint8 *owned_src;
+
+  guint8 *dst;
+  gsize dst_size;
+
+  gboolean done;
+  gboolean failed;
+} ZstdJob;
+
+struct _EamZstdDecoder {
+  int fd;
+  const guint8 *map;
+  guint64 size;
+
+  ZstdFrame *frames;
+  guint n_frames;
+  guint64 seek_table_offset;
+
+  EamZstdTapFunc tap_func;
+  gpointer tap_data;
+
+  GThreadPool *pool;
+  guint max_jobs;
+
+  /* Indexed by frame; only the window between next_read and
+   * next_submit is populated
+   */
+  ZstdJob **jobs;
+  guint next_submit;
+  guint next_read;
+  ZstdJob *current;
+
+  guint64 bytes_read;
+  gsize bytes_in_flight;
+
+  /* Protects the done and failed fields of the jobs */
+  GMutex lock;
+  GCond cond;
+};
+
+static guint32
+read_le32 (const guint8 *p)
+{
+  return (guint32) p[0] |
+         ((guint32) p[1] << 8) |
+         ((guint32) p[2] << 16) |
+         ((guint32) p[3] << 24);
+}
+
+static gboolean
+read_at (EamZstdDecoder *decoder,
+         guint64 offset,
+         void *buffer,
+         gsize size)
+{
+  if (decoder->map != NULL) {
+    memcpy (buffer, decoder->map + offset, size);
+    return TRUE;
+  }
+
+  guint8 *p = buffer;
+  while (size > 0) {
+    gssize n = pread (decoder->fd, p, size, offset);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0) {
+      if (n == 0)
+        errno = EIO;
+      return FALSE;
+    }
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+parse_seek_table (EamZstdDecoder *decoder)
+{
+  guint8 footer[SEEK_TABLE_FOOTER_SIZE];
+  guint8 header[SKIPPABLE_HEADER_SIZE];
+
+  if (decoder->size < SKIPPABLE_HEADER_SIZE + SEEK_TABLE_FOOTER_SIZE)
+    return FALSE;
+
+  if (!read_at (decoder, decoder->size - SEEK_TABLE_FOOTER_SIZE, footer, sizeof (footer)))
+    return FALSE;
+
+  if (read_le32 (footer + 5) != SEEKABLE_MAGIC)
+    return FALSE;
+
+  guint32 n_frames = read_le32 (footer);
+  guint8 descriptor = footer[4];
+
+  if ((descriptor & SEEK_TABLE_RESERVED_BITS) != 0 || n_frames == 0)
+    return FALSE;
+
+  guint64 entry_size = (descriptor & SEEK_TABLE_CHECKSUM_FLAG) != 0 ? 12 : 8;
+  guint64 table_size = n_frames * entry_size + SEEK_TABLE_FOOTER_SIZE;
+
+  if (table_size + SKIPPABLE_HEADER_SIZE > decoder->size)
+    return FALSE;
+
+  guint64 table_offset = decoder->size - table_size - SKIPPABLE_HEADER_SIZE;
+
+  if (!read_at (decoder, table_offset, header, sizeof (header)))
+    return FALSE;
+
+  if (read_le32 (header) != SKIPPABLE_MAGIC || read_le32 (header + 4) != table_size)
+    return FALSE;
+
+  g_autofree guint8 *entries = g_malloc (table_size - SEEK_TABLE_FOOTER_SIZE);
+  if (!read_at (decoder, table_offset + SKIPPABLE_HEADER_SIZE, entries,
+                table_size - SEEK_TABLE_FOOTER_SIZE))
+    return FALSE;
+
+  g_autofree ZstdFrame *frames = g_new (ZstdFrame, n_frames);
+  guint64 offset = 0;
+
+  for (guint32 i = 0; i < n_frames; i++) {
+    const guint8 *entry = entries + i * entry_size;
+
+    frames[i].offset = offset;
+    frames[i].compressed_size = read_le32 (entry);
+    frames[i].size = read_le32 (entry + 4);
+
+    if (frames[i].compressed_size == 0 ||
+        frames[i].compressed_size > MAX_FRAME_SIZE ||
+        frames[i].size > MAX_FRAME_SIZE)
+      return FALSE;
+
+    offset += frames[i].compressed_size;
+  }
+
+  /* The frames must cover the file up to the seek table */
+  if (offset != table_offset)
+    return FALSE;
+
+  decoder->frames = g_steal_pointer (&frames);
+  decoder->n_frames = n_frames;
+  decoder->seek_table_offset = table_offset;
+
+  return TRUE;
+}
+
+#ifdef HAVE_ZSTD
+static void
+dctx_free (gpointer data)
+{
+  ZSTD_freeDCtx (data);
+}
+
+/* Each thread of the pool keeps its decompression context around,
+ * and releases it when it exits
+ */
+static GPrivate dctx_key = G_PRIVATE_INIT (dctx_free);
+
+static gboolean
+frame_decompress (ZstdJob *job)
+{
+  ZSTD_DCtx *dctx = g_private_get (&dctx_key);
+
+  if (dctx == NULL) {
+    dctx = ZSTD_createDCtx ();
+    if (dctx == NULL)
+      return FALSE;
+    g_private_set (&dctx_key, dctx);
+  }
+
+  size_t res = ZSTD_decompressDCtx (dctx, job->dst, job->dst_size, job->src, job->src_size);
+  if (ZSTD_isError (res)) {
+    eam_log_error_message ("Unable to decompress frame: %s", ZSTD_getErrorName (res));
+    return FALSE;
+  }
+
+  return res == job->dst_size;
+}
+#else
+static gboolean
+frame_decompress (ZstdJob *job)
+{
+  return FALSE;
+}
+#endif
+
+static void
+zstd_job_free (ZstdJob *job)
+{
+  g_free (job->owned_src);
+  g_free (job->dst);
+
+  g_slice_free (ZstdJob, job);
+}
+
+static void
+decompress_thread (gpointer data,
+                   gpointer user_data)
+{
+  ZstdJob *job = data;
+  EamZstdDecoder *decoder = user_data;
+
+  gboolean ok = frame_decompress (job);
+
+  g_mutex_lock (&decoder->lock);
+  job->failed = !ok;
+  job->done = TRUE;
+  g_cond_broadcast (&decoder->cond);
+  g_mutex_unlock (&decoder->lock);
+}
+
+/**
+ * eam_zstd_decoder_new:
+ * @fd: a file descriptor for the bundle
+ * @map: (allow-none): the bundle mapped in memory, or %NULL to read
+ *   it from @fd
+ * @size: the size of the bundle
+ * @n_threads: the number of decompression threads
+ *
+ * Returns: (transfer full): a new #EamZstdDecoder, or %NULL if the
+ *   bundle is not a seekable zstd bundle, or if this build cannot
+ *   decompress it
+ */
+EamZstdDecoder *
+eam_zstd_decoder_new (int fd,
+                      const guint8 *map,
+                      guint64 size,
+                      guint n_threads)
+{
+  EamZstdDecoder *decoder = g_new0 (EamZstdDecoder, 1);
+
+  decoder->fd = fd;
+  decoder->map = map;
+  decoder->size = size;
+
+  if (!parse_seek_table (decoder)) {
+    g_free (decoder);
+    return NULL;
+  }
+
+#ifndef HAVE_ZSTD
+  /* libarchive may still be able to decompress it, serially */
+  eam_log_info_message ("Built without zstd support, decompressing seekable bundle serially");
+  g_free (decoder->frames);
+  g_free (decoder);
+  return NULL;
+#endif
+
+  n_threads = CLAMP (n_threads, 1, MIN (decoder->n_frames, 16));
+
+  g_autoptr(GError) error = NULL;
+  decoder->pool = g_thread_pool_new (decompress_thread, decoder, n_threads, TRUE, &error);
+  if (decoder->pool == NULL) {
+    eam_log_error_message ("Unable to start the decompression threads: %s", error->message);
+    g_free (decoder->frames);
+    g_free (decoder);
+    return NULL;
+  }
+
+  decoder->max_jobs = n_threads * FRAMES_PER_THREAD;
+  decoder->jobs = g_new0 (ZstdJob *, decoder->n_frames);
+
+  g_mutex_init (&decoder->lock);
+  g_cond_init (&decoder->cond);
+
+  return decoder;
+}
+
+void
+eam_zstd_decoder_free (EamZstdDecoder *decoder)
+{
+  if (decoder == NULL)
+    return;
+
+  /* Wait for the frames still being decompressed */
+  g_thread_pool_free (decoder->pool, FALSE, TRUE);
+
+  for (guint i = decoder->next_read; i < decoder->next_submit; i++)
+    g_clear_pointer (&decoder->jobs[i], zstd_job_free);
+
+  if (decoder->current != NULL)
+    zstd_job_free (decoder->current);
+
+  g_mutex_clear (&decoder->lock);
+  g_cond_clear (&decoder->cond);
+
+  g_free (decoder->jobs);
+  g_free (decoder->frames);
+  g_free (decoder);
+}
+
+/**
+ * eam_zstd_decoder_set_tap_func:
+ * @decoder: a #EamZstdDecoder
+ * @func: (allow-none): a function to call with the compressed data
+ * @user_data: data for @func
+ *
+ * Sets a function that is passed all the compressed data, in order,
+ * as it is read.
+ */
+void
+eam_zstd_decoder_set_tap_func (EamZstdDecoder *decoder,
+                               EamZstdTapFunc func,
+                               gpointer user_data)
+{
+  decoder->tap_func = func;
+  decoder->tap_data = user_data;
+}
+
+static gboolean
+decoder_tap (EamZstdDecoder *decoder,
+             const void *data,
+             gsize size)
+{
+  decoder->bytes_read += size;
+
+  if (decoder->tap_func == NULL)
+    return TRUE;
+
+  return decoder->tap_func (data, size, decoder->tap_data);
+}
+
+static gboolean
+decoder_submit (EamZstdDecoder *decoder)
+{
+  const ZstdFrame *frame = &decoder->frames[decoder->next_submit];
+  ZstdJob *job = g_slice_new0 (ZstdJob);
+
+  job->decoder = decoder;
+  job->src_size = frame->compressed_size;
+  job->dst_size = frame->size;
+
+  if (decoder->map != NULL) {
+    job->src = decoder->map + frame->offset;
+  }
+  else {
+    job->owned_src = g_malloc (job->src_size);
+    if (!read_at (decoder, frame->offset, job->owned_src, job->src_size)) {
+      zstd_job_free (job);
+      return FALSE;
+    }
+    job->src = job->owned_src;
+  }
+
+  if (!decoder_tap (decoder, job->src, job->src_size)) {
+    zstd_job_free (job);
+    errno = EIO;
+    return FALSE;
+  }
+
+  job->dst = g_malloc (MAX (job->dst_size, 1));
+
+  decoder->jobs[decoder->next_submit++] = job;
+  decoder->bytes_in_flight += job->dst_size;
+
+  g_thread_pool_push (decoder->pool, job, NULL);
+
+  return TRUE;
+}
+
+/**
+ * eam_zstd_decoder_read:
+ * @decoder: a #EamZstdDecoder
+ * @buffer: (out): return location for the decompressed data
+ *
+ * Returns the next block of decompressed data. The data remains
+ * valid until the next call.
+ *
+ * Returns: the size of the data, 0 at the end of the stream, or -1
+ *   on error, with errno set
+ */
+gssize
+eam_zstd_decoder_read (EamZstdDecoder *decoder,
+                       const void **buffer)
+{
+  if (decoder->current != NULL) {
+    decoder->bytes_in_flight -= decoder->current->dst_size;
+    g_clear_pointer (&decoder->current, zstd_job_free);
+  }
+
+  while (decoder->next_read < decoder->n_frames) {
+    /* Keep the pool busy, within the memory budget; there is always
+     * room for the frame we are about to wait for
+     */
+    while (decoder->next_submit < decoder->n_frames &&
+           (decoder->next_submit == decoder->next_read ||
+            (decoder->next_submit - decoder->next_read < decoder->max_jobs &&
+             decoder->bytes_in_flight + decoder->frames[decoder->next_submit].size <= MAX_BYTES_IN_FLIGHT))) {
+      if (!decoder_submit (decoder))
+        return -1;
+    }
+
+    ZstdJob *job = decoder->jobs[decoder->next_read];
+
+    g_mutex_lock (&decoder->lock);
+    while (!job->done)
+      g_cond_wait (&decoder->cond, &decoder->lock);
+    g_mutex_unlock (&decoder->lock);
+
+    decoder->jobs[decoder->next_read++] = NULL;
+    decoder->current = job;
+
+    if (job->failed) {
+      errno = EBADMSG;
+      return -1;
+    }
+
+    /* An empty frame is not the end of the stream */
+    if (job->dst_size > 0) {
+      *buffer = job->dst;
+      return job->dst_size;
+    }
+
+    decoder->bytes_in_flight -= job->dst_size;
+    g_clear_pointer (&decoder->current, zstd_job_free);
+  }
+
+  return 0;
+}
+
+/**
+ * eam_zstd_decoder_finish:
+ * @decoder: a #EamZstdDecoder
+ *
+ * Passes the compressed data that was not needed to produce the
+ * stream, including the seek table, to the tap.
+ *
+ * Returns: %FALSE if the data could not be read, or was rejected
+ */
+gboolean
+eam_zstd_decoder_finish (EamZstdDecoder *decoder)
+{
+  if (decoder->tap_func == NULL)
+    return TRUE;
+
+  /* The frames up to next_submit have been tapped already */
+  guint64 offset = decoder->next_submit < decoder->n_frames
+                 ? decoder->frames[decoder->next_submit].offset
+                 : decoder->seek_table_offset;
+
+  g_autofree guint8 *buffer = decoder->map == NULL ? g_malloc (1024 * 1024) : NULL;
+
+  while (offset < decoder->size) {
+    gsize n = MIN (decoder->size - offset, 1024 * 1024);
+    const guint8 *data;
+
+    if (decoder->map != NULL) {
+      data = decoder->map + offset;
+    }
+    else {
+      if (!read_at (decoder, offset, buffer, n))
+        return FALSE;
+      data = buffer;
+    }
+
+    if (!decoder_tap (decoder, data, n))
+      return FALSE;
+
+    offset += n;
+  }
+
+  return TRUE;
+}
+
+/**
+ * eam_zstd_decoder_get_bytes_read:
+ * @decoder: a #EamZstdDecoder
+ *
+ * Returns: the amount of compressed data read so far
+ */
+guint64
+eam_zstd_decoder_get_bytes_read (EamZstdDecoder *decoder)
+{
+  return decoder->bytes_read;
+}
+
+guint
+eam_zstd_decoder_get_n_frames (EamZstdDecoder *decoder)
+{
+  return decoder->n_frames;
+}
@@ -0,0 +1,50 @@
+/* eam-zstd.h: Parallel decompression of seekable zstd bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EamZstdDecoder  EamZstdDecoder;
+
+typedef gboolean (* EamZstdTapFunc) (const void *data,
+                                     gsize size,
+                                     gpointer user_data);
+
+EamZstdDecoder *        eam_zstd_decoder_new            (int fd,
+                                                         const guint8 *map,
+                                                         guint64 size,
+                                                         guint n_threads);
+void                    eam_zstd_decoder_free           (EamZstdDecoder *decoder);
+
+void                    eam_zstd_decoder_set_tap_func   (EamZstdDecoder *decoder,
+                                                         EamZstdTapFunc func,
+                                                         gpointer user_data);
+
+gssize                  eam_zstd_decoder_read           (EamZstdDecoder *decoder,
+                                                         const void **buffer);
+gboolean                eam_zstd_decoder_finish         (EamZstdDecoder *decoder);
+
+guint64                 eam_zstd_decoder_get_bytes_read (EamZstdDecoder *decoder);
+guint                   eam_zstd_decoder_get_n_frames   (EamZstdDecoder *decoder);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EamZstdDecoder, eam_zstd_decoder_free)
+
+G_END_DECLS
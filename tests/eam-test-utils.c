@@ -0,0 +1,201 @@
+/* eam-test-utils.c: Helpers shared by the tests
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "eam-test-utils.h"
+
+/* The trees the tests and benchmarks work on look like applications:
+ * many small files, in directories of EAM_TEST_FILES_PER_DIR entries
+ * that are grouped by ten, each with a symbolic link to its first
+ * file:
+ *
+ *   root/group-000/dir-0000/file-0000
+ *                           ...
+ *                           file-0099
+ *                           link -> file-0000
+ *
+ * Measuring a benchmark needs a large tree, which takes a while to
+ * create, so the size is eam_test_get_tree_size(): 100000 files in
+ * perf mode, i.e. with -m perf, and 2000 otherwise.
+ */
+
+/**
+ * eam_test_get_tree_size:
+ *
+ * Returns: the number of files of the trees of the benchmarks
+ */
+guint
+eam_test_get_tree_size (void)
+{
+  return g_test_perf () ? 100000 : 2000;
+}
+
+static void
+write_file (const char *path,
+            guint index,
+            EamTestTreeFlags flags)
+{
+  if (!(flags & EAM_TEST_TREE_CONTENTS)) {
+    int fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    g_assert_cmpint (fd, >=, 0);
+    close (fd);
+    return;
+  }
+
+  /* Sizes up to a page, and a few executables */
+  gsize size = (index * 397) % 4096;
+  g_autofree char *contents = g_malloc (MAX (size, 1));
+  GError *error = NULL;
+
+  for (gsize i = 0; i < size; i++)
+    contents[i] = 'a' + (index + i) % 26;
+
+  g_file_set_contents (path, contents, size, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_chmod (path, index % 7 == 0 ? 0755 : 0644), ==, 0);
+}
+
+/**
+ * eam_test_create_tree:
+ * @root: the directory to create
+ * @n_files: the number of files
+ * @flags: whether the files are empty
+ * @tree: (out caller-allocates) (optional): what the tree holds
+ *
+ * Creates a tree of @n_files files in @root. Unless @flags has
+ * %EAM_TEST_TREE_CONTENTS, the files are empty, which is enough to
+ * test what happens to directory entries.
+ *
+ * The number of directories in @tree includes @root.
+ */
+void
+eam_test_create_tree (const char *root,
+                      guint n_files,
+                      EamTestTreeFlags flags,
+                      EamTestTree *tree)
+{
+  EamTestTree counts = { 0, 1, 0 };
+
+  g_assert_cmpint (g_mkdir_with_parents (root, 0755), ==, 0);
+
+  for (guint i = 0; i < n_files; i++) {
+    guint subdir = i / EAM_TEST_FILES_PER_DIR;
+    g_autofree char *dir =
+      g_strdup_printf ("%s/group-%03u/dir-%04u", root, subdir / 10, subdir);
+
+    if (i % EAM_TEST_FILES_PER_DIR == 0) {
+      if (subdir % 10 == 0)
+        counts.n_dirs += 1;
+      counts.n_dirs += 1;
+      counts.n_links += 1;
+
+      g_assert_cmpint (g_mkdir_with_parents (dir, 0755), ==, 0);
+
+      g_autofree char *link = g_build_filename (dir, "link", NULL);
+      g_assert_cmpint (symlink ("file-0000", link), ==, 0);
+    }
+
+    g_autofree char *name = g_strdup_printf ("file-%04u", i % EAM_TEST_FILES_PER_DIR);
+    g_autofree char *path = g_build_filename (dir, name, NULL);
+
+    write_file (path, i, flags);
+    counts.n_files += 1;
+  }
+
+  if (tree != NULL)
+    *tree = counts;
+}
+
+static void
+byte_array_append_le32 (GByteArray *array,
+                        guint32 value)
+{
+  guint8 bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+
+  g_byte_array_append (array, bytes, sizeof (bytes));
+}
+
+/**
+ * eam_test_zstd_compress_seekable:
+ * @data: the data to compress
+ * @frame_size: the amount of data in each frame
+ *
+ * Compresses @data in the seekable zstd format that eam-zstd.c reads:
+ * independent frames, followed by a skippable frame with the seek
+ * table, without checksums.
+ *
+ * Returns: (transfer full): the compressed data, or %NULL if this
+ *   build has no zstd support
+ */
+GBytes *
+eam_test_zstd_compress_seekable (GBytes *data,
+                                 gsize frame_size)
+{
+#ifdef HAVE_ZSTD
+  gsize size;
+  const guint8 *p = g_bytes_get_data (data, &size);
+  GByteArray *res = g_byte_array_new ();
+  g_autoptr(GArray) sizes = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  g_assert_cmpuint (frame_size, >, 0);
+
+  for (gsize offset = 0; offset < size; offset += frame_size) {
+    gsize n = MIN (size - offset, frame_size);
+    gsize bound = ZSTD_compressBound (n);
+    guint old_len = res->len;
+
+    g_byte_array_set_size (res, old_len + bound);
+
+    size_t compressed = ZSTD_compress (res->data + old_len, bound, p + offset, n, 3);
+    g_assert_false (ZSTD_isError (compressed));
+
+    g_byte_array_set_size (res, old_len + compressed);
+
+    guint32 frame_sizes[2] = { compressed, n };
+    g_array_append_vals (sizes, frame_sizes, 2);
+  }
+
+  /* Skippable frame header, one entry per frame, then the footer */
+  guint n_frames = sizes->len / 2;
+
+  byte_array_append_le32 (res, 0x184D2A5E);
+  byte_array_append_le32 (res, n_frames * 8 + 9);
+
+  for (guint i = 0; i < sizes->len; i++)
+    byte_array_append_le32 (res, g_array_index (sizes, guint32, i));
+
+  byte_array_append_le32 (res, n_frames);
+  g_byte_array_append (res, (const guint8 *) "", 1);
+  byte_array_append_le32 (res, 0x8F92EAB1);
+
+  return g_byte_array_free_to_bytes (res);
+#else
+  return NULL;
+#endif
+}
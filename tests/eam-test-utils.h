@@ -0,0 +1,48 @@
+/* eam-test-utils.h: Helpers shared by the tests
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EAM_TEST_FILES_PER_DIR  100
+
+typedef enum {
+  EAM_TEST_TREE_EMPTY_FILES = 0,
+  EAM_TEST_TREE_CONTENTS    = 1 << 0,
+} EamTestTreeFlags;
+
+typedef struct {
+  guint n_files;
+  guint n_dirs;
+  guint n_links;
+} EamTestTree;
+
+guint           eam_test_get_tree_size  (void);
+void            eam_test_create_tree    (const char *root,
+                                         guint n_files,
+                                         EamTestTreeFlags flags,
+                                         EamTestTree *tree);
+
+GBytes *        eam_test_zstd_compress_seekable
+                                        (GBytes *data,
+                                         gsize frame_size);
+
+G_END_DECLS
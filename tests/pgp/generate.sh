@@ -0,0 +1,121 @@
+#!/bin/sh
+# Generates the keyrings and signatures used by test-pgp; they are
+# checked in, so this only needs to be run to change them.
+#
+# The test key is created in the past, so that it can make a signature
+# that expired on 2020-01-02.
+#
+# keyring.gpg holds:
+#  - the test key, an RSA primary key with an RSA signing subkey
+#  - a key that expired on 2020-01-02
+#  - a revoked key
+# The subkey of the test key has no back-signature in
+# keyring-no-backsig.gpg, and no binding signature at all in
+# keyring-no-binding.gpg. The other key is not in any keyring.
+
+set -e
+
+cd "$(dirname "$0")"
+
+GNUPGHOME=$(mktemp -d)
+export GNUPGHOME
+trap 'rm -rf "$GNUPGHOME"' EXIT
+
+PAST='--faked-system-time 20200101T000000!'
+GPG="gpg --batch --quiet --passphrase= --pinentry-mode loopback"
+
+fingerprint () {
+    $GPG --with-colons --list-keys "$1" | awk -F: '/^fpr/ { print $10 }' | sed -n "${2:-1}p"
+}
+
+$GPG $PAST --quick-gen-key 'EAM Test Key <test@example.com>' rsa2048 sign never
+$GPG $PAST --quick-add-key "$(fingerprint test@example.com)" rsa2048 sign never
+$GPG $PAST --quick-gen-key 'EAM Expired Key <expired@example.com>' rsa2048 sign 1d
+$GPG --quick-gen-key 'EAM Revoked Key <revoked@example.com>' rsa2048 sign never
+$GPG --quick-gen-key 'EAM Other Key <other@example.com>' rsa2048 sign never
+
+printf 'Data signed for the tests of eos-app-manager\n' > data
+
+sign () {
+    rm -f "$1"
+    $GPG --local-user "$2!" --detach-sign --output "$1" $3 data
+}
+
+sign good.sig "$(fingerprint test@example.com)"
+sign good.asc "$(fingerprint test@example.com)" --armor
+sign subkey.sig "$(fingerprint test@example.com 2)"
+sign other.sig "$(fingerprint other@example.com)"
+sign revoked.sig "$(fingerprint revoked@example.com)"
+sign expired-key.sig "$(fingerprint expired@example.com)" "$PAST"
+sign expired.sig "$(fingerprint test@example.com)" "$PAST --default-sig-expire 1d"
+
+# The revocation certificate is stored with its first line commented out
+sed 's/^:-----/-----/' "$GNUPGHOME/openpgp-revocs.d/$(fingerprint revoked@example.com).rev" |
+    $GPG --import
+
+{
+    $GPG --export test@example.com
+    $GPG --export expired@example.com
+    $GPG --export revoked@example.com
+} > keyring.gpg
+
+$GPG --export test@example.com | python3 -c '
+import sys
+
+data = sys.stdin.buffer.read()
+
+# Splits the export into packets, as (tag, header, body)
+packets = []
+while data:
+    ctb = data[0]
+    if ctb & 0x40:
+        tag = ctb & 0x3f
+        first = data[1]
+        if first < 192:
+            header, length = 2, first
+        elif first < 224:
+            header, length = 3, ((first - 192) << 8) + data[2] + 192
+        else:
+            header, length = 6, int.from_bytes(data[2:6], "big")
+    else:
+        tag = (ctb >> 2) & 0xf
+        header = 1 + (1, 2, 4)[ctb & 3]
+        length = int.from_bytes(data[1:header], "big")
+    packets.append((tag, data[:header], data[header:header + length]))
+    data = data[header + length:]
+
+def packet(tag, body):
+    return bytes([0xc0 | tag, 0xff]) + len(body).to_bytes(4, "big") + body
+
+# Drops the embedded back-signature from the unhashed subpackets
+def strip_backsig(body):
+    hashed_end = 6 + int.from_bytes(body[4:6], "big")
+    unhashed_len = int.from_bytes(body[hashed_end:hashed_end + 2], "big")
+    unhashed = body[hashed_end + 2:hashed_end + 2 + unhashed_len]
+    kept = b""
+    while unhashed:
+        length, size = unhashed[0], 1
+        if length >= 255:
+            length, size = int.from_bytes(unhashed[1:5], "big"), 5
+        elif length >= 192:
+            length, size = ((length - 192) << 8) + unhashed[1] + 192, 2
+        if unhashed[size] & 0x7f != 32:
+            kept += unhashed[:size + length]
+        unhashed = unhashed[size + length:]
+    rest = body[hashed_end + 2 + unhashed_len:]
+    return body[:hashed_end] + len(kept).to_bytes(2, "big") + kept + rest
+
+no_backsig, no_binding = b"", b""
+after_subkey = False
+for tag, header, body in packets:
+    if tag == 14:
+        after_subkey = True
+    if after_subkey and tag == 2:
+        no_backsig += packet(tag, strip_backsig(body))
+        continue
+    no_backsig += header + body
+    no_binding += header + body
+
+open("keyring-no-backsig.gpg", "wb").write(no_backsig)
+open("keyring-no-binding.gpg", "wb").write(no_binding)
+'
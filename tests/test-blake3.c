@@ -0,0 +1,166 @@
+/* test-blake3.c: Tests and benchmark for the BLAKE3 implementation
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "eam-blake3.h"
+#include "eam-sha256.h"
+
+/* The vectors are the ones of the reference implementation: the input
+ * is the sequence 0, 1, ..., 250, 0, 1, ... of the given length.
+ *
+ * The throughput is only measured on a large buffer in perf mode,
+ * i.e. with -m perf; otherwise a small one just exercises the code.
+ */
+
+typedef struct {
+  gsize length;
+  const char *digest;
+} Blake3Vector;
+
+static const Blake3Vector vectors[] = {
+  { 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+  { 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+  { 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+  { 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+  { 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+  { 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+  { 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+  { 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+  { 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+  { 4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+  { 4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+  { 5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+  { 5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff" },
+  { 6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205" },
+  { 6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f" },
+  { 7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a" },
+  { 7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817" },
+  { 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+  { 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+  { 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+  { 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+  { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+};
+
+static guint8 *
+input_new (gsize length)
+{
+  guint8 *input = g_malloc (MAX (length, 1));
+
+  for (gsize i = 0; i < length; i++)
+    input[i] = i % 251;
+
+  return input;
+}
+
+static void
+test_vectors (void)
+{
+  g_autofree guint8 *input = input_new (vectors[G_N_ELEMENTS (vectors) - 1].length);
+
+  for (guint i = 0; i < G_N_ELEMENTS (vectors); i++) {
+    g_autoptr(EamBlake3) hasher = eam_blake3_new ();
+    eam_blake3_update (hasher, input, vectors[i].length);
+
+    g_assert_cmpstr (eam_blake3_get_string (hasher), ==, vectors[i].digest);
+  }
+}
+
+/* Feeding the data in uneven pieces goes through the chunk buffering,
+ * and feeding it at once through the parallel subtrees; both must
+ * give the same result
+ */
+static void
+test_split_updates (void)
+{
+  gsize length = 8 * 1024 * 1024 + 4097;
+  g_autofree guint8 *input = input_new (length);
+
+  g_autoptr(EamBlake3) whole = eam_blake3_new ();
+  eam_blake3_update (whole, input, length);
+
+  g_autoptr(EamBlake3) split = eam_blake3_new ();
+  gsize offset = 0;
+
+  while (offset < length) {
+    gsize piece = MIN (length - offset, (gsize) g_test_rand_int_range (1, 70000));
+
+    eam_blake3_update (split, input + offset, piece);
+    offset += piece;
+  }
+
+  g_assert_cmpstr (eam_blake3_get_string (split), ==, eam_blake3_get_string (whole));
+}
+
+/* Both hashes are fed the same blocks, the size of the chunks the
+ * extraction writers see
+ */
+static void
+test_throughput (void)
+{
+  gsize block_size = 1024 * 1024;
+  guint n_blocks = g_test_perf () ? 1024 : 16;
+  g_autofree guint8 *block = input_new (block_size);
+
+  g_autoptr(EamSha256) sha = eam_sha256_new ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_blocks; i++)
+    eam_sha256_update (sha, block, block_size);
+  (void) eam_sha256_get_string (sha);
+  double sha256_elapsed = g_test_timer_elapsed ();
+
+  g_autoptr(EamBlake3) hasher = eam_blake3_new ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < n_blocks; i++)
+    eam_blake3_update (hasher, block, block_size);
+  (void) eam_blake3_get_string (hasher);
+  double blake3_elapsed = g_test_timer_elapsed ();
+
+  double size = (double) block_size * n_blocks / 1e9;
+
+  g_print ("# SHA-256 %s: %.2f GB/s\n", eam_sha256_get_implementation (),
+           size / MAX (sha256_elapsed, 1e-9));
+  g_print ("# BLAKE3 %s: %.2f GB/s\n", eam_blake3_get_implementation (),
+           size / MAX (blake3_elapsed, 1e-9));
+  g_print ("# BLAKE3 speedup over SHA-256: %.2fx\n",
+           sha256_elapsed / MAX (blake3_elapsed, 1e-9));
+
+  g_test_minimized_result (blake3_elapsed, "BLAKE3 %s: %.2f GB/s",
+                           eam_blake3_get_implementation (),
+                           size / MAX (blake3_elapsed, 1e-9));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/blake3/vectors", test_vectors);
+  g_test_add_func ("/blake3/split-updates", test_split_updates);
+  g_test_add_func ("/blake3/throughput", test_throughput);
+
+  return g_test_run ();
+}
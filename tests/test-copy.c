@@ -0,0 +1,270 @@
+/* test-copy.c: Tests and benchmark for the tree copy engine
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "eam-copy.h"
+#include "eam-fs-utils.h"
+
+#include "eam-test-utils.h"
+
+/* The tree is the one of eam_test_create_tree(), with the contents of
+ * the files.
+ *
+ * The benchmark compares eam_copy_tree() with the recursive copy over
+ * g_file_copy() that eam_fs_cpdir_recursive() used to do.
+ */
+
+typedef struct {
+  char *tmpdir;
+  char *source;
+  EamTestTree tree;
+} Fixture;
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eam-test-copy-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->source = g_build_filename (fixture->tmpdir, "source", NULL);
+  eam_test_create_tree (fixture->source, eam_test_get_tree_size (),
+                        EAM_TEST_TREE_CONTENTS, &fixture->tree);
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  eam_fs_rmdir_recursive (fixture->tmpdir);
+
+  g_free (fixture->source);
+  g_free (fixture->tmpdir);
+}
+
+static void
+assert_same_tree (const char *source,
+                  const char *target)
+{
+  struct stat sbuf, tbuf;
+
+  g_assert_cmpint (lstat (source, &sbuf), ==, 0);
+  g_assert_cmpint (lstat (target, &tbuf), ==, 0);
+
+  g_assert_cmpuint (sbuf.st_mode, ==, tbuf.st_mode);
+  g_assert_cmpuint (sbuf.st_uid, ==, tbuf.st_uid);
+  g_assert_cmpuint (sbuf.st_gid, ==, tbuf.st_gid);
+
+  if (S_ISLNK (sbuf.st_mode)) {
+    g_autofree char *starget = g_file_read_link (source, NULL);
+    g_autofree char *ttarget = g_file_read_link (target, NULL);
+
+    g_assert_cmpstr (starget, ==, ttarget);
+    return;
+  }
+
+  g_assert_cmpint (sbuf.st_mtim.tv_sec, ==, tbuf.st_mtim.tv_sec);
+
+  if (S_ISREG (sbuf.st_mode)) {
+    g_autofree char *scontents = NULL, *tcontents = NULL;
+    gsize ssize, tsize;
+
+    g_assert_true (g_file_get_contents (source, &scontents, &ssize, NULL));
+    g_assert_true (g_file_get_contents (target, &tcontents, &tsize, NULL));
+
+    g_assert_cmpuint (ssize, ==, tsize);
+    g_assert (memcmp (scontents, tcontents, ssize) == 0);
+    return;
+  }
+
+  g_assert_true (S_ISDIR (sbuf.st_mode));
+
+  g_autoptr(GDir) dir = g_dir_open (source, 0, NULL);
+  g_assert_nonnull (dir);
+
+  guint n_entries = 0;
+  const char *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *schild = g_build_filename (source, name, NULL);
+    g_autofree char *tchild = g_build_filename (target, name, NULL);
+
+    assert_same_tree (schild, tchild);
+    n_entries += 1;
+  }
+
+  g_autoptr(GDir) tdir = g_dir_open (target, 0, NULL);
+  g_assert_nonnull (tdir);
+
+  while (g_dir_read_name (tdir) != NULL)
+    n_entries -= 1;
+
+  g_assert_cmpuint (n_entries, ==, 0);
+}
+
+/* The copy eam_fs_cpdir_recursive() used to do, one file at a time */
+static void
+gio_copy_tree (GFile *source,
+               GFile *target)
+{
+  GError *error = NULL;
+
+  g_file_make_directory (target, NULL, &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GFileEnumerator) enumerator =
+    g_file_enumerate_children (source,
+                               G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                               G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                               G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                               NULL, &error);
+  g_assert_no_error (error);
+
+  while (TRUE) {
+    GFileInfo *info;
+    GFile *child;
+
+    g_assert_true (g_file_enumerator_iterate (enumerator, &info, &child, NULL, &error));
+    if (info == NULL)
+      break;
+
+    g_autoptr(GFile) target_child = g_file_get_child (target, g_file_info_get_name (info));
+
+    if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
+      gio_copy_tree (child, target_child);
+      continue;
+    }
+
+    g_file_copy (child, target_child,
+                 G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_ALL_METADATA,
+                 NULL, NULL, NULL, &error);
+    g_assert_no_error (error);
+  }
+
+  g_file_copy_attributes (source, target, G_FILE_COPY_ALL_METADATA, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_copy_tree (Fixture *fixture,
+                gconstpointer user_data)
+{
+  g_autofree char *target = g_build_filename (fixture->tmpdir, "target", NULL);
+  g_autofree char *file = g_build_filename ("group-000", "dir-0000", "file-0001", NULL);
+  g_autofree char *source_file = g_build_filename (fixture->source, file, NULL);
+  g_autofree char *target_file = g_build_filename (target, file, NULL);
+  GError *error = NULL;
+
+  /* Not every file system has extended attributes */
+  gboolean has_xattrs = setxattr (source_file, "user.eam-test", "value", 5, 0) == 0;
+
+  g_assert_true (eam_copy_tree (fixture->source, target, NULL, &error));
+  g_assert_no_error (error);
+
+  assert_same_tree (fixture->source, target);
+
+  if (has_xattrs) {
+    char value[16];
+
+    g_assert_cmpint (getxattr (target_file, "user.eam-test", value, sizeof (value)), ==, 5);
+    g_assert (memcmp (value, "value", 5) == 0);
+  }
+}
+
+static void
+test_copy_tree_existing (Fixture *fixture,
+                         gconstpointer user_data)
+{
+  g_autofree char *target = g_build_filename (fixture->tmpdir, "target", NULL);
+  GError *error = NULL;
+
+  g_assert_cmpint (g_mkdir (target, 0755), ==, 0);
+
+  g_assert_false (eam_copy_tree (fixture->source, target, NULL, &error));
+  g_assert_nonnull (error);
+  g_error_free (error);
+}
+
+static void
+report (const char *what,
+        guint n_files,
+        double elapsed)
+{
+  g_print ("# %s: %u files in %.3f s, %.0f files/s\n",
+           what, n_files, elapsed, n_files / MAX (elapsed, 1e-9));
+  g_test_minimized_result (elapsed, "%s: %.0f files/s", what, n_files / MAX (elapsed, 1e-9));
+}
+
+static void
+test_copy_tree_throughput (Fixture *fixture,
+                           gconstpointer user_data)
+{
+  g_autofree char *gio_target = g_build_filename (fixture->tmpdir, "gio", NULL);
+  g_autofree char *eam_target = g_build_filename (fixture->tmpdir, "eam", NULL);
+  GError *error = NULL;
+
+  /* Both copies read the source from the page cache, as it was just
+   * written
+   */
+
+  g_autoptr(GFile) source = g_file_new_for_path (fixture->source);
+  g_autoptr(GFile) target = g_file_new_for_path (gio_target);
+
+  g_test_timer_start ();
+  gio_copy_tree (source, target);
+  double gio_elapsed = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  g_assert_true (eam_copy_tree (fixture->source, eam_target, NULL, &error));
+  g_assert_no_error (error);
+  double eam_elapsed = g_test_timer_elapsed ();
+
+  report ("g_file_copy", fixture->tree.n_files, gio_elapsed);
+  report ("eam_copy_tree", fixture->tree.n_files, eam_elapsed);
+  g_print ("# eam_copy_tree speedup: %.2fx\n", gio_elapsed / MAX (eam_elapsed, 1e-9));
+
+  assert_same_tree (fixture->source, eam_target);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/copy/tree", Fixture, NULL,
+              fixture_set_up, test_copy_tree, fixture_tear_down);
+  g_test_add ("/copy/tree-existing", Fixture, NULL,
+              fixture_set_up, test_copy_tree_existing, fixture_tear_down);
+  g_test_add ("/copy/tree-throughput", Fixture, NULL,
+              fixture_set_up, test_copy_tree_throughput, fixture_tear_down);
+
+  return g_test_run ();
+}
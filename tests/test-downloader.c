@@ -0,0 +1,620 @@
+/* test-downloader.c: Tests for the shared HTTP session
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <libsoup/soup.h>
+#include <glib/gstdio.h>
+
+#include "eam-downloader.h"
+#include "eam-error.h"
+
+/* The downloader only has a synchronous API, so the server runs in a
+ * thread of its own, with its own main context. It serves a single
+ * resource, with a strong ETag, and answers range requests itself;
+ * it records the remote port of each request, which tells whether
+ * the requests went through the same connection.
+ *
+ * The tests of segmented downloads change the ETag of the resource
+ * halfway, or make the server fail the range starting at a given
+ * offset, after a delay that lets the other segments finish first.
+ */
+
+#define RESOURCE_SIZE   (2 * 1024 * 1024)
+#define RESOURCE_ETAG   "\"eam-test-1\""
+#define CHANGED_ETAG    "\"eam-test-2\""
+#define N_SEGMENTS      4
+#define SEGMENT_SIZE    (RESOURCE_SIZE / N_SEGMENTS)
+#define FAIL_DELAY_MS   500
+
+typedef struct {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  SoupServer *server;
+  char *url;
+
+  guint8 *data;
+
+  /* Protects the fields below */
+  GMutex lock;
+  GCond cond;
+  GArray *ports;
+  guint n_partial;
+  const char *etag;
+  goffset fail_offset;
+} Fixture;
+
+typedef struct {
+  SoupServer *server;
+  SoupMessage *msg;
+} PausedMessage;
+
+static gboolean
+fail_paused_message (gpointer user_data)
+{
+  PausedMessage *paused = user_data;
+
+  soup_message_set_status (paused->msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+  soup_server_unpause_message (paused->server, paused->msg);
+
+  g_free (paused);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+server_callback (SoupServer *server,
+                 SoupMessage *msg,
+                 const char *path,
+                 GHashTable *query,
+                 SoupClientContext *client,
+                 gpointer user_data)
+{
+  Fixture *fixture = user_data;
+
+  GSocketAddress *address = soup_client_context_get_remote_address (client);
+  guint16 port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+
+  g_mutex_lock (&fixture->lock);
+  g_array_append_val (fixture->ports, port);
+  const char *etag = fixture->etag;
+  goffset fail_offset = fixture->fail_offset;
+  g_mutex_unlock (&fixture->lock);
+
+  if (msg->method != SOUP_METHOD_GET) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+    return;
+  }
+
+  soup_message_headers_replace (msg->response_headers, "ETag", etag);
+  soup_message_headers_replace (msg->response_headers, "Accept-Ranges", "bytes");
+
+  /* A range is only honoured if the resource still matches If-Range;
+   * otherwise the Range header is dropped, so that the server does
+   * not turn the full response into a partial one behind our back
+   */
+  const char *if_range = soup_message_headers_get_one (msg->request_headers, "If-Range");
+  if (if_range != NULL && g_strcmp0 (if_range, etag) != 0)
+    soup_message_headers_remove (msg->request_headers, "Range");
+
+  SoupRange *ranges;
+  int n_ranges;
+
+  if (soup_message_headers_get_one (msg->request_headers, "Range") != NULL) {
+    goffset start = -1, end = -1;
+
+    if (soup_message_headers_get_ranges (msg->request_headers, RESOURCE_SIZE, &ranges, &n_ranges)) {
+      g_assert_cmpint (n_ranges, ==, 1);
+
+      start = ranges[0].start;
+      end = MIN (ranges[0].end, RESOURCE_SIZE - 1);
+      soup_message_headers_free_ranges (msg->request_headers, ranges);
+    }
+
+    if (start < 0 || start >= RESOURCE_SIZE || start > end) {
+      soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+      return;
+    }
+
+    if (start == fail_offset) {
+      PausedMessage *paused = g_new0 (PausedMessage, 1);
+      paused->server = server;
+      paused->msg = msg;
+
+      soup_server_pause_message (server, msg);
+
+      g_autoptr(GSource) source = g_timeout_source_new (FAIL_DELAY_MS);
+      g_source_set_callback (source, fail_paused_message, paused, NULL);
+      g_source_attach (source, fixture->context);
+      return;
+    }
+
+    soup_message_set_status (msg, SOUP_STATUS_PARTIAL_CONTENT);
+    soup_message_headers_set_content_range (msg->response_headers, start, end, RESOURCE_SIZE);
+    soup_message_body_append (msg->response_body, SOUP_MEMORY_STATIC,
+                              fixture->data + start, end - start + 1);
+
+    g_mutex_lock (&fixture->lock);
+    fixture->n_partial += 1;
+    g_mutex_unlock (&fixture->lock);
+    return;
+  }
+
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_body_append (msg->response_body, SOUP_MEMORY_STATIC,
+                            fixture->data, RESOURCE_SIZE);
+}
+
+static gpointer
+server_thread_func (gpointer user_data)
+{
+  Fixture *fixture = user_data;
+  GError *error = NULL;
+
+  g_main_context_push_thread_default (fixture->context);
+
+  fixture->server = soup_server_new (NULL, NULL);
+  soup_server_add_handler (fixture->server, "/bundle", server_callback, fixture, NULL);
+
+  soup_server_listen_local (fixture->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  GSList *uris = soup_server_get_uris (fixture->server);
+  char *base = soup_uri_to_string (uris->data, FALSE);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  g_mutex_lock (&fixture->lock);
+  fixture->url = g_strconcat (base, g_str_has_suffix (base, "/") ? "" : "/", "bundle", NULL);
+  g_cond_signal (&fixture->cond);
+  g_mutex_unlock (&fixture->lock);
+
+  g_free (base);
+
+  g_main_loop_run (fixture->loop);
+
+  soup_server_disconnect (fixture->server);
+  g_clear_object (&fixture->server);
+
+  g_main_context_pop_thread_default (fixture->context);
+
+  return NULL;
+}
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  fixture->data = g_malloc (RESOURCE_SIZE);
+  for (gsize i = 0; i < RESOURCE_SIZE; i++)
+    fixture->data[i] = (i * 7 + i / 251) & 0xff;
+
+  g_mutex_init (&fixture->lock);
+  g_cond_init (&fixture->cond);
+  fixture->ports = g_array_new (FALSE, FALSE, sizeof (guint16));
+  fixture->etag = RESOURCE_ETAG;
+  fixture->fail_offset = -1;
+
+  fixture->context = g_main_context_new ();
+  fixture->loop = g_main_loop_new (fixture->context, FALSE);
+  fixture->thread = g_thread_new ("test-server", server_thread_func, fixture);
+
+  g_mutex_lock (&fixture->lock);
+  while (fixture->url == NULL)
+    g_cond_wait (&fixture->cond, &fixture->lock);
+  g_mutex_unlock (&fixture->lock);
+}
+
+static gboolean
+quit_loop (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_main_context_invoke (fixture->context, quit_loop, fixture->loop);
+  g_thread_join (fixture->thread);
+
+  g_main_loop_unref (fixture->loop);
+  g_main_context_unref (fixture->context);
+
+  g_array_unref (fixture->ports);
+  g_cond_clear (&fixture->cond);
+  g_mutex_clear (&fixture->lock);
+
+  g_free (fixture->url);
+  g_free (fixture->data);
+}
+
+static GBytes *
+read_all (GInputStream *stream)
+{
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+  GError *error = NULL;
+
+  g_output_stream_splice (out, stream,
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                          NULL, &error);
+  g_assert_no_error (error);
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+}
+
+static void
+assert_body (GBytes *body,
+             const guint8 *expected,
+             gsize expected_size)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (body, &size);
+
+  g_assert_cmpuint (size, ==, expected_size);
+  g_assert (memcmp (data, expected, size) == 0);
+}
+
+static void
+test_connection_reuse (Fixture *fixture,
+                       gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+
+  for (guint i = 0; i < 3; i++) {
+    GError *error = NULL;
+    goffset content_length;
+
+    g_autoptr(GInputStream) stream =
+      eam_downloader_open (downloader, fixture->url, &content_length, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (content_length, ==, RESOURCE_SIZE);
+
+    g_autoptr(GBytes) body = read_all (stream);
+    assert_body (body, fixture->data, RESOURCE_SIZE);
+  }
+
+  /* Requests made one after the other go through the same connection */
+  g_assert_cmpuint (fixture->ports->len, ==, 3);
+  g_assert_cmpuint (g_array_index (fixture->ports, guint16, 1), ==,
+                    g_array_index (fixture->ports, guint16, 0));
+  g_assert_cmpuint (g_array_index (fixture->ports, guint16, 2), ==,
+                    g_array_index (fixture->ports, guint16, 0));
+}
+
+static void
+test_open_missing (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_autofree char *url = g_strconcat (fixture->url, "-missing", NULL);
+  GError *error = NULL;
+
+  g_autoptr(GInputStream) stream = eam_downloader_open (downloader, url, NULL, NULL, &error);
+  g_assert_null (stream);
+  g_assert_nonnull (error);
+  g_error_free (error);
+}
+
+static void
+test_range (Fixture *fixture,
+            gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_auto(EamDownloadInfo) info = { 0, };
+  GError *error = NULL;
+  goffset offset = 1000;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, offset, -1, RESOURCE_ETAG,
+                               &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (info.start, ==, offset);
+  g_assert_cmpint (info.content_length, ==, RESOURCE_SIZE - offset);
+  g_assert_cmpint (info.total_length, ==, RESOURCE_SIZE);
+  g_assert_true (info.accept_ranges);
+  g_assert_cmpstr (info.validator, ==, RESOURCE_ETAG);
+
+  g_autoptr(GBytes) body = read_all (stream);
+  assert_body (body, fixture->data + offset, RESOURCE_SIZE - offset);
+
+  g_assert_cmpuint (fixture->n_partial, ==, 1);
+}
+
+static void
+test_range_end (Fixture *fixture,
+                gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_auto(EamDownloadInfo) info = { 0, };
+  GError *error = NULL;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, 4096, 8191, RESOURCE_ETAG,
+                               &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (info.start, ==, 4096);
+  g_assert_cmpint (info.content_length, ==, 4096);
+  g_assert_cmpint (info.total_length, ==, RESOURCE_SIZE);
+
+  g_autoptr(GBytes) body = read_all (stream);
+  assert_body (body, fixture->data + 4096, 4096);
+}
+
+/* A resource that changed since the first request is sent in full */
+static void
+test_if_range_mismatch (Fixture *fixture,
+                        gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_auto(EamDownloadInfo) info = { 0, };
+  GError *error = NULL;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, 1000, -1, "\"eam-test-0\"",
+                               &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (info.start, ==, 0);
+  g_assert_cmpint (info.content_length, ==, RESOURCE_SIZE);
+  g_assert_cmpint (info.total_length, ==, RESOURCE_SIZE);
+  g_assert_cmpstr (info.validator, ==, RESOURCE_ETAG);
+
+  g_autoptr(GBytes) body = read_all (stream);
+  assert_body (body, fixture->data, RESOURCE_SIZE);
+
+  g_assert_cmpuint (fixture->n_partial, ==, 0);
+}
+
+/* Without a validator, there is no way to tell whether the bytes we
+ * have are still good, so the range is not even asked for
+ */
+static void
+test_range_without_validator (Fixture *fixture,
+                              gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_auto(EamDownloadInfo) info = { 0, };
+  GError *error = NULL;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, 1000, -1, NULL,
+                               &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (info.start, ==, 0);
+
+  g_autoptr(GBytes) body = read_all (stream);
+  assert_body (body, fixture->data, RESOURCE_SIZE);
+
+  g_assert_cmpuint (fixture->n_partial, ==, 0);
+}
+
+/* A range past the end means the resource shrank under the same
+ * validator; the download starts over
+ */
+static void
+test_range_not_satisfiable (Fixture *fixture,
+                            gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (4, 2);
+  g_auto(EamDownloadInfo) info = { 0, };
+  GError *error = NULL;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, RESOURCE_SIZE + 10, -1, RESOURCE_ETAG,
+                               &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (info.start, ==, 0);
+  g_assert_cmpint (info.total_length, ==, RESOURCE_SIZE);
+
+  g_autoptr(GBytes) body = read_all (stream);
+  assert_body (body, fixture->data, RESOURCE_SIZE);
+
+  g_assert_cmpuint (fixture->ports->len, ==, 2);
+}
+
+static int
+open_tmp_file (char **path)
+{
+  GError *error = NULL;
+  int fd = g_file_open_tmp ("eam-test-downloader-XXXXXX", path, &error);
+  g_assert_no_error (error);
+
+  return fd;
+}
+
+static void
+assert_file_range (int fd,
+                   const guint8 *data,
+                   goffset start,
+                   goffset end)
+{
+  g_autofree guint8 *contents = g_malloc (MAX (end - start, 1));
+
+  g_assert_cmpint (pread (fd, contents, end - start, start), ==, end - start);
+  g_assert (memcmp (contents, data + start, end - start) == 0);
+}
+
+/* The body is split between the stream of the first request and new
+ * range requests, and reassembled in place
+ */
+static void
+test_segments (Fixture *fixture,
+               gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (8, 8);
+  g_autofree char *path = NULL;
+  int fd = open_tmp_file (&path);
+
+  for (guint i = 0; i < 2; i++) {
+    g_auto(EamDownloadInfo) info = { 0, };
+    GError *error = NULL;
+    goffset completed = -1;
+
+    /* A download from the start, and one that resumes */
+    goffset offset = i == 0 ? 0 : 1000;
+
+    g_autoptr(GInputStream) stream =
+      eam_downloader_open_range (downloader, fixture->url, offset, -1, RESOURCE_ETAG,
+                                 &info, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (info.start, ==, offset);
+
+    g_mutex_lock (&fixture->lock);
+    guint n_partial = fixture->n_partial;
+    g_mutex_unlock (&fixture->lock);
+
+    g_assert_true (eam_downloader_fetch_segments (downloader, fixture->url, stream, &info, fd,
+                                                  N_SEGMENTS, &completed, NULL, &error));
+    g_assert_no_error (error);
+    g_assert_cmpint (completed, ==, RESOURCE_SIZE);
+
+    assert_file_range (fd, fixture->data, offset, RESOURCE_SIZE);
+
+    /* The first segment reuses the stream */
+    g_mutex_lock (&fixture->lock);
+    g_assert_cmpuint (fixture->n_partial - n_partial, ==, N_SEGMENTS - 1);
+    g_mutex_unlock (&fixture->lock);
+  }
+
+  close (fd);
+  g_unlink (path);
+}
+
+/* If the resource changes after the first request, the server sends
+ * it in full instead of the ranges, which cannot be used
+ */
+static void
+test_segments_resource_changed (Fixture *fixture,
+                                gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (8, 8);
+  g_auto(EamDownloadInfo) info = { 0, };
+  g_autofree char *path = NULL;
+  int fd = open_tmp_file (&path);
+  GError *error = NULL;
+  goffset completed = -1;
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, 0, -1, NULL, &info, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (info.validator, ==, RESOURCE_ETAG);
+
+  g_mutex_lock (&fixture->lock);
+  fixture->etag = CHANGED_ETAG;
+  g_mutex_unlock (&fixture->lock);
+
+  g_assert_false (eam_downloader_fetch_segments (downloader, fixture->url, stream, &info, fd,
+                                                 N_SEGMENTS, &completed, NULL, &error));
+
+  /* The cause is reported, not the cancellation of the other segments */
+  g_assert_error (error, EAM_ERROR, EAM_ERROR_FAILED);
+  g_assert_nonnull (strstr (error->message, "changed"));
+  g_clear_error (&error);
+
+  /* Only the first segment may have been written */
+  g_assert_cmpint (completed, >=, 0);
+  g_assert_cmpint (completed, <=, SEGMENT_SIZE);
+  assert_file_range (fd, fixture->data, 0, completed);
+
+  g_assert_cmpuint (fixture->n_partial, ==, 0);
+
+  close (fd);
+  g_unlink (path);
+}
+
+/* The segments after a failed one may be complete, but what was
+ * written does not reach them without a gap, so it is not counted
+ */
+static void
+test_segments_gap (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(EamDownloader) downloader = eam_downloader_new (8, 8);
+  g_auto(EamDownloadInfo) info = { 0, };
+  g_autofree char *path = NULL;
+  int fd = open_tmp_file (&path);
+  GError *error = NULL;
+  goffset completed = -1;
+
+  g_mutex_lock (&fixture->lock);
+  fixture->fail_offset = SEGMENT_SIZE;
+  g_mutex_unlock (&fixture->lock);
+
+  g_autoptr(GInputStream) stream =
+    eam_downloader_open_range (downloader, fixture->url, 0, -1, NULL, &info, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (eam_downloader_fetch_segments (downloader, fixture->url, stream, &info, fd,
+                                                 N_SEGMENTS, &completed, NULL, &error));
+  g_assert_error (error, EAM_ERROR, EAM_ERROR_FAILED);
+  g_assert_nonnull (strstr (error->message, "500"));
+  g_clear_error (&error);
+
+  /* The first and last segments were done before the second one
+   * failed, and the resource is written up to the gap only
+   */
+  g_assert_cmpuint (fixture->n_partial, ==, N_SEGMENTS - 2);
+
+  g_assert_cmpint (completed, ==, SEGMENT_SIZE);
+  assert_file_range (fd, fixture->data, 0, completed);
+  assert_file_range (fd, fixture->data, 2 * SEGMENT_SIZE, RESOURCE_SIZE);
+
+  close (fd);
+  g_unlink (path);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/downloader/connection-reuse", Fixture, NULL,
+              fixture_set_up, test_connection_reuse, fixture_tear_down);
+  g_test_add ("/downloader/open-missing", Fixture, NULL,
+              fixture_set_up, test_open_missing, fixture_tear_down);
+  g_test_add ("/downloader/range", Fixture, NULL,
+              fixture_set_up, test_range, fixture_tear_down);
+  g_test_add ("/downloader/range-end", Fixture, NULL,
+              fixture_set_up, test_range_end, fixture_tear_down);
+  g_test_add ("/downloader/if-range-mismatch", Fixture, NULL,
+              fixture_set_up, test_if_range_mismatch, fixture_tear_down);
+  g_test_add ("/downloader/range-without-validator", Fixture, NULL,
+              fixture_set_up, test_range_without_validator, fixture_tear_down);
+  g_test_add ("/downloader/range-not-satisfiable", Fixture, NULL,
+              fixture_set_up, test_range_not_satisfiable, fixture_tear_down);
+  g_test_add ("/downloader/segments", Fixture, NULL,
+              fixture_set_up, test_segments, fixture_tear_down);
+  g_test_add ("/downloader/segments-resource-changed", Fixture, NULL,
+              fixture_set_up, test_segments_resource_changed, fixture_tear_down);
+  g_test_add ("/downloader/segments-gap", Fixture, NULL,
+              fixture_set_up, test_segments_gap, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,195 @@
+/* test-extract-filter.c: Tests for the partial extraction of bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "eam-extract-filter.h"
+#include "eam-fs-utils.h"
+
+/* The paths are the ones of bundle entries, which start with the app
+ * id; the filters are created with explicit lists, as the ones from
+ * the configuration depend on the system.
+ */
+
+static const char * const locales[] = { "pt_BR.UTF-8", "en", NULL };
+static const char * const architectures[] = { "x86_64-linux-gnu", NULL };
+
+static void
+assert_match (EamExtractFilter *filter,
+              const char *path,
+              gboolean is_dir,
+              gboolean expected)
+{
+  if (eam_extract_filter_match (filter, path, is_dir) != expected)
+    g_error ("'%s' should %sbe extracted", path, expected ? "" : "not ");
+}
+
+static void
+test_subtree (void)
+{
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new (locales, architectures);
+
+  /* The app directory and the locale directory itself are kept */
+  assert_match (filter, "com.example.App", TRUE, TRUE);
+  assert_match (filter, "com.example.App/share/locale", TRUE, TRUE);
+  assert_match (filter, "com.example.App/share/locale/", TRUE, TRUE);
+
+  /* A subtree is left out as a whole */
+  assert_match (filter, "com.example.App/share/locale/de", TRUE, FALSE);
+  assert_match (filter, "com.example.App/share/locale/de/LC_MESSAGES", TRUE, FALSE);
+  assert_match (filter, "com.example.App/share/locale/de/LC_MESSAGES/app.mo", FALSE, FALSE);
+  assert_match (filter, "./com.example.App/share/locale/de/LC_MESSAGES/app.mo", FALSE, FALSE);
+
+  /* Files directly inside the directory are not a subtree */
+  assert_match (filter, "com.example.App/share/locale/locale.alias", FALSE, TRUE);
+
+  /* Only whole path components match */
+  assert_match (filter, "com.example.App/share/locales/de", TRUE, TRUE);
+  assert_match (filter, "com.example.App/usr/share/locale/de", TRUE, TRUE);
+  assert_match (filter, "com.example.App/libexec/i386-linux-gnu", TRUE, TRUE);
+}
+
+static void
+test_locales (void)
+{
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new (locales, NULL);
+
+  /* Locales are matched by language */
+  assert_match (filter, "com.example.App/share/locale/pt/LC_MESSAGES/app.mo", FALSE, TRUE);
+  assert_match (filter, "com.example.App/share/locale/pt_BR/LC_MESSAGES/app.mo", FALSE, TRUE);
+  assert_match (filter, "com.example.App/share/locale/pt_PT/LC_MESSAGES/app.mo", FALSE, TRUE);
+  assert_match (filter, "com.example.App/share/help/en_GB/app/index.page", FALSE, TRUE);
+  assert_match (filter, "com.example.App/share/help/en@shaw", TRUE, TRUE);
+  assert_match (filter, "com.example.App/share/locale/es/LC_MESSAGES/app.mo", FALSE, FALSE);
+  assert_match (filter, "com.example.App/share/help/fr_FR", TRUE, FALSE);
+
+  /* The fallbacks are always kept */
+  assert_match (filter, "com.example.App/share/help/C/app/index.page", FALSE, TRUE);
+  assert_match (filter, "com.example.App/share/locale/POSIX", TRUE, TRUE);
+
+  /* Without a list of architectures, every library is kept */
+  assert_match (filter, "com.example.App/lib/i386-linux-gnu/libapp.so", FALSE, TRUE);
+
+  /* Without any list, everything is */
+  g_autoptr(EamExtractFilter) all = eam_extract_filter_new (NULL, NULL);
+
+  assert_match (all, "com.example.App/share/locale/es/LC_MESSAGES/app.mo", FALSE, TRUE);
+  assert_match (all, "com.example.App/lib/arm-linux-gnueabihf/libapp.so", FALSE, TRUE);
+}
+
+static void
+test_architectures (void)
+{
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new (NULL, architectures);
+
+  assert_match (filter, "com.example.App/lib/x86_64-linux-gnu/libapp.so", FALSE, TRUE);
+  assert_match (filter, "com.example.App/lib/i386-linux-gnu", TRUE, FALSE);
+  assert_match (filter, "com.example.App/lib/arm-linux-gnueabihf/libapp.so", FALSE, FALSE);
+
+  /* Triplets we know nothing about, and other directories, are kept */
+  assert_match (filter, "com.example.App/lib/mips64el-linux-gnuabi64/libapp.so", FALSE, TRUE);
+  assert_match (filter, "com.example.App/lib/python3/site-packages", TRUE, TRUE);
+  assert_match (filter, "com.example.App/lib/libapp.so", FALSE, TRUE);
+
+  /* Without a list of locales, every translation is kept */
+  assert_match (filter, "com.example.App/share/locale/es/LC_MESSAGES/app.mo", FALSE, TRUE);
+}
+
+static void
+assert_string_list (GKeyFile *keyfile,
+                    const char *key,
+                    const char *expected)
+{
+  GError *error = NULL;
+  g_auto(GStrv) list = g_key_file_get_string_list (keyfile, EAM_EXTRACT_FILTER_INFO_GROUP,
+                                                   key, NULL, &error);
+  g_assert_no_error (error);
+
+  g_autofree char *joined = g_strjoinv (";", list);
+  g_assert_cmpstr (joined, ==, expected);
+}
+
+static void
+test_record (void)
+{
+  GError *error = NULL;
+  g_autofree char *tmpdir = g_dir_make_tmp ("eam-test-extract-filter-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_autofree char *info_file = g_build_filename (tmpdir, ".info", NULL);
+  g_file_set_contents (info_file,
+                       "[Bundle]\n"
+                       "app_id=com.example.App\n"
+                       "\n"
+                       "[Partial]\n"
+                       "skipped_locales=it\n",
+                       -1, &error);
+  g_assert_no_error (error);
+
+  /* Nothing to record: the .info file is not even read */
+  g_autoptr(EamExtractFilter) all = eam_extract_filter_new (NULL, NULL);
+  g_assert_true (eam_extract_filter_match (all, "com.example.App/share/locale/es", TRUE));
+  g_assert_true (eam_extract_filter_record (all, "/nonexistent"));
+
+  g_autoptr(EamExtractFilter) filter = eam_extract_filter_new (locales, architectures);
+
+  assert_match (filter, "com.example.App/share/locale/fr_FR", TRUE, FALSE);
+  assert_match (filter, "com.example.App/share/locale/de", TRUE, FALSE);
+  assert_match (filter, "com.example.App/share/help/de", TRUE, FALSE);
+  assert_match (filter, "com.example.App/lib/i386-linux-gnu", TRUE, FALSE);
+
+  g_assert_true (eam_extract_filter_record (filter, tmpdir));
+
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_assert_true (g_key_file_load_from_file (keyfile, info_file, 0, &error));
+  g_assert_no_error (error);
+
+  /* The rest of the file is kept, and the section is replaced */
+  g_autofree char *app_id = g_key_file_get_string (keyfile, "Bundle", "app_id", &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (app_id, ==, "com.example.App");
+
+  assert_string_list (keyfile, "locales", "en;pt");
+  assert_string_list (keyfile, "architectures", "x86_64-linux-gnu");
+  assert_string_list (keyfile, "skipped_locales", "de;fr_FR");
+  assert_string_list (keyfile, "skipped_architectures", "i386-linux-gnu");
+
+  /* A missing .info file is an error */
+  g_autofree char *missing = g_build_filename (tmpdir, "missing", NULL);
+  g_assert_false (eam_extract_filter_record (filter, missing));
+
+  eam_fs_rmdir_recursive (tmpdir);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/extract-filter/subtree", test_subtree);
+  g_test_add_func ("/extract-filter/locales", test_locales);
+  g_test_add_func ("/extract-filter/architectures", test_architectures);
+  g_test_add_func ("/extract-filter/record", test_record);
+
+  return g_test_run ();
+}
@@ -0,0 +1,819 @@
+/* test-extract.c: Tests and benchmarks for the bundle extraction engine
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <glib/gstdio.h>
+
+#include "eam-extract.h"
+#include "eam-fs-utils.h"
+#include "eam-utils.h"
+#include "eam-verify-cache.h"
+
+#include "eam-test-utils.h"
+
+/* The bundles are generated by the tests, as uncompressed tarballs,
+ * so that decompression does not hide the cost of the code around it;
+ * only /extract/compressed compresses them.
+ *
+ * The benchmarks only use a large bundle in perf mode, i.e. with
+ * -m perf; otherwise a small one just exercises the code. Each one is
+ * run a few times, and the best run is reported, after a first read
+ * of the bundle has brought it into the page cache.
+ *
+ * The journal keys depend on the keyring, so the tests run with a
+ * configuration of their own, pointing to an empty one.
+ */
+
+#define TEST_APPID      "com.endlessm.TestExtract"
+#define BENCH_RUNS      3
+
+typedef struct {
+  char *tmpdir;
+  char *bundle;
+  guint n_files;
+  gsize file_size;
+  guint64 bundle_size;
+} Fixture;
+
+static guint8
+file_byte (guint file,
+           gsize offset)
+{
+  return (offset * 13 + file * 101 + offset / 4093) & 0xff;
+}
+
+/* Returns %FALSE if libarchive cannot compress with @filter */
+static gboolean
+bundle_write (const char *path,
+              guint n_files,
+              gsize file_size,
+              int filter)
+{
+  struct archive *a = archive_write_new ();
+  g_assert_cmpint (archive_write_set_format_pax_restricted (a), ==, ARCHIVE_OK);
+
+  if (archive_write_add_filter (a, filter) != ARCHIVE_OK) {
+    archive_write_free (a);
+    return FALSE;
+  }
+
+  g_assert_cmpint (archive_write_open_filename (a, path), ==, ARCHIVE_OK);
+
+  struct archive_entry *entry = archive_entry_new ();
+  const char *dirs[] = { TEST_APPID, TEST_APPID "/files" };
+
+  for (guint i = 0; i < G_N_ELEMENTS (dirs); i++) {
+    archive_entry_clear (entry);
+    archive_entry_set_pathname (entry, dirs[i]);
+    archive_entry_set_filetype (entry, AE_IFDIR);
+    archive_entry_set_perm (entry, 0755);
+    g_assert_cmpint (archive_write_header (a, entry), ==, ARCHIVE_OK);
+  }
+
+  g_autofree guint8 *data = g_malloc (file_size);
+
+  for (guint i = 0; i < n_files; i++) {
+    g_autofree char *name = g_strdup_printf (TEST_APPID "/files/file-%04u", i);
+
+    for (gsize j = 0; j < file_size; j++)
+      data[j] = file_byte (i, j);
+
+    archive_entry_clear (entry);
+    archive_entry_set_pathname (entry, name);
+    archive_entry_set_filetype (entry, AE_IFREG);
+    archive_entry_set_perm (entry, 0644);
+    archive_entry_set_size (entry, file_size);
+    g_assert_cmpint (archive_write_header (a, entry), ==, ARCHIVE_OK);
+    g_assert_cmpint (archive_write_data (a, data, file_size), ==, (la_ssize_t) file_size);
+  }
+
+  archive_entry_free (entry);
+  g_assert_cmpint (archive_write_close (a), ==, ARCHIVE_OK);
+  archive_write_free (a);
+
+  return TRUE;
+}
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eam-test-extract-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->bundle = g_build_filename (fixture->tmpdir, "bundle.tar", NULL);
+
+  if (g_test_perf ()) {
+    fixture->n_files = 64;
+    fixture->file_size = 4 * 1024 * 1024;
+  }
+  else {
+    fixture->n_files = 16;
+    fixture->file_size = 256 * 1024;
+  }
+
+  g_assert_true (bundle_write (fixture->bundle, fixture->n_files, fixture->file_size,
+                               ARCHIVE_FILTER_NONE));
+
+  struct stat buf;
+  g_assert_cmpint (stat (fixture->bundle, &buf), ==, 0);
+  fixture->bundle_size = buf.st_size;
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  eam_fs_rmdir_recursive (fixture->tmpdir);
+
+  g_free (fixture->bundle);
+  g_free (fixture->tmpdir);
+}
+
+static EamExtractor *
+fixture_new_bundle_extractor (Fixture *fixture,
+                              const char *bundle,
+                              const char *name,
+                              char **prefix)
+{
+  *prefix = g_build_filename (fixture->tmpdir, name, NULL);
+
+  eam_fs_rmdir_recursive (*prefix);
+  g_assert_cmpint (g_mkdir (*prefix, 0755), ==, 0);
+
+  return eam_extractor_new (bundle, *prefix);
+}
+
+static EamExtractor *
+fixture_new_extractor (Fixture *fixture,
+                       const char *name,
+                       char **prefix)
+{
+  return fixture_new_bundle_extractor (fixture, fixture->bundle, name, prefix);
+}
+
+static double
+extractor_run_timed (EamExtractor *extractor)
+{
+  g_test_timer_start ();
+  g_assert_true (eam_extractor_run (extractor, NULL));
+
+  return g_test_timer_elapsed ();
+}
+
+static char *
+fixture_extract (Fixture *fixture,
+                 const char *name,
+                 EamExtractorReader reader,
+                 double *elapsed)
+{
+  char *prefix;
+  g_autoptr(EamExtractor) extractor = fixture_new_extractor (fixture, name, &prefix);
+  eam_extractor_set_reader (extractor, reader);
+
+  double res = extractor_run_timed (extractor);
+
+  if (elapsed != NULL)
+    *elapsed = res;
+
+  return prefix;
+}
+
+static void
+assert_extracted (Fixture *fixture,
+                  const char *prefix)
+{
+  for (guint i = 0; i < fixture->n_files; i++) {
+    g_autofree char *name = g_strdup_printf ("file-%04u", i);
+    g_autofree char *path = g_build_filename (prefix, TEST_APPID, "files", name, NULL);
+    g_autofree char *contents = NULL;
+    gsize size;
+    GError *error = NULL;
+
+    g_file_get_contents (path, &contents, &size, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (size, ==, fixture->file_size);
+
+    for (gsize j = 0; j < size; j++) {
+      if ((guint8) contents[j] != file_byte (i, j))
+        g_error ("'%s' differs from the bundle at offset %" G_GSIZE_FORMAT, path, j);
+    }
+  }
+}
+
+static void
+report (const char *what,
+        guint64 size,
+        double elapsed)
+{
+  double mbps = size / 1e6 / MAX (elapsed, 1e-9);
+
+  g_print ("# %s: %.1f MB in %.3f s, %.1f MB/s\n", what, size / 1e6, elapsed, mbps);
+  g_test_minimized_result (elapsed, "%s: %.1f MB/s", what, mbps);
+}
+
+/* Both readers must produce the same tree */
+static void
+test_readers (Fixture *fixture,
+              gconstpointer user_data)
+{
+  g_autofree char *mmap_prefix =
+    fixture_extract (fixture, "mmap", EAM_EXTRACTOR_READER_MMAP, NULL);
+  assert_extracted (fixture, mmap_prefix);
+
+  g_autofree char *buffered_prefix =
+    fixture_extract (fixture, "buffered", EAM_EXTRACTOR_READER_BUFFERED, NULL);
+  assert_extracted (fixture, buffered_prefix);
+}
+
+/* Legacy bundles are left to libarchive, and seekable zstd bundles are
+ * decompressed in parallel; both readers must produce the same tree
+ * from all of them
+ */
+static void
+extract_compressed (Fixture *fixture,
+                    const char *bundle,
+                    const char *name)
+{
+  static const struct {
+    const char *name;
+    EamExtractorReader reader;
+  } readers[] = {
+    { "mmap", EAM_EXTRACTOR_READER_MMAP },
+    { "buffered", EAM_EXTRACTOR_READER_BUFFERED },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (readers); i++) {
+    g_autofree char *prefix_name = g_strdup_printf ("%s-%s", name, readers[i].name);
+    g_autofree char *prefix = NULL;
+    g_autoptr(EamExtractor) extractor =
+      fixture_new_bundle_extractor (fixture, bundle, prefix_name, &prefix);
+
+    eam_extractor_set_reader (extractor, readers[i].reader);
+    g_assert_true (eam_extractor_run (extractor, NULL));
+
+    assert_extracted (fixture, prefix);
+  }
+}
+
+static void
+test_compressed (Fixture *fixture,
+                 gconstpointer user_data)
+{
+  static const struct {
+    const char *name;
+    int filter;
+  } filters[] = {
+    { "gzip", ARCHIVE_FILTER_GZIP },
+    { "xz", ARCHIVE_FILTER_XZ },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (filters); i++) {
+    g_autofree char *bundle = g_strconcat (fixture->bundle, ".", filters[i].name, NULL);
+
+    if (!bundle_write (bundle, fixture->n_files, fixture->file_size, filters[i].filter)) {
+      g_test_message ("libarchive cannot write %s bundles", filters[i].name);
+      continue;
+    }
+
+    extract_compressed (fixture, bundle, filters[i].name);
+  }
+
+  g_autofree char *contents = NULL;
+  gsize size;
+  GError *error = NULL;
+
+  g_file_get_contents (fixture->bundle, &contents, &size, &error);
+  g_assert_no_error (error);
+
+  g_autoptr(GBytes) data = g_bytes_new_take (g_steal_pointer (&contents), size);
+  g_autoptr(GBytes) compressed = eam_test_zstd_compress_seekable (data, 1024 * 1024);
+
+  if (compressed == NULL) {
+    g_test_message ("Built without zstd support");
+    return;
+  }
+
+  g_autofree char *bundle = g_strconcat (fixture->bundle, ".zst", NULL);
+  g_file_set_contents (bundle, g_bytes_get_data (compressed, NULL),
+                       g_bytes_get_size (compressed), &error);
+  g_assert_no_error (error);
+
+  extract_compressed (fixture, bundle, "zstd");
+}
+
+/* The entries of the bundles are numbered from 1, and the files come
+ * after the two directories
+ */
+static guint64
+file_index (guint file)
+{
+  return file + 3;
+}
+
+static char *
+file_path (const char *prefix,
+           guint file)
+{
+  g_autofree char *name = g_strdup_printf ("file-%04u", file);
+
+  return g_build_filename (prefix, TEST_APPID, "files", name, NULL);
+}
+
+typedef struct {
+  EamJournal *journal;
+  const char *journal_file;
+  guint64 bytes_read;
+  guint64 limit;
+} InterruptTap;
+
+static goffset
+file_get_size (const char *path)
+{
+  struct stat buf;
+
+  g_assert_cmpint (stat (path, &buf), ==, 0);
+
+  return buf.st_size;
+}
+
+/* Stands for a power loss once @limit bytes of the bundle were read,
+ * after a checkpoint recorded some of the files
+ */
+static gboolean
+interrupt_tap (const void *data,
+               gsize size,
+               gpointer user_data)
+{
+  InterruptTap *tap = user_data;
+
+  tap->bytes_read += size;
+
+  if (tap->bytes_read < tap->limit)
+    return TRUE;
+
+  /* The writers may still be working on the first files */
+  goffset header_size = file_get_size (tap->journal_file);
+
+  for (guint i = 0; i < 500 && file_get_size (tap->journal_file) == header_size; i++) {
+    g_assert_true (eam_journal_checkpoint (tap->journal));
+    g_usleep (10000);
+  }
+
+  return FALSE;
+}
+
+/* Extracts the bundle with a journal, and checkpoints every file; with
+ * a @limit, the extraction is interrupted after a checkpoint instead
+ */
+static char *
+fixture_extract_journaled (Fixture *fixture,
+                           const char *journal_file,
+                           guint64 limit)
+{
+  char *prefix;
+  g_autoptr(EamExtractor) extractor = fixture_new_extractor (fixture, "journaled", &prefix);
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, "bundle");
+  g_assert_nonnull (journal);
+  g_assert_false (eam_journal_is_resumed (journal));
+
+  InterruptTap tap = { journal, journal_file, 0, limit };
+
+  eam_extractor_set_journal (extractor, journal);
+
+  if (limit > 0) {
+    eam_extractor_set_tap_func (extractor, interrupt_tap, &tap);
+    g_assert_false (eam_extractor_run (extractor, NULL));
+    g_assert_false (eam_extractor_get_resume_rejected (extractor));
+  }
+  else {
+    g_assert_true (eam_extractor_run (extractor, NULL));
+    g_assert_true (eam_journal_checkpoint (journal));
+  }
+
+  return prefix;
+}
+
+/* Resumes the extraction into @prefix, without discarding it */
+static gboolean
+fixture_resume (Fixture *fixture,
+                const char *prefix,
+                const char *journal_file,
+                gboolean *rejected)
+{
+  g_autoptr(EamExtractor) extractor = eam_extractor_new (fixture->bundle, prefix);
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, "bundle");
+  g_assert_nonnull (journal);
+  g_assert_true (eam_journal_is_resumed (journal));
+
+  eam_extractor_set_journal (extractor, journal);
+
+  gboolean res = eam_extractor_run (extractor, NULL);
+  *rejected = eam_extractor_get_resume_rejected (extractor);
+
+  return res;
+}
+
+static void
+test_resume (Fixture *fixture,
+             gconstpointer user_data)
+{
+  g_autofree char *journal_file = g_build_filename (fixture->tmpdir, "journal", NULL);
+  g_autofree char *prefix =
+    fixture_extract_journaled (fixture, journal_file, fixture->bundle_size / 2);
+
+  /* Which files made it depends on how far the writers went */
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, "bundle");
+  guint n_journaled = 0;
+
+  for (guint i = 0; i < fixture->n_files; i++) {
+    g_autofree char *name = g_strdup_printf (TEST_APPID "/files/file-%04u", i);
+    guint64 size;
+    const char *checksum;
+
+    if (eam_journal_lookup (journal, file_index (i), name, &size, &checksum))
+      n_journaled += 1;
+  }
+
+  g_clear_pointer (&journal, eam_journal_free);
+  g_test_message ("%u of %u files were journaled", n_journaled, fixture->n_files);
+  g_assert_cmpuint (n_journaled, >, 0);
+  g_assert_cmpuint (n_journaled, <, fixture->n_files);
+
+  gboolean rejected;
+  g_assert_true (fixture_resume (fixture, prefix, journal_file, &rejected));
+  g_assert_false (rejected);
+
+  assert_extracted (fixture, prefix);
+}
+
+static void
+test_resume_modified (Fixture *fixture,
+                      gconstpointer user_data)
+{
+  g_autofree char *journal_file = g_build_filename (fixture->tmpdir, "journal", NULL);
+  g_autofree char *prefix = fixture_extract_journaled (fixture, journal_file, 0);
+
+  /* A journaled file modified in place, keeping its size */
+  g_autofree char *modified = file_path (prefix, 1);
+  int fd = open (modified, O_WRONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pwrite (fd, "modified", 8, fixture->file_size / 2), ==, 8);
+  close (fd);
+
+  /* One that is gone, and one that was cut short */
+  g_autofree char *removed = file_path (prefix, 2);
+  g_assert_cmpint (g_unlink (removed), ==, 0);
+
+  g_autofree char *truncated = file_path (prefix, 3);
+  g_assert_cmpint (truncate (truncated, fixture->file_size / 2), ==, 0);
+
+  gboolean rejected;
+  g_assert_true (fixture_resume (fixture, prefix, journal_file, &rejected));
+  g_assert_false (rejected);
+
+  assert_extracted (fixture, prefix);
+}
+
+static void
+test_resume_rejected (Fixture *fixture,
+                      gconstpointer user_data)
+{
+  g_autofree char *journal_file = g_build_filename (fixture->tmpdir, "journal", NULL);
+  g_autofree char *prefix = fixture_extract_journaled (fixture, journal_file, 0);
+
+  /* The journal records another checksum for a file than the one of
+   * its data in the bundle, as if the bundle had changed; the last
+   * record of an entry is the one that counts
+   */
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, "bundle");
+  g_assert_true (eam_journal_is_resumed (journal));
+
+  eam_journal_add (journal, file_index (2), TEST_APPID "/files/file-0002", fixture->file_size,
+                   "0000000000000000000000000000000000000000000000000000000000000000");
+  g_assert_true (eam_journal_checkpoint (journal));
+  g_clear_pointer (&journal, eam_journal_free);
+
+  gboolean rejected;
+  g_assert_false (fixture_resume (fixture, prefix, journal_file, &rejected));
+  g_assert_true (rejected);
+
+  /* The extraction is then started over, without the journal */
+  eam_fs_rmdir_recursive (prefix);
+  g_assert_cmpint (g_mkdir (prefix, 0755), ==, 0);
+
+  g_autoptr(EamExtractor) extractor = eam_extractor_new (fixture->bundle, prefix);
+  g_assert_true (eam_extractor_run (extractor, NULL));
+
+  assert_extracted (fixture, prefix);
+}
+
+/* Leaves behind what an interrupted extraction of the bundle with
+ * @key would have, plus a file the bundle does not have
+ */
+static void
+leave_interrupted (const char *extract_dir,
+                   const char *key)
+{
+  g_autofree char *journal_file = g_strconcat (extract_dir, ".journal", NULL);
+  g_autofree char *stray = g_build_filename (extract_dir, "stray", NULL);
+  GError *error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (extract_dir, 0755), ==, 0);
+  g_file_set_contents (stray, "stray", -1, &error);
+  g_assert_no_error (error);
+
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, key);
+  g_assert_nonnull (journal);
+}
+
+static void
+test_resume_stale (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_autofree char *prefix = g_build_filename (fixture->tmpdir, "prefix", NULL);
+  g_autofree char *extract_dir = g_build_filename (prefix, TEST_APPID, NULL);
+  g_autofree char *journal_file = g_strconcat (extract_dir, ".journal", NULL);
+  g_autofree char *stray = g_build_filename (extract_dir, "stray", NULL);
+
+  /* An extraction of the same bundle is resumed */
+  g_autofree char *key = eam_verify_cache_get_key (fixture->bundle, NULL);
+  g_assert_nonnull (key);
+
+  leave_interrupted (extract_dir, key);
+
+  g_assert_true (eam_utils_bundle_extract (fixture->bundle, prefix, TEST_APPID, NULL, NULL, NULL));
+  assert_extracted (fixture, prefix);
+  g_assert_true (g_file_test (stray, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (journal_file, G_FILE_TEST_EXISTS));
+
+  /* Once the bundle is modified, the journal is thrown away, along
+   * with what it describes
+   */
+  leave_interrupted (extract_dir, key);
+
+  struct timespec times[2] = {
+    { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+    { .tv_sec = 1, .tv_nsec = 0 },
+  };
+  g_assert_cmpint (utimensat (AT_FDCWD, fixture->bundle, times, 0), ==, 0);
+
+  g_autofree char *modified_key = eam_verify_cache_get_key (fixture->bundle, NULL);
+  g_assert_cmpstr (modified_key, !=, key);
+
+  g_assert_true (eam_utils_bundle_extract (fixture->bundle, prefix, TEST_APPID, NULL, NULL, NULL));
+  assert_extracted (fixture, prefix);
+  g_assert_false (g_file_test (stray, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (journal_file, G_FILE_TEST_EXISTS));
+
+  /* So is the journal of the same bundle with another signature */
+  g_autofree char *signature = g_build_filename (fixture->tmpdir, "bundle.asc", NULL);
+  GError *error = NULL;
+
+  g_file_set_contents (signature, "signature", -1, &error);
+  g_assert_no_error (error);
+  g_autofree char *signed_key = eam_verify_cache_get_key (fixture->bundle, signature);
+
+  g_file_set_contents (signature, "another signature", -1, &error);
+  g_assert_no_error (error);
+  g_autofree char *resigned_key = eam_verify_cache_get_key (fixture->bundle, signature);
+
+  g_assert_nonnull (signed_key);
+  g_assert_cmpstr (signed_key, !=, modified_key);
+  g_assert_cmpstr (resigned_key, !=, signed_key);
+
+  g_autoptr(EamJournal) journal = eam_journal_open (journal_file, signed_key);
+  g_assert_false (eam_journal_is_resumed (journal));
+  g_clear_pointer (&journal, eam_journal_free);
+
+  journal = eam_journal_open (journal_file, resigned_key);
+  g_assert_false (eam_journal_is_resumed (journal));
+  g_clear_pointer (&journal, eam_journal_free);
+
+  journal = eam_journal_open (journal_file, resigned_key);
+  g_assert_true (eam_journal_is_resumed (journal));
+}
+
+static void
+test_reader_throughput (Fixture *fixture,
+                        gconstpointer user_data)
+{
+  const struct {
+    const char *name;
+    EamExtractorReader reader;
+  } readers[] = {
+    { "mmap", EAM_EXTRACTOR_READER_MMAP },
+    { "buffered", EAM_EXTRACTOR_READER_BUFFERED },
+  };
+
+  /* Warm up the page cache, so that both readers see the same bundle */
+  g_autofree char *warm_up = fixture_extract (fixture, "warm-up", EAM_EXTRACTOR_READER_BUFFERED, NULL);
+  eam_fs_rmdir_recursive (warm_up);
+
+  for (guint i = 0; i < G_N_ELEMENTS (readers); i++) {
+    double best = G_MAXDOUBLE;
+
+    for (guint run = 0; run < BENCH_RUNS; run++) {
+      double elapsed;
+      g_autofree char *prefix = fixture_extract (fixture, readers[i].name, readers[i].reader, &elapsed);
+
+      best = MIN (best, elapsed);
+      eam_fs_rmdir_recursive (prefix);
+    }
+
+    g_autofree char *what = g_strdup_printf ("%s reader", readers[i].name);
+    report (what, fixture->bundle_size, best);
+  }
+}
+
+/* Drops the pages of a file from the page cache, so that reading it
+ * again goes to the disk; this only works for clean pages, hence the
+ * sync first
+ */
+static void
+drop_cache (int fd)
+{
+  g_assert_cmpint (fdatasync (fd), ==, 0);
+  g_assert_cmpint (posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED), ==, 0);
+}
+
+/* Returns the number of extents of a file, or 0 if the file system
+ * cannot tell
+ */
+static guint
+count_extents (int fd)
+{
+  struct fiemap fm;
+
+  memset (&fm, 0, sizeof (fm));
+  fm.fm_length = FIEMAP_MAX_OFFSET;
+  fm.fm_flags = FIEMAP_FLAG_SYNC;
+
+  if (ioctl (fd, FS_IOC_FIEMAP, &fm) < 0)
+    return 0;
+
+  return fm.fm_mapped_extents;
+}
+
+static double
+read_extracted (Fixture *fixture,
+                const char *prefix,
+                guint *n_extents)
+{
+  g_autoptr(GArray) fds = g_array_new (FALSE, FALSE, sizeof (int));
+
+  *n_extents = 0;
+
+  for (guint i = 0; i < fixture->n_files; i++) {
+    g_autofree char *name = g_strdup_printf ("file-%04u", i);
+    g_autofree char *path = g_build_filename (prefix, TEST_APPID, "files", name, NULL);
+
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    g_assert_cmpint (fd, >=, 0);
+
+    drop_cache (fd);
+    *n_extents += count_extents (fd);
+
+    g_array_append_val (fds, fd);
+  }
+
+  gsize block_size = 1024 * 1024;
+  g_autofree guint8 *block = g_malloc (block_size);
+  guint64 total = 0;
+
+  g_test_timer_start ();
+
+  for (guint i = 0; i < fds->len; i++) {
+    int fd = g_array_index (fds, int, i);
+    ssize_t n;
+
+    while ((n = read (fd, block, block_size)) > 0)
+      total += n;
+
+    g_assert_cmpint (n, ==, 0);
+  }
+
+  double elapsed = g_test_timer_elapsed ();
+
+  for (guint i = 0; i < fds->len; i++)
+    close (g_array_index (fds, int, i));
+
+  g_assert_cmpuint (total, ==, (guint64) fixture->n_files * fixture->file_size);
+
+  return elapsed;
+}
+
+/* Files growing block by block, while several writers do the same,
+ * end up interleaved on the disk; this is only visible once they are
+ * read back from the disk rather than from the page cache
+ */
+static void
+test_preallocate_read_throughput (Fixture *fixture,
+                                  gconstpointer user_data)
+{
+  const struct {
+    const char *name;
+    gboolean preallocate;
+  } modes[] = {
+    { "preallocated", TRUE },
+    { "incremental", FALSE },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (modes); i++) {
+    double best = G_MAXDOUBLE;
+    guint n_extents = 0;
+
+    for (guint run = 0; run < BENCH_RUNS; run++) {
+      g_autofree char *prefix = NULL;
+      g_autoptr(EamExtractor) extractor = fixture_new_extractor (fixture, modes[i].name, &prefix);
+      eam_extractor_set_preallocate (extractor, modes[i].preallocate);
+      eam_extractor_set_n_writers (extractor, 4);
+
+      (void) extractor_run_timed (extractor);
+
+      best = MIN (best, read_extracted (fixture, prefix, &n_extents));
+      eam_fs_rmdir_recursive (prefix);
+    }
+
+    g_print ("# %s files: %.1f extents per file\n",
+             modes[i].name, (double) n_extents / fixture->n_files);
+
+    g_autofree char *what = g_strdup_printf ("reading %s files", modes[i].name);
+    report (what, (guint64) fixture->n_files * fixture->file_size, best);
+  }
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GError *error = NULL;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_autofree char *config_dir = g_dir_make_tmp ("eam-test-extract-config-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_autofree char *keyring = g_build_filename (config_dir, "keyring.gpg", NULL);
+  g_file_set_contents (keyring, "", 0, &error);
+  g_assert_no_error (error);
+
+  g_autofree char *config = g_strdup_printf ("[Directories]\nGpgKeyring=%s\n", keyring);
+  g_autofree char *config_file = g_build_filename (config_dir, "eos-app-manager.ini", NULL);
+  g_file_set_contents (config_file, config, -1, &error);
+  g_assert_no_error (error);
+
+  g_setenv ("EAM_CONFIG_FILE", config_file, TRUE);
+
+  g_test_add ("/extract/readers", Fixture, NULL,
+              fixture_set_up, test_readers, fixture_tear_down);
+  g_test_add ("/extract/compressed", Fixture, NULL,
+              fixture_set_up, test_compressed, fixture_tear_down);
+  g_test_add ("/extract/resume", Fixture, NULL,
+              fixture_set_up, test_resume, fixture_tear_down);
+  g_test_add ("/extract/resume-modified", Fixture, NULL,
+              fixture_set_up, test_resume_modified, fixture_tear_down);
+  g_test_add ("/extract/resume-rejected", Fixture, NULL,
+              fixture_set_up, test_resume_rejected, fixture_tear_down);
+  g_test_add ("/extract/resume-stale", Fixture, NULL,
+              fixture_set_up, test_resume_stale, fixture_tear_down);
+  g_test_add ("/extract/reader-throughput", Fixture, NULL,
+              fixture_set_up, test_reader_throughput, fixture_tear_down);
+  g_test_add ("/extract/preallocate-read-throughput", Fixture, NULL,
+              fixture_set_up, test_preallocate_read_throughput, fixture_tear_down);
+
+  int res = g_test_run ();
+
+  eam_fs_rmdir_recursive (config_dir);
+
+  return res;
+}
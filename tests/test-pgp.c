@@ -0,0 +1,369 @@
+/* test-pgp.c: Tests for the in-process signature verification
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "eam-fs-utils.h"
+#include "eam-pgp.h"
+
+/* The keyrings and signatures in pgp/ are made by pgp/generate.sh,
+ * which describes what they hold.
+ *
+ * Whatever the verifier does not handle itself is left to gpgv: for
+ * those signatures, eam_pgp_verifier_new() returns %NULL.
+ */
+
+typedef enum {
+  RESULT_GPGV,
+  RESULT_GOOD,
+  RESULT_BAD,
+} Result;
+
+typedef struct {
+  char *tmpdir;
+  char *data;
+  gsize data_len;
+} Fixture;
+
+static char *
+get_test_file (const char *name)
+{
+  return g_test_build_filename (G_TEST_DIST, "pgp", name, NULL);
+}
+
+static char *
+get_test_contents (const char *name,
+                   gsize *len)
+{
+  g_autofree char *path = get_test_file (name);
+  char *contents = NULL;
+  GError *error = NULL;
+
+  g_file_get_contents (path, &contents, len, &error);
+  g_assert_no_error (error);
+
+  return contents;
+}
+
+static char *
+fixture_write (Fixture *fixture,
+               const char *name,
+               const char *contents,
+               gsize len)
+{
+  char *path = g_build_filename (fixture->tmpdir, name, NULL);
+  GError *error = NULL;
+
+  g_file_set_contents (path, contents, len, &error);
+  g_assert_no_error (error);
+
+  return path;
+}
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eam-test-pgp-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->data = get_test_contents ("data", &fixture->data_len);
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  eam_fs_rmdir_recursive (fixture->tmpdir);
+
+  g_free (fixture->tmpdir);
+  g_free (fixture->data);
+}
+
+/* The data is passed in small blocks, as a bundle would be */
+static Result
+verify_data (const char *keyring_file,
+             const char *signature_file,
+             const char *data,
+             gsize len)
+{
+  g_autoptr(EamPgpVerifier) verifier = eam_pgp_verifier_new (keyring_file, signature_file);
+
+  if (verifier == NULL)
+    return RESULT_GPGV;
+
+  for (gsize offset = 0; offset < len; offset += 7)
+    eam_pgp_verifier_update (verifier, data + offset, MIN (7, len - offset));
+
+  return eam_pgp_verifier_finish (verifier) ? RESULT_GOOD : RESULT_BAD;
+}
+
+static Result
+verify (Fixture *fixture,
+        const char *keyring,
+        const char *signature)
+{
+  g_autofree char *keyring_file = get_test_file (keyring);
+  g_autofree char *signature_file = get_test_file (signature);
+
+  return verify_data (keyring_file, signature_file, fixture->data, fixture->data_len);
+}
+
+static void
+test_valid (Fixture *fixture,
+            gconstpointer user_data)
+{
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "good.sig"), ==, RESULT_GOOD);
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "good.asc"), ==, RESULT_GOOD);
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "subkey.sig"), ==, RESULT_GOOD);
+}
+
+static void
+test_tampered (Fixture *fixture,
+               gconstpointer user_data)
+{
+  g_autofree char *keyring_file = get_test_file ("keyring.gpg");
+  g_autofree char *signature_file = get_test_file ("good.sig");
+  g_autofree char *data = g_memdup (fixture->data, fixture->data_len);
+
+  /* A single bit of the data */
+  data[fixture->data_len / 2] ^= 0x01;
+  g_assert_cmpint (verify_data (keyring_file, signature_file, data, fixture->data_len), ==, RESULT_BAD);
+
+  /* Some data missing, or added */
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, fixture->data_len - 1),
+                   ==, RESULT_BAD);
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, 0), ==, RESULT_BAD);
+
+  g_autofree char *longer = g_strconcat (fixture->data, "\n", NULL);
+  g_assert_cmpint (verify_data (keyring_file, signature_file, longer, fixture->data_len + 1),
+                   ==, RESULT_BAD);
+
+  /* The last byte of the signature itself, which is part of its MPI */
+  gsize len;
+  g_autofree char *signature = get_test_contents ("good.sig", &len);
+  signature[len - 1] ^= 0x01;
+
+  g_autofree char *tampered = fixture_write (fixture, "tampered.sig", signature, len);
+  g_assert_cmpint (verify_data (keyring_file, tampered, fixture->data, fixture->data_len), ==, RESULT_BAD);
+}
+
+static void
+test_unknown_key (Fixture *fixture,
+                  gconstpointer user_data)
+{
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "other.sig"), ==, RESULT_GPGV);
+}
+
+/* A signing subkey is only trusted with a binding signature from its
+ * primary key, and a back-signature of its own; the primary key is
+ * trusted either way
+ */
+static void
+test_subkey_binding (Fixture *fixture,
+                     gconstpointer user_data)
+{
+  g_assert_cmpint (verify (fixture, "keyring-no-backsig.gpg", "subkey.sig"), ==, RESULT_GPGV);
+  g_assert_cmpint (verify (fixture, "keyring-no-backsig.gpg", "good.sig"), ==, RESULT_GOOD);
+
+  g_assert_cmpint (verify (fixture, "keyring-no-binding.gpg", "subkey.sig"), ==, RESULT_GPGV);
+  g_assert_cmpint (verify (fixture, "keyring-no-binding.gpg", "good.sig"), ==, RESULT_GOOD);
+}
+
+static void
+test_expired (Fixture *fixture,
+              gconstpointer user_data)
+{
+  /* Signatures made by a key that expired since */
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "expired-key.sig"), ==, RESULT_GPGV);
+
+  /* Signatures that expired themselves */
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "expired.sig"), ==, RESULT_GPGV);
+}
+
+static void
+test_revoked (Fixture *fixture,
+              gconstpointer user_data)
+{
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "revoked.sig"), ==, RESULT_GPGV);
+}
+
+static void
+test_malformed (Fixture *fixture,
+                gconstpointer user_data)
+{
+  g_autofree char *keyring_file = get_test_file ("keyring.gpg");
+  gsize len;
+  g_autofree char *signature = get_test_contents ("good.sig", &len);
+
+  /* Every truncation of the signature */
+  for (gsize i = 0; i < len; i++) {
+    g_autofree char *truncated = fixture_write (fixture, "truncated.sig", signature, i);
+
+    g_assert_cmpint (verify_data (keyring_file, truncated, fixture->data, fixture->data_len),
+                     ==, RESULT_GPGV);
+  }
+
+  /* Two signatures, or trailing garbage */
+  g_autofree char *twice = g_malloc (2 * len);
+  memcpy (twice, signature, len);
+  memcpy (twice + len, signature, len);
+
+  g_autofree char *twice_file = fixture_write (fixture, "twice.sig", twice, 2 * len);
+  g_assert_cmpint (verify_data (keyring_file, twice_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GPGV);
+
+  g_autofree char *trailing_file = fixture_write (fixture, "trailing.sig", twice, len + 1);
+  g_assert_cmpint (verify_data (keyring_file, trailing_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GPGV);
+
+  /* Armor with nothing in it, or not base64 */
+  static const char * const armors[] = {
+    "-----BEGIN PGP SIGNATURE-----\n\n-----END PGP SIGNATURE-----\n",
+    "-----BEGIN PGP SIGNATURE-----\n\n!!!!\n-----END PGP SIGNATURE-----\n",
+    "-----BEGIN PGP SIGNATURE-----\nnot a header\n\n-----END PGP SIGNATURE-----\n",
+    "not a signature\n",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (armors); i++) {
+    g_autofree char *armor_file = fixture_write (fixture, "armor.asc", armors[i], -1);
+
+    g_assert_cmpint (verify_data (keyring_file, armor_file, fixture->data, fixture->data_len),
+                     ==, RESULT_GPGV);
+  }
+
+  /* A keyring cut short only keeps the keys it holds whole, if it can
+   * be parsed at all
+   */
+  gsize keyring_len;
+  g_autofree char *keyring = get_test_contents ("keyring.gpg", &keyring_len);
+  g_autofree char *signature_file = get_test_file ("good.sig");
+
+  for (gsize i = 1; i < keyring_len; i++) {
+    g_autofree char *truncated = fixture_write (fixture, "truncated.gpg", keyring, i);
+
+    g_assert_cmpint (verify_data (truncated, signature_file, fixture->data, fixture->data_len),
+                     !=, RESULT_BAD);
+  }
+}
+
+static void
+set_mtime (int fd,
+           time_t mtime)
+{
+  struct timespec times[2] = {
+    { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+    { .tv_sec = mtime, .tv_nsec = 0 },
+  };
+
+  g_assert_cmpint (futimens (fd, times), ==, 0);
+}
+
+/* The keyring is parsed once, and parsed again when its size or
+ * modification time change; the same file is modified in place, so
+ * that its inode does not change either
+ */
+static void
+test_reload (Fixture *fixture,
+             gconstpointer user_data)
+{
+  g_autofree char *signature_file = get_test_file ("good.sig");
+  gsize len;
+  g_autofree char *keyring = get_test_contents ("keyring.gpg", &len);
+  g_autofree char *keyring_file = fixture_write (fixture, "keyring.gpg", keyring, len);
+
+  int fd = open (keyring_file, O_WRONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  set_mtime (fd, 1000000000);
+
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GOOD);
+
+  /* The test key comes first; a byte of its modulus changes its key
+   * id, so that it cannot be found any more
+   */
+  char byte = keyring[20] ^ 0xff;
+  g_assert_cmpint (pwrite (fd, &byte, 1, 20), ==, 1);
+
+  /* Without a new modification time, the keyring is not read again */
+  set_mtime (fd, 1000000000);
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GOOD);
+
+  set_mtime (fd, 1000000001);
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GPGV);
+
+  /* Once it is put back, it is read again */
+  g_assert_cmpint (pwrite (fd, &keyring[20], 1, 20), ==, 1);
+  set_mtime (fd, 1000000002);
+  g_assert_cmpint (verify_data (keyring_file, signature_file, fixture->data, fixture->data_len),
+                   ==, RESULT_GOOD);
+
+  close (fd);
+}
+
+#ifndef HAVE_GCRYPT
+static void
+test_unsupported (Fixture *fixture,
+                  gconstpointer user_data)
+{
+  /* Everything is left to gpgv */
+  g_assert_cmpint (verify (fixture, "keyring.gpg", "good.sig"), ==, RESULT_GPGV);
+}
+#endif
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+#ifdef HAVE_GCRYPT
+  g_test_add ("/pgp/valid", Fixture, NULL,
+              fixture_set_up, test_valid, fixture_tear_down);
+  g_test_add ("/pgp/tampered", Fixture, NULL,
+              fixture_set_up, test_tampered, fixture_tear_down);
+  g_test_add ("/pgp/unknown-key", Fixture, NULL,
+              fixture_set_up, test_unknown_key, fixture_tear_down);
+  g_test_add ("/pgp/subkey-binding", Fixture, NULL,
+              fixture_set_up, test_subkey_binding, fixture_tear_down);
+  g_test_add ("/pgp/expired", Fixture, NULL,
+              fixture_set_up, test_expired, fixture_tear_down);
+  g_test_add ("/pgp/revoked", Fixture, NULL,
+              fixture_set_up, test_revoked, fixture_tear_down);
+  g_test_add ("/pgp/malformed", Fixture, NULL,
+              fixture_set_up, test_malformed, fixture_tear_down);
+  g_test_add ("/pgp/reload", Fixture, NULL,
+              fixture_set_up, test_reload, fixture_tear_down);
+#else
+  g_test_add ("/pgp/unsupported", Fixture, NULL,
+              fixture_set_up, test_unsupported, fixture_tear_down);
+#endif
+
+  return g_test_run ();
+}
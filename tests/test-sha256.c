@@ -0,0 +1,178 @@
+/* test-sha256.c: Tests and benchmark for the SHA-256 implementations
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "eam-sha256.h"
+
+/* The implementation is selected once per process, so the generic one
+ * is tested by running the same tests again in a subprocess, with
+ * EAM_SHA256_GENERIC=1 in its environment.
+ *
+ * The throughput is only measured on a large buffer in perf mode,
+ * i.e. with -m perf; otherwise a small one just exercises the code.
+ */
+
+typedef struct {
+  const char *message;
+  guint repeat;
+  const char *digest;
+} Sha256Vector;
+
+/* FIPS 180-2 examples, and messages around the padding boundaries */
+static const Sha256Vector vectors[] = {
+  { "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+  { "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+  { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+    "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+  { "a", 55, "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318" },
+  { "a", 64, "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb" },
+  { "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+static void
+test_vectors (void)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (vectors); i++) {
+    const Sha256Vector *v = &vectors[i];
+    gsize len = strlen (v->message);
+
+    g_autoptr(EamSha256) sha = eam_sha256_new ();
+    for (guint j = 0; j < v->repeat; j++)
+      eam_sha256_update (sha, v->message, len);
+
+    g_assert_cmpstr (eam_sha256_get_string (sha), ==, v->digest);
+  }
+}
+
+/* Feeding the data in uneven pieces goes through the partial block
+ * buffering; the result is checked against GChecksum
+ */
+static void
+test_split_updates (void)
+{
+  guint8 data[1024];
+
+  for (guint i = 0; i < sizeof (data); i++)
+    data[i] = g_test_rand_int_range (0, 256);
+
+  for (gsize len = 0; len <= sizeof (data); len += 7) {
+    g_autoptr(GChecksum) expected = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (expected, data, len);
+
+    g_autoptr(EamSha256) sha = eam_sha256_new ();
+    gsize offset = 0;
+
+    while (offset < len) {
+      gsize piece = MIN (len - offset, (gsize) g_test_rand_int_range (1, 130));
+
+      eam_sha256_update (sha, data + offset, piece);
+      offset += piece;
+    }
+
+    g_assert_cmpstr (eam_sha256_get_string (sha), ==, g_checksum_get_string (expected));
+  }
+}
+
+static void
+test_digest (void)
+{
+  static const guint8 expected[EAM_SHA256_DIGEST_SIZE] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+    0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+    0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+  };
+  guint8 digest[EAM_SHA256_DIGEST_SIZE];
+
+  g_autoptr(EamSha256) sha = eam_sha256_new ();
+  eam_sha256_update (sha, "abc", 3);
+  eam_sha256_get_digest (sha, digest);
+
+  g_assert (memcmp (digest, expected, sizeof (digest)) == 0);
+}
+
+static void
+test_throughput (void)
+{
+  gsize block_size = 1024 * 1024;
+  guint n_blocks = g_test_perf () ? 1024 : 16;
+
+  g_autofree guint8 *block = g_malloc (block_size);
+  for (gsize i = 0; i < block_size; i++)
+    block[i] = i * 31;
+
+  g_autoptr(EamSha256) sha = eam_sha256_new ();
+
+  g_test_timer_start ();
+
+  for (guint i = 0; i < n_blocks; i++)
+    eam_sha256_update (sha, block, block_size);
+
+  (void) eam_sha256_get_string (sha);
+
+  double elapsed = g_test_timer_elapsed ();
+  double gbps = (double) block_size * n_blocks / 1e9 / MAX (elapsed, 1e-9);
+
+  g_print ("# SHA-256 %s: %u MiB in %.3f s, %.2f GB/s\n",
+           eam_sha256_get_implementation (), n_blocks, elapsed, gbps);
+  g_test_minimized_result (elapsed, "SHA-256 %s: %.2f GB/s",
+                           eam_sha256_get_implementation (), gbps);
+}
+
+static void
+test_generic (void)
+{
+  if (g_test_subprocess ()) {
+    g_assert_cmpstr (eam_sha256_get_implementation (), ==, "generic");
+
+    test_vectors ();
+    test_split_updates ();
+    test_digest ();
+    test_throughput ();
+    return;
+  }
+
+  g_setenv ("EAM_SHA256_GENERIC", "1", TRUE);
+  g_test_trap_subprocess (NULL, 0, G_TEST_SUBPROCESS_INHERIT_STDOUT);
+  g_unsetenv ("EAM_SHA256_GENERIC");
+
+  g_test_trap_assert_passed ();
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sha256/vectors", test_vectors);
+  g_test_add_func ("/sha256/split-updates", test_split_updates);
+  g_test_add_func ("/sha256/digest", test_digest);
+  g_test_add_func ("/sha256/throughput", test_throughput);
+  g_test_add_func ("/sha256/generic", test_generic);
+
+  return g_test_run ();
+}
@@ -0,0 +1,261 @@
+/* test-uring.c: Tests and benchmark for the io_uring batching
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "eam-fs-utils.h"
+#include "eam-uring.h"
+
+#include "eam-test-utils.h"
+
+/* Whether io_uring is used is decided once per process, so the
+ * synchronous removal is measured in a subprocess, with EAM_IO_URING=0
+ * in its environment.
+ *
+ * The trees are the ones of eam_test_create_tree().
+ */
+
+typedef struct {
+  char *tmpdir;
+} Fixture;
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eam-test-uring-XXXXXX", &error);
+  g_assert_no_error (error);
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  eam_fs_rmdir_recursive (fixture->tmpdir);
+
+  g_free (fixture->tmpdir);
+}
+
+static void
+create_file (int dfd,
+             const char *name)
+{
+  int fd = openat (dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  g_assert_cmpint (fd, >=, 0);
+  close (fd);
+}
+
+static char *
+create_tree (Fixture *fixture,
+             guint n_files)
+{
+  char *root = g_build_filename (fixture->tmpdir, "tree", NULL);
+
+  eam_test_create_tree (root, n_files, EAM_TEST_TREE_EMPTY_FILES, NULL);
+
+  return root;
+}
+
+static void
+test_unlinkat (Fixture *fixture,
+               gconstpointer user_data)
+{
+  g_autoptr(EamUring) ring = eam_uring_new ();
+
+  if (ring == NULL) {
+    g_test_skip ("io_uring is not available");
+    return;
+  }
+
+  int dfd = open (fixture->tmpdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (dfd, >=, 0);
+
+  /* More than fit in the ring at once */
+  for (guint i = 0; i < 1000; i++) {
+    char name[32];
+
+    g_snprintf (name, sizeof (name), "file-%04u", i);
+    create_file (dfd, name);
+    eam_uring_unlinkat (ring, dfd, name, 0);
+  }
+
+  /* Files that are already gone are not an error */
+  eam_uring_unlinkat (ring, dfd, "missing", 0);
+
+  g_assert_true (eam_uring_flush (ring));
+
+  for (guint i = 0; i < 1000; i++) {
+    char name[32];
+    struct stat buf;
+
+    g_snprintf (name, sizeof (name), "file-%04u", i);
+    g_assert_cmpint (fstatat (dfd, name, &buf, AT_SYMLINK_NOFOLLOW), <, 0);
+    g_assert_cmpint (errno, ==, ENOENT);
+  }
+
+  /* A non-empty directory cannot be removed */
+  g_assert_cmpint (mkdirat (dfd, "dir", 0755), ==, 0);
+  g_assert_cmpint (mkdirat (dfd, "dir/subdir", 0755), ==, 0);
+
+  eam_uring_unlinkat (ring, dfd, "dir", AT_REMOVEDIR);
+  g_assert_false (eam_uring_flush (ring));
+  g_assert_cmpint (errno, ==, ENOTEMPTY);
+
+  close (dfd);
+}
+
+static void
+test_submit_error (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_autoptr(EamUring) ring = eam_uring_new ();
+
+  if (ring == NULL) {
+    g_test_skip ("io_uring is not available");
+    return;
+  }
+
+  g_autofree char *path = g_build_filename (fixture->tmpdir, "file", NULL);
+  int fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  g_assert_cmpint (fd, >=, 0);
+
+  const gsize chunk_size = 65536;
+  g_autofree guint8 *data = g_malloc (8 * chunk_size);
+
+  for (guint i = 0; i < 8; i++)
+    memset (data + i * chunk_size, 'a' + i, chunk_size);
+
+  /* The kernel takes half of the writes, and then stops */
+  eam_uring_fail_submit_after (ring, 4, EIO);
+
+  for (guint i = 0; i < 8; i++)
+    eam_uring_write (ring, fd, data + i * chunk_size, chunk_size, i * chunk_size);
+
+  g_assert_false (eam_uring_flush (ring));
+  g_assert_cmpint (errno, ==, EIO);
+
+  /* The writes that were taken are done once the flush returns, so that
+   * their data can be freed; the others are lost
+   */
+  g_autofree guint8 *contents = g_malloc (8 * chunk_size);
+  struct stat buf;
+
+  g_assert_cmpint (fstat (fd, &buf), ==, 0);
+  g_assert_cmpint (buf.st_size, ==, 4 * chunk_size);
+  g_assert_cmpint (pread (fd, contents, 4 * chunk_size, 0), ==, 4 * chunk_size);
+  g_assert_true (memcmp (contents, data, 4 * chunk_size) == 0);
+
+  /* The ring then runs what it is given synchronously */
+  memset (data, 'z', chunk_size);
+  eam_uring_write (ring, fd, data, chunk_size, 4 * chunk_size);
+  g_assert_true (eam_uring_flush (ring));
+
+  g_assert_cmpint (pread (fd, contents, chunk_size, 4 * chunk_size), ==, chunk_size);
+  g_assert_true (memcmp (contents, data, chunk_size) == 0);
+
+  close (fd);
+}
+
+static void
+test_rmdir_recursive (Fixture *fixture,
+                      gconstpointer user_data)
+{
+  g_autofree char *root = create_tree (fixture, 1000);
+
+  g_assert_true (eam_fs_rmdir_recursive (root));
+  g_assert_false (g_file_test (root, G_FILE_TEST_EXISTS));
+
+  /* Removing what does not exist succeeds */
+  g_assert_true (eam_fs_rmdir_recursive (root));
+}
+
+static void
+rmdir_throughput (Fixture *fixture,
+                  const char *what)
+{
+  guint n_files = eam_test_get_tree_size ();
+  g_autofree char *root = create_tree (fixture, n_files);
+
+  /* Make the new entries durable, so that writing them back does not
+   * get in the way
+   */
+  sync ();
+
+  g_test_timer_start ();
+  g_assert_true (eam_fs_rmdir_recursive (root));
+  double elapsed = g_test_timer_elapsed ();
+
+  g_print ("# %s: %u files in %.3f s, %.0f files/s\n",
+           what, n_files, elapsed, n_files / MAX (elapsed, 1e-9));
+  g_test_minimized_result (elapsed, "%s: %.0f files/s", what, n_files / MAX (elapsed, 1e-9));
+}
+
+static void
+test_rmdir_throughput (Fixture *fixture,
+                       gconstpointer user_data)
+{
+  rmdir_throughput (fixture, eam_uring_is_supported () ? "io_uring unlink" : "unlink (no io_uring)");
+}
+
+static void
+test_rmdir_throughput_sync (Fixture *fixture,
+                            gconstpointer user_data)
+{
+  if (g_test_subprocess ()) {
+    g_assert_false (eam_uring_is_supported ());
+
+    rmdir_throughput (fixture, "synchronous unlink");
+    return;
+  }
+
+  g_setenv ("EAM_IO_URING", "0", TRUE);
+  g_test_trap_subprocess (NULL, 0, G_TEST_SUBPROCESS_INHERIT_STDOUT);
+  g_unsetenv ("EAM_IO_URING");
+
+  g_test_trap_assert_passed ();
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/uring/unlinkat", Fixture, NULL,
+              fixture_set_up, test_unlinkat, fixture_tear_down);
+  g_test_add ("/uring/submit-error", Fixture, NULL,
+              fixture_set_up, test_submit_error, fixture_tear_down);
+  g_test_add ("/uring/rmdir-recursive", Fixture, NULL,
+              fixture_set_up, test_rmdir_recursive, fixture_tear_down);
+  g_test_add ("/uring/rmdir-throughput", Fixture, NULL,
+              fixture_set_up, test_rmdir_throughput, fixture_tear_down);
+  g_test_add ("/uring/rmdir-throughput-sync", Fixture, NULL,
+              fixture_set_up, test_rmdir_throughput_sync, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,312 @@
+/* test-walk.c: Tests and benchmark for the directory tree walker
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "eam-fs-utils.h"
+#include "eam-walk.h"
+
+#include "eam-test-utils.h"
+
+/* The tree is the one of eam_test_create_tree(), which is two levels
+ * deep.
+ *
+ * The benchmark compares eam_walk() with the recursion over GDir,
+ * g_build_filename() and lstat() it replaced, both with and without
+ * a stat() of each entry.
+ */
+
+#define BENCH_RUNS      3
+
+typedef struct {
+  char *tmpdir;
+  EamTestTree tree;
+} Fixture;
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->tmpdir = g_dir_make_tmp ("eam-test-walk-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  eam_test_create_tree (fixture->tmpdir, eam_test_get_tree_size (),
+                        EAM_TEST_TREE_EMPTY_FILES, &fixture->tree);
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  eam_fs_rmdir_recursive (fixture->tmpdir);
+
+  g_free (fixture->tmpdir);
+}
+
+typedef struct {
+  const char *root;
+  gboolean stat_entries;
+  guint n_enter;
+  guint n_leave;
+  guint n_files;
+  guint n_links;
+  guint n_errors;
+  guint depth;
+  const char *skip;
+  const char *stop;
+} WalkCount;
+
+static EamWalkAction
+count_visit (EamWalkEvent event,
+             const EamWalkEntry *entry,
+             gpointer user_data)
+{
+  WalkCount *count = user_data;
+  struct stat buf;
+
+  switch (event) {
+  case EAM_WALK_ENTER:
+    count->n_enter += 1;
+    count->depth = MAX (count->depth, entry->depth);
+
+    if (count->skip != NULL && g_strcmp0 (entry->relative, count->skip) == 0)
+      return EAM_WALK_SKIP;
+    break;
+
+  case EAM_WALK_LEAVE:
+    count->n_leave += 1;
+    g_assert_cmpint (entry->fd, >=, 0);
+    break;
+
+  case EAM_WALK_FILE:
+    if (count->stat_entries)
+      g_assert_cmpint (fstatat (entry->dfd, entry->name, &buf, AT_SYMLINK_NOFOLLOW), ==, 0);
+
+    if (entry->type == DT_LNK)
+      count->n_links += 1;
+    else
+      count->n_files += 1;
+
+    if (count->stop != NULL && g_strcmp0 (entry->relative, count->stop) == 0)
+      return EAM_WALK_STOP;
+    break;
+
+  case EAM_WALK_ERROR:
+    count->n_errors += 1;
+    break;
+  }
+
+  /* The path is the root, followed by the relative path */
+  if (entry->depth > 0) {
+    gsize root_len = strlen (count->root);
+
+    g_assert (strncmp (entry->path, count->root, root_len) == 0);
+    g_assert_cmpint (entry->path[root_len], ==, '/');
+    g_assert_cmpstr (entry->path + root_len + 1, ==, entry->relative);
+    g_assert_cmpstr (strrchr (entry->path, '/') + 1, ==, entry->name);
+  }
+  else {
+    g_assert_cmpstr (entry->relative, ==, "");
+  }
+
+  return EAM_WALK_CONTINUE;
+}
+
+static void
+test_walk (Fixture *fixture,
+           gconstpointer user_data)
+{
+  WalkCount count = { fixture->tmpdir, TRUE, };
+
+  g_assert_true (eam_walk (AT_FDCWD, fixture->tmpdir, count_visit, &count));
+
+  g_assert_cmpuint (count.n_enter, ==, fixture->tree.n_dirs);
+  g_assert_cmpuint (count.n_leave, ==, fixture->tree.n_dirs);
+  g_assert_cmpuint (count.n_files, ==, fixture->tree.n_files);
+  g_assert_cmpuint (count.n_links, ==, fixture->tree.n_links);
+  g_assert_cmpuint (count.n_errors, ==, 0);
+  g_assert_cmpuint (count.depth, ==, 2);
+}
+
+static void
+test_walk_skip (Fixture *fixture,
+                gconstpointer user_data)
+{
+  WalkCount count = { fixture->tmpdir, FALSE, };
+  count.skip = "group-000/dir-0000";
+
+  g_assert_true (eam_walk (AT_FDCWD, fixture->tmpdir, count_visit, &count));
+
+  /* A skipped directory is entered, but neither read nor left */
+  g_assert_cmpuint (count.n_enter, ==, fixture->tree.n_dirs);
+  g_assert_cmpuint (count.n_leave, ==, fixture->tree.n_dirs - 1);
+  g_assert_cmpuint (count.n_files, ==, fixture->tree.n_files - EAM_TEST_FILES_PER_DIR);
+}
+
+static void
+test_walk_stop (Fixture *fixture,
+                gconstpointer user_data)
+{
+  WalkCount count = { fixture->tmpdir, FALSE, };
+  count.stop = "group-000/dir-0000/file-0000";
+
+  g_assert_false (eam_walk (AT_FDCWD, fixture->tmpdir, count_visit, &count));
+  g_assert_cmpuint (count.n_files, ==, 1);
+}
+
+static void
+test_walk_missing (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_autofree char *missing = g_build_filename (fixture->tmpdir, "missing", NULL);
+  WalkCount count = { missing, FALSE, };
+
+  eam_walk (AT_FDCWD, missing, count_visit, &count);
+
+  g_assert_cmpuint (count.n_errors, ==, 1);
+  g_assert_cmpuint (count.n_files, ==, 0);
+}
+
+/* What the benchmark does with each entry, without the checks */
+static EamWalkAction
+bench_visit (EamWalkEvent event,
+             const EamWalkEntry *entry,
+             gpointer user_data)
+{
+  WalkCount *count = user_data;
+  struct stat buf;
+
+  if (event != EAM_WALK_FILE)
+    return EAM_WALK_CONTINUE;
+
+  if (count->stat_entries && fstatat (entry->dfd, entry->name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+    count->n_errors += 1;
+
+  if (entry->type == DT_REG)
+    count->n_files += 1;
+
+  return EAM_WALK_CONTINUE;
+}
+
+/* The recursion eam_walk() replaced: a path is built for each entry,
+ * and each entry is lstat()ed to find out its type
+ */
+static void
+gdir_walk (const char *path,
+           guint *n_files)
+{
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  g_assert_nonnull (dir);
+
+  const char *name;
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *child = g_build_filename (path, name, NULL);
+    struct stat buf;
+
+    g_assert_cmpint (lstat (child, &buf), ==, 0);
+
+    if (S_ISDIR (buf.st_mode)) {
+      gdir_walk (child, n_files);
+      continue;
+    }
+
+    if (S_ISREG (buf.st_mode))
+      *n_files += 1;
+  }
+}
+
+static void
+report (const char *what,
+        guint n_entries,
+        double elapsed)
+{
+  g_print ("# %s: %u entries in %.3f s, %.0f entries/s\n",
+           what, n_entries, elapsed, n_entries / MAX (elapsed, 1e-9));
+  g_test_minimized_result (elapsed, "%s: %.0f entries/s", what, n_entries / MAX (elapsed, 1e-9));
+}
+
+static void
+test_walk_throughput (Fixture *fixture,
+                      gconstpointer user_data)
+{
+  guint n_entries = fixture->tree.n_files + fixture->tree.n_dirs + fixture->tree.n_links;
+
+  /* Warm up the dentry and inode caches */
+  guint n_files = 0;
+  gdir_walk (fixture->tmpdir, &n_files);
+  g_assert_cmpuint (n_files, ==, fixture->tree.n_files);
+
+  double gdir_best = G_MAXDOUBLE;
+  double walk_best = G_MAXDOUBLE;
+  double walk_stat_best = G_MAXDOUBLE;
+
+  for (guint run = 0; run < BENCH_RUNS; run++) {
+    n_files = 0;
+    g_test_timer_start ();
+    gdir_walk (fixture->tmpdir, &n_files);
+    gdir_best = MIN (gdir_best, g_test_timer_elapsed ());
+
+    WalkCount count = { fixture->tmpdir, FALSE, };
+    g_test_timer_start ();
+    g_assert_true (eam_walk (AT_FDCWD, fixture->tmpdir, bench_visit, &count));
+    walk_best = MIN (walk_best, g_test_timer_elapsed ());
+    g_assert_cmpuint (count.n_files, ==, fixture->tree.n_files);
+
+    WalkCount stat_count = { fixture->tmpdir, TRUE, };
+    g_test_timer_start ();
+    g_assert_true (eam_walk (AT_FDCWD, fixture->tmpdir, bench_visit, &stat_count));
+    walk_stat_best = MIN (walk_stat_best, g_test_timer_elapsed ());
+    g_assert_cmpuint (stat_count.n_errors, ==, 0);
+  }
+
+  report ("GDir and lstat", n_entries, gdir_best);
+  report ("eam_walk", n_entries, walk_best);
+  report ("eam_walk and fstatat", n_entries, walk_stat_best);
+  g_print ("# eam_walk speedup: %.2fx, %.2fx with fstatat\n",
+           gdir_best / MAX (walk_best, 1e-9), gdir_best / MAX (walk_stat_best, 1e-9));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/walk/tree", Fixture, NULL,
+              fixture_set_up, test_walk, fixture_tear_down);
+  g_test_add ("/walk/skip", Fixture, NULL,
+              fixture_set_up, test_walk_skip, fixture_tear_down);
+  g_test_add ("/walk/stop", Fixture, NULL,
+              fixture_set_up, test_walk_stop, fixture_tear_down);
+  g_test_add ("/walk/missing", Fixture, NULL,
+              fixture_set_up, test_walk_missing, fixture_tear_down);
+  g_test_add ("/walk/throughput", Fixture, NULL,
+              fixture_set_up, test_walk_throughput, fixture_tear_down);
+
+  return g_test_run ();
+}
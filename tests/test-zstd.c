@@ -0,0 +1,369 @@
+/* test-zstd.c: Tests for the decoder of seekable zstd bundles
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "eam-zstd.h"
+
+#include "eam-test-utils.h"
+
+/* The bundles are compressed by eam_test_zstd_compress_seekable(); the
+ * tests that damage them edit the seek table, which is at the end:
+ *
+ *   frames | magic, size | compressed size, size, ... | count, 0, magic
+ *
+ * Builds without zstd support never decode seekable bundles, so every
+ * test is skipped there.
+ */
+
+#define FRAME_SIZE      (64 * 1024)
+#define N_FRAMES        9
+#define DATA_SIZE       (N_FRAMES * FRAME_SIZE - 1000)
+
+/* Number of frames, descriptor, magic */
+#define FOOTER_SIZE     9
+
+typedef struct {
+  GBytes *data;
+  GBytes *bundle;
+} Fixture;
+
+static void
+fixture_set_up (Fixture *fixture,
+                gconstpointer user_data)
+{
+  guint8 *data = g_malloc (DATA_SIZE);
+
+  /* Compressible, but not trivially so */
+  for (gsize i = 0; i < DATA_SIZE; i++)
+    data[i] = (i * 13 + i / 4093) & 0xff;
+
+  fixture->data = g_bytes_new_take (data, DATA_SIZE);
+  fixture->bundle = eam_test_zstd_compress_seekable (fixture->data, FRAME_SIZE);
+}
+
+static void
+fixture_tear_down (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  g_bytes_unref (fixture->data);
+  g_clear_pointer (&fixture->bundle, g_bytes_unref);
+}
+
+static gboolean
+skip_without_zstd (Fixture *fixture)
+{
+  if (fixture->bundle != NULL)
+    return FALSE;
+
+  g_test_skip ("Built without zstd support");
+  return TRUE;
+}
+
+static gboolean
+tap_append (const void *data,
+            gsize size,
+            gpointer user_data)
+{
+  g_byte_array_append (user_data, data, size);
+
+  return TRUE;
+}
+
+/* Decodes the whole stream; returns the error of the read, or 0 */
+static int
+decode (EamZstdDecoder *decoder,
+        GByteArray *output)
+{
+  while (TRUE) {
+    const void *buffer;
+    gssize n = eam_zstd_decoder_read (decoder, &buffer);
+
+    if (n < 0)
+      return errno;
+
+    if (n == 0)
+      return 0;
+
+    g_byte_array_append (output, buffer, n);
+  }
+}
+
+static void
+assert_same_bytes (const guint8 *data,
+                   gsize size,
+                   GBytes *expected)
+{
+  gsize expected_size;
+  const guint8 *expected_data = g_bytes_get_data (expected, &expected_size);
+
+  g_assert_cmpuint (size, ==, expected_size);
+  g_assert (memcmp (data, expected_data, size) == 0);
+}
+
+static void
+round_trip (Fixture *fixture,
+            int fd,
+            const guint8 *map,
+            guint n_threads)
+{
+  gsize bundle_size = g_bytes_get_size (fixture->bundle);
+  g_autoptr(EamZstdDecoder) decoder =
+    eam_zstd_decoder_new (fd, map, bundle_size, n_threads);
+  g_assert_nonnull (decoder);
+
+  g_assert_cmpuint (eam_zstd_decoder_get_n_frames (decoder), ==, N_FRAMES);
+
+  g_autoptr(GByteArray) tapped = g_byte_array_new ();
+  eam_zstd_decoder_set_tap_func (decoder, tap_append, tapped);
+
+  g_autoptr(GByteArray) output = g_byte_array_new ();
+  g_assert_cmpint (decode (decoder, output), ==, 0);
+  assert_same_bytes (output->data, output->len, fixture->data);
+
+  /* The tap sees the whole file, in order, once the seek table is
+   * passed to it as well
+   */
+  g_assert_cmpuint (tapped->len, <, bundle_size);
+  g_assert_true (eam_zstd_decoder_finish (decoder));
+  assert_same_bytes (tapped->data, tapped->len, fixture->bundle);
+  g_assert_cmpuint (eam_zstd_decoder_get_bytes_read (decoder), ==, bundle_size);
+}
+
+static void
+test_round_trip (Fixture *fixture,
+                 gconstpointer user_data)
+{
+  if (skip_without_zstd (fixture))
+    return;
+
+  const guint8 *map = g_bytes_get_data (fixture->bundle, NULL);
+
+  /* From memory, with a single thread and with more threads than
+   * frames are decoded ahead
+   */
+  round_trip (fixture, -1, map, 1);
+  round_trip (fixture, -1, map, 4);
+  round_trip (fixture, -1, map, 64);
+
+  /* From a file */
+  g_autofree char *path = NULL;
+  GError *error = NULL;
+  int fd = g_file_open_tmp ("eam-test-zstd-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+
+  gssize bundle_size = g_bytes_get_size (fixture->bundle);
+  g_assert_cmpint (write (fd, map, bundle_size), ==, bundle_size);
+
+  round_trip (fixture, fd, NULL, 4);
+
+  close (fd);
+  g_unlink (path);
+}
+
+static void
+test_not_seekable (Fixture *fixture,
+                   gconstpointer user_data)
+{
+  if (skip_without_zstd (fixture))
+    return;
+
+  gsize bundle_size;
+  const guint8 *map = g_bytes_get_data (fixture->bundle, &bundle_size);
+
+  /* The headers of legacy gzip and xz bundles */
+  static const guint8 gzip[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+    0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  };
+  static const guint8 xz[] = {
+    0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x04, 0xe6, 0xd6,
+    0xb4, 0x46, 0x00, 0x00, 0x00, 0x00, 0x1c, 0xdf, 0x44, 0x21,
+    0x1f, 0xb6, 0xf3, 0x7d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x04,
+    0x59, 0x5a,
+  };
+
+  g_assert_null (eam_zstd_decoder_new (-1, gzip, sizeof (gzip), 1));
+  g_assert_null (eam_zstd_decoder_new (-1, xz, sizeof (xz), 1));
+
+  /* Frames without their seek table */
+  gsize table_size = 8 + N_FRAMES * 8 + FOOTER_SIZE;
+  g_assert_null (eam_zstd_decoder_new (-1, map, bundle_size - table_size, 1));
+
+  /* Files smaller than a seek table */
+  g_assert_null (eam_zstd_decoder_new (-1, map + bundle_size - FOOTER_SIZE, FOOTER_SIZE, 1));
+}
+
+static void
+write_le32 (guint8 *p,
+            guint32 value)
+{
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static guint32
+read_le32 (const guint8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+/* Returns a copy of the bundle, and the offset of its first seek
+ * table entry
+ */
+static guint8 *
+bundle_copy (Fixture *fixture,
+             gsize *size,
+             gsize *entries)
+{
+  guint8 *copy = g_bytes_unref_to_data (g_bytes_ref (fixture->bundle), size);
+
+  *entries = *size - FOOTER_SIZE - N_FRAMES * 8;
+
+  return copy;
+}
+
+static void
+test_corrupt_table (Fixture *fixture,
+                    gconstpointer user_data)
+{
+  if (skip_without_zstd (fixture))
+    return;
+
+  gsize size, entries;
+  g_autofree guint8 *copy = NULL;
+
+  /* Wrong footer magic */
+  copy = bundle_copy (fixture, &size, &entries);
+  copy[size - 1] ^= 0xff;
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* Wrong skippable frame magic */
+  copy = bundle_copy (fixture, &size, &entries);
+  copy[entries - 8] ^= 0xff;
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* Reserved bits in the descriptor */
+  copy = bundle_copy (fixture, &size, &entries);
+  copy[size - 5] = 0x04;
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* No frames, and more frames than fit in the file */
+  copy = bundle_copy (fixture, &size, &entries);
+  write_le32 (copy + size - FOOTER_SIZE, 0);
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  write_le32 (copy + size - FOOTER_SIZE, G_MAXUINT32 / 8);
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* Frames that do not reach the seek table, or overlap it */
+  copy = bundle_copy (fixture, &size, &entries);
+  write_le32 (copy + entries, read_le32 (copy + entries) - 1);
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  write_le32 (copy + entries, read_le32 (copy + entries) + 2);
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* A frame too large to be decompressed in memory */
+  copy = bundle_copy (fixture, &size, &entries);
+  write_le32 (copy + entries + 4, 128 * 1024 * 1024 + 1);
+  g_assert_null (eam_zstd_decoder_new (-1, copy, size, 1));
+  g_clear_pointer (&copy, g_free);
+
+  /* The untouched bundle is fine */
+  copy = bundle_copy (fixture, &size, &entries);
+  g_autoptr(EamZstdDecoder) decoder = eam_zstd_decoder_new (-1, copy, size, 1);
+  g_assert_nonnull (decoder);
+}
+
+static void
+test_truncated_frame (Fixture *fixture,
+                      gconstpointer user_data)
+{
+  if (skip_without_zstd (fixture))
+    return;
+
+  gsize size, entries;
+  g_autofree guint8 *copy = bundle_copy (fixture, &size, &entries);
+
+  /* Cut the end of the third frame, and make the seek table agree, so
+   * that only decompressing it can tell
+   */
+  const guint cut = 16;
+  gsize frame_end = 0;
+
+  for (guint i = 0; i < 3; i++)
+    frame_end += read_le32 (copy + entries + i * 8);
+
+  memmove (copy + frame_end - cut, copy + frame_end, size - frame_end);
+  size -= cut;
+  entries -= cut;
+  write_le32 (copy + entries + 2 * 8, read_le32 (copy + entries + 2 * 8) - cut);
+
+  g_autoptr(EamZstdDecoder) decoder = eam_zstd_decoder_new (-1, copy, size, 4);
+  g_assert_nonnull (decoder);
+
+  /* The frames before it are still returned */
+  g_autoptr(GByteArray) output = g_byte_array_new ();
+  g_assert_cmpint (decode (decoder, output), ==, EBADMSG);
+  g_assert_cmpuint (output->len, ==, 2 * FRAME_SIZE);
+  g_assert (memcmp (output->data, g_bytes_get_data (fixture->data, NULL), output->len) == 0);
+
+  /* A frame holding less than the seek table says is as bad */
+  g_clear_pointer (&copy, g_free);
+  copy = bundle_copy (fixture, &size, &entries);
+  write_le32 (copy + entries + 4, FRAME_SIZE + 1);
+
+  g_autoptr(EamZstdDecoder) short_decoder = eam_zstd_decoder_new (-1, copy, size, 1);
+  g_assert_nonnull (short_decoder);
+
+  g_byte_array_set_size (output, 0);
+  g_assert_cmpint (decode (short_decoder, output), ==, EBADMSG);
+  g_assert_cmpuint (output->len, ==, 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/zstd/round-trip", Fixture, NULL,
+              fixture_set_up, test_round_trip, fixture_tear_down);
+  g_test_add ("/zstd/not-seekable", Fixture, NULL,
+              fixture_set_up, test_not_seekable, fixture_tear_down);
+  g_test_add ("/zstd/corrupt-table", Fixture, NULL,
+              fixture_set_up, test_corrupt_table, fixture_tear_down);
+  g_test_add ("/zstd/truncated-frame", Fixture, NULL,
+              fixture_set_up, test_truncated_frame, fixture_tear_down);
+
+  return g_test_run ();
+}
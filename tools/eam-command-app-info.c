@@ -61,13 +61,16 @@ eam_command_app_info (int argc, char *argv[])
 
   if (g_key_file_has_group (keyfile, "External")) {
     g_autofree char *ext_url = g_key_file_get_string (keyfile, "External", "url", NULL);
-    g_autofree char *ext_sum = g_key_file_get_string (keyfile, "External", "sha256sum", NULL);
+    gboolean blake3 = g_key_file_has_key (keyfile, "External", "blake3sum", NULL);
+    g_autofree char *ext_sum = g_key_file_get_string (keyfile, "External",
+                                                      blake3 ? "blake3sum" : "sha256sum", NULL);
 
     g_print ("%*s └─external─┬─url───%s\n"
-             "%*s            └─sha256─── %s\n",
+             "%*s            └─%s─── %s\n",
              (int) strlen (appid), " ",
              ext_url != NULL ? ext_url : "<none>",
              (int) strlen (appid), " ",
+             blake3 ? "blake3" : "sha256",
              ext_sum != NULL ? ext_sum : "<none>");
   }
   else {
@@ -0,0 +1,102 @@
+/* eam: Command line tool for eos-app-manager
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eam-commands.h"
+
+#include "eam-config.h"
+#include "eam-payload-cache.h"
+#include "eam-utils.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+static int
+cache_list (void)
+{
+  g_autoptr(GPtrArray) entries = eam_payload_cache_list ();
+  guint64 total = 0;
+
+  for (guint i = 0; i < entries->len; i++) {
+    EamPayloadCacheEntry *entry = g_ptr_array_index (entries, i);
+    g_autofree char *size = g_format_size (entry->size);
+    g_autoptr(GDateTime) last_used = g_date_time_new_from_unix_local (entry->last_used);
+    g_autofree char *date = g_date_time_format (last_used, "%Y-%m-%d %H:%M");
+
+    g_print ("%s  %10s  %s\n", entry->key, size, date);
+    total += entry->size;
+  }
+
+  g_autofree char *total_size = g_format_size (total);
+  g_autofree char *max_size =
+    g_format_size ((guint64) eam_config_get_payload_cache_size () * 1024 * 1024);
+
+  g_print ("%u payloads, %s of %s\n", entries->len, total_size, max_size);
+
+  return EXIT_SUCCESS;
+}
+
+static int
+cache_prune (guint64 max_size)
+{
+  if (!eam_utils_can_modify_configuration (getuid ())) {
+    g_printerr ("You need administrator privileges to modify the payload cache\n");
+    return EXIT_FAILURE;
+  }
+
+  g_autofree char *freed = g_format_size (eam_payload_cache_prune (max_size));
+  g_print ("Freed %s\n", freed);
+
+  return EXIT_SUCCESS;
+}
+
+int
+eam_command_cache (int argc, char *argv[])
+{
+  if (argc == 1 || (argc == 2 && strcmp (argv[1], "list") == 0))
+    return cache_list ();
+
+  /* Without a size, the cache is pruned to its configured size */
+  if (strcmp (argv[1], "prune") == 0 && argc <= 3) {
+    guint64 max_size = eam_config_get_payload_cache_size ();
+
+    if (argc == 3) {
+      char *end;
+
+      max_size = g_ascii_strtoull (argv[2], &end, 10);
+      if (*argv[2] == '\0' || *end != '\0') {
+        g_printerr ("Invalid size '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+      }
+    }
+
+    return cache_prune (max_size * 1024 * 1024);
+  }
+
+  if (strcmp (argv[1], "clear") == 0 && argc == 2)
+    return cache_prune (0);
+
+  g_printerr ("Usage: %s cache [list | prune [MiB] | clear]\n", eam_argv0);
+
+  return EXIT_FAILURE;
+}
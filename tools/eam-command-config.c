@@ -38,6 +38,18 @@ print_all (void)
            "    ├─repository─┬─server url───%s\n"
            "    │            ├─api version───%s\n"
            "    │            └─delta updates───%s\n"
+           "    ├─install─┬─extract workers───%u\n"
+           "    │         ├─streaming verification───%s\n"
+           "    │         ├─bundle reader───%s\n"
+           "    │         ├─deduplicate───%s\n"
+           "    │         ├─preallocate───%s\n"
+           "    │         ├─resumable extraction───%s\n"
+           "    │         ├─locales───%s\n"
+           "    │         └─architectures───%s\n"
+           "    ├─download─┬─max connections───%u\n"
+           "    │          ├─max connections per host───%u\n"
+           "    │          ├─segmented threshold───%u MiB\n"
+           "    │          └─payload cache size───%u MiB\n"
            "    └─daemon───inactivity timeout───%u\n",
            eam_config_get_applications_dir (),
            eam_config_get_cache_dir (),
@@ -47,6 +59,18 @@ print_all (void)
            eam_config_get_server_url (),
            eam_config_get_api_version (),
            eam_config_get_enable_delta_updates () ? "true" : "false",
+           eam_config_get_extract_workers (),
+           eam_config_get_streaming_verification () ? "true" : "false",
+           eam_config_get_bundle_reader (),
+           eam_config_get_deduplicate () ? "true" : "false",
+           eam_config_get_preallocate () ? "true" : "false",
+           eam_config_get_resumable_extraction () ? "true" : "false",
+           eam_config_get_locales (),
+           eam_config_get_architectures (),
+           eam_config_get_max_connections (),
+           eam_config_get_max_connections_per_host (),
+           eam_config_get_segmented_threshold (),
+           eam_config_get_payload_cache_size (),
            eam_config_get_inactivity_timeout ());
 }
 
@@ -67,6 +91,19 @@ eam_command_config (int argc, char *argv[])
              "ServerURL\n"
              "ProtocolVersion\n"
              "DeltaUpdates\n"
+             "ExtractWorkers\n"
+             "StreamingVerification\n"
+             "BundleReader\n"
+             "Deduplicate\n"
+             "Preallocate\n"
+             "IoUring\n"
+             "ResumableExtraction\n"
+             "Locales\n"
+             "Architectures\n"
+             "MaxConnections\n"
+             "MaxConnectionsPerHost\n"
+             "SegmentedThreshold\n"
+             "PayloadCacheSize\n"
              "InactivityTimeout\n");
     return EXIT_SUCCESS;
   }
@@ -149,6 +186,71 @@ eam_command_config (int argc, char *argv[])
     return EXIT_SUCCESS;
   }
 
+  if (strcmp (argv[1], "ExtractWorkers") == 0) {
+    g_print ("%u\n", eam_config_get_extract_workers ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "StreamingVerification") == 0) {
+    g_print ("%s\n", eam_config_get_streaming_verification () ? "true" : "false");
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "BundleReader") == 0) {
+    g_print ("%s\n", eam_config_get_bundle_reader ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "Deduplicate") == 0) {
+    g_print ("%s\n", eam_config_get_deduplicate () ? "true" : "false");
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "Preallocate") == 0) {
+    g_print ("%s\n", eam_config_get_preallocate () ? "true" : "false");
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "IoUring") == 0) {
+    g_print ("%s\n", eam_config_get_io_uring () ? "true" : "false");
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "ResumableExtraction") == 0) {
+    g_print ("%s\n", eam_config_get_resumable_extraction () ? "true" : "false");
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "Locales") == 0) {
+    g_print ("%s\n", eam_config_get_locales ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "Architectures") == 0) {
+    g_print ("%s\n", eam_config_get_architectures ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "MaxConnections") == 0) {
+    g_print ("%u\n", eam_config_get_max_connections ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "MaxConnectionsPerHost") == 0) {
+    g_print ("%u\n", eam_config_get_max_connections_per_host ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "SegmentedThreshold") == 0) {
+    g_print ("%u\n", eam_config_get_segmented_threshold ());
+    return EXIT_SUCCESS;
+  }
+
+  if (strcmp (argv[1], "PayloadCacheSize") == 0) {
+    g_print ("%u\n", eam_config_get_payload_cache_size ());
+    return EXIT_SUCCESS;
+  }
+
   if (strcmp (argv[1], "InactivityTimeout") == 0) {
     g_print ("%u\n", eam_config_get_inactivity_timeout ());
     return EXIT_SUCCESS;
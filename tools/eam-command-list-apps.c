@@ -97,12 +97,15 @@ app_file_print (gpointer data, gpointer user_data)
                (int) strlen (appid), " ", version != NULL ? version : "<none>");
 
       g_autofree char *ext_url = g_key_file_get_string (keyfile, "External", "url", NULL);
-      g_autofree char *ext_sum = g_key_file_get_string (keyfile, "External", "sha256sum", NULL);
+      gboolean blake3 = g_key_file_has_key (keyfile, "External", "blake3sum", NULL);
+      g_autofree char *ext_sum = g_key_file_get_string (keyfile, "External",
+                                                        blake3 ? "blake3sum" : "sha256sum", NULL);
 
       g_print ("%*s └─external─┬─url───%s\n"
-               "%*s            └─sha256───%s\n\n",
+               "%*s            └─%s───%s\n\n",
                (int) strlen (appid), " ", ext_url != NULL ? ext_url : "<none>",
-               (int) strlen (appid), " ", ext_sum != NULL ? ext_sum : "<none>");
+               (int) strlen (appid), " ", blake3 ? "blake3" : "sha256",
+               ext_sum != NULL ? ext_sum : "<none>");
     }
     else {
       g_print ("%*s └─version───%s\n\n",
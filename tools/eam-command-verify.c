@@ -0,0 +1,144 @@
+/* eam: Command line tool for eos-app-manager
+ *
+ * This file is part of eos-app-manager.
+ * Copyright 2016  Endless Mobile Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "eam-commands.h"
+
+#include "eam-config.h"
+#include "eam-fs-utils.h"
+#include "eam-manifest.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <gio/gio.h>
+
+static int verify_jobs = 0;
+
+static const GOptionEntry verify_entries[] = {
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &verify_jobs, NULL, NULL },
+  { NULL }
+};
+
+static void
+report_problem (const char *appid,
+                const char *path,
+                EamManifestStatus status,
+                gpointer user_data)
+{
+  const char *what = NULL;
+
+  switch (status) {
+  case EAM_MANIFEST_STATUS_MODIFIED:
+    what = "modified";
+    break;
+  case EAM_MANIFEST_STATUS_MISSING:
+    what = "missing";
+    break;
+  case EAM_MANIFEST_STATUS_EXTRA:
+    what = "extra";
+    break;
+  }
+
+  g_print ("%s: %s %s\n", appid, what, path);
+}
+
+/* Lists all the installed apps, in a stable order */
+static GPtrArray *
+list_apps (const char *appdir)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GDir) dir = g_dir_open (appdir, 0, &error);
+
+  if (dir == NULL) {
+    g_printerr ("Failed to enumerate application directory '%s': %s\n",
+                appdir, error->message);
+    return NULL;
+  }
+
+  GPtrArray *apps = g_ptr_array_new_with_free_func (g_free);
+  const char *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    g_autofree char *path = g_build_filename (appdir, name, NULL);
+
+    if (eam_fs_is_app_dir (path))
+      g_ptr_array_add (apps, g_strdup (name));
+  }
+
+  g_ptr_array_sort (apps, (GCompareFunc) g_strcmp0);
+
+  return apps;
+}
+
+int
+eam_command_verify (int argc, char *argv[])
+{
+  GOptionContext *context = g_option_context_new (NULL);
+  g_option_context_set_help_enabled (context, FALSE);
+  g_option_context_add_main_entries (context, verify_entries, GETTEXT_PACKAGE);
+
+  if (!g_option_context_parse (context, &argc, &argv, NULL) || verify_jobs < 0) {
+    g_printerr ("Usage: %s verify [--jobs N] [APPID...]\n", eam_argv0);
+    return EXIT_FAILURE;
+  }
+
+  g_option_context_free (context);
+
+  const char *appdir = eam_config_get_applications_dir ();
+  g_assert (appdir != NULL);
+
+  g_autoptr(GPtrArray) apps = NULL;
+
+  if (argc > 1) {
+    apps = g_ptr_array_new_with_free_func (g_free);
+    for (int i = 1; i < argc; i++)
+      g_ptr_array_add (apps, g_strdup (argv[i]));
+  }
+  else {
+    apps = list_apps (appdir);
+    if (apps == NULL)
+      return EXIT_FAILURE;
+  }
+
+  g_autoptr(EamManifestVerifier) verifier = eam_manifest_verifier_new (verify_jobs);
+  int res = EXIT_SUCCESS;
+
+  for (guint i = 0; i < apps->len; i++) {
+    const char *appid = g_ptr_array_index (apps, i);
+    g_autofree char *path = g_build_filename (appdir, appid, NULL);
+
+    if (!eam_fs_is_app_dir (path)) {
+      g_printerr ("No application '%s' found.\n", appid);
+      res = EXIT_FAILURE;
+      continue;
+    }
+
+    if (!eam_manifest_verifier_add (verifier, appid, path)) {
+      g_printerr ("Unable to verify '%s': no usable manifest.\n", appid);
+      res = EXIT_FAILURE;
+    }
+  }
+
+  if (eam_manifest_verifier_finish (verifier, report_problem, NULL) > 0)
+    res = EXIT_FAILURE;
+
+  return res;
+}
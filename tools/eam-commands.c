@@ -121,4 +121,20 @@ const EamToolCommand commands[EAM_N_COMMANDS] = {
     .command_main = eam_command_ensure_symlink_farm,
     .flags = EAM_COMMAND_FLAG_REQUIRES_CONFIG,
   },
+
+  [EAM_COMMAND_VERIFY] = {
+    .name = "verify",
+    .short_desc = "Checks installed applications against their manifest",
+    .usage = "verify [--jobs N] [APPID...]",
+    .command_main = eam_command_verify,
+    .flags = EAM_COMMAND_FLAG_REQUIRES_CONFIG,
+  },
+
+  [EAM_COMMAND_CACHE] = {
+    .name = "cache",
+    .short_desc = "Inspects and prunes the cache of external payloads",
+    .usage = "cache [list | prune [MiB] | clear]",
+    .command_main = eam_command_cache,
+    .flags = EAM_COMMAND_FLAG_REQUIRES_CONFIG,
+  },
 };
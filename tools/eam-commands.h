@@ -49,6 +49,8 @@ enum {
   EAM_COMMAND_UPDATE,
   EAM_COMMAND_UNINSTALL,
   EAM_COMMAND_ENSURE_SYMLINK_FARM,
+  EAM_COMMAND_VERIFY,
+  EAM_COMMAND_CACHE,
 
   EAM_N_COMMANDS
 };
@@ -69,3 +71,5 @@ extern int eam_command_migrate (int argc, char *argv[]);
 extern int eam_command_update (int argc, char *argv[]);
 extern int eam_command_uninstall (int argc, char *argv[]);
 extern int eam_command_ensure_symlink_farm (int argc, char *argv[]);
+extern int eam_command_verify (int argc, char *argv[]);
+extern int eam_command_cache (int argc, char *argv[]);